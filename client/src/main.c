@@ -29,11 +29,14 @@
 #include <unistd.h>
 #endif
 
+#include "aggregate.h"
+#include "auth_cache.h"
 #include "client.h"
 #include "cmd.h"
 #include "expansion.h"
 #include "log.h"
 #include "output.h"
+#include "relay.h"
 #include "remote.h"
 #include "ssh.h"
 #include "types.h"
@@ -48,11 +51,23 @@ static gchar* sudo_username = NULL;
 static gint threads = 0;
 static gint timeout = 300;
 static gchar* script = NULL;
+static gboolean inline_script = FALSE;
 static gboolean version = FALSE;
 static gboolean verbose = FALSE;
 static gboolean use_shell = TRUE;
 static gchar **ssh_opts = NULL;
 static gchar *cwd = NULL;
+static gboolean no_auth_cache = FALSE;
+static gint canary = 1;
+static gchar* jump = NULL;
+static gint jump_channels = 0;
+static gchar* relays = NULL;
+static gint relay_depth = 1;
+static gchar* bwlimit_total = NULL;
+static gchar* bwlimit_host = NULL;
+static guint64 total_rate = 0;
+static guint64 host_rate = 0;
+static gint compress_level = 0;
 
 // Host selection variables
 static gchar* hosts_arg = NULL;
@@ -63,6 +78,13 @@ static gchar* range = NULL;
 static gboolean hostname_output = FALSE;
 static gboolean collate_output = FALSE;
 static gboolean errors_only = FALSE;
+static gboolean passthrough = FALSE;
+static gchar* expect_hash = NULL;
+static gboolean expect_first = FALSE;
+static gboolean representatives = FALSE;
+static gchar* inspect = NULL;
+static gchar* aggregate = NULL;
+static wsh_aggregate_op_t aggregate_op = WSH_AGGREGATE_NONE;
 
 static void* passwd_mem;
 
@@ -74,11 +96,21 @@ static GOptionEntry entries[] = {
 	{ "threads", 't', 0, G_OPTION_ARG_INT, &threads, "Number of threads to use (default: determined by # of cpus)", NULL },
 	{ "timeout", 'T', 0, G_OPTION_ARG_INT, &timeout, "Timeout before killing command (default: 300 seconds)", NULL },
 	{ "script", 's', 0, G_OPTION_ARG_FILENAME, &script, "File to transfer to remote host", NULL },
+	{ "inline-script", 0, 0, G_OPTION_ARG_NONE, &inline_script, "Send --script inside the command request instead of copying it to ~ first", NULL },
+	{ "bwlimit-total", 0, 0, G_OPTION_ARG_STRING, &bwlimit_total, "Cap on bytes per second of --script sent to all hosts together (e.g. 10M)", NULL },
+	{ "bwlimit-per-host", 0, 0, G_OPTION_ARG_STRING, &bwlimit_host, "Cap on bytes per second of --script sent to each host (e.g. 500K)", NULL },
 	{ "version", 'V', 0, G_OPTION_ARG_NONE, &version, "Print the version number", NULL },
 	{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Execute verbosely", NULL },
 	{ "no-shell", 'N', G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &use_shell, "Execute without spawning a shell", NULL },
 	{ "ssh-opt", 0, 0, G_OPTION_ARG_STRING_ARRAY, &ssh_opts, "Config directives to pass to ssh (ssh_config(5))" },
 	{ "chdir", 'd', 0, G_OPTION_ARG_STRING, &cwd, "chdir to this directory after ssh" },
+	{ "jump", 'J', 0, G_OPTION_ARG_STRING, &jump, "Reach hosts through this bastion ([user@]host[:port])", NULL },
+	{ "jump-channels", 0, 0, G_OPTION_ARG_INT, &jump_channels, "Max hosts tunnelled over one bastion connection (default: 64)", NULL },
+	{ "relays", 0, 0, G_OPTION_ARG_STRING, &relays, "Comma separated list of hosts that run the command on the others for us", NULL },
+	{ "relay-depth", 0, 0, G_OPTION_ARG_INT, &relay_depth, "Tiers of relays between us and the hosts (default: 1)", NULL },
+	{ "canary", 0, 0, G_OPTION_ARG_INT, &canary, "With -p or -U, check credentials on this many hosts before authenticating to the rest (default: 1, 0 disables)", NULL },
+	{ "compress", 0, 0, G_OPTION_ARG_INT, &compress_level, "Have wshd zlib compress large replies at this level (1-9, default: 0 for none)", NULL },
+	{ "no-auth-cache", 0, 0, G_OPTION_ARG_NONE, &no_auth_cache, "Don't remember which auth method worked for each host", NULL },
 
 	// Host selection options
 	{ "hosts", 'h', 0, G_OPTION_ARG_STRING, &hosts_arg, "Comma separated list of hosts to ssh into", NULL },
@@ -91,6 +123,12 @@ static GOptionEntry entries[] = {
 	{ "print-hostnames", 'H', 0, G_OPTION_ARG_NONE, &hostname_output, "Display output immediately, prefixed with hostname", NULL },
 	{ "print-collated", 'c', 0, G_OPTION_ARG_NONE, &collate_output, "Display output at the end, collated into matching chunks", NULL },
 	{ "errors-only", 0, 0, G_OPTION_ARG_NONE, &errors_only, "Display only hosts that had a non-zero exit code", NULL },
+	{ "passthrough", 0, 0, G_OPTION_ARG_NONE, &passthrough, "Stream a single host's output through as it comes, unprefixed and byte for byte", NULL },
+	{ "expect-hash", 0, 0, G_OPTION_ARG_STRING, &expect_hash, "Hosts whose output has this SHA-256 (from an earlier run's summary) only report that it matched", NULL },
+	{ "expect-first", 0, 0, G_OPTION_ARG_NONE, &expect_first, "Hosts whose output matches the first host to succeed only report that it matched", NULL },
+	{ "representatives", 0, 0, G_OPTION_ARG_NONE, &representatives, "Hosts send a summary of their output, and full output is fetched from one host per group of matching output", NULL },
+	{ "inspect", 0, 0, G_OPTION_ARG_STRING, &inspect, "With --representatives, comma separated list of hosts to fetch full output from regardless", NULL },
+	{ "aggregate", 0, 0, G_OPTION_ARG_STRING, &aggregate, "Have hosts send stdout back boiled down, then merge it into a table (uniq-count, sum, min-max or histogram)", NULL },
 	{ NULL }
 };
 
@@ -114,6 +152,10 @@ static void build_wsh_cmd_req(wsh_cmd_req_t* req, gchar* password, gchar* cmd) {
 	req->host = g_strdup(g_get_host_name());
 	req->cmd_string = cmd;
 	req->use_shell = use_shell;
+	req->passthrough = passthrough;
+	req->raw_output = TRUE;
+	req->compress_level = compress_level;
+	req->aggregate_op = aggregate_op;
 }
 
 static void free_wsh_cmd_req_fields(wsh_cmd_req_t* req) {
@@ -129,6 +171,138 @@ static void cleanup(int sig, siginfo_t* sigi, void* ctx) {
 	exit(sig);
 }
 
+// Fills in whichever of password and sudo_password are non-NULL, then makes
+// them read-only
+static gint prompt_passwords(gchar* password, gchar* sudo_password) {
+	gint ret = EXIT_SUCCESS;
+
+	if (password) {
+		if ((ret = wsh_client_getpass(password, WSH_MAX_PASSWORD_LEN, "SSH password: ",
+		                              passwd_mem))) {
+			g_printerr("getpass: %s\n", strerror(ret));
+			return ret;
+		}
+
+		if (! *password) return EXIT_FAILURE;
+	}
+
+	if (sudo_password) {
+		if ((ret = wsh_client_getpass(sudo_password, WSH_MAX_PASSWORD_LEN,
+		                              "sudo password: ", passwd_mem))) {
+			g_printerr("getpass: %s\n", strerror(ret));
+			return ret;
+		}
+
+		if (! *sudo_password) return EXIT_FAILURE;
+	}
+
+	if (mprotect(passwd_mem, WSH_MAX_PASSWORD_LEN * 3, PROT_READ)) {
+		perror("mprotect");
+		return EXIT_FAILURE;
+	}
+
+	return ret;
+}
+
+// Judges a finished canary host, and says why we stop if it rejected our
+// credentials
+static wshc_canary_verdict_t check_canary(const wshc_host_info_t* host_info,
+        gboolean sudo, gsize hosts_left) {
+	wshc_canary_verdict_t verdict = wshc_canary_verdict(host_info, sudo);
+	if (verdict != WSHC_CANARY_REJECTED)
+		return verdict;
+
+	if (host_info->status == WSHC_HOST_SUDO_FAILED)
+		g_printerr("sudo rejected the password on %s, not authenticating to the remaining %zu hosts\n",
+		           host_info->hostname, hosts_left);
+	else
+		g_printerr("SSH authentication failed on %s, not authenticating to the remaining %zu hosts\n",
+		           host_info->hostname, hosts_left);
+
+	return verdict;
+}
+
+// libssh doesn't do ProxyJump for us, so pull it out of the ssh options and
+// treat it like --jump. Only --ssh-opt is looked at: a ProxyJump in
+// ~/.ssh/config would need resolving per host, and is ignored
+static void take_proxy_jump(void) {
+	if (! ssh_opts)
+		return;
+
+	gchar** dst = ssh_opts;
+	for (gchar** opt = ssh_opts; *opt; opt++) {
+		if (! g_ascii_strncasecmp(*opt, "proxyjump=", strlen("proxyjump="))) {
+			if (! jump)
+				jump = g_strdup(g_strstrip(*opt + strlen("proxyjump=")));
+			g_free(*opt);
+		} else {
+			*dst++ = *opt;
+		}
+	}
+	*dst = NULL;
+}
+
+// Summaries only came back from each host, so get the full output from one
+// host per group of matching summaries, and any the user asked to see
+static void fetch_representatives(const wshc_cmd_info_t* cmd_info,
+                                  const wsh_cmd_req_t* req) {
+	gchar** inspect_hosts = inspect ? g_strsplit(inspect, ",", 0) : NULL;
+	gchar** fetch_hosts = NULL, ** spool_ids = NULL;
+	gsize num_fetch = wshc_representatives(cmd_info->out, inspect_hosts,
+	                                       &fetch_hosts, &spool_ids);
+
+	// Nothing runs, so there's nothing to sudo for or push first
+	wsh_cmd_req_t fetch_req = {
+		.cmd_string = "",
+		.cwd = "",
+		.host = req->host,
+		.raw_output = TRUE,
+		.compress_level = req->compress_level,
+	};
+	wshc_cmd_info_t fetch_info = *cmd_info;
+	fetch_info.req = &fetch_req;
+	fetch_info.script = NULL;
+	fetch_info.payload = NULL;
+	fetch_info.gate = NULL;
+	fetch_info.host_rate = 0;
+
+	wshc_host_info_t host_info[num_fetch + 1];
+	wsh_cmd_res_t* res[num_fetch + 1];
+	for (gsize i = 0; i < num_fetch; i++) {
+		res[i] = NULL;
+
+		host_info[i].hostname = fetch_hosts[i];
+		host_info[i].res = &res[i];
+		host_info[i].status = WSHC_HOST_SKIPPED;
+		host_info[i].canary = FALSE;
+		host_info[i].authenticated = FALSE;
+		host_info[i].finished = FALSE;
+		host_info[i].relay_req = NULL;
+		host_info[i].fetch_spool = spool_ids[i];
+	}
+
+	wshc_verbose_print(cmd_info->out, "Fetching full output from %zu hosts\n",
+	                   num_fetch);
+
+	GThreadPool* gtp = NULL;
+	if (num_fetch > 1 && threads > 1)
+		gtp = g_thread_pool_new((GFunc)wshc_try_ssh, &fetch_info, threads, TRUE, NULL);
+
+	for (gsize i = 0; i < num_fetch; i++) {
+		if (gtp)
+			g_thread_pool_push(gtp, &host_info[i], NULL);
+		else
+			wshc_try_ssh(&host_info[i], &fetch_info);
+	}
+
+	if (gtp)
+		g_thread_pool_free(gtp, FALSE, TRUE);
+
+	g_strfreev(spool_ids);
+	g_strfreev(fetch_hosts);
+	g_strfreev(inspect_hosts);
+}
+
 static gboolean valid_arguments(gchar** mesg) {
 	GError *err = NULL;
 #ifdef WITH_RANGE
@@ -153,6 +327,106 @@ static gboolean valid_arguments(gchar** mesg) {
 		return FALSE;
 	}
 
+	take_proxy_jump();
+	if (jump && strchr(jump, ',')) {
+		*mesg = g_strdup("Only a single jump host is supported\n");
+		return FALSE;
+	}
+
+	if (jump_channels < 0) {
+		*mesg = g_strdup("--jump-channels must be a positive value or 0 for the default\n");
+		return FALSE;
+	}
+
+	if (relays && relay_depth < 1) {
+		*mesg = g_strdup("--relay-depth must be at least 1\n");
+		return FALSE;
+	}
+
+	// Relays only hand the request on, they don't have the script to push
+	if (relays && script) {
+		*mesg = g_strdup("--script can't be used with --relays\n");
+		return FALSE;
+	}
+
+	if (inline_script) {
+		if (! script || g_file_test(script, G_FILE_TEST_IS_DIR)) {
+			*mesg = g_strdup("--inline-script needs a --script that isn't a directory\n");
+			return FALSE;
+		}
+
+		// The script's directory is private to the user wshd runs as
+		if (sudo_username && *sudo_username && strcmp(sudo_username, "root")) {
+			*mesg = g_strdup("--inline-script can't be used with -U for users other than root\n");
+			return FALSE;
+		}
+	}
+
+	if (compress_level < 0 || compress_level > 9) {
+		*mesg = g_strdup("--compress must be a level from 1 to 9, or 0 for none\n");
+		return FALSE;
+	}
+
+	if (passthrough && relays) {
+		*mesg = g_strdup("--passthrough can't be used with --relays\n");
+		return FALSE;
+	}
+
+	if (expect_hash && expect_first) {
+		*mesg = g_strdup("--expect-hash can't be used with --expect-first\n");
+		return FALSE;
+	}
+
+	// Passed through output never makes it into a reply to be hashed
+	if (passthrough && (expect_hash || expect_first)) {
+		*mesg = g_strdup("--passthrough can't be used with --expect-hash or --expect-first\n");
+		return FALSE;
+	}
+
+	// Summaries can't be told apart by hash until their output is fetched
+	if (representatives && expect_first) {
+		*mesg = g_strdup("--representatives can't be used with --expect-first\n");
+		return FALSE;
+	}
+
+	if (aggregate) {
+		if (wsh_aggregate_parse_op(aggregate, &aggregate_op, &err)) {
+			*mesg = g_strdup_printf("--aggregate: %s\n", err->message);
+			g_error_free(err);
+			return FALSE;
+		}
+
+		// There's no stdout left to pass through, hash or spool
+		if (passthrough || representatives || expect_hash || expect_first) {
+			*mesg = g_strdup("--aggregate can't be used with --passthrough, --representatives, --expect-hash or --expect-first\n");
+			return FALSE;
+		}
+	}
+
+	if (inspect && ! representatives) {
+		*mesg = g_strdup("--inspect only works with --representatives\n");
+		return FALSE;
+	}
+
+	if (expect_hash) {
+		gsize len = strlen(expect_hash);
+		gboolean hex = (len == 64);
+		for (gsize i = 0; hex && i < len; i++)
+			hex = g_ascii_isxdigit(expect_hash[i]);
+
+		if (! hex) {
+			*mesg = g_strdup("--expect-hash must be a hex SHA-256\n");
+			return FALSE;
+		}
+	}
+
+	if ((bwlimit_total && wsh_throttle_parse_rate(bwlimit_total, &total_rate, &err)) ||
+	        (bwlimit_host && wsh_throttle_parse_rate(bwlimit_host, &host_rate, &err))) {
+		*mesg = g_strdup_printf("%s\n", err->message);
+		g_error_free(err);
+		return FALSE;
+	}
+
 	if (wsh_ssh_check_args(ssh_opts, &err)) {
 		*mesg = g_strdup(err->message);
 		g_error_free(err);
@@ -208,33 +482,11 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	if (ask_password) {
+	// Prompting happens once connections are under way
+	if (ask_password)
 		password = ((gchar*)passwd_mem) + (WSH_MAX_PASSWORD_LEN * 0);
-		if ((ret = wsh_client_getpass(password, WSH_MAX_PASSWORD_LEN, "SSH password: ",
-		                              passwd_mem))) {
-			g_printerr("getpass: %s\n", strerror(ret));
-			return ret;
-		}
-
-		if (! *password) return EXIT_FAILURE;
-	}
-
-	if (sudo_username) {
+	if (sudo_username)
 		sudo_password = ((gchar*)passwd_mem) + (WSH_MAX_PASSWORD_LEN * 1);
-		if ((ret = wsh_client_getpass(sudo_password, WSH_MAX_PASSWORD_LEN,
-		                              "sudo password: ", passwd_mem))) {
-			g_printerr("getpass: %s\n", strerror(ret));
-			return ret;
-		}
-
-		if (! *sudo_password) return EXIT_FAILURE;
-	}
-
-	if ((ask_password || sudo_username) &&
-	        mprotect(passwd_mem, WSH_MAX_PASSWORD_LEN * 3, PROT_READ)) {
-		perror("mprotect");
-		return EXIT_FAILURE;
-	}
 
 	/* Declare our output metadata structure
 	 * We do this here that way we can output range information
@@ -244,6 +496,10 @@ int main(int argc, char** argv) {
 
 	out_info->verbose = verbose;
 	out_info->errors_only = errors_only;
+	if (expect_hash || expect_first)
+		wshc_expect_output(out_info, expect_hash);
+	if (aggregate_op)
+		wsh_aggregate_new(&out_info->aggregate, aggregate_op);
 
 	// Done with checking options, expand hosts
 	if (file_arg) {
@@ -301,6 +557,13 @@ int main(int argc, char** argv) {
 		return EXIT_FAILURE;
 	}
 
+	// Output from more than one host would come out interleaved
+	if (passthrough && num_hosts > 1) {
+		g_printerr("ERROR: --passthrough only works with a single host\n\n");
+		g_printerr("%s", g_option_context_get_help(context, FALSE, NULL));
+		return EXIT_FAILURE;
+	}
+
 	// We're now done with any situation that would require our GOptionContext
 	g_option_context_free(context);
 
@@ -313,6 +576,36 @@ int main(int argc, char** argv) {
 	cmd_info.password = password;
 	cmd_info.port = port;
 	cmd_info.script = script;
+	cmd_info.host_rate = host_rate;
+	if (total_rate)
+		wsh_throttle_new(&cmd_info.throttle, total_rate);
+
+	// Compress the script once here rather than have ssh compress it once per
+	// host. Directories still go file by file
+	wsh_payload_t* payload = NULL;
+	if (script && ! g_file_test(script, G_FILE_TEST_IS_DIR)) {
+		if (wsh_payload_new(&payload, script, TRUE, &err)) {
+			g_printerr("%s\n", err->message);
+			g_error_free(err);
+			return EXIT_FAILURE;
+		}
+		cmd_info.payload = payload;
+	}
+
+	if (jump) {
+		if (wsh_jump_new(&cmd_info.jump, jump, username, password,
+		                 (const gchar**)ssh_opts, jump_channels, &err)) {
+			g_printerr("%s\n", err->message);
+			g_error_free(err);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (! no_auth_cache) {
+		gchar* auth_cache_path = wsh_auth_cache_default_path();
+		wsh_auth_cache_open(&cmd_info.auth_cache, auth_cache_path);
+		g_free(auth_cache_path);
+	}
 
 	// 20 will be our magic number for hosts
 	if (!hostname_output && (num_hosts < 20 || collate_output)) {
@@ -327,6 +620,13 @@ int main(int argc, char** argv) {
 	if (!isatty(STDIN_FILENO) || !isatty(STDERR_FILENO))
 		out_info->type = WSHC_OUTPUT_TYPE_HOSTNAME;
 
+	// Passed through output has already been written as it came, and nothing
+	// else may end up in it
+	if (passthrough) {
+		collate_output = FALSE;
+		out_info->type = WSHC_OUTPUT_TYPE_HOSTNAME;
+	}
+
 	cmd_info.out = out_info;
 
 	wsh_cmd_req_t req;
@@ -334,6 +634,27 @@ int main(int argc, char** argv) {
 	build_wsh_cmd_req(&req, sudo_password, cmd_string);
 	cmd_info.req = &req;
 
+	// Summaries are only worth it when output is collated at the end
+	req.summary_only = representatives && out_info->type == WSHC_OUTPUT_TYPE_COLLATED;
+
+	// Without a shell, wshd can run the arguments just as we got them
+	if (! use_shell) {
+		req.argv = argv;
+		req.argv_len = g_strv_length(argv);
+	}
+
+	// The script rides along in the request when asked, otherwise it's
+	// copied to ~ where older wshds and the command can find it
+	gchar* inflate[] = { NULL, NULL };
+	if (payload && inline_script) {
+		req.script_name = payload->name;
+		req.script = (guint8*)g_bytes_get_data(payload->data, &req.script_len);
+	} else if (payload && payload->compressed) {
+		inflate[0] = payload->name;
+		req.inflate = inflate;
+		req.inflate_len = 1;
+	}
+
 	struct sigaction sa = {
 		.sa_sigaction = cleanup,
 	};
@@ -358,46 +679,188 @@ int main(int argc, char** argv) {
 #endif
 	}
 
-	wsh_log_client_cmd(req.cmd_string, req.username, hosts, req.cwd);
-	if (num_hosts == 1 || threads < 2) {
-		for (gint i = 0; i < num_hosts; i++) {
-			wsh_cmd_res_t* res = NULL;
+	// With relays we only talk to the relays, and each runs the command on
+	// its own shard of the hosts
+	gchar** targets = hosts;
+	gsize num_targets = num_hosts;
+	gchar** relay_list = NULL;
+	gchar*** shards = NULL;
+	wsh_cmd_req_t* relay_reqs = NULL;
+	if (relays) {
+		relay_list = g_strsplit(relays, ",", 0);
+		shards = wsh_relay_split(hosts, num_hosts, g_strv_length(relay_list));
+
+		for (num_targets = 0; shards[num_targets]; num_targets++);
+		relay_reqs = g_new0(wsh_cmd_req_t, num_targets);
+		for (gsize i = 0; i < num_targets; i++) {
+			relay_reqs[i] = req;
+			relay_reqs[i].relay_hosts = shards[i];
+			relay_reqs[i].relay_hosts_len = g_strv_length(shards[i]);
+			relay_reqs[i].relay_depth = relay_depth;
+			relay_reqs[i].relay_port = port;
+		}
 
-			wshc_host_info_t host_info = {
-				.hostname = hosts[i],
-				.res = &res,
-			};
+		targets = relay_list;
+	}
 
-			wshc_try_ssh(&host_info, &cmd_info);
-		}
+	wshc_host_info_t host_info[num_targets + 1];
+	wsh_cmd_res_t* res[num_targets + 1];
+	gboolean prompt = (password || sudo_password);
+	gboolean rejected = FALSE;
+	gsize attempted = 0;
+
+	// Prove the credentials on a few hosts before handing them to every other
+	// host. A typo would otherwise cost a failed login (and a possible lockout)
+	// per host. Relays take their credentials straight through to the hosts,
+	// so there's nothing to hold back. A canary that fails before trying the
+	// credentials proves nothing, so the next host takes its place
+	gsize canaries = 0, verified = 0;
+	if (prompt && canary > 0 && num_targets > 1 && ! relays)
+		canaries = MIN((gsize)canary, num_targets);
+
+	for (gsize i = 0; i < num_targets; i++) {
+		res[i] = NULL;
+
+		host_info[i].hostname = targets[i];
+		host_info[i].res = &res[i];
+		host_info[i].status = WSHC_HOST_SKIPPED;
+		host_info[i].canary = (i < canaries);
+		host_info[i].authenticated = FALSE;
+		host_info[i].finished = FALSE;
+		host_info[i].relay_req = relay_reqs ? &relay_reqs[i] : NULL;
+		host_info[i].fetch_spool = NULL;
+	}
+
+	wsh_log_client_cmd(req.cmd_string, req.username, hosts, req.cwd);
+	if (! prompt && (num_targets == 1 || threads < 2)) {
+		for (gsize i = 0; i < num_targets; i++)
+			wshc_try_ssh(&host_info[i], &cmd_info);
 	} else {
+		// Even a serial run connects from a worker, so the first host can be
+		// connecting while we prompt. A single worker still takes the hosts
+		// one at a time, in order
 		GThreadPool* gtp;
-		if ((gtp = g_thread_pool_new((GFunc)wshc_try_ssh, &cmd_info, threads, TRUE,
-		                             &err)) == NULL) {
+		if ((gtp = g_thread_pool_new((GFunc)wshc_try_ssh, &cmd_info,
+		                             MAX(threads, 1), TRUE, &err)) == NULL) {
 			g_printerr("%s\n", err->message);
 			g_error_free(err);
 			return EXIT_FAILURE;
 		}
 
-		wshc_host_info_t host_info[num_hosts + 1];
-		wsh_cmd_res_t* res[num_hosts + 1];
+		// Bastions authenticate as soon as the first tunnel opens, and relays
+		// don't stop between connecting and authenticating, so neither can
+		// wait for the prompt
+		gboolean prompted = FALSE;
+		if (prompt && (cmd_info.jump || relays)) {
+			if ((ret = prompt_passwords(password, sudo_password)))
+				return ret;
+			prompted = TRUE;
+		}
+
+		// Hosts connect and verify host keys while we prompt, and wait at the
+		// gate before authenticating
+		if (prompt)
+			wshc_init_auth_gate(&cmd_info.gate, canaries);
 
 		// Set the max idle thread time to 10s longer than the specified timeout
 		// This will harvest dead threads
 		if (timeout)
 			g_thread_pool_set_max_idle_time(timeout + 10);
 
-		for (gsize i = 0; i < num_hosts; i++) {
-			res[i] = NULL;
-
-			host_info[i].hostname = hosts[i];
-			host_info[i].res = &res[i];
-
+		for (gsize i = 0; i < num_targets; i++)
 			g_thread_pool_push(gtp, &host_info[i], NULL);
+
+		if (prompt) {
+			if (! prompted && (ret = prompt_passwords(password, sudo_password))) {
+				wshc_set_auth_gate(cmd_info.gate, WSHC_GATE_CLOSED);
+				g_thread_pool_free(gtp, FALSE, TRUE);
+				wshc_free_auth_gate(&cmd_info.gate);
+				return ret;
+			}
+
+			if (canaries) {
+				wshc_set_auth_gate(cmd_info.gate, WSHC_GATE_CANARY);
+
+				gsize checked = 0, next = canaries;
+				while (! rejected && verified < canaries) {
+					wshc_wait_for_canaries(cmd_info.gate);
+
+					for (; checked < next && !rejected; checked++) {
+						if (! host_info[checked].canary)
+							continue;
+
+						switch (check_canary(&host_info[checked], req.sudo,
+						                     num_targets - checked - 1)) {
+							case WSHC_CANARY_VERIFIED:
+								verified++;
+								break;
+							case WSHC_CANARY_REJECTED:
+								rejected = TRUE;
+								break;
+							default:
+								break;
+						}
+					}
+
+					if (rejected || verified >= canaries)
+						break;
+
+					// Hosts that already finished never reached the gate, so
+					// they can't stand in
+					gsize promoted = 0;
+					for (; next < num_targets && promoted < canaries - verified; next++) {
+						if (wshc_promote_canary(cmd_info.gate, &host_info[next]))
+							promoted++;
+					}
+
+					// Every host has had its turn
+					if (! promoted)
+						break;
+				}
+			}
+
+			wshc_set_auth_gate(cmd_info.gate,
+			                   rejected ? WSHC_GATE_CLOSED : WSHC_GATE_OPEN);
 		}
 
 		g_thread_pool_free(gtp, FALSE, TRUE);
 		gtp = NULL;
+
+		wshc_free_auth_gate(&cmd_info.gate);
+	}
+
+	if (rejected)
+		ret = EXIT_FAILURE;
+
+	for (gsize i = 0; i < num_targets; i++) {
+		if (host_info[i].status == WSHC_HOST_SKIPPED)
+			continue;
+
+		attempted += relay_reqs ? relay_reqs[i].relay_hosts_len : 1;
+	}
+
+	if (req.summary_only && ! rejected)
+		fetch_representatives(&cmd_info, &req);
+	g_free(inspect);
+	inspect = NULL;
+
+	g_free(relay_reqs);
+	relay_reqs = NULL;
+	wsh_relay_free_shards(shards);
+	shards = NULL;
+	g_strfreev(relay_list);
+	relay_list = NULL;
+	g_free(relays);
+	relays = NULL;
+
+	if (cmd_info.auth_cache) {
+		// Failing to save just costs us a slower handshake next time
+		if (wsh_auth_cache_save(cmd_info.auth_cache, &err)) {
+			wshc_verbose_print(out_info, "Couldn't save auth cache: %s\n", err->message);
+			g_error_free(err);
+			err = NULL;
+		}
+		wsh_auth_cache_free(&cmd_info.auth_cache);
 	}
 
 	if (password || sudo_password) {
@@ -412,6 +875,13 @@ int main(int argc, char** argv) {
 		                            strlen(sudo_password));
 	if (password || sudo_password) wsh_client_unlock_password_pages(passwd_mem);
 
+	// Every tunnel is done with by now
+	wsh_jump_free(&cmd_info.jump);
+	wsh_throttle_free(&cmd_info.throttle);
+	wsh_payload_free(&payload);
+	g_free(jump);
+	jump = NULL;
+
 	wsh_ssh_cleanup();
 	g_free(username);
 	username = NULL;
@@ -437,20 +907,25 @@ int main(int argc, char** argv) {
 	if (collate_output) {
 		wshc_collate_output(out_info, &output, &output_len);
 
-		if (output) {
-			g_print("%s", output);
-		}
+		(void) fwrite(output, 1, output_len, stdout);
+		g_free(output);
 	}
 
 	wshc_write_failed_hosts(out_info);
+	wshc_write_aggregate(out_info);
 
 	if (collate_output) {
 		wsh_client_print_header(stdout, "\nSummary\n");
-		g_print("Attempted: %lu\n", num_hosts);
+		g_print("Attempted: %lu\n", attempted);
 		g_print("Failed: %u\n", g_atomic_int_get(&out_info->num_failed));
 		g_print("Errored (non-0 exit code): %u\n",
 		        g_atomic_int_get(&out_info->num_errored));
 		g_print("Succeeded: %u\n", g_atomic_int_get(&out_info->num_success));
+		if (out_info->expect_hash) {
+			g_print("Expected output: %s\n", out_info->expect_hash);
+			g_print("Matched expected output: %u\n",
+			        g_atomic_int_get(&out_info->num_matched));
+		}
 	}
 
 	wshc_cleanup_output(&out_info);
@@ -33,31 +33,35 @@
 #endif
 
 #include "cmd.h"
+#include "pack.h"
 
-static const gsize WSHC_ALLOC_LEN = 4096;
 static const gchar* WSHC_STDERR_TAIL = "stderr:\n";
 static const gchar* WSHC_STDOUT_TAIL = "stdout:\n";
-static const gsize WSHC_STDERR_TAIL_SIZE = 9;
-static const gsize WSHC_STDOUT_TAIL_SIZE = 9;
 static const gsize WSHC_ERROR_MAX_LEN = 1024;
+static const guint64 WSHC_HISTOGRAM_WIDTH = 40;
 
 struct collate {
 	GSList* hosts;
 	gchar** output;
 	gchar** error;
+	gchar* output_raw;
+	gchar* error_raw;
+	gsize output_raw_len;
+	gsize error_raw_len;
+	gboolean raw;
 	gint exit_code;
 };
 
-// Struct for final collate info
-struct f_collate {
-	gchar** out;
-	gsize* size;
-};
-
 static void free_output(wshc_host_output_t* out) {
 	if (! out) return;
-	if (out->error) g_strfreev(out->error);
-	if (out->output) g_strfreev(out->output);
+	if (! out->shared) {
+		if (out->error) g_strfreev(out->error);
+		if (out->output) g_strfreev(out->output);
+		g_free(out->output_raw);
+		g_free(out->error_raw);
+	}
+	g_free(out->hash);
+	g_free(out->spool_id);
 	g_slice_free(wshc_host_output_t, out);
 }
 
@@ -92,6 +96,11 @@ void wshc_cleanup_output(wshc_output_info_t** out) {
 
 	g_hash_table_destroy((*out)->output);
 	g_hash_table_destroy((*out)->failed_hosts);
+	if ((*out)->fetched)
+		g_hash_table_destroy((*out)->fetched);
+	free_output((*out)->expected);
+	wsh_aggregate_free(&(*out)->aggregate);
+	g_free((*out)->expect_hash);
 
 #if GLIB_CHECK_VERSION(2, 32, 0)
 	g_mutex_clear((*out)->mut);
@@ -104,6 +113,63 @@ void wshc_cleanup_output(wshc_output_info_t** out) {
 	*out = NULL;
 }
 
+__attribute__((nonnull(1)))
+void wshc_expect_output(wshc_output_info_t* out, const gchar* hash) {
+	g_assert(out);
+
+	if (! hash) {
+		out->expect_learn = TRUE;
+		return;
+	}
+
+	// We never see the output itself, so matching hosts just say so
+	out->expect_hash = g_ascii_strdown(hash, -1);
+	out->expected = g_slice_new0(wshc_host_output_t);
+	out->expected->output = g_new0(gchar*, 2);
+	out->expected->output[0] = g_strdup_printf("(output matched sha256 %s)",
+	                                           out->expect_hash);
+	out->expected->error = g_new0(gchar*, 1);
+}
+
+__attribute__((nonnull))
+gchar* wshc_expected_hash(wshc_output_info_t* out) {
+	g_mutex_lock(out->mut);
+	gchar* ret = g_strdup(out->expect_hash);
+	g_mutex_unlock(out->mut);
+
+	return ret;
+}
+
+// Output that came raw is shown as it was written, NULs and all
+__attribute__((nonnull))
+static void keep_raw(wshc_host_output_t* host_out, const wsh_cmd_res_t* res) {
+	if (! res->std_output_raw || ! res->std_error_raw)
+		return;
+
+	host_out->output_raw = g_memdup2(res->std_output_raw, res->std_output_raw_len);
+	host_out->output_raw_len = res->std_output_raw_len;
+	host_out->error_raw = g_memdup2(res->std_error_raw, res->std_error_raw_len);
+	host_out->error_raw_len = res->std_error_raw_len;
+	host_out->raw = TRUE;
+}
+
+// The first host to succeed sets what everyone after it is asked to match
+__attribute__((nonnull))
+static void learn_output(wshc_output_info_t* out, const wsh_cmd_res_t* res) {
+	g_mutex_lock(out->mut);
+
+	if (! out->expect_hash) {
+		out->expected = g_slice_new0(wshc_host_output_t);
+		out->expected->output = g_strdupv(res->std_output);
+		out->expected->error = g_strdupv(res->std_error);
+		keep_raw(out->expected, res);
+		out->expected->exit_code = res->exit_status;
+		out->expect_hash = wsh_response_hash(res);
+	}
+
+	g_mutex_unlock(out->mut);
+}
+
 __attribute__((nonnull))
 static gint write_output_mem(wshc_output_info_t* out, const gchar* hostname,
                              const wsh_cmd_res_t* res) {
@@ -113,6 +179,19 @@ static gint write_output_mem(wshc_output_info_t* out, const gchar* hostname,
 	host_out->output = g_strdupv(res->std_output);
 	host_out->exit_code = res->exit_status;
 
+	// Until the full output's fetched, say how much of it there is
+	if (res->spool_id) {
+		gsize len = g_strv_length(host_out->output);
+		host_out->output = g_renew(gchar*, host_out->output, len + 2);
+		host_out->output[len] = g_strdup_printf("(wsh: first lines of %" G_GUINT64_FORMAT
+		                                        " bytes of output)", res->output_size);
+		host_out->output[len + 1] = NULL;
+		host_out->hash = g_strdup(res->output_hash);
+		host_out->spool_id = g_strdup(res->spool_id);
+	} else {
+		keep_raw(host_out, res);
+	}
+
 	g_mutex_lock(out->mut);
 	g_hash_table_insert(out->output, g_strdup(hostname), host_out);
 	g_mutex_unlock(out->mut);
@@ -120,6 +199,47 @@ static gint write_output_mem(wshc_output_info_t* out, const gchar* hostname,
 	return EXIT_SUCCESS;
 }
 
+// Hosts that matched share the expected output rather than a copy each
+__attribute__((nonnull))
+static gint matched_output_mem(wshc_output_info_t* out, const gchar* hostname,
+                               const wsh_cmd_res_t* res) {
+	wshc_host_output_t* host_out = g_slice_new0(wshc_host_output_t);
+	host_out->error = out->expected->error;
+	host_out->output = out->expected->output;
+	host_out->output_raw = out->expected->output_raw;
+	host_out->output_raw_len = out->expected->output_raw_len;
+	host_out->error_raw = out->expected->error_raw;
+	host_out->error_raw_len = out->expected->error_raw_len;
+	host_out->raw = out->expected->raw;
+	host_out->exit_code = res->exit_status;
+	host_out->shared = TRUE;
+
+	g_mutex_lock(out->mut);
+	g_hash_table_insert(out->output, g_strdup(hostname), host_out);
+	g_mutex_unlock(out->mut);
+
+	return EXIT_SUCCESS;
+}
+
+// Raw output can hold NULs, so each line is written by its length
+__attribute__((nonnull))
+static void print_raw_lines(const gchar* hostname, const guint8* raw, gsize len,
+                            gboolean std_err) {
+	const gchar* line = (const gchar*)raw, * end = line + len;
+
+	while (line < end) {
+		const gchar* nl = memchr(line, '\n', end - line);
+		gsize line_len = (nl ? nl : end) - line;
+
+		if (std_err)
+			wsh_client_print_error_line(hostname, line, line_len);
+		else
+			wsh_client_print_success_line(hostname, line, line_len);
+
+		line = nl ? nl + 1 : end;
+	}
+}
+
 __attribute__((nonnull))
 static gint hostname_output(wshc_output_info_t* out, const gchar* hostname,
                             const wsh_cmd_res_t* res) {
@@ -128,8 +248,11 @@ static gint hostname_output(wshc_output_info_t* out, const gchar* hostname,
 	if (res->std_output_len) {
 		if (out->stdout_tty)
 			wsh_client_print_header(stdout, "%s: stdout ****\n", hostname);
-		for (guint32 i = 0; i < res->std_output_len; i++)
-			wsh_client_print_success("%s: %s\n", hostname, res->std_output[i]);
+		if (res->std_output_raw)
+			print_raw_lines(hostname, res->std_output_raw, res->std_output_raw_len, FALSE);
+		else
+			for (guint32 i = 0; i < res->std_output_len; i++)
+				wsh_client_print_success("%s: %s\n", hostname, res->std_output[i]);
 	}
 
 	if (res->std_output_len || res->std_error_len)
@@ -139,8 +262,11 @@ static gint hostname_output(wshc_output_info_t* out, const gchar* hostname,
 	if (res->std_error_len) {
 		if (out->stderr_tty)
 			wsh_client_print_header(stderr, "%s: stderr ****\n", hostname);
-		for (guint32 i = 0; i < res->std_error_len; i++)
-			wsh_client_print_error("%s: %s\n", hostname, res->std_error[i]);
+		if (res->std_error_raw)
+			print_raw_lines(hostname, res->std_error_raw, res->std_error_raw_len, TRUE);
+		else
+			for (guint32 i = 0; i < res->std_error_len; i++)
+				wsh_client_print_error("%s: %s\n", hostname, res->std_error[i]);
 	}
 
 	if (out->stdout_tty)
@@ -168,10 +294,42 @@ gint wshc_write_output(wshc_output_info_t* out, const gchar* hostname,
 		g_atomic_int_inc(&out->num_success);
 	}
 
+	if (res->aggregate)
+		wshc_add_aggregate(out, res->aggregate);
+
+	if (res->matches)
+		g_atomic_int_inc(&out->num_matched);
+	else if (out->expect_learn && !res->exit_status && !res->spool_id)
+		learn_output(out, res);
+
 	/* If we only want to capture errors, exit quickly on success */
 	if (out->errors_only && !res->exit_status)
 		return EXIT_SUCCESS;
 
+	if (res->matches) {
+		// expected was set before any host could be asked to match it
+		wsh_cmd_res_t expected = *res;
+		expected.std_output = out->expected->output;
+		expected.std_output_len = g_strv_length(out->expected->output);
+		expected.std_error = out->expected->error;
+		expected.std_error_len = g_strv_length(out->expected->error);
+		expected.std_output_raw = (guint8*)out->expected->output_raw;
+		expected.std_output_raw_len = out->expected->output_raw_len;
+		expected.std_error_raw = (guint8*)out->expected->error_raw;
+		expected.std_error_raw_len = out->expected->error_raw_len;
+		if (! out->expected->raw)
+			expected.std_output_raw = expected.std_error_raw = NULL;
+
+		switch (out->type) {
+			case WSHC_OUTPUT_TYPE_COLLATED:
+				return matched_output_mem(out, hostname, res);
+			case WSHC_OUTPUT_TYPE_HOSTNAME:
+				return hostname_output(out, hostname, &expected);
+			default:
+				return EXIT_FAILURE;
+		}
+	}
+
 	switch (out->type) {
 		case WSHC_OUTPUT_TYPE_COLLATED:
 			return write_output_mem(out, hostname, res);
@@ -182,11 +340,226 @@ gint wshc_write_output(wshc_output_info_t* out, const gchar* hostname,
 	}
 }
 
+__attribute__((nonnull(1, 3, 4)))
+gsize wshc_representatives(wshc_output_info_t* out, gchar** inspect,
+                           gchar*** hosts, gchar*** spool_ids) {
+	g_assert(out);
+
+	GHashTable* seen = g_hash_table_new(g_str_hash, g_str_equal);
+	GPtrArray* fetch_hosts = g_ptr_array_new();
+	GPtrArray* fetch_ids = g_ptr_array_new();
+
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, out->output);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		const gchar* hostname = key;
+		wshc_host_output_t* host_out = value;
+		if (! host_out->spool_id)
+			continue;
+
+		gboolean asked = FALSE;
+		for (gchar** p = inspect; p && *p && ! asked; p++)
+			asked = ! strcmp(*p, hostname);
+
+		if (! asked && g_hash_table_lookup(seen, host_out->hash))
+			continue;
+
+		g_hash_table_insert(seen, host_out->hash, host_out);
+		g_ptr_array_add(fetch_hosts, g_strdup(hostname));
+		g_ptr_array_add(fetch_ids, g_strdup(host_out->spool_id));
+	}
+
+	gsize len = fetch_hosts->len;
+	g_ptr_array_add(fetch_hosts, NULL);
+	g_ptr_array_add(fetch_ids, NULL);
+	*hosts = (gchar**)g_ptr_array_free(fetch_hosts, FALSE);
+	*spool_ids = (gchar**)g_ptr_array_free(fetch_ids, FALSE);
+	g_hash_table_destroy(seen);
+
+	out->fetched = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	out->fetching = TRUE;
+
+	return len;
+}
+
+__attribute__((nonnull))
+gint wshc_write_fetched(wshc_output_info_t* out, const gchar* hostname,
+                        const wsh_cmd_res_t* res) {
+	if (res->error_message) {
+		wshc_verbose_print(out, "Couldn't fetch output from %s: %s\n", hostname,
+		                   res->error_message);
+		return EXIT_FAILURE;
+	}
+
+	wshc_host_output_t* host_out = g_slice_new0(wshc_host_output_t);
+	host_out->error = g_strdupv(res->std_error);
+	host_out->output = g_strdupv(res->std_output);
+	keep_raw(host_out, res);
+	host_out->exit_code = res->exit_status;
+	gchar* hash = wsh_response_hash(res);
+
+	// Replaces the host's summary
+	g_mutex_lock(out->mut);
+	g_hash_table_insert(out->output, g_strdup(hostname), host_out);
+	if (! g_hash_table_lookup(out->fetched, hash))
+		g_hash_table_insert(out->fetched, hash, host_out);
+	else
+		g_free(hash);
+	g_mutex_unlock(out->mut);
+
+	return EXIT_SUCCESS;
+}
+
+// Summaries take on the full output fetched from a host that matched them
+static void fill_summary(const gchar* hostname, wshc_host_output_t* host_out,
+                         GHashTable* fetched) {
+	if (! host_out->spool_id || host_out->shared)
+		return;
+
+	wshc_host_output_t* full = g_hash_table_lookup(fetched, host_out->hash);
+	if (! full)
+		return;
+
+	g_strfreev(host_out->output);
+	g_strfreev(host_out->error);
+	host_out->output = full->output;
+	host_out->error = full->error;
+	host_out->output_raw = full->output_raw;
+	host_out->output_raw_len = full->output_raw_len;
+	host_out->error_raw = full->error_raw;
+	host_out->error_raw_len = full->error_raw_len;
+	host_out->raw = full->raw;
+	host_out->shared = TRUE;
+}
+
+__attribute__((nonnull))
+void wshc_add_aggregate(wshc_output_info_t* out, const wsh_aggregate_t* agg) {
+	if (! out->aggregate)
+		return;
+
+	g_mutex_lock(out->mut);
+	wsh_aggregate_merge(out->aggregate, agg);
+	g_mutex_unlock(out->mut);
+}
+
+// Most common lines first, then in order
+static gint cmp_counts(gconstpointer a, gconstpointer b, gpointer counts) {
+	const gchar* line_a = *(const gchar**)a, * line_b = *(const gchar**)b;
+	guint64 count_a = *(guint64*)g_hash_table_lookup(counts, line_a);
+	guint64 count_b = *(guint64*)g_hash_table_lookup(counts, line_b);
+
+	if (count_a != count_b)
+		return count_a > count_b ? -1 : 1;
+
+	return strcmp(line_a, line_b);
+}
+
+static gint cmp_buckets(gconstpointer a, gconstpointer b) {
+	gint bucket_a = GPOINTER_TO_INT(*(gconstpointer*)a);
+	gint bucket_b = GPOINTER_TO_INT(*(gconstpointer*)b);
+
+	return (bucket_a > bucket_b) - (bucket_a < bucket_b);
+}
+
+static void write_counts(const wsh_aggregate_t* agg) {
+	GPtrArray* lines = g_ptr_array_sized_new(g_hash_table_size(agg->counts));
+	GHashTableIter iter;
+	gpointer key;
+
+	g_hash_table_iter_init(&iter, agg->counts);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		g_ptr_array_add(lines, key);
+	g_ptr_array_sort_with_data(lines, cmp_counts, agg->counts);
+
+	for (guint i = 0; i < lines->len; i++) {
+		const gchar* line = g_ptr_array_index(lines, i);
+		g_print("%10" G_GUINT64_FORMAT " %s\n",
+		        *(guint64*)g_hash_table_lookup(agg->counts, line), line);
+	}
+
+	g_ptr_array_free(lines, TRUE);
+}
+
+static void write_histogram(const wsh_aggregate_t* agg) {
+	GPtrArray* buckets = g_ptr_array_sized_new(g_hash_table_size(agg->buckets));
+	GHashTableIter iter;
+	gpointer key, value;
+	guint64 most = 0;
+
+	g_hash_table_iter_init(&iter, agg->buckets);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		g_ptr_array_add(buckets, key);
+		most = MAX(most, *(guint64*)value);
+	}
+	g_ptr_array_sort(buckets, cmp_buckets);
+
+	for (guint i = 0; i < buckets->len; i++) {
+		gint bucket = GPOINTER_TO_INT(g_ptr_array_index(buckets, i));
+		guint64 count = *(guint64*)g_hash_table_lookup(agg->buckets,
+		                GINT_TO_POINTER(bucket));
+
+		gdouble low, high;
+		wsh_aggregate_bucket_range(bucket, &low, &high);
+		gchar* range = bucket ? g_strdup_printf("%g .. %g", low, high) : g_strdup("0");
+		gchar* bar = g_strnfill(MAX(1, count * WSHC_HISTOGRAM_WIDTH / most), '#');
+
+		g_print("%-24s %10" G_GUINT64_FORMAT " %s\n", range, count, bar);
+
+		g_free(bar);
+		g_free(range);
+	}
+
+	g_ptr_array_free(buckets, TRUE);
+}
+
+__attribute__((nonnull))
+void wshc_write_aggregate(wshc_output_info_t* out) {
+	const wsh_aggregate_t* agg = out->aggregate;
+	if (! agg)
+		return;
+
+	wsh_client_print_header(stdout, "Aggregate (%s)\n",
+	                        wsh_aggregate_op_name(agg->op));
+
+	if (agg->op == WSH_AGGREGATE_UNIQ_COUNT) {
+		write_counts(agg);
+		g_print("\n");
+		return;
+	}
+
+	if (agg->op == WSH_AGGREGATE_HISTOGRAM)
+		write_histogram(agg);
+
+	if (agg->op == WSH_AGGREGATE_SUM)
+		g_print("Sum: %.15g\n", agg->sum);
+
+	if (agg->op != WSH_AGGREGATE_SUM && agg->values) {
+		g_print("Min: %.15g\n", agg->min);
+		g_print("Max: %.15g\n", agg->max);
+	}
+
+	g_print("Numbers: %" G_GUINT64_FORMAT "\n", agg->values);
+	if (agg->skipped)
+		g_print("Lines that weren't numbers: %" G_GUINT64_FORMAT "\n", agg->skipped);
+	g_print("\n");
+}
+
+static gboolean same_bytes(const gchar* a, gsize a_len, const gchar* b, gsize b_len) {
+	return a_len == b_len && (! a_len || ! memcmp(a, b, a_len));
+}
+
 __attribute__((nonnull))
 static gboolean cmp(struct collate* col, wshc_host_output_t* out) {
 	if (col->exit_code != out->exit_code)
 		return FALSE;
 
+	if (col->raw && out->raw)
+		return same_bytes(col->error_raw, col->error_raw_len, out->error_raw,
+		                  out->error_raw_len) &&
+		       same_bytes(col->output_raw, col->output_raw_len, out->output_raw,
+		                  out->output_raw_len);
+
 	gsize i = 0;
 
 	for (gchar** cur = col->error; *cur != NULL; cur++) {
@@ -234,6 +607,11 @@ static void hash_compare(gchar* hostname, wshc_host_output_t* out,
 	struct collate* c = g_slice_new0(struct collate);
 	c->output = out->output;
 	c->error = out->error;
+	c->output_raw = out->output_raw;
+	c->output_raw_len = out->output_raw_len;
+	c->error_raw = out->error_raw;
+	c->error_raw_len = out->error_raw_len;
+	c->raw = out->raw;
 	c->exit_code = out->exit_code;
 	c->hosts = NULL;
 	c->hosts = g_slist_prepend(c->hosts, hostname);
@@ -241,95 +619,56 @@ static void hash_compare(gchar* hostname, wshc_host_output_t* out,
 	*clist = g_slist_prepend(*clist, c);
 }
 
-__attribute__((nonnull))
-static void construct_out(struct collate* c, struct f_collate* f) {
-	// If both are null, let's not bother with any of this
-	if (*c->error == NULL && *c->output == NULL) return;
-
-	gsize new_len = 0;
-	gchar* host_list_str_stdout, * host_list_str_stderr, * host_list_str_base;
-	host_list_str_base = host_list_str_stderr = host_list_str_stdout = NULL;
-
-	// Calculate size of host list
-	gsize host_list_len = 0;
-	for (GSList* host_list = c->hosts; host_list != NULL;
-	        host_list = host_list->next) {
-		host_list_len += strlen(host_list->data) + 2;
+// Lines each end in a newline. Raw output is copied as it is, NULs and all,
+// with a newline if it didn't end in one
+static void append_output(GString* buf, gchar** lines, const gchar* raw,
+                          gsize raw_len, gboolean is_raw) {
+	if (! is_raw) {
+		for (gchar** p = lines; *p != NULL; p++) {
+			g_string_append(buf, *p);
+			g_string_append_c(buf, '\n');
+		}
+		return;
 	}
 
-	// Build host list string
-	host_list_str_base = g_slice_alloc0(host_list_len + WSHC_STDERR_TAIL_SIZE);
-	for (GSList* host_list = c->hosts; host_list != NULL;
-	        host_list = host_list->next) {
-		g_strlcat(host_list_str_base, host_list->data, host_list_len);
-		g_strlcat(host_list_str_base, " ", host_list_len);
-	}
+	g_string_append_len(buf, raw, raw_len);
+	if (raw_len && raw[raw_len - 1] != '\n')
+		g_string_append_c(buf, '\n');
+}
 
-	// Copy the host list string
-	if (*c->output && ! *c->error)
-		host_list_str_stdout = host_list_str_base;
-	else if (*c->error && ! *c->output)
-		host_list_str_stderr = host_list_str_base;
-	else {
-		host_list_str_stdout = host_list_str_base;
-		host_list_str_stderr = g_slice_copy(host_list_len + WSHC_STDOUT_TAIL_SIZE,
-		                                    host_list_str_base);
-	}
+__attribute__((nonnull))
+static void construct_out(struct collate* c, GString* out) {
+	gboolean has_error = c->raw ? c->error_raw_len != 0 : *c->error != NULL;
+	gboolean has_output = c->raw ? c->output_raw_len != 0 : *c->output != NULL;
 
-	// Add the tails of the host command to the host list
-	if (host_list_str_stderr)
-		strncat(host_list_str_stderr, WSHC_STDERR_TAIL, WSHC_STDERR_TAIL_SIZE);
-	if(host_list_str_stdout)
-		strncat(host_list_str_stdout, WSHC_STDOUT_TAIL, WSHC_STDOUT_TAIL_SIZE);
-
-	// Calculate the size of the stderr and stdout
-	gsize stderr_len = 0;
-	for (gchar** p = c->error; *p != NULL; p++) stderr_len += (strlen(*p) + 1);
-
-	gsize stdout_len = 0;
-	for (gchar** p = c->output; *p != NULL; p++) stdout_len += (strlen(*p) + 1);
-
-	// Allocate memory until requirement is satisfied
-	new_len = 1 + stderr_len + stdout_len + host_list_len * 2 +
-	          WSHC_STDOUT_TAIL_SIZE + WSHC_STDERR_TAIL_SIZE;
-	while (*f->size == 0 || new_len + strlen(*f->out) > *f->size) {
-		gchar* new_output = g_slice_alloc0(*f->size + WSHC_ALLOC_LEN);
-		memmove(new_output, *f->out, *f->size);
-		if (*f->size)
-			g_slice_free1(*f->size, *f->out);
-		*f->out = new_output;
-		*f->size += WSHC_ALLOC_LEN;
-	}
+	// If both are empty, let's not bother with any of this
+	if (! has_error && ! has_output) return;
 
-	// Start copying data into out
-	if (*c->error && host_list_str_stderr) {
-		strncat(*f->out, host_list_str_stderr, *f->size);
+	// Build host list string
+	GString* host_list = g_string_new(NULL);
+	for (GSList* host = c->hosts; host != NULL; host = host->next) {
+		g_string_append(host_list, host->data);
+		g_string_append_c(host_list, ' ');
+	}
 
-		for (gchar** p = c->error; *p != NULL; p++) {
-			strncat(*f->out, *p, *f->size);
-			strncat(*f->out, "\n", *f->size);
-		}
+	if (has_error) {
+		g_string_append(out, host_list->str);
+		g_string_append(out, WSHC_STDERR_TAIL);
+		append_output(out, c->error, c->error_raw, c->error_raw_len, c->raw);
 
 		// Add separating newline
-		if (*c->output != NULL)
-			strncat(*f->out, "\n", *f->size);
+		if (has_output)
+			g_string_append_c(out, '\n');
 	}
 
-	if (*c->output && host_list_str_stdout) {
-		strncat(*f->out, host_list_str_stdout, *f->size);
-
-		for (gchar** p = c->output; *p != NULL; p++) {
-			strncat(*f->out, *p, *f->size);
-			strncat(*f->out, "\n", *f->size);
-		}
+	if (has_output) {
+		g_string_append(out, host_list->str);
+		g_string_append(out, WSHC_STDOUT_TAIL);
+		append_output(out, c->output, c->output_raw, c->output_raw_len, c->raw);
 	}
 
-	strncat(*f->out, "\n", *f->size);
-
-	if (host_list_str_stderr)
-		g_slice_free1(host_list_len + WSHC_STDERR_TAIL_SIZE, host_list_str_stderr);
-	if (host_list_str_stdout)
-		g_slice_free1(host_list_len + WSHC_STDOUT_TAIL_SIZE, host_list_str_stdout);
+	g_string_append_c(out, '\n');
+	g_string_free(host_list, TRUE);
 }
 
 /* First, let's iterate over our hash table of hostname:output and iterate over that
@@ -338,10 +677,8 @@ static void construct_out(struct collate* c, struct f_collate* f) {
  *
  * Collate structs contain unique entries of output to display to the user
  *
- * Then let's iterate over those and build the human readable output.
- *
- * f_collate is a struct containing the output buffer and the size of the output
- * buffer
+ * Then let's iterate over those and build the human readable output, which
+ * raw output can put NULs in, so it has to be written by its length
  */
 __attribute__((nonnull))
 gint wshc_collate_output(wshc_output_info_t* out, gchar** output,
@@ -351,13 +688,16 @@ gint wshc_collate_output(wshc_output_info_t* out, gchar** output,
 	g_assert(! *output_size);
 
 	GSList* clist = NULL;
-	struct f_collate f = {
-		.size = output_size,
-		.out = output,
-	};
+	GString* buf = g_string_new(NULL);
+
+	if (out->fetched)
+		g_hash_table_foreach(out->output, (GHFunc)fill_summary, out->fetched);
 
 	g_hash_table_foreach(out->output, (GHFunc)hash_compare, &clist);
-	g_slist_foreach(clist, (GFunc)construct_out, &f);
+	g_slist_foreach(clist, (GFunc)construct_out, buf);
+
+	*output_size = buf->len;
+	*output = g_string_free(buf, FALSE);
 
 	return EXIT_SUCCESS;
 }
@@ -369,6 +709,12 @@ void wshc_add_failed_host(wshc_output_info_t* out, const gchar* host,
 	g_assert(host);
 	g_assert(message);
 
+	// The host already ran the command, and keeps its summary
+	if (out->fetching) {
+		wshc_verbose_print(out, "Couldn't fetch output from %s: %s\n", host, message);
+		return;
+	}
+
 	g_atomic_int_inc(&out->num_failed);
 
 	g_mutex_lock(out->mut);
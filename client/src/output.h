@@ -27,6 +27,7 @@
 
 #include <glib.h>
 
+#include "aggregate.h"
 #include "cmd.h"
 
 /** Method in which to display output
@@ -50,14 +51,29 @@ typedef struct {
 	guint num_failed;			/**< number of hosts that failed to run wshd */
 	guint num_errored;			/**< number of hosts whose commands errored */
 	guint num_success;			/**< number of hosts whose commends succeeded */
+	guint num_matched;			/**< number of hosts whose output matched expect_hash */
+	gchar* expect_hash;			/**< hex SHA-256 hosts are asked to match, NULL for none */
+	gboolean expect_learn;		/**< take expect_hash from the first host to succeed */
+	struct wshc_host_output* expected;	/**< what matching hosts show, NULL until expect_hash is set */
+	GHashTable* fetched;		/**< full output fetched for each output hash, NULL until fetching */
+	gboolean fetching;			/**< fetching full output for summaries, so failures aren't the host's */
+	wsh_aggregate_t* aggregate;	/**< every host's stdout merged, NULL unless aggregating */
 } wshc_output_info_t;
 
 /** Final output data
  */
-typedef struct {
+typedef struct wshc_host_output {
 	gchar** output;		/**< Stringified output to show to user */
 	gchar** error;		/**< Stringified error to show to user */
+	gchar* output_raw;	/**< Output as it was written, if raw is set */
+	gchar* error_raw;	/**< Error as it was written, if raw is set */
+	gsize output_raw_len;	/**< Length of output_raw */
+	gsize error_raw_len;	/**< Length of error_raw */
+	gboolean raw;		/**< Came as raw output, which is what's shown */
 	gint exit_code;		/**< Exit code of command */
+	gchar* hash;		/**< wsh_response_hash() of the full output, if this is a summary */
+	gchar* spool_id;	/**< Where the full output waits, if this is a summary */
+	gboolean shared;	/**< output and error belong to another wshc_host_output_t */
 } wshc_host_output_t;
 
 /**
@@ -80,6 +96,29 @@ void wshc_init_output(wshc_output_info_t** out);
 __attribute__((nonnull))
 void wshc_cleanup_output(wshc_output_info_t** out);
 
+/**
+ * @brief Asks hosts to only vouch for output we already expect
+ *
+ * @param[out] out Our wshc_output_info_t struct describing our output
+ * @param[in] hash Hex SHA-256 from wsh_response_hash(), or NULL to take it
+ * from the first host to succeed
+ *
+ * @note Expects not to be threaded
+ */
+__attribute__((nonnull(1)))
+void wshc_expect_output(wshc_output_info_t* out, const gchar* hash);
+
+/**
+ * @brief Gets the hash hosts should be asked to match
+ *
+ * @param[in] out Our wshc_output_info_t struct describing our output
+ *
+ * @returns Hex SHA-256 to free with g_free, or NULL if there's nothing to
+ * match yet
+ */
+__attribute__((nonnull))
+gchar* wshc_expected_hash(wshc_output_info_t* out);
+
 /**
  * @brief Writes output from a host to desired location based on
  * command flags
@@ -94,12 +133,67 @@ __attribute__((nonnull))
 gint wshc_write_output(wshc_output_info_t* out, const gchar* hostname,
                        const wsh_cmd_res_t* res);
 
+/**
+ * @brief Picks hosts to fetch full output from, in place of their summaries
+ *
+ * That's one host for each distinct output, and every host in inspect.
+ * Failures from then on are only reported verbosely, as the hosts keep
+ * their summaries.
+ *
+ * @param[in,out] out Our wshc_output_info_t struct describing our output
+ * @param[in] inspect Hosts to fetch from regardless, or NULL
+ * @param[out] hosts Hosts to fetch from. Free with g_strfreev
+ * @param[out] spool_ids spool_id to fetch from each host. Free with g_strfreev
+ *
+ * @returns Number of hosts to fetch from
+ *
+ * @note Expects not to be threaded
+ */
+__attribute__((nonnull(1, 3, 4)))
+gsize wshc_representatives(wshc_output_info_t* out, gchar** inspect,
+                           gchar*** hosts, gchar*** spool_ids);
+
+/**
+ * @brief Records a host's full output, fetched for its summary
+ *
+ * Hosts with matching summaries show it too, once collated.
+ *
+ * @param[out] out Our wshc_output_info_t struct describing our output
+ * @param[in] hostname The hostname of the current host
+ * @param[in] res The full result
+ *
+ * @return 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wshc_write_fetched(wshc_output_info_t* out, const gchar* hostname,
+                        const wsh_cmd_res_t* res);
+
+/**
+ * @brief Merges a host's aggregate into everyone else's
+ *
+ * @param[in,out] out Our wshc_output_info_t struct describing our output
+ * @param[in] agg Aggregate from a result, which may cover several hosts
+ */
+__attribute__((nonnull))
+void wshc_add_aggregate(wshc_output_info_t* out, const wsh_aggregate_t* agg);
+
+/**
+ * @brief Print the merged aggregate as a table, if we're aggregating
+ *
+ * @param[in] out Our output metadata
+ *
+ * @note Expects not to be threaded
+ */
+__attribute__((nonnull))
+void wshc_write_aggregate(wshc_output_info_t* out);
+
 /**
  * @brief Takes the given output, and collates it into an easy-to-parse format
  *
  * @param[in] out Our collected output
- * @param[out] output Our output buffer that we'll show to the user
- * @param[out] output_size The size of our current output buffer
+ * @param[out] output Our output buffer that we'll show to the user. Free with
+ * g_free
+ * @param[out] output_size The length of output, which can hold NULs
  *
  * @note Expects not to be threaded
  */
@@ -25,65 +25,251 @@
 #include <glib/gprintf.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "cmd.h"
 #include "log.h"
 #include "ssh.h"
 #include "pack.h"
+#include "relay.h"
+
+// sshd drops connections that haven't authenticated within its LoginGraceTime,
+// 120s by default. A host that waited at the auth gate for longer than this
+// connects again before authenticating
+static const gint64 WSHC_GATE_MAX_WAIT = 60 * G_USEC_PER_SEC;
+
+// What sudo (and wsh-askpass, once sudo retries) says about a bad password
+static const gchar* sudo_auth_failures[] = {
+	"incorrect password attempt",
+	"Sorry, try again.",
+	"Invalid sudo password",
+	NULL,
+};
 
 __attribute__((nonnull))
-void wshc_try_ssh(wshc_host_info_t* host_info,
-                  const wshc_cmd_info_t* cmd_info) {
-	g_assert(cmd_info != NULL);
-	g_assert(host_info != NULL);
+gboolean wshc_sudo_auth_failed(const wsh_cmd_res_t* res) {
+	if (res->exit_status == 0)
+		return FALSE;
 
-	GError* err = NULL;
-	wsh_ssh_session_t session = {
-		.hostname = host_info->hostname,
-		.username = cmd_info->username,
-		.password = cmd_info->password,
-		.port = cmd_info->port,
-		.session = NULL,
-		.ssh_opts = cmd_info->ssh_opts,
-	};
+	for (gsize i = 0; i < res->std_error_len; i++) {
+		for (const gchar** msg = sudo_auth_failures; *msg; msg++) {
+			if (strstr(res->std_error[i], *msg))
+				return TRUE;
+		}
+	}
 
-	if (session.password == NULL) {
-		session.auth_type = WSH_SSH_AUTH_PUBKEY;
-		wshc_verbose_print(cmd_info->out, "Using public key authentication\n");
-	} else {
-		session.auth_type = WSH_SSH_AUTH_PASSWORD;
-		wshc_verbose_print(cmd_info->out, "Using password authentication\n");
+	return FALSE;
+}
+
+__attribute__((nonnull))
+wshc_canary_verdict_t wshc_canary_verdict(const wshc_host_info_t* host_info,
+        gboolean sudo) {
+	switch (host_info->status) {
+		case WSHC_HOST_AUTH_FAILED:
+		case WSHC_HOST_SUDO_FAILED:
+			return WSHC_CANARY_REJECTED;
+		case WSHC_HOST_OK:
+			return WSHC_CANARY_VERIFIED;
+		default:
+			// Without sudo, getting in is all the password has to do
+			if (host_info->authenticated && ! sudo)
+				return WSHC_CANARY_VERIFIED;
+			return WSHC_CANARY_UNVERIFIED;
+	}
+}
+
+__attribute__((nonnull))
+void wshc_init_auth_gate(wshc_auth_gate_t** gate, guint canaries) {
+	*gate = g_slice_new0(wshc_auth_gate_t);
+	(*gate)->state = WSHC_GATE_PENDING;
+	(*gate)->canaries_left = canaries;
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	(*gate)->mut = g_slice_new(GMutex);
+	g_mutex_init((*gate)->mut);
+	(*gate)->cond = g_slice_new(GCond);
+	g_cond_init((*gate)->cond);
+#else
+	(*gate)->mut = g_mutex_new();
+	(*gate)->cond = g_cond_new();
+#endif
+}
+
+__attribute__((nonnull))
+void wshc_set_auth_gate(wshc_auth_gate_t* gate, wshc_gate_state_t state) {
+	g_mutex_lock(gate->mut);
+	gate->state = state;
+	g_cond_broadcast(gate->cond);
+	g_mutex_unlock(gate->mut);
+}
+
+__attribute__((nonnull))
+void wshc_wait_for_canaries(wshc_auth_gate_t* gate) {
+	g_mutex_lock(gate->mut);
+	while (gate->canaries_left)
+		g_cond_wait(gate->cond, gate->mut);
+	g_mutex_unlock(gate->mut);
+}
+
+__attribute__((nonnull))
+gboolean wshc_promote_canary(wshc_auth_gate_t* gate, wshc_host_info_t* host_info) {
+	g_mutex_lock(gate->mut);
+	gboolean ret = ! host_info->canary && ! host_info->finished;
+	if (ret) {
+		host_info->canary = TRUE;
+		gate->canaries_left++;
+		g_cond_broadcast(gate->cond);
 	}
+	g_mutex_unlock(gate->mut);
+
+	return ret;
+}
+
+void wshc_free_auth_gate(wshc_auth_gate_t** gate) {
+	if (! gate || ! *gate) return;
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	g_mutex_clear((*gate)->mut);
+	g_slice_free(GMutex, (*gate)->mut);
+	g_cond_clear((*gate)->cond);
+	g_slice_free(GCond, (*gate)->cond);
+#else
+	g_mutex_free((*gate)->mut);
+	g_cond_free((*gate)->cond);
+#endif
+
+	g_slice_free(wshc_auth_gate_t, *gate);
+	*gate = NULL;
+}
+
+// Whether the gate already turned everyone away, so there's no point connecting
+__attribute__((nonnull))
+static gboolean auth_gate_closed(wshc_auth_gate_t* gate) {
+	g_mutex_lock(gate->mut);
+	gboolean ret = gate->state == WSHC_GATE_CLOSED;
+	g_mutex_unlock(gate->mut);
+
+	return ret;
+}
+
+// Returns FALSE if the gate closed on us
+__attribute__((nonnull))
+static gboolean pass_auth_gate(wshc_auth_gate_t* gate,
+                               const wshc_host_info_t* host_info) {
+	g_mutex_lock(gate->mut);
+	while (gate->state == WSHC_GATE_PENDING ||
+	        (gate->state == WSHC_GATE_CANARY && ! host_info->canary))
+		g_cond_wait(gate->cond, gate->mut);
+
+	gboolean ret = gate->state != WSHC_GATE_CLOSED;
+	g_mutex_unlock(gate->mut);
+
+	return ret;
+}
+
+// Returns FALSE, having reported the host as failed, if we couldn't connect or
+// trust the host
+__attribute__((nonnull))
+static gboolean connect_host(wsh_ssh_session_t* session,
+                             const wshc_host_info_t* host_info,
+                             const wshc_cmd_info_t* cmd_info) {
+	GError* err = NULL;
 
 	wshc_verbose_print(cmd_info->out, "Initiating connection to %s\n",
 	                   host_info->hostname);
-	if (wsh_ssh_host(&session, &err)) {
+	if (wsh_ssh_host(session, &err)) {
 		wshc_add_failed_host(cmd_info->out, host_info->hostname, err->message);
 		wshc_verbose_print(cmd_info->out, "Connection failed on %s: %s\n",
 		                   host_info->hostname, err->message);
 		g_error_free(err);
-		err = NULL;
-		return;
+		return FALSE;
 	}
 	wshc_verbose_print(cmd_info->out, "Connection to %s successful\n",
 	                   host_info->hostname);
 
 	wshc_verbose_print(cmd_info->out, "Verifying host key for %s\n",
 	                   host_info->hostname);
-	if (wsh_verify_host_key(&session, FALSE, FALSE, &err)) {
+	if (wsh_verify_host_key(session, FALSE, FALSE, &err)) {
 		wshc_add_failed_host(cmd_info->out, host_info->hostname, err->message);
 		wshc_verbose_print(cmd_info->out, "Host key verification for %s failed: %s\n",
 		                   host_info->hostname, err->message);
 		g_error_free(err);
-		err = NULL;
-		return;
+		return FALSE;
 	}
 	wshc_verbose_print(cmd_info->out, "Host verification for %s successful\n",
 	                   host_info->hostname);
 
+	return TRUE;
+}
+
+__attribute__((nonnull))
+static void try_ssh(wshc_host_info_t* host_info,
+                    const wshc_cmd_info_t* cmd_info) {
+	GError* err = NULL;
+	host_info->status = WSHC_HOST_FAILED;
+
+	if (cmd_info->gate && auth_gate_closed(cmd_info->gate)) {
+		wshc_verbose_print(cmd_info->out, "Not connecting to %s\n",
+		                   host_info->hostname);
+		host_info->status = WSHC_HOST_SKIPPED;
+		return;
+	}
+
+	wsh_ssh_session_t session = {
+		.hostname = host_info->hostname,
+		.username = cmd_info->username,
+		.password = cmd_info->password,
+		.port = cmd_info->port,
+		.session = NULL,
+		.ssh_opts = cmd_info->ssh_opts,
+		.jump = cmd_info->jump,
+		.throttle = cmd_info->throttle,
+	};
+
+	if (session.password == NULL) {
+		session.auth_type = WSH_SSH_AUTH_PUBKEY;
+		wshc_verbose_print(cmd_info->out, "Using public key authentication\n");
+	} else {
+		session.auth_type = WSH_SSH_AUTH_PASSWORD;
+		wshc_verbose_print(cmd_info->out, "Using password authentication\n");
+	}
+
+	if (! connect_host(&session, host_info, cmd_info))
+		return;
+	gint64 connected = g_get_monotonic_time();
+
+	if (cmd_info->gate && ! pass_auth_gate(cmd_info->gate, host_info)) {
+		wshc_verbose_print(cmd_info->out, "Not authenticating to %s\n",
+		                   host_info->hostname);
+		host_info->status = WSHC_HOST_SKIPPED;
+		wsh_ssh_disconnect(&session);
+		return;
+	}
+
+	// sshd may already have given up on us while we sat at the gate
+	if (g_get_monotonic_time() - connected > WSHC_GATE_MAX_WAIT) {
+		wshc_verbose_print(cmd_info->out, "Reconnecting to %s after waiting to authenticate\n",
+		                   host_info->hostname);
+		wsh_ssh_disconnect(&session);
+		if (! connect_host(&session, host_info, cmd_info))
+			return;
+	}
+
+	if (cmd_info->auth_cache)
+		session.auth_hint = wsh_auth_cache_lookup(cmd_info->auth_cache,
+		                    session.username, host_info->hostname, session.port);
+
 	wshc_verbose_print(cmd_info->out, "Authenticating to %s\n",
 	                   host_info->hostname);
 	if (wsh_ssh_authenticate(&session, &err)) {
+		// Don't keep steering future runs towards a method that just failed
+		if (cmd_info->auth_cache && session.auth_hint != WSH_SSH_AUTH_METHOD_UNKNOWN)
+			wsh_auth_cache_store(cmd_info->auth_cache, session.username,
+			                     host_info->hostname, session.port,
+			                     WSH_SSH_AUTH_METHOD_UNKNOWN);
+
+		host_info->status = WSHC_HOST_AUTH_FAILED;
 		wshc_add_failed_host(cmd_info->out, host_info->hostname, err->message);
 		wshc_verbose_print(cmd_info->out, "Failed to authenticate to %s: %s\n",
 		                   host_info->hostname, err->message);
@@ -93,8 +279,13 @@ void wshc_try_ssh(wshc_host_info_t* host_info,
 	}
 	wshc_verbose_print(cmd_info->out, "Authenticated to %s successfully\n",
 	                   host_info->hostname);
+	host_info->authenticated = TRUE;
+
+	if (cmd_info->auth_cache)
+		wsh_auth_cache_store(cmd_info->auth_cache, session.username,
+		                     host_info->hostname, session.port, session.auth_method);
 
-	if (cmd_info->script) {
+	if (cmd_info->script && ! cmd_info->req->script_name) {
 		wshc_verbose_print(cmd_info->out, "Initializing scp subsystem for %s\n",
 		                   host_info->hostname);
 		if (wsh_ssh_scp_init(&session, "~")) {
@@ -106,9 +297,14 @@ void wshc_try_ssh(wshc_host_info_t* host_info,
 		wshc_verbose_print(cmd_info->out, "Initialized scp subsystem on %s\n",
 		                   host_info->hostname);
 
+		if (cmd_info->host_rate)
+			wsh_throttle_new(&session.host_throttle, cmd_info->host_rate);
+
 		wshc_verbose_print(cmd_info->out, "Transferring script %s to %s\n",
 		                   cmd_info->script, host_info->hostname);
-		if (wsh_ssh_scp_file(&session, cmd_info->script, TRUE, &err)) {
+		if ((cmd_info->payload ?
+		        wsh_ssh_scp_payload(&session, cmd_info->payload, &err) :
+		        wsh_ssh_scp_file(&session, cmd_info->script, TRUE, &err))) {
 			wshc_add_failed_host(cmd_info->out, host_info->hostname, err->message);
 			wshc_verbose_print(cmd_info->out, "Failed to transfer script %s to %s\n",
 			                   cmd_info->script, host_info->hostname);
@@ -118,6 +314,7 @@ void wshc_try_ssh(wshc_host_info_t* host_info,
 		wshc_verbose_print(cmd_info->out, "Transferred script %s to %s successfully\n",
 		                   cmd_info->script, host_info->hostname);
 
+		wsh_throttle_free(&session.host_throttle);
 		wsh_ssh_scp_cleanup(&session);
 	}
 
@@ -133,9 +330,22 @@ void wshc_try_ssh(wshc_host_info_t* host_info,
 	wshc_verbose_print(cmd_info->out, "Successfully launched wshd %s\n",
 	                   host_info->hostname);
 
+	// A script sent inline still counts against the bandwidth limits, which
+	// wsh_ssh_send_cmd() takes from as it writes
+	if (cmd_info->req->script_name && cmd_info->host_rate)
+		wsh_throttle_new(&session.host_throttle, cmd_info->host_rate);
+
+	// Once we know what to expect, a host that matches only has to say so
+	wsh_cmd_req_t req = *cmd_info->req;
+	req.expect_hash = wshc_expected_hash(cmd_info->out);
+	req.fetch_spool = (gchar*)host_info->fetch_spool;
+
 	wshc_verbose_print(cmd_info->out, "Sending command info to wshd on %s\n",
 	                   host_info->hostname);
-	if (wsh_ssh_send_cmd(&session, cmd_info->req, &err)) {
+	gint sent = wsh_ssh_send_cmd(&session, &req, &err);
+	wsh_throttle_free(&session.host_throttle);
+	g_free(req.expect_hash);
+	if (sent) {
 		wshc_verbose_print(cmd_info->out, "Failed to send command to %s: %s\n",
 		                   host_info->hostname, err->message);
 		wshc_add_failed_host(cmd_info->out, host_info->hostname, err->message);
@@ -147,6 +357,16 @@ void wshc_try_ssh(wshc_host_info_t* host_info,
 	                   "Successfully sent command info to wshd on %s\n",
 	                   host_info->hostname);
 
+	if (cmd_info->req->passthrough &&
+	        wsh_ssh_recv_frames(&session, STDOUT_FILENO, STDERR_FILENO, &err)) {
+		wshc_verbose_print(cmd_info->out, "Failed to receive output from %s: %s\n",
+		                   host_info->hostname, err->message);
+		wshc_add_failed_host(cmd_info->out, host_info->hostname, err->message);
+		g_error_free(err);
+		err = NULL;
+		return;
+	}
+
 	wshc_verbose_print(cmd_info->out,
 	                   "Waiting for response from %s\n", host_info->hostname);
 	if (wsh_ssh_recv_cmd_res(&session, host_info->res, &err)) {
@@ -161,6 +381,21 @@ void wshc_try_ssh(wshc_host_info_t* host_info,
 	wshc_verbose_print(cmd_info->out, "Got response from %s\n",
 	                   host_info->hostname);
 
+	wsh_split_response(*host_info->res);
+
+	host_info->status = WSHC_HOST_OK;
+
+	// The command already ran, this is just the rest of its output
+	if (host_info->fetch_spool) {
+		wshc_write_fetched(cmd_info->out, host_info->hostname, *host_info->res);
+		wsh_free_unpacked_response(host_info->res);
+		wsh_ssh_disconnect(&session);
+		return;
+	}
+
+	if (cmd_info->req->sudo && wshc_sudo_auth_failed(*host_info->res))
+		host_info->status = WSHC_HOST_SUDO_FAILED;
+
 	wsh_log_client_cmd_status(cmd_info->req->cmd_string, cmd_info->req->username,
 	                          host_info->hostname, cmd_info->req->cwd, (*host_info->res)->exit_status);
 	wshc_write_output(cmd_info->out, host_info->hostname, *host_info->res);
@@ -169,3 +404,95 @@ void wshc_try_ssh(wshc_host_info_t* host_info,
 	wsh_ssh_disconnect(&session);
 }
 
+// Each result from a relay covers every host in res->hosts
+static void relay_result(const wsh_cmd_res_t* res, gpointer user_data) {
+	const wshc_cmd_info_t* cmd_info = user_data;
+
+	// The relay still owns res, so lines are split into a copy
+	wsh_cmd_res_t lines = *res;
+	wsh_split_response(&lines);
+
+	// The aggregate already covers every host in res
+	if (res->aggregate)
+		wshc_add_aggregate(cmd_info->out, res->aggregate);
+	lines.aggregate = NULL;
+
+	for (gsize i = 0; i < res->hosts_len; i++) {
+		if (res->error_message && res->exit_status == -1) {
+			wshc_add_failed_host(cmd_info->out, res->hosts[i], res->error_message);
+			continue;
+		}
+
+		wsh_log_client_cmd_status(cmd_info->req->cmd_string, cmd_info->req->username,
+		                          res->hosts[i], cmd_info->req->cwd, res->exit_status);
+		wshc_write_output(cmd_info->out, res->hosts[i], &lines);
+	}
+
+	if (lines.std_output != res->std_output)
+		g_strfreev(lines.std_output);
+	if (lines.std_error != res->std_error)
+		g_strfreev(lines.std_error);
+}
+
+__attribute__((nonnull))
+static void try_relay(wshc_host_info_t* host_info,
+                      const wshc_cmd_info_t* cmd_info) {
+	GError* err = NULL;
+	wsh_ssh_session_t session = {
+		.hostname = host_info->hostname,
+		.username = cmd_info->username,
+		.password = cmd_info->password,
+		.port = cmd_info->port,
+		.session = NULL,
+		.ssh_opts = cmd_info->ssh_opts,
+		.jump = cmd_info->jump,
+		.auth_type = cmd_info->password ? WSH_SSH_AUTH_PASSWORD : WSH_SSH_AUTH_PUBKEY,
+	};
+
+	wsh_cmd_req_t req = *host_info->relay_req;
+	req.expect_hash = wshc_expected_hash(cmd_info->out);
+
+	wshc_verbose_print(cmd_info->out, "Relaying to %zu hosts through %s\n",
+	                   req.relay_hosts_len, host_info->hostname);
+	gint relayed = wsh_relay_host(&session, &req, relay_result,
+	                              (gpointer)cmd_info, &err);
+	g_free(req.expect_hash);
+	if (relayed) {
+		host_info->status = WSHC_HOST_FAILED;
+		// Its hosts have already been reported as failed through relay_result
+		if (err->domain == WSH_SSH_ERROR && err->code >= WSH_SSH_PUBKEY_AUTH_ERR &&
+		        err->code <= WSH_SSH_KBDINT_SET_ANSWER_ERR)
+			host_info->status = WSHC_HOST_AUTH_FAILED;
+
+		wshc_verbose_print(cmd_info->out, "Relay %s failed: %s\n",
+		                   host_info->hostname, err->message);
+		g_error_free(err);
+		return;
+	}
+
+	wshc_verbose_print(cmd_info->out, "Relay %s finished\n", host_info->hostname);
+	host_info->authenticated = TRUE;
+	host_info->status = WSHC_HOST_OK;
+}
+
+__attribute__((nonnull))
+void wshc_try_ssh(wshc_host_info_t* host_info,
+                  const wshc_cmd_info_t* cmd_info) {
+	g_assert(cmd_info != NULL);
+	g_assert(host_info != NULL);
+
+	if (host_info->relay_req)
+		try_relay(host_info, cmd_info);
+	else
+		try_ssh(host_info, cmd_info);
+
+	if (cmd_info->gate) {
+		g_mutex_lock(cmd_info->gate->mut);
+		host_info->finished = TRUE;
+		if (host_info->canary) {
+			cmd_info->gate->canaries_left--;
+			g_cond_broadcast(cmd_info->gate->cond);
+		}
+		g_mutex_unlock(cmd_info->gate->mut);
+	}
+}
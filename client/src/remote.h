@@ -25,8 +25,28 @@
 #ifndef __WSHC_REMOTE_H
 #define __WSHC_REMOTE_H
 
+#include "auth_cache.h"
 #include "cmd.h"
+#include "jump.h"
 #include "output.h"
+#include "payload.h"
+#include "throttle.h"
+
+/** Who may authenticate right now */
+typedef enum {
+	WSHC_GATE_PENDING,	/**< credentials not known yet, everyone waits */
+	WSHC_GATE_CANARY,	/**< only canary hosts may authenticate */
+	WSHC_GATE_OPEN,		/**< everyone may authenticate */
+	WSHC_GATE_CLOSED,	/**< credentials were rejected, nobody may */
+} wshc_gate_state_t;
+
+/** Holds hosts between host key verification and auth until we have creds */
+typedef struct {
+	GMutex* mut;				/**< protects the rest of the struct */
+	GCond* cond;				/**< signalled on every change */
+	wshc_gate_state_t state;	/**< current state */
+	guint canaries_left;		/**< canary hosts that haven't finished yet */
+} wshc_auth_gate_t;
 
 /** metadata about commands */
 typedef struct {
@@ -34,17 +54,89 @@ typedef struct {
 	const gchar* username;		/**< Username to connect with */
 	const gchar* password;		/**< Password to auth with */
 	const gchar* script;		/**< Script to execute */
+	const wsh_payload_t* payload;	/**< script, read once for every host, or NULL */
 	const wsh_cmd_req_t* req;	/**< wsh_cmd_req_t to send over the wire */
 	wshc_output_info_t* out;	/**< metadata about output */
+	wsh_auth_cache_t* auth_cache;	/**< Last working auth method per host, or NULL */
+	wshc_auth_gate_t* gate;		/**< Wait here before auth, or NULL to go straight on */
+	wsh_jump_t* jump;			/**< Bastion to tunnel through, or NULL */
+	wsh_throttle_t* throttle;	/**< Cap on script pushes to all hosts, or NULL */
+	guint64 host_rate;			/**< Cap on the script push to each host, 0 for none */
 	gint port;					/**< port number */
 } wshc_cmd_info_t;
 
+/** How far we got with a host */
+typedef enum {
+	WSHC_HOST_OK,				/**< command ran, whatever its exit status */
+	WSHC_HOST_FAILED,			/**< connection or transport failure */
+	WSHC_HOST_AUTH_FAILED,		/**< ssh rejected our credentials */
+	WSHC_HOST_SUDO_FAILED,		/**< sudo rejected our password */
+	WSHC_HOST_SKIPPED,			/**< gave up before authenticating */
+} wshc_host_status_t;
+
+/** What a canary host made of our credentials */
+typedef enum {
+	WSHC_CANARY_UNVERIFIED,		/**< failed before it could tell us */
+	WSHC_CANARY_VERIFIED,		/**< ssh, and sudo if we use it, accepted them */
+	WSHC_CANARY_REJECTED,		/**< ssh or sudo rejected them */
+} wshc_canary_verdict_t;
+
 /** host-specific information */
 typedef struct {
 	const gchar* hostname;		/**< hostname of remote machine */
 	wsh_cmd_res_t** res;		/**< result of command execution on remote machine */
+	wshc_host_status_t status;	/**< outcome, set by wshc_try_ssh() */
+	gboolean canary;			/**< may pass a gate in WSHC_GATE_CANARY */
+	gboolean authenticated;		/**< ssh accepted our credentials */
+	gboolean finished;			/**< wshc_try_ssh() is done, under the gate's mutex */
+	const wsh_cmd_req_t* relay_req;	/**< Relay this request through the host, or NULL */
+	const gchar* fetch_spool;	/**< Fetch this spooled result instead of running anything, or NULL */
 } wshc_host_info_t;
 
+/**
+ * @brief Create a gate in WSHC_GATE_PENDING
+ *
+ * @param[out] gate The new gate
+ * @param[in] canaries Number of canary hosts wshc_wait_for_canaries() waits on
+ */
+__attribute__((nonnull))
+void wshc_init_auth_gate(wshc_auth_gate_t** gate, guint canaries);
+
+/**
+ * @brief Move a gate to a new state and wake up anyone waiting on it
+ *
+ * @param[in] gate The gate
+ * @param[in] state What to let through from now on
+ */
+__attribute__((nonnull))
+void wshc_set_auth_gate(wshc_auth_gate_t* gate, wshc_gate_state_t state);
+
+/**
+ * @brief Block until every canary host has finished
+ *
+ * @param[in] gate The gate
+ */
+__attribute__((nonnull))
+void wshc_wait_for_canaries(wshc_auth_gate_t* gate);
+
+/**
+ * @brief Make a host a canary, so it may pass a gate in WSHC_GATE_CANARY
+ *
+ * @param[in] gate The gate
+ * @param[in,out] host_info The host to promote
+ *
+ * @returns FALSE if the host was already a canary or is already finished
+ */
+__attribute__((nonnull))
+gboolean wshc_promote_canary(wshc_auth_gate_t* gate, wshc_host_info_t* host_info);
+
+/**
+ * @brief Free a gate. Nothing may be waiting on it
+ *
+ * @param[in,out] gate The gate to free, is set to NULL
+ */
+void wshc_free_auth_gate(wshc_auth_gate_t** gate);
+
 /**
  * @brief Attempt to ssh into a host and run a command with wshd
  *
@@ -54,5 +146,30 @@ typedef struct {
 __attribute__((nonnull))
 void wshc_try_ssh(wshc_host_info_t* host_info, const wshc_cmd_info_t* cmd_info);
 
+/**
+ * @brief Check whether a command failed because sudo refused our password
+ *
+ * @param[in] res Result of a sudo command
+ *
+ * @returns TRUE if sudo rejected the password
+ */
+__attribute__((nonnull))
+gboolean wshc_sudo_auth_failed(const wsh_cmd_res_t* res);
+
+/**
+ * @brief Decide what a finished canary host proved about our credentials
+ *
+ * A host that failed before authenticating, or before sudo ran when we use
+ * sudo, proves nothing either way
+ *
+ * @param[in] host_info The canary host
+ * @param[in] sudo Whether the command runs under sudo
+ *
+ * @returns The verdict
+ */
+__attribute__((nonnull))
+wshc_canary_verdict_t wshc_canary_verdict(const wshc_host_info_t* host_info,
+        gboolean sudo);
+
 #endif
 
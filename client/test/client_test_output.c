@@ -21,6 +21,7 @@
 #include "config.h"
 #include <glib.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cmd.h"
 #include "isatty.h"
@@ -217,6 +218,42 @@ static void collate_output(void) {
 	g_strfreev(testable_output);
 }
 
+// NULs in raw output make it through to what's printed
+static void collate_raw_output(void) {
+	guint8 raw_out[] = "bin\0ary\nend";
+	guint8 raw_err[] = "";
+	gchar* a_out[] = { "bin", "end", NULL };
+	gchar* none[] = { NULL };
+	set_isatty_ret(1);
+
+	wsh_cmd_res_t res = {
+		.std_output = a_out,
+		.std_output_len = 2,
+		.std_error = none,
+		.std_output_raw = raw_out,
+		.std_output_raw_len = sizeof(raw_out) - 1,
+		.std_error_raw = raw_err,
+	};
+
+	wshc_output_info_t* out;
+	wshc_init_output(&out);
+	out->type = WSHC_OUTPUT_TYPE_COLLATED;
+
+	(void)wshc_write_output(out, "localhost", &res);
+
+	gchar* printable_output = NULL;
+	gsize output_size = 0;
+	gint ret = wshc_collate_output(out, &printable_output, &output_size);
+	g_assert(ret == EXIT_SUCCESS);
+
+	const gchar expected[] = "localhost stdout:\nbin\0ary\nend\n\n";
+	g_assert_cmpuint(output_size, ==, sizeof(expected) - 1);
+	g_assert(! memcmp(printable_output, expected, output_size));
+
+	g_free(printable_output);
+	wshc_cleanup_output(&out);
+}
+
 // XXX: Remove duplication
 #if GLIB_CHECK_VERSION(2, 38, 0)
 static void hostname_output_subprocess(void) {
@@ -584,6 +621,7 @@ int main(int argc, char** argv) {
 	g_test_add_func("/Client/TestWriteOutputMemNull", write_output_mem_null);
 
 	g_test_add_func("/Client/TestCollateOutput", collate_output);
+	g_test_add_func("/Client/TestCollateRawOutput", collate_raw_output);
 
 	g_test_add_func("/Client/TestHostnameOutput", hostname_output);
 	g_test_add_func("/Client/TestHostnameOutputPiped", hostname_output_piped);
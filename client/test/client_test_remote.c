@@ -0,0 +1,171 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include <glib.h>
+#include <stdlib.h>
+
+#include "cmd.h"
+#include "remote.h"
+
+static void sudo_auth_failed_on_bad_password(void) {
+	gchar* err_lines[] = {
+		"Sorry, try again.",
+		"Invalid sudo password",
+		"sudo: 2 incorrect password attempts",
+		NULL,
+	};
+	wsh_cmd_res_t res = {
+		.std_error = err_lines,
+		.std_error_len = 3,
+		.exit_status = 1,
+	};
+
+	g_assert(wshc_sudo_auth_failed(&res));
+}
+
+static void sudo_auth_failed_askpass_only(void) {
+	gchar* err_lines[] = {
+		"Invalid sudo password",
+		NULL,
+	};
+	wsh_cmd_res_t res = {
+		.std_error = err_lines,
+		.std_error_len = 1,
+		.exit_status = 1,
+	};
+
+	g_assert(wshc_sudo_auth_failed(&res));
+}
+
+static void sudo_auth_failed_command_failure(void) {
+	gchar* err_lines[] = {
+		"ls: cannot access '/nonexistent': No such file or directory",
+		NULL,
+	};
+	wsh_cmd_res_t res = {
+		.std_error = err_lines,
+		.std_error_len = 1,
+		.exit_status = 2,
+	};
+
+	g_assert(! wshc_sudo_auth_failed(&res));
+}
+
+static void sudo_auth_failed_success(void) {
+	// The command itself may well print this, don't trip on it
+	gchar* err_lines[] = {
+		"Sorry, try again.",
+		NULL,
+	};
+	wsh_cmd_res_t res = {
+		.std_error = err_lines,
+		.std_error_len = 1,
+		.exit_status = 0,
+	};
+
+	g_assert(! wshc_sudo_auth_failed(&res));
+}
+
+static void sudo_auth_failed_no_stderr(void) {
+	wsh_cmd_res_t res = {
+		.std_error = NULL,
+		.std_error_len = 0,
+		.exit_status = 1,
+	};
+
+	g_assert(! wshc_sudo_auth_failed(&res));
+}
+
+static void canary_verdict_rejected(void) {
+	wshc_host_info_t host = { .status = WSHC_HOST_AUTH_FAILED };
+	g_assert(wshc_canary_verdict(&host, FALSE) == WSHC_CANARY_REJECTED);
+
+	host.status = WSHC_HOST_SUDO_FAILED;
+	host.authenticated = TRUE;
+	g_assert(wshc_canary_verdict(&host, TRUE) == WSHC_CANARY_REJECTED);
+}
+
+static void canary_verdict_before_auth(void) {
+	// Connection refused, DNS or a bad host key
+	wshc_host_info_t host = { .status = WSHC_HOST_FAILED };
+	g_assert(wshc_canary_verdict(&host, FALSE) == WSHC_CANARY_UNVERIFIED);
+	g_assert(wshc_canary_verdict(&host, TRUE) == WSHC_CANARY_UNVERIFIED);
+
+	host.status = WSHC_HOST_SKIPPED;
+	g_assert(wshc_canary_verdict(&host, FALSE) == WSHC_CANARY_UNVERIFIED);
+}
+
+static void canary_verdict_before_sudo(void) {
+	wshc_host_info_t host = {
+		.status = WSHC_HOST_FAILED,
+		.authenticated = TRUE,
+	};
+
+	g_assert(wshc_canary_verdict(&host, FALSE) == WSHC_CANARY_VERIFIED);
+	g_assert(wshc_canary_verdict(&host, TRUE) == WSHC_CANARY_UNVERIFIED);
+
+	host.status = WSHC_HOST_OK;
+	g_assert(wshc_canary_verdict(&host, TRUE) == WSHC_CANARY_VERIFIED);
+}
+
+static void promote_canary(void) {
+	wshc_auth_gate_t* gate = NULL;
+	wshc_host_info_t waiting = { .canary = FALSE };
+	wshc_host_info_t finished = { .finished = TRUE };
+	wshc_init_auth_gate(&gate, 0);
+
+	g_assert(wshc_promote_canary(gate, &waiting));
+	g_assert(waiting.canary);
+	g_assert_cmpuint(gate->canaries_left, ==, 1);
+
+	g_assert(! wshc_promote_canary(gate, &waiting));
+	g_assert(! wshc_promote_canary(gate, &finished));
+	g_assert(! finished.canary);
+	g_assert_cmpuint(gate->canaries_left, ==, 1);
+
+	wshc_free_auth_gate(&gate);
+}
+
+int main(int argc, char** argv) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/Client/SudoAuthFailedBadPassword",
+	                sudo_auth_failed_on_bad_password);
+	g_test_add_func("/Client/SudoAuthFailedAskpassOnly",
+	                sudo_auth_failed_askpass_only);
+	g_test_add_func("/Client/SudoAuthFailedCommandFailure",
+	                sudo_auth_failed_command_failure);
+	g_test_add_func("/Client/SudoAuthFailedSuccess",
+	                sudo_auth_failed_success);
+	g_test_add_func("/Client/SudoAuthFailedNoStderr",
+	                sudo_auth_failed_no_stderr);
+	g_test_add_func("/Client/CanaryVerdictRejected",
+	                canary_verdict_rejected);
+	g_test_add_func("/Client/CanaryVerdictBeforeAuth",
+	                canary_verdict_before_auth);
+	g_test_add_func("/Client/CanaryVerdictBeforeSudo",
+	                canary_verdict_before_sudo);
+	g_test_add_func("/Client/PromoteCanary",
+	                promote_canary);
+
+	return g_test_run();
+}
+
@@ -0,0 +1,234 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include "aggregate.h"
+
+#include <glib.h>
+#include <math.h>
+#include <string.h>
+
+// Past the smallest exponent frexp() gives, so only 0 lands in bucket 0
+#define WSH_AGGREGATE_BUCKET_BIAS 1075
+
+static const gchar* op_names[WSH_AGGREGATE_MAX] = {
+	[WSH_AGGREGATE_UNIQ_COUNT] = "uniq-count",
+	[WSH_AGGREGATE_SUM] = "sum",
+	[WSH_AGGREGATE_MIN_MAX] = "min-max",
+	[WSH_AGGREGATE_HISTOGRAM] = "histogram",
+};
+
+// Counts are only allocated for keys that aren't in table yet
+static gboolean add_count(GHashTable* table, gconstpointer key, guint64 count) {
+	guint64* cur = g_hash_table_lookup(table, key);
+	if (! cur)
+		return FALSE;
+
+	*cur += count;
+	return TRUE;
+}
+
+static guint64* new_count(guint64 count) {
+	guint64* ret = g_new(guint64, 1);
+	*ret = count;
+	return ret;
+}
+
+static void add_number(wsh_aggregate_t* agg, gdouble value) {
+	if (! agg->values || value < agg->min)
+		agg->min = value;
+	if (! agg->values || value > agg->max)
+		agg->max = value;
+	agg->sum += value;
+	agg->values++;
+
+	if (agg->op == WSH_AGGREGATE_HISTOGRAM)
+		wsh_aggregate_count_bucket(agg, wsh_aggregate_bucket(value), 1);
+}
+
+__attribute__((nonnull))
+gint wsh_aggregate_parse_op(const gchar* name, wsh_aggregate_op_t* op,
+                            GError** err) {
+	WSH_AGGREGATE_ERROR = g_quark_from_static_string("wsh_aggregate_error");
+
+	for (gint i = WSH_AGGREGATE_NONE + 1; i < WSH_AGGREGATE_MAX; i++) {
+		if (! strcmp(name, op_names[i])) {
+			*op = i;
+			return 0;
+		}
+	}
+
+	*err = g_error_new(WSH_AGGREGATE_ERROR, WSH_AGGREGATE_PARSE_ERR,
+	                   "%s isn't uniq-count, sum, min-max or histogram", name);
+	return WSH_AGGREGATE_PARSE_ERR;
+}
+
+const gchar* wsh_aggregate_op_name(wsh_aggregate_op_t op) {
+	if (op >= WSH_AGGREGATE_MAX)
+		return NULL;
+
+	return op_names[op];
+}
+
+__attribute__((nonnull))
+void wsh_aggregate_new(wsh_aggregate_t** agg, wsh_aggregate_op_t op) {
+	g_assert(op > WSH_AGGREGATE_NONE && op < WSH_AGGREGATE_MAX);
+
+	*agg = g_slice_new0(wsh_aggregate_t);
+	(*agg)->op = op;
+
+	if (op == WSH_AGGREGATE_UNIQ_COUNT)
+		(*agg)->counts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	else if (op == WSH_AGGREGATE_HISTOGRAM)
+		(*agg)->buckets = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+}
+
+__attribute__((nonnull))
+void wsh_aggregate_line(wsh_aggregate_t* agg, const gchar* line, gsize len) {
+	if (agg->op == WSH_AGGREGATE_UNIQ_COUNT) {
+		gchar* key = g_strndup(line, len);
+		if (add_count(agg->counts, key, 1))
+			g_free(key);
+		else
+			g_hash_table_insert(agg->counts, key, new_count(1));
+		return;
+	}
+
+	// Numbers may have whitespace around them, but nothing else
+	gchar* num = g_strstrip(g_strndup(line, len));
+	gchar* end = NULL;
+	gdouble value = g_ascii_strtod(num, &end);
+
+	if (*num && ! *end && isfinite(value))
+		add_number(agg, value);
+	else
+		agg->skipped++;
+
+	g_free(num);
+}
+
+__attribute__((nonnull))
+void wsh_aggregate_output(wsh_aggregate_t* agg, const wsh_cmd_res_t* res) {
+	if (! res->std_output_raw) {
+		for (gsize i = 0; i < res->std_output_len; i++)
+			wsh_aggregate_line(agg, res->std_output[i], strlen(res->std_output[i]));
+		return;
+	}
+
+	const gchar* raw = (const gchar*)res->std_output_raw;
+	gsize start = 0;
+	for (gsize i = 0; i < res->std_output_raw_len; i++) {
+		if (raw[i] == '\n') {
+			wsh_aggregate_line(agg, raw + start, i - start);
+			start = i + 1;
+		}
+	}
+
+	// A last line with no newline still counts
+	if (start < res->std_output_raw_len)
+		wsh_aggregate_line(agg, raw + start, res->std_output_raw_len - start);
+}
+
+__attribute__((nonnull))
+void wsh_aggregate_count(wsh_aggregate_t* agg, const gchar* line,
+                         guint64 count) {
+	g_assert(agg->op == WSH_AGGREGATE_UNIQ_COUNT);
+
+	if (! add_count(agg->counts, line, count))
+		g_hash_table_insert(agg->counts, g_strdup(line), new_count(count));
+}
+
+__attribute__((nonnull))
+void wsh_aggregate_count_bucket(wsh_aggregate_t* agg, gint bucket,
+                                guint64 count) {
+	g_assert(agg->op == WSH_AGGREGATE_HISTOGRAM);
+
+	if (! add_count(agg->buckets, GINT_TO_POINTER(bucket), count))
+		g_hash_table_insert(agg->buckets, GINT_TO_POINTER(bucket), new_count(count));
+}
+
+__attribute__((nonnull))
+void wsh_aggregate_merge(wsh_aggregate_t* into, const wsh_aggregate_t* from) {
+	if (into->op != from->op)
+		return;
+
+	GHashTableIter iter;
+	gpointer key, value;
+
+	if (from->counts) {
+		g_hash_table_iter_init(&iter, from->counts);
+		while (g_hash_table_iter_next(&iter, &key, &value))
+			wsh_aggregate_count(into, key, *(guint64*)value);
+	}
+
+	if (from->buckets) {
+		g_hash_table_iter_init(&iter, from->buckets);
+		while (g_hash_table_iter_next(&iter, &key, &value))
+			wsh_aggregate_count_bucket(into, GPOINTER_TO_INT(key), *(guint64*)value);
+	}
+
+	if (from->values) {
+		if (! into->values || from->min < into->min)
+			into->min = from->min;
+		if (! into->values || from->max > into->max)
+			into->max = from->max;
+	}
+	into->sum += from->sum;
+	into->values += from->values;
+	into->skipped += from->skipped;
+}
+
+gint wsh_aggregate_bucket(gdouble value) {
+	if (value == 0)
+		return 0;
+
+	// |value| is in [2^(exp - 1), 2^exp)
+	gint exp;
+	frexp(value, &exp);
+
+	gint bucket = exp + WSH_AGGREGATE_BUCKET_BIAS;
+	return value < 0 ? -bucket : bucket;
+}
+
+__attribute__((nonnull))
+void wsh_aggregate_bucket_range(gint bucket, gdouble* low, gdouble* high) {
+	if (bucket == 0) {
+		*low = *high = 0;
+		return;
+	}
+
+	gint exp = ABS(bucket) - WSH_AGGREGATE_BUCKET_BIAS;
+	gdouble near = ldexp(1, exp - 1), far = ldexp(1, exp);
+
+	*low = bucket > 0 ? near : -far;
+	*high = bucket > 0 ? far : -near;
+}
+
+void wsh_aggregate_free(wsh_aggregate_t** agg) {
+	if (! agg || ! *agg) return;
+
+	if ((*agg)->counts)
+		g_hash_table_destroy((*agg)->counts);
+	if ((*agg)->buckets)
+		g_hash_table_destroy((*agg)->buckets);
+
+	g_slice_free(wsh_aggregate_t, *agg);
+	*agg = NULL;
+}
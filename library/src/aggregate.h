@@ -0,0 +1,182 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/** @file
+ * @brief Boiling output down to counts and statistics
+ *
+ * wshd reduces a command's stdout to a partial aggregate, and relays and
+ * wshc merge partials together. Every operator merges exactly, so the
+ * result is the same however hosts are split between relays.
+ */
+#ifndef __WSH_AGGREGATE_H
+#define __WSH_AGGREGATE_H
+
+#include <glib.h>
+
+#include "types.h"
+
+/** GQuark for aggregate errors */
+GQuark WSH_AGGREGATE_ERROR;
+
+/** Aggregate errors */
+typedef enum {
+	WSH_AGGREGATE_PARSE_ERR,	/**< Not an operator we know */
+} wsh_aggregate_err_enum;
+
+/** What to boil output down to */
+typedef enum {
+	WSH_AGGREGATE_NONE,			/**< Leave output alone */
+	WSH_AGGREGATE_UNIQ_COUNT,	/**< How many times each distinct line came up */
+	WSH_AGGREGATE_SUM,			/**< Sum of lines that are numbers */
+	WSH_AGGREGATE_MIN_MAX,		/**< Smallest and largest lines that are numbers */
+	WSH_AGGREGATE_HISTOGRAM,	/**< Lines that are numbers, in power of two buckets */
+	WSH_AGGREGATE_MAX,			/**< Not an operator, one past the last */
+} wsh_aggregate_op_t;
+
+/** A partial or merged aggregate */
+struct wsh_aggregate {
+	wsh_aggregate_op_t op;	/**< operator being applied */
+	GHashTable* counts;		/**< line to guint64 count, for WSH_AGGREGATE_UNIQ_COUNT */
+	GHashTable* buckets;	/**< bucket to guint64 count, for WSH_AGGREGATE_HISTOGRAM */
+	gdouble sum;			/**< sum of numbers */
+	gdouble min;			/**< smallest number, if values */
+	gdouble max;			/**< largest number, if values */
+	guint64 values;			/**< lines that were numbers */
+	guint64 skipped;		/**< lines that weren't numbers, for numeric operators */
+};
+
+/** A partial or merged aggregate */
+typedef struct wsh_aggregate wsh_aggregate_t;
+
+/**
+ * @brief Parses an operator name, like uniq-count or histogram
+ *
+ * @param[in] name The name to parse
+ * @param[out] op The operator
+ * @param[out] err GError describing the failure
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_aggregate_parse_op(const gchar* name, wsh_aggregate_op_t* op,
+                            GError** err);
+
+/**
+ * @brief Names an operator, as wsh_aggregate_parse_op() takes it
+ *
+ * @param[in] op The operator
+ *
+ * @returns The name, or NULL for WSH_AGGREGATE_NONE and anything unknown
+ */
+const gchar* wsh_aggregate_op_name(wsh_aggregate_op_t op);
+
+/**
+ * @brief Makes an empty aggregate
+ *
+ * @param[out] agg The new aggregate. Free with wsh_aggregate_free
+ * @param[in] op Operator to apply, not WSH_AGGREGATE_NONE
+ */
+__attribute__((nonnull))
+void wsh_aggregate_new(wsh_aggregate_t** agg, wsh_aggregate_op_t op);
+
+/**
+ * @brief Adds one line of output
+ *
+ * @param[in,out] agg The aggregate
+ * @param[in] line The line, without its newline
+ * @param[in] len Length of line
+ */
+__attribute__((nonnull))
+void wsh_aggregate_line(wsh_aggregate_t* agg, const gchar* line, gsize len);
+
+/**
+ * @brief Adds every line of a result's stdout
+ *
+ * @param[in,out] agg The aggregate
+ * @param[in] res The result, raw or split into lines
+ */
+__attribute__((nonnull))
+void wsh_aggregate_output(wsh_aggregate_t* agg, const wsh_cmd_res_t* res);
+
+/**
+ * @brief Adds to the count of a line
+ *
+ * @param[in,out] agg A WSH_AGGREGATE_UNIQ_COUNT aggregate
+ * @param[in] line The line
+ * @param[in] count How many more times it came up
+ */
+__attribute__((nonnull))
+void wsh_aggregate_count(wsh_aggregate_t* agg, const gchar* line,
+                         guint64 count);
+
+/**
+ * @brief Adds to the count of a histogram bucket
+ *
+ * @param[in,out] agg A WSH_AGGREGATE_HISTOGRAM aggregate
+ * @param[in] bucket The bucket, from wsh_aggregate_bucket()
+ * @param[in] count How many more numbers fell in it
+ */
+__attribute__((nonnull))
+void wsh_aggregate_count_bucket(wsh_aggregate_t* agg, gint bucket,
+                                guint64 count);
+
+/**
+ * @brief Merges one aggregate into another
+ *
+ * Aggregates of different operators are left alone.
+ *
+ * @param[in,out] into The aggregate to merge into
+ * @param[in] from The aggregate to merge
+ */
+__attribute__((nonnull))
+void wsh_aggregate_merge(wsh_aggregate_t* into, const wsh_aggregate_t* from);
+
+/**
+ * @brief Finds the histogram bucket a number falls in
+ *
+ * Buckets order the same as the numbers in them. 0 has a bucket to itself,
+ * and the others run from one power of two to the next.
+ *
+ * @param[in] value A finite number
+ *
+ * @returns The bucket
+ */
+gint wsh_aggregate_bucket(gdouble value);
+
+/**
+ * @brief Finds the numbers in a histogram bucket
+ *
+ * Whichever end is further from 0 isn't in the bucket.
+ *
+ * @param[in] bucket The bucket
+ * @param[out] low The lower end
+ * @param[out] high The higher end
+ */
+__attribute__((nonnull))
+void wsh_aggregate_bucket_range(gint bucket, gdouble* low, gdouble* high);
+
+/**
+ * @brief Frees an aggregate
+ *
+ * @param[in,out] agg The aggregate to free, is set to NULL
+ */
+void wsh_aggregate_free(wsh_aggregate_t** agg);
+
+#endif
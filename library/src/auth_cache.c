@@ -0,0 +1,168 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include "auth_cache.h"
+
+#include <errno.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ssh.h"
+
+static const gchar* WSH_AUTH_CACHE_KEY = "method";
+
+static const gchar* method_names[] = {
+	[WSH_SSH_AUTH_METHOD_UNKNOWN] = "unknown",
+	[WSH_SSH_AUTH_METHOD_PUBKEY] = "publickey",
+	[WSH_SSH_AUTH_METHOD_KBDINT] = "keyboard-interactive",
+	[WSH_SSH_AUTH_METHOD_PASSWORD] = "password",
+};
+
+// retval should be g_free'd
+__attribute__((nonnull))
+static gchar* cache_group(const gchar* username, const gchar* hostname,
+                          gint port) {
+	return g_strdup_printf("%s@%s:%d", username, hostname, port);
+}
+
+gchar* wsh_auth_cache_default_path(void) {
+	return g_build_filename(g_get_home_dir(), ".wsh", "auth_cache", NULL);
+}
+
+__attribute__((nonnull))
+void wsh_auth_cache_open(wsh_auth_cache_t** cache, const gchar* path) {
+	g_assert(cache);
+	g_assert(path);
+
+	*cache = g_slice_new0(wsh_auth_cache_t);
+	(*cache)->path = g_strdup(path);
+	(*cache)->keyfile = g_key_file_new();
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	(*cache)->mut = g_slice_new(GMutex);
+	g_mutex_init((*cache)->mut);
+#else
+	(*cache)->mut = g_mutex_new();
+#endif
+
+	// A missing or corrupt cache just means we negotiate everything again
+	(void) g_key_file_load_from_file((*cache)->keyfile, path, G_KEY_FILE_NONE,
+	                                 NULL);
+}
+
+__attribute__((nonnull))
+wsh_ssh_auth_method_t wsh_auth_cache_lookup(wsh_auth_cache_t* cache,
+        const gchar* username, const gchar* hostname, gint port) {
+	wsh_ssh_auth_method_t ret = WSH_SSH_AUTH_METHOD_UNKNOWN;
+	gchar* group = cache_group(username, hostname, port);
+
+	g_mutex_lock(cache->mut);
+	gchar* name = g_key_file_get_string(cache->keyfile, group, WSH_AUTH_CACHE_KEY,
+	                                    NULL);
+	g_mutex_unlock(cache->mut);
+
+	for (gsize i = 0; name && i < G_N_ELEMENTS(method_names); i++) {
+		if (! g_strcmp0(name, method_names[i])) {
+			ret = (wsh_ssh_auth_method_t)i;
+			break;
+		}
+	}
+
+	g_free(name);
+	g_free(group);
+	return ret;
+}
+
+__attribute__((nonnull))
+void wsh_auth_cache_store(wsh_auth_cache_t* cache, const gchar* username,
+                          const gchar* hostname, gint port,
+                          wsh_ssh_auth_method_t method) {
+	gchar* group = cache_group(username, hostname, port);
+
+	g_mutex_lock(cache->mut);
+	if (method == WSH_SSH_AUTH_METHOD_UNKNOWN) {
+		if (g_key_file_remove_group(cache->keyfile, group, NULL))
+			cache->dirty = TRUE;
+	} else {
+		gchar* old = g_key_file_get_string(cache->keyfile, group, WSH_AUTH_CACHE_KEY,
+		                                   NULL);
+		if (g_strcmp0(old, method_names[method])) {
+			g_key_file_set_string(cache->keyfile, group, WSH_AUTH_CACHE_KEY,
+			                      method_names[method]);
+			cache->dirty = TRUE;
+		}
+		g_free(old);
+	}
+	g_mutex_unlock(cache->mut);
+
+	g_free(group);
+}
+
+__attribute__((nonnull))
+gint wsh_auth_cache_save(wsh_auth_cache_t* cache, GError** err) {
+	WSH_AUTH_CACHE_ERROR = g_quark_from_static_string("wsh_auth_cache_error");
+	gint ret = EXIT_SUCCESS;
+
+	g_mutex_lock(cache->mut);
+	if (! cache->dirty)
+		goto out;
+
+	gchar* dir = g_path_get_dirname(cache->path);
+	if (g_mkdir_with_parents(dir, 0700)) {
+		*err = g_error_new(WSH_AUTH_CACHE_ERROR, WSH_AUTH_CACHE_DIR_ERR,
+		                   "Can't create %s: %s", dir, strerror(errno));
+		g_free(dir);
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+	g_free(dir);
+
+	gsize len = 0;
+	gchar* data = g_key_file_to_data(cache->keyfile, &len, NULL);
+	if (! g_file_set_contents(cache->path, data, len, err))
+		ret = EXIT_FAILURE;
+	else
+		cache->dirty = FALSE;
+	g_free(data);
+
+out:
+	g_mutex_unlock(cache->mut);
+	return ret;
+}
+
+void wsh_auth_cache_free(wsh_auth_cache_t** cache) {
+	if (! cache || ! *cache) return;
+
+	g_key_file_free((*cache)->keyfile);
+	g_free((*cache)->path);
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	g_mutex_clear((*cache)->mut);
+	g_slice_free(GMutex, (*cache)->mut);
+#else
+	g_mutex_free((*cache)->mut);
+#endif
+
+	g_slice_free(wsh_auth_cache_t, *cache);
+	*cache = NULL;
+}
+
@@ -0,0 +1,114 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/** @file
+ * @brief Per-host cache of the auth method that last worked
+ */
+#ifndef __WSH_AUTH_CACHE_H
+#define __WSH_AUTH_CACHE_H
+
+#include <glib.h>
+
+#include "ssh.h"
+
+/** GQuark for auth cache errors */
+GQuark WSH_AUTH_CACHE_ERROR;
+
+/** Auth cache errors */
+typedef enum {
+	WSH_AUTH_CACHE_DIR_ERR,		/**< Can't create the cache directory */
+} wsh_auth_cache_error_enum;
+
+/** On-disk cache of which auth method worked for user@host:port */
+typedef struct {
+	GKeyFile* keyfile;		/**< cache contents */
+	gchar* path;			/**< file the cache is persisted to */
+	GMutex* mut;			/**< protects keyfile and dirty */
+	gboolean dirty;			/**< do we need to write the cache back out? */
+} wsh_auth_cache_t;
+
+/**
+ * @brief Location of the auth cache for the current user
+ *
+ * @returns ~/.wsh/auth_cache, must be g_free'd
+ */
+gchar* wsh_auth_cache_default_path(void);
+
+/**
+ * @brief Loads an auth cache from disk
+ *
+ * A missing or unreadable cache file is not an error, the cache just
+ * starts empty.
+ *
+ * @param[out] cache The loaded cache. Free with wsh_auth_cache_free
+ * @param[in] path File to load from and save to
+ */
+__attribute__((nonnull))
+void wsh_auth_cache_open(wsh_auth_cache_t** cache, const gchar* path);
+
+/**
+ * @brief Looks up the method that last authenticated a host
+ *
+ * @param[in] cache The auth cache
+ * @param[in] username The user we're connecting as
+ * @param[in] hostname The host we're connecting to
+ * @param[in] port The port we're connecting to
+ *
+ * @returns the cached method, or WSH_SSH_AUTH_METHOD_UNKNOWN
+ */
+__attribute__((nonnull))
+wsh_ssh_auth_method_t wsh_auth_cache_lookup(wsh_auth_cache_t* cache,
+        const gchar* username, const gchar* hostname, gint port);
+
+/**
+ * @brief Records the method that authenticated a host
+ *
+ * @param[in] cache The auth cache
+ * @param[in] username The user we connected as
+ * @param[in] hostname The host we connected to
+ * @param[in] port The port we connected to
+ * @param[in] method The method that worked. WSH_SSH_AUTH_METHOD_UNKNOWN
+ * drops the entry
+ */
+__attribute__((nonnull))
+void wsh_auth_cache_store(wsh_auth_cache_t* cache, const gchar* username,
+                          const gchar* hostname, gint port,
+                          wsh_ssh_auth_method_t method);
+
+/**
+ * @brief Writes the cache back to disk if it has changed
+ *
+ * @param[in] cache The auth cache
+ * @param[out] err GError describing error condition
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_auth_cache_save(wsh_auth_cache_t* cache, GError** err);
+
+/**
+ * @brief Frees an auth cache without saving it
+ *
+ * @param[in] cache The cache to free
+ */
+void wsh_auth_cache_free(wsh_auth_cache_t** cache);
+
+#endif
+
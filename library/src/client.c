@@ -317,6 +317,35 @@ void wsh_client_print_success(const char* format, ...) {
 	va_end(args);
 }
 
+// Written by length, so NULs in output make it through
+static void color_write_line(const char* color, FILE* file, const gchar* hostname,
+                             const gchar* line, gsize len) {
+	gboolean colors = wsh_client_has_colors();
+	if (colors && isatty(fileno(file)))
+		g_fprintf(file, "%s", color);
+
+	g_fprintf(file, "%s: ", hostname);
+	(void) fwrite(line, 1, len, file);
+	(void) fputc('\n', file);
+
+	if (colors && isatty(fileno(file)))
+		g_fprintf(file, "%s", "\x1b[39m");
+}
+
+__attribute__((nonnull))
+void wsh_client_print_error_line(const gchar* hostname, const gchar* line, gsize len) {
+	if (wsh_client_get_dark_bg())
+		color_write_line("\x1b[91m", stderr, hostname, line, len);
+	else
+		color_write_line("\x1b[31m", stderr, hostname, line, len);
+}
+
+__attribute__((nonnull))
+void wsh_client_print_success_line(const gchar* hostname, const gchar* line,
+                                   gsize len) {
+	color_write_line("\x1b[39m", stdout, hostname, line, len);
+}
+
 __attribute__((nonnull format(printf, 2, 3)))
 void wsh_client_print_header(FILE* file, const char* format, ...) {
 	va_list args;
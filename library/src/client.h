@@ -112,6 +112,27 @@ void wsh_client_print_error(const char* format, ...);
 __attribute__((nonnull format(printf, 1, 2)))
 void wsh_client_print_success(const char* format, ...);
 
+/**
+ * @brief Print a line of raw output from a host as an error
+ *
+ * @param[in] hostname Host the line came from
+ * @param[in] line The line, without its newline. May hold NULs
+ * @param[in] len Length of line
+ */
+__attribute__((nonnull))
+void wsh_client_print_error_line(const gchar* hostname, const gchar* line, gsize len);
+
+/**
+ * @brief Print a line of raw output from a host as a success
+ *
+ * @param[in] hostname Host the line came from
+ * @param[in] line The line, without its newline. May hold NULs
+ * @param[in] len Length of line
+ */
+__attribute__((nonnull))
+void wsh_client_print_success_line(const gchar* hostname, const gchar* line,
+                                   gsize len);
+
 /**
  * @brief Print headers to descriptor
  *
@@ -18,18 +18,38 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
+// glibc only declares splice() and posix_spawn's chdir and closefrom actions
+// for GNU code
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include "config.h"
 #include "cmd.h"
 #include "cmd_internal.h"
 
+// posix_spawn() is only used where it can both chdir and close the rest of
+// wshd's fds in the child. Elsewhere g_spawn forks, and closes them itself
+#if defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP) && \
+    defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP)
+#define WSH_POSIX_SPAWN
+#endif
+
 #include <errno.h>
-#include <inttypes.h>
+#include <fcntl.h>
 #include <glib.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
+#ifdef WSH_POSIX_SPAWN
+#include <spawn.h>
+#endif
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_SYS_PIDFD_OPEN
+#include <sys/syscall.h>
+#endif
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -39,7 +59,19 @@ extern int memset_s(void* v, size_t smax, int c, size_t n);
 
 #include "log.h"
 
+#ifdef WSH_POSIX_SPAWN
+extern char** environ;
+#endif
+
 const guint MAX_CMD_ARGS = 255;
+const gsize MAX_RAW_OUTPUT = 512 * 1024 * 1024;
+const guint TIMEOUT_GRACE = 2;
+
+// Pipes are read this much at a time
+#define CMD_READ_SIZE (64 * 1024)
+
+// How often to check on a command that's closed its pipes, without a pidfd
+#define CMD_REAP_MSEC 100
 const gchar* SUDO_SHELL_CMD = "sudo -sA -u ";
 const gchar* SUDO_CMD = "sudo -A -u ";
 
@@ -75,138 +107,518 @@ static void add_line_stderr(wsh_cmd_res_t* res, const gchar* line) {
 
 // All this should do is log the status code and add it to our data struct
 __attribute__((nonnull))
-static gboolean check_exit_status(GPid pid, gint status,
-                                  struct cmd_data* data) {
-	g_assert(data != NULL);
-
+static void check_exit_status(gint status, struct cmd_data* data) {
 	wsh_cmd_res_t* res = data->res;
 	wsh_cmd_req_t* req = data->req;
 	g_assert(res != NULL);
 	g_assert(req != NULL);
 
-	res->exit_status = WEXITSTATUS(status);
+	// Report a signal the way a shell would, so it can't pass for an exit code
+	if (WIFSIGNALED(status))
+		res->exit_status = 128 + WTERMSIG(status);
+	else
+		res->exit_status = WEXITSTATUS(status);
 	wsh_log_server_cmd_status(req->cmd_string, req->username, req->host, req->cwd,
 	                          res->exit_status);
 
-	g_spawn_close_pid(pid);
-
 	data->cmd_exited = TRUE;
-	if (data->cmd_exited && data->out_closed && data->err_closed && data->in_closed)
-		if (g_main_loop_is_running(data->loop))
-			g_main_loop_quit(data->loop);
+}
+
+#ifdef WSH_POSIX_SPAWN
+// Reports a failed spawn the way g_spawn_async_with_pipes() would have
+__attribute__((nonnull))
+static void spawn_error(wsh_cmd_res_t* res, const gchar* prog, gint code, gint errnum) {
+	if (code == G_SPAWN_ERROR_FAILED) {
+		if (errnum == ENOENT || errnum == ENOTDIR)
+			code = G_SPAWN_ERROR_NOENT;
+		else if (errnum == EACCES)
+			code = G_SPAWN_ERROR_ACCES;
+		else if (errnum == ENOMEM)
+			code = G_SPAWN_ERROR_NOMEM;
+	}
+
+	g_set_error(&res->err, G_SPAWN_ERROR, code,
+	            "Failed to execute child process \"%s\" (%s)", prog, strerror(errnum));
+}
+
+static gboolean cloexec_pipe(gint fds[2]) {
+	if (pipe(fds))
+		return FALSE;
+
+	if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) || fcntl(fds[1], F_SETFD, FD_CLOEXEC)) {
+		close(fds[0]);
+		close(fds[1]);
+		return FALSE;
+	}
 
-	return !data->cmd_exited;
+	return TRUE;
 }
 
+// posix_spawn() skips copying wshd's address space, and there's no per-fd
+// close loop in the child over our raised fd limit. The program is looked
+// up in PATH once, here
 __attribute__((nonnull))
-static gboolean check_stream(GIOChannel* out, GIOCondition cond,
-                             struct cmd_data* data, gboolean std_err) {
-	g_assert(data != NULL);
+static gboolean spawn_cmd(wsh_cmd_req_t* req, wsh_cmd_res_t* res, gchar** argv,
+                          GPid* pid) {
+	gint pipes[3][2] = { { -1, -1 }, { -1, -1 }, { -1, -1 } };
+	gboolean ret = FALSE;
+
+	// posix_spawn() can't tell a bad directory from a bad program
+	if (! g_file_test(req->cwd, G_FILE_TEST_IS_DIR)) {
+		g_set_error(&res->err, G_SPAWN_ERROR, G_SPAWN_ERROR_CHDIR,
+		            "Failed to change to directory \"%s\" (%s)", req->cwd,
+		            strerror(ENOENT));
+		return FALSE;
+	}
 
-	wsh_cmd_res_t* res = data->res;
-	wsh_cmd_req_t* req = data->req;
-	g_assert(res != NULL);
-	g_assert(req != NULL);
+	// Paths with a slash are relative to cwd, which the child is yet to be in
+	gchar* prog = strchr(argv[0], '/') ? g_strdup(argv[0]) :
+	              g_find_program_in_path(argv[0]);
+	if (prog == NULL) {
+		spawn_error(res, argv[0], G_SPAWN_ERROR_NOENT, ENOENT);
+		return FALSE;
+	}
 
-	GIOStatus stat = 0;
+	for (gsize i = 0; i < 3; i++) {
+		if (! cloexec_pipe(pipes[i])) {
+			spawn_error(res, argv[0], G_SPAWN_ERROR_FAILED, errno);
+			goto spawn_cmd_pipes;
+		}
+	}
 
-	gchar* buf = NULL;
-	gsize buf_len = 0;
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	(void) posix_spawn_file_actions_init(&actions);
+	(void) posix_spawnattr_init(&attr);
+
+	// dup2() leaves the child's copies without close-on-exec
+	(void) posix_spawn_file_actions_adddup2(&actions, pipes[0][0], STDIN_FILENO);
+	(void) posix_spawn_file_actions_adddup2(&actions, pipes[1][1], STDOUT_FILENO);
+	(void) posix_spawn_file_actions_adddup2(&actions, pipes[2][1], STDERR_FILENO);
+	(void) posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+	(void) posix_spawn_file_actions_addchdir_np(&actions, req->cwd);
+
+	// Its own process group, so a timeout can stop everything it starts
+	(void) sigemptyset(&mask);
+	(void) posix_spawnattr_setsigmask(&attr, &mask);
+	(void) posix_spawnattr_setpgroup(&attr, 0);
+	(void) posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP|POSIX_SPAWN_SETSIGMASK);
+
+	gint errnum = posix_spawn(pid, prog, &actions, &attr, argv,
+	                          req->env ? req->env : environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (errnum) {
+		spawn_error(res, argv[0], G_SPAWN_ERROR_FAILED, errnum);
+		goto spawn_cmd_pipes;
+	}
+
+	req->in_fd = pipes[0][1];
+	res->out_fd = pipes[1][0];
+	res->err_fd = pipes[2][0];
+	pipes[0][1] = pipes[1][0] = pipes[2][0] = -1;
+	ret = TRUE;
+
+spawn_cmd_pipes:
+	for (gsize i = 0; i < 3; i++) {
+		for (gsize j = 0; j < 2; j++) {
+			if (pipes[i][j] != -1)
+				close(pipes[i][j]);
+		}
+	}
+
+	g_free(prog);
+	return ret;
+}
+#else
+// Background jobs and pipelines share cmd's process group, so they can be
+// stopped along with it
+static void new_process_group(gpointer user_data) {
+	(void) setpgid(0, 0);
+}
+
+// Forks all of wshd, and the child closes every fd it doesn't need
+__attribute__((nonnull))
+static gboolean spawn_cmd(wsh_cmd_req_t* req, wsh_cmd_res_t* res, gchar** argv,
+                          GPid* pid) {
+	gint flags = G_SPAWN_DO_NOT_REAP_CHILD|G_SPAWN_SEARCH_PATH;
+
+	return g_spawn_async_with_pipes(
+	           req->cwd,  // working dir
+	           argv, // argv
+	           req->env, // env
+	           flags, // flags
+	           new_process_group, // child setup
+	           NULL, // user_data
+	           pid, // child_pid
+	           &req->in_fd, // stdin
+	           &res->out_fd, // stdout
+	           &res->err_fd, // stderr
+	           &res->err); // Gerror
+}
+#endif
+
+// First asks the whole group to exit, then makes it. Under sudo, only sudo
+// is in our reach, and timeout(1) stops the rest. Whatever neither could stop
+// can hold the pipes open forever, so after one more grace period we stop
+// waiting
+__attribute__((nonnull))
+static void cmd_timed_out(struct cmd_data* data) {
+	if (data->killed) {
+		wsh_log_message("Giving up on output from a command that won't die");
+		data->out_closed = data->err_closed = TRUE;
+		data->abandoned = TRUE;
+		data->deadline = 0;
+		return;
+	}
+
+	if (data->timed_out) {
+		(void) killpg(data->pid, SIGKILL);
+		data->killed = TRUE;
+		data->deadline = g_get_monotonic_time() + TIMEOUT_GRACE * G_USEC_PER_SEC;
+		return;
+	}
+
+	data->timed_out = TRUE;
+	if (data->req->raw_output) {
+		GString* out = data->out_buf;
+		if (out->len && out->str[out->len - 1] != '\n')
+			g_string_append_c(out, '\n');
+		g_string_append(out, "wsh: Timeout exceeded\n");
+	} else {
+		add_line_stdout(data->res, "wsh: Timeout exceeded");
+	}
+	(void) killpg(data->pid, SIGTERM);
+	data->deadline = g_get_monotonic_time() + TIMEOUT_GRACE * G_USEC_PER_SEC;
+}
+
+// Waits out a full pipe or socket rather than give up on it
+static gboolean wait_writable(gint fd) {
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+	if (errno != EAGAIN)
+		return FALSE;
 
-	if (cond & G_IO_IN) {
-		stat = g_io_channel_read_line(out, &buf, &buf_len, NULL, &res->err);
-		while (stat != G_IO_STATUS_EOF && stat != G_IO_STATUS_ERROR) {
-			if (res->err) {
-				if (std_err)
-					data->err_closed = TRUE;
-				else
-					data->out_closed = TRUE;
+	while (poll(&pfd, 1, -1) < 0) {
+		if (errno != EINTR)
+			return FALSE;
+	}
 
-				goto check_stream_err;
-			}
+	return TRUE;
+}
 
-			if (buf && std_err)
-				add_line_stderr(res, buf);
-			else if (buf)
-				add_line_stdout(res, buf);
+static gint write_all(gint fd, const gchar* buf, gsize len) {
+	while (len) {
+		gssize wrote = write(fd, buf, len);
+		if (wrote < 0 && (errno == EINTR || wait_writable(fd)))
+			continue;
+		if (wrote <= 0)
+			return -1;
 
-			stat = g_io_channel_read_line(out, &buf, &buf_len, NULL, &res->err);
+		buf += wrote;
+		len -= wrote;
+	}
+
+	return 0;
+}
+
+gint wsh_write_frame_header(gint fd, wsh_frame_stream_t stream, guint32 len) {
+	guchar header[WSH_FRAME_HEADER_LEN];
+	guint32 size = g_htonl(len);
+
+	header[0] = stream;
+	memcpy(header + 1, &size, sizeof(size));
+
+	return write_all(fd, (const gchar*)header, sizeof(header));
+}
+
+// Moves len bytes from fd to pass_fd. splice() has the kernel move them
+// without them ever reaching us, when pass_fd will take it. The frame header
+// promised len bytes, so if fd comes up short, the rest of the frame is
+// zeros rather than have the reader take what follows as output
+static gint pass_bytes(gint fd, gint pass_fd, gsize len) {
+#ifdef HAVE_SPLICE
+	while (len) {
+		gssize moved = splice(fd, NULL, pass_fd, NULL, len, SPLICE_F_MOVE|SPLICE_F_MORE);
+		if (moved < 0 && (errno == EINTR || wait_writable(pass_fd)))
+			continue;
+		if (moved <= 0)
+			break;
+
+		len -= moved;
+	}
+#endif
+
+	if (! len)
+		return 0;
+
+	gchar* chunk = g_malloc(MIN(len, CMD_READ_SIZE));
+	gint ret = 0;
+	while (len) {
+		gssize got = read(fd, chunk, MIN(len, CMD_READ_SIZE));
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0) {
+			ret = -1;
+			break;
 		}
+		if (write_all(pass_fd, chunk, got)) {
+			// Nothing more is getting through, padding or otherwise
+			ret = -1;
+			len = 0;
+			break;
+		}
+
+		len -= got;
 	}
 
-	if (cond & G_IO_HUP || cond & G_IO_NVAL || // Check if pipe has closed
-	        stat == G_IO_STATUS_ERROR || stat == G_IO_STATUS_EOF) {
-		if (std_err)
-			data->err_closed = TRUE;
-		else
-			data->out_closed = TRUE;
+	memset(chunk, 0, MIN(len, CMD_READ_SIZE));
+	while (len) {
+		gsize pad = MIN(len, CMD_READ_SIZE);
+		if (write_all(pass_fd, chunk, pad))
+			break;
+
+		len -= pad;
 	}
 
-check_stream_err:
-	g_free(buf);
-	buf = NULL;
+	g_free(chunk);
+	return ret;
+}
 
-	if (data->cmd_exited && data->out_closed && data->err_closed && data->in_closed)
-		g_main_loop_quit(data->loop);
+// Sends everything waiting in fd on as a frame. Returns FALSE if fd has to
+// be read the usual way instead
+__attribute__((nonnull))
+static gboolean pass_stream(gint fd, struct cmd_data* data, gboolean std_err) {
+	gboolean* closed = std_err ? &data->err_closed : &data->out_closed;
+	gint avail = 0;
+
+	if (ioctl(fd, FIONREAD, &avail))
+		return FALSE;
+
+	// poll() only wakes us with nothing waiting at EOF
+	if (avail <= 0) {
+		*closed = TRUE;
+		return TRUE;
+	}
 
-	if (std_err)
-		return !data->err_closed;
-	return !data->out_closed;
+	if (wsh_write_frame_header(data->pass_fd,
+	                           std_err ? WSH_FRAME_STDERR : WSH_FRAME_STDOUT, avail) ||
+	        pass_bytes(fd, data->pass_fd, avail)) {
+		// Nobody's taking it, or the frame had to be padded out, so
+		// whatever's left goes in the result
+		data->pass_fd = -1;
+	}
+
+	return TRUE;
 }
 
+// Output too big to send back is dropped whole, and only read from then on
+// so cmd doesn't block on a full pipe
 __attribute__((nonnull))
-static gboolean check_stdout(GIOChannel* out, GIOCondition cond,
-                             struct cmd_data* user_data) {
-	return check_stream(out, cond, user_data, FALSE);
+static void drop_raw_stream(gint fd, struct cmd_data* data, gboolean* closed) {
+	gchar drop[4096];
+	gssize len = 0;
+
+	if (! data->overflowed) {
+		data->overflowed = TRUE;
+		g_string_truncate(data->out_buf, 0);
+		g_string_truncate(data->err_buf, 0);
+		data->res->err = g_error_new(WSH_CMD_ERROR, WSH_CMD_OUTPUT_ERR,
+		                             "Output passed the %" G_GSIZE_FORMAT
+		                             " byte limit, and was dropped",
+		                             MAX_RAW_OUTPUT);
+	}
+
+	while ((len = read(fd, drop, sizeof(drop))) > 0 || (len < 0 && errno == EINTR));
+
+	if (len == 0 || errno != EAGAIN)
+		*closed = TRUE;
 }
 
+// Reads everything there is straight onto the end of what we have, as it is
 __attribute__((nonnull))
-static gboolean check_stderr(GIOChannel* out, GIOCondition cond,
-                             struct cmd_data* user_data) {
-	return check_stream(out, cond, user_data, TRUE);
+static void check_raw_stream(gint fd, struct cmd_data* data, gboolean std_err) {
+	GString* buf = std_err ? data->err_buf : data->out_buf;
+	gboolean* closed = std_err ? &data->err_closed : &data->out_closed;
+	gssize len = 0;
+
+	do {
+		if (data->overflowed ||
+		        data->out_buf->len + data->err_buf->len > MAX_RAW_OUTPUT) {
+			drop_raw_stream(fd, data, closed);
+			return;
+		}
+
+		gsize had = buf->len;
+		g_string_set_size(buf, had + CMD_READ_SIZE);
+		len = read(fd, buf->str + had, CMD_READ_SIZE);
+		g_string_set_size(buf, had + MAX(len, 0));
+	} while (len > 0 || (len < 0 && errno == EINTR));
+
+	if (data->out_buf->len + data->err_buf->len > MAX_RAW_OUTPUT) {
+		drop_raw_stream(fd, data, closed);
+		return;
+	}
+
+	if (len == 0 || errno != EAGAIN)
+		*closed = TRUE;
 }
 
+// Reads everything there is, and keeps whatever follows the last newline
+// for next time. Anything left at EOF is a line of its own
 __attribute__((nonnull))
-static gboolean wsh_write_stdin(GIOChannel* in, GIOCondition cond,
-                                struct cmd_data* data) {
-	g_assert(data != NULL);
+static void check_stream(gint fd, struct cmd_data* data, gboolean std_err) {
+	if (data->pass_fd != -1 && pass_stream(fd, data, std_err))
+		return;
 
-	wsh_cmd_req_t* req = data->req;
-	wsh_cmd_res_t* res = data->res;
+	if (data->req->raw_output) {
+		check_raw_stream(fd, data, std_err);
+		return;
+	}
 
-	g_assert(req != NULL);
-	g_assert(res != NULL);
-	g_assert(res->err == NULL);
+	GString* buf = std_err ? data->err_buf : data->out_buf;
+	gboolean* closed = std_err ? &data->err_closed : &data->out_closed;
+	gchar* chunk = g_malloc(CMD_READ_SIZE);
+	gssize len = 0;
+
+	while ((len = read(fd, chunk, CMD_READ_SIZE)) > 0 || (len < 0 && errno == EINTR)) {
+		if (len < 0)
+			continue;
+
+		gsize start = buf->len;
+		g_string_append_len(buf, chunk, len);
+
+		gchar* nl = NULL;
+		gsize from = 0;
+		while ((nl = memchr(buf->str + MAX(from, start), '\n',
+		                    buf->len - MAX(from, start)))) {
+			gchar* line = g_strndup(buf->str + from, nl - (buf->str + from) + 1);
+			if (std_err)
+				add_line_stderr(data->res, line);
+			else
+				add_line_stdout(data->res, line);
+			g_free(line);
+			from = nl - buf->str + 1;
+		}
+		g_string_erase(buf, 0, from);
+	}
 
-	gsize wrote = 0;
+	if (len == 0 || errno != EAGAIN) {
+		if (buf->len) {
+			if (std_err)
+				add_line_stderr(data->res, buf->str);
+			else
+				add_line_stdout(data->res, buf->str);
+			g_string_truncate(buf, 0);
+		}
+		*closed = TRUE;
+	}
 
+	g_free(chunk);
+}
+
+// The sudo password is all cmd gets on stdin
+__attribute__((nonnull))
+static void wsh_write_stdin(wsh_cmd_req_t* req) {
 	if (req->sudo) {
-		g_io_channel_write_chars(in, req->password, strlen(req->password), &wrote,
-		                         &res->err);
-		if (res->err || wrote < strlen(req->password))
-			goto write_stdin_err;
+		gchar* line = g_strconcat(req->password, "\n", NULL);
+		gsize len = strlen(line);
+		for (gsize off = 0; off < len; ) {
+			gssize w = write(req->in_fd, line + off, len - off);
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w < 0)
+				break;
+			off += w;
+		}
 
+		memset_s(line, len, 0, len);
+		g_free(line);
 		memset_s(req->password, strlen(req->password), 0, strlen(req->password));
 		req->sudo = FALSE;
+	}
 
-		g_io_channel_write_chars(in, "\n", 1, &wrote, &res->err);
-		if (res->err || wrote == 0)
-			goto write_stdin_err;
+	close(req->in_fd);
+	req->in_fd = -1;
+}
 
-		g_io_channel_flush(in, &res->err);
-		if (res->err || wrote < strlen(req->password))
-			goto write_stdin_err;
-	}
+// Until cmd has exited and closed both its pipes, or whatever it left
+// running has. A pidfd says when cmd exits where there is one. Elsewhere,
+// we check every time a pipe wakes us, and once they're both closed, after
+// waits that double up to CMD_REAP_MSEC
+__attribute__((nonnull))
+static void wait_for_cmd(struct cmd_data* data) {
+	wsh_cmd_res_t* res = data->res;
+	gint reap_wait = 1;
+
+	while (! (data->cmd_exited && data->out_closed && data->err_closed) &&
+	        ! data->abandoned) {
+		struct pollfd fds[3];
+		nfds_t nfds = 0;
+		gint out_i = -1, err_i = -1;
+
+		if (! data->out_closed) {
+			fds[nfds].fd = res->out_fd;
+			fds[nfds].events = POLLIN;
+			out_i = nfds++;
+		}
+		if (! data->err_closed) {
+			fds[nfds].fd = res->err_fd;
+			fds[nfds].events = POLLIN;
+			err_i = nfds++;
+		}
+		if (! data->cmd_exited && data->pid_fd != -1) {
+			fds[nfds].fd = data->pid_fd;
+			fds[nfds].events = POLLIN;
+			nfds++;
+		}
 
-	data->in_closed = TRUE;
-	g_io_channel_unref(in);
+		gint wait = -1;
+		if (data->deadline) {
+			gint64 left = data->deadline - g_get_monotonic_time();
+			wait = left > 0 ? (left + 999) / 1000 : 0;
+		}
+		if (! data->cmd_exited && data->pid_fd == -1 && data->out_closed &&
+		        data->err_closed) {
+			wait = wait == -1 ? reap_wait : MIN(wait, reap_wait);
+			reap_wait = MIN(reap_wait * 2, CMD_REAP_MSEC);
+		}
 
-write_stdin_err:
+		if (poll(fds, nfds, wait) < 0 && errno != EINTR) {
+			g_clear_error(&res->err);
+			res->err = g_error_new(WSH_CMD_ERROR, WSH_CMD_POLL_ERR, "poll: %s",
+			                       strerror(errno));
+			(void) killpg(data->pid, SIGKILL);
+			break;
+		}
 
-	if (data->cmd_exited && data->out_closed && data->err_closed && data->in_closed)
-		g_main_loop_quit(data->loop);
+		if (out_i != -1 && fds[out_i].revents)
+			check_stream(res->out_fd, data, FALSE);
+		if (err_i != -1 && fds[err_i].revents)
+			check_stream(res->err_fd, data, TRUE);
 
-	return FALSE;
+		gint status = 0;
+		if (! data->cmd_exited && waitpid(data->pid, &status, WNOHANG) == data->pid)
+			check_exit_status(status, data);
+
+		if (data->deadline && g_get_monotonic_time() >= data->deadline)
+			cmd_timed_out(data);
+	}
+
+	// Only left over if polling failed, or cmd was abandoned. Something we
+	// couldn't kill isn't worth blocking on
+	if (! data->cmd_exited && ! data->abandoned) {
+		gint status = 0;
+		while (waitpid(data->pid, &status, 0) == -1 && errno == EINTR);
+	} else if (! data->cmd_exited) {
+		gint status = 0;
+		if (waitpid(data->pid, &status, WNOHANG) == data->pid)
+			check_exit_status(status, data);
+		else
+			res->exit_status = -1;
+	}
 }
 
 __attribute__((nonnull))
@@ -224,22 +636,30 @@ static gchar* sudo_constructor(const wsh_cmd_req_t* req, gchar* shell,
 		username = "root";
 	}
 
-	gchar* timeout = g_strdup_printf("%" PRIu64, req->timeout);
+	// cmd runs as username, where our killpg() only reaches sudo, and sudo
+	// only passes signals on to cmd itself. timeout(1) runs as username too,
+	// and stops cmd's whole group on the same schedule we would
+	gchar* timeout = NULL;
+	if (req->timeout)
+		timeout = g_strdup_printf("timeout -k %u %" G_GUINT64_FORMAT " ", TIMEOUT_GRACE,
+		                          req->timeout);
+	else
+		timeout = g_strdup("");
+
 	gchar* ret = NULL;
 	if (req->use_shell) {
-		ret = g_strconcat(SUDO_SHELL_CMD, username, " "LIBEXEC_PATH"/wsh-killer ",
-		                  timeout,
-		                  " ", shell, " -c '", cmd_string, "'", NULL);
+		ret = g_strconcat(SUDO_SHELL_CMD, username, " ", timeout, shell, " -c '",
+		                  cmd_string, "'", NULL);
 	} else {
-		ret = g_strconcat(SUDO_CMD, username, " "LIBEXEC_PATH"/wsh-killer ",
-		                  timeout, " ''", cmd_string, "''", NULL);
+		ret = g_strconcat(SUDO_CMD, username, " ", timeout, cmd_string, NULL);
 	}
 
+	g_free(timeout);
+	timeout = NULL;
+
 	g_free(shell);
 	shell = NULL;
 
-	g_free(timeout);
-	timeout = NULL;
 	return ret;
 }
 
@@ -292,24 +712,15 @@ gchar* wsh_construct_sudo_cmd(const wsh_cmd_req_t* req, GError** err) {
 	if (shell_str == NULL)
 		return NULL;
 
-	// If not sudo, we still need to enable the wsh killer
 	if (! req->sudo) {
-		gchar* timeout_str = g_strdup_printf("%" PRIu64, req->timeout);
-
 		gchar* ret = NULL;
-		if (req->use_shell) {
-			ret = g_strconcat(LIBEXEC_PATH"/wsh-killer ", timeout_str, " ",
-			                  shell_str, " -c '", req->cmd_string, "'", NULL);
-		} else {
-			ret = g_strconcat(LIBEXEC_PATH"/wsh-killer ", timeout_str, " ",
-			                  " ''", req->cmd_string, "''", NULL);
-		}
+		if (req->use_shell)
+			ret = g_strconcat(shell_str, " -c '", req->cmd_string, "'", NULL);
+		else
+			ret = g_strdup(req->cmd_string);
 
 		g_free(shell_str);
 		shell_str = NULL;
-
-		g_free(timeout_str);
-		timeout_str = NULL;
 		return ret;
 	}
 
@@ -317,7 +728,39 @@ gchar* wsh_construct_sudo_cmd(const wsh_cmd_req_t* req, GError** err) {
 }
 
 __attribute__((nonnull))
-gint wsh_run_cmd(wsh_cmd_res_t* res, wsh_cmd_req_t* req) {
+gchar** wsh_construct_argv(const wsh_cmd_req_t* req) {
+	g_assert(req != NULL);
+
+	GPtrArray* args = g_ptr_array_sized_new(req->argv_len + 8);
+	if (req->sudo) {
+		const gchar* username = req->username;
+		if (username == NULL || strlen(username) == 0)
+			username = "root";
+
+		g_ptr_array_add(args, g_strdup("sudo"));
+		g_ptr_array_add(args, g_strdup("-A"));
+		g_ptr_array_add(args, g_strdup("-u"));
+		g_ptr_array_add(args, g_strdup(username));
+		g_ptr_array_add(args, g_strdup("--"));
+
+		// See sudo_constructor()
+		if (req->timeout) {
+			g_ptr_array_add(args, g_strdup("timeout"));
+			g_ptr_array_add(args, g_strdup("-k"));
+			g_ptr_array_add(args, g_strdup_printf("%u", TIMEOUT_GRACE));
+			g_ptr_array_add(args, g_strdup_printf("%" G_GUINT64_FORMAT, req->timeout));
+		}
+	}
+
+	for (gsize i = 0; i < req->argv_len; i++)
+		g_ptr_array_add(args, g_strdup(req->argv[i]));
+	g_ptr_array_add(args, NULL);
+
+	return (gchar**)g_ptr_array_free(args, FALSE);
+}
+
+__attribute__((nonnull))
+static gint run_cmd(wsh_cmd_res_t* res, wsh_cmd_req_t* req, gint pass_fd) {
 	g_assert(res != NULL);
 	g_assert(res->err == NULL);
 	g_assert(req != NULL);
@@ -325,14 +768,17 @@ gint wsh_run_cmd(wsh_cmd_res_t* res, wsh_cmd_req_t* req) {
 	WSH_CMD_ERROR = g_quark_from_string("wsh_cmd_error");
 
 	gchar** argcv = NULL;
-	GMainLoop* loop;
-	GIOChannel* in, * out, * err;
 	gint argcp;
 	gint ret = EXIT_SUCCESS;
 	GPid pid;
 
-	gint flags = G_SPAWN_DO_NOT_REAP_CHILD|G_SPAWN_SEARCH_PATH;
-	gchar* cmd = wsh_construct_sudo_cmd(req, &(res->err));
+	gchar* cmd = NULL;
+
+	// Arguments sent as they are skip the shell, and any quoting to get wrong
+	if (req->argv_len)
+		argcv = wsh_construct_argv(req);
+	else
+		cmd = wsh_construct_sudo_cmd(req, &(res->err));
 
 	if (req->sudo) {
 		if (! g_environ_setenv(req->env, "SUDO_ASKPASS", LIBEXEC_PATH"/wsh-askpass",
@@ -342,7 +788,7 @@ gint wsh_run_cmd(wsh_cmd_res_t* res, wsh_cmd_req_t* req) {
 		}
 	}
 
-	if (! g_shell_parse_argv(cmd, &argcp, &argcv, &res->err)) {
+	if (! argcv && ! g_shell_parse_argv(cmd, &argcp, &argcv, &res->err)) {
 		ret = EXIT_FAILURE;
 		goto run_cmd_error_no_log_cmd;
 	}
@@ -350,82 +796,53 @@ gint wsh_run_cmd(wsh_cmd_res_t* res, wsh_cmd_req_t* req) {
 	gchar* log_cmd = g_strjoinv(" ", argcv);
 	wsh_log_server_cmd(log_cmd, req->username, req->host, req->cwd);
 
-	// Main loop initialization
-	GMainContext* context = g_main_context_new();
-	loop = g_main_loop_new(context, FALSE);
-	struct cmd_data user_data = {
-		.loop = loop,
+	struct cmd_data data = {
 		.req = req,
 		.res = res,
-		.cmd_exited = FALSE,
-		.out_closed = FALSE,
-		.in_closed = FALSE,
-		.err_closed = FALSE,
+		.pid_fd = -1,
+		.pass_fd = pass_fd,
 	};
 
-	g_spawn_async_with_pipes(
-	    req->cwd,  // working dir
-	    argcv, // argv
-	    req->env, // env
-	    flags, // flags
-	    NULL, // child setup
-	    NULL, // user_data
-	    &pid, // child_pid
-	    &req->in_fd, // stdin
-	    &res->out_fd, // stdout
-	    &res->err_fd, // stderr
-	    &res->err); // Gerror
-
-	if (res->err != NULL) {
+	if (! spawn_cmd(req, res, argcv, &pid)) {
 		ret = EXIT_FAILURE;
 		goto run_cmd_error;
 	}
 
-	// Watch child process
-	GSource* watch_src = g_child_watch_source_new(pid);
-	g_source_set_callback(watch_src, (GSourceFunc)check_exit_status, &user_data,
-	                      NULL);
-	g_source_attach(watch_src, context);
-	user_data.cmd_watch = watch_src;
-	g_source_unref(watch_src);
-
-	// Initialize IO Channels
-	out = g_io_channel_unix_new(res->out_fd);
-	err = g_io_channel_unix_new(res->err_fd);
-	in = g_io_channel_unix_new(req->in_fd);
-
-	// Add IO channels
-	GSource* stdout_src = g_io_create_watch(out, G_IO_IN | G_IO_HUP | G_IO_NVAL);
-	g_source_set_callback(stdout_src, (GSourceFunc)check_stdout, &user_data,
-	                      NULL);
-	g_source_attach(stdout_src, context);
-	user_data.out_watch = stdout_src;
-	g_source_unref(stdout_src);
-
-	GSource* stderr_src = g_io_create_watch(err, G_IO_IN | G_IO_HUP | G_IO_NVAL);
-	g_source_set_callback(stderr_src, (GSourceFunc)check_stderr, &user_data,
-	                      NULL);
-	g_source_attach(stderr_src, context);
-	user_data.err_watch = stderr_src;
-	g_source_unref(stderr_src);
-
-	GSource* stdin_src = g_io_create_watch(in, G_IO_OUT | G_IO_HUP | G_IO_NVAL);
-	g_source_set_callback(stdin_src, (GSourceFunc)wsh_write_stdin, &user_data,
-	                      NULL);
-	g_source_attach(stdin_src, context);
-	user_data.in_watch = stdin_src;
-	g_source_unref(stdin_src);
-
-	g_io_channel_unref(out);
-	g_io_channel_unref(err);
-
-	// Start dat loop
-	g_main_loop_run(loop);
+	// We enforce the timeout ourselves, on everything cmd starts. Set the
+	// group here too, in case it fires before the child gets to it
+	(void) setpgid(pid, pid);
+	data.pid = pid;
+	if (req->timeout)
+		data.deadline = g_get_monotonic_time() + req->timeout * G_USEC_PER_SEC;
+#ifdef HAVE_SYS_PIDFD_OPEN
+	data.pid_fd = syscall(SYS_pidfd_open, pid, 0);
+#endif
 
-run_cmd_error:
-	g_main_context_unref(context);
-	g_main_loop_unref(loop);
+	(void) fcntl(res->out_fd, F_SETFL, fcntl(res->out_fd, F_GETFL) | O_NONBLOCK);
+	(void) fcntl(res->err_fd, F_SETFL, fcntl(res->err_fd, F_GETFL) | O_NONBLOCK);
+	data.out_buf = g_string_sized_new(CMD_READ_SIZE);
+	data.err_buf = g_string_sized_new(CMD_READ_SIZE);
+
+	wsh_write_stdin(req);
+	wait_for_cmd(&data);
+
+	close(res->out_fd);
+	close(res->err_fd);
+	if (data.pid_fd != -1)
+		close(data.pid_fd);
+
+	// Raw output goes back just as it was read
+	if (req->raw_output) {
+		res->std_output_raw_len = data.out_buf->len;
+		res->std_output_raw = (guint8*)g_string_free(data.out_buf, FALSE);
+		res->std_error_raw_len = data.err_buf->len;
+		res->std_error_raw = (guint8*)g_string_free(data.err_buf, FALSE);
+	} else {
+		g_string_free(data.out_buf, TRUE);
+		g_string_free(data.err_buf, TRUE);
+	}
 
+run_cmd_error:
 	g_free(log_cmd);
 	log_cmd = NULL;
 
@@ -447,3 +864,14 @@ run_cmd_error_no_log_cmd:
 	return ret;
 }
 
+__attribute__((nonnull))
+gint wsh_run_cmd(wsh_cmd_res_t* res, wsh_cmd_req_t* req) {
+	return run_cmd(res, req, -1);
+}
+
+__attribute__((nonnull))
+gint wsh_pass_cmd(wsh_cmd_res_t* res, wsh_cmd_req_t* req, gint out_fd) {
+	g_assert(out_fd >= 0);
+
+	return run_cmd(res, req, out_fd);
+}
@@ -28,27 +28,50 @@
 
 #include "types.h"
 
-/** internal struct for gmainloop signaling
+/** A running command, as wsh_run_cmd waits on it
  * @internal
  */
 struct cmd_data {
-	GMainLoop* loop;		/**< gmainloop ref */
 	wsh_cmd_req_t* req;		/**< req_t ref */
 	wsh_cmd_res_t* res;		/**< res_t ref */
-	GSource* in_watch;		/**< ref to gsource for stdin */
-	GSource* out_watch;		/**< ref to gsource for stdout */
-	GSource* err_watch;		/**< ref to gsource for stderr */
-	GSource* cmd_watch;		/**< ref to gsource for cmd */
-	GSource* timeout_watch;	/**< ref to gsource for timeout */
-	gboolean in_closed;		/**< is stdin closed? */
+	GString* out_buf;		/**< stdout after its last newline so far */
+	GString* err_buf;		/**< stderr after its last newline so far */
+	gint64 deadline;		/**< monotonic time to act on the timeout next, 0 for never */
+	GPid pid;				/**< cmd, and its process group */
+	gint pid_fd;			/**< pidfd for cmd, -1 where there isn't one */
+	gint pass_fd;			/**< where output goes in frames as it comes, -1 to collect it */
+	gboolean timed_out;		/**< has cmd been sent SIGTERM for running too long? */
+	gboolean killed;		/**< has cmd been sent SIGKILL since? */
+	gboolean abandoned;		/**< did we give up on cmd's pipes after that? */
+	gboolean overflowed;	/**< has raw output passed MAX_RAW_OUTPUT? */
 	gboolean cmd_exited;	/**< has cmd exited? */
 	gboolean out_closed;	/**< is stdout closed? */
 	gboolean err_closed;	/**< is stderr closed? */
 };
 
+/** Which output a passthrough frame carries
+ */
+typedef enum {
+	WSH_FRAME_END = 0,		/**< no more frames, the result follows */
+	WSH_FRAME_STDOUT = 1,	/**< stdout */
+	WSH_FRAME_STDERR = 2,	/**< stderr */
+} wsh_frame_stream_t;
+
+/** Bytes in a frame header: the stream, then the length in network order */
+#define WSH_FRAME_HEADER_LEN 5
+
 /** Maximum number of args a command can have */
 extern const guint MAX_CMD_ARGS;
 
+/** Most raw output, stdout and stderr together, a command can send back. Its
+ * line index takes up to five bytes a line, and the whole reply has to pack
+ * into less than 4GiB */
+extern const gsize MAX_RAW_OUTPUT;
+
+/** Seconds a timed out command's process group gets after SIGTERM, before
+ * SIGKILL */
+extern const guint TIMEOUT_GRACE;
+
 /** Sudo command prefix, w/ shell */
 extern const gchar* SUDO_SHELL_CMD;
 
@@ -65,11 +88,20 @@ typedef enum {
 	WSH_CMD_SIG_ERR,		/**< error setting up signal handler */
 	WSH_CMD_PW_ERR,			/**< error looking up username in passwd */
 	WSH_CMD_ALLOC_ERR,		/**< error allocating memory */
+	WSH_CMD_POLL_ERR,		/**< error waiting on the command's output */
+	WSH_CMD_OUTPUT_ERR,		/**< raw output passed MAX_RAW_OUTPUT */
 } wsh_cmd_errors_enum;
 
 /**
  * @brief Runs a command from a given request
  *
+ * The command runs in its own process group. If it's still going after
+ * req->timeout seconds, the whole group gets SIGTERM, then SIGKILL
+ * TIMEOUT_GRACE seconds later. Under sudo, the command runs under timeout(1),
+ * which does the same to the group as the user the command runs as. If the
+ * pipes are still open TIMEOUT_GRACE seconds after SIGKILL, whatever holds
+ * them is left behind.
+ *
  * @param[out] res Result from running the command
  * @param[in] req Command request
  *
@@ -79,7 +111,36 @@ __attribute__((nonnull))
 gint wsh_run_cmd(wsh_cmd_res_t* res, wsh_cmd_req_t* req);
 
 /**
- * @brief Helper for building a sudo command with wsh-killer capabilities
+ * @brief Runs a command like wsh_run_cmd, passing its output straight through
+ *
+ * Output goes to out_fd as it arrives, in frames headed by
+ * wsh_write_frame_header(), instead of into res. It's moved with splice(2)
+ * where it can be. The caller ends the frames with WSH_FRAME_END. If out_fd
+ * stops taking output, the rest is collected into res.
+ *
+ * @param[out] res Result from running the command
+ * @param[in] req Command request
+ * @param[in] out_fd Where to write frames
+ *
+ * @returns 0 on success, anything else on error
+ */
+__attribute__((nonnull))
+gint wsh_pass_cmd(wsh_cmd_res_t* res, wsh_cmd_req_t* req, gint out_fd);
+
+/**
+ * @brief Writes the header of a passthrough frame
+ *
+ * @param[in] fd Where to write it
+ * @param[in] stream Which output the frame carries
+ * @param[in] len Bytes of output that follow it
+ *
+ * @returns 0 on success, anything else on error
+ */
+gint wsh_write_frame_header(gint fd, wsh_frame_stream_t stream, guint32 len);
+
+/**
+ * @brief Helper for building the command line to run, through sudo and a
+ * shell if asked
  *
  * @param[in,out] req The command request that we're modifying
  * @param[out] err Errors returned by the host
@@ -90,5 +151,17 @@ __attribute__((nonnull))
 gchar* wsh_construct_sudo_cmd(const wsh_cmd_req_t* req,
                               GError** err) __attribute__((nonnull (1)));
 
+/**
+ * @brief Builds the argument vector to exec for a request with argv set
+ *
+ * The arguments are used as they are, behind sudo if the request asks for it.
+ *
+ * @param[in] req The command request
+ *
+ * @returns A NULL terminated argument vector. Free with g_strfreev
+ */
+__attribute__((nonnull))
+gchar** wsh_construct_argv(const wsh_cmd_req_t* req);
+
 #endif
 
@@ -0,0 +1,463 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include "jump.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <libssh/libssh.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+const guint WSH_JUMP_DEFAULT_MAX_CHANNELS = 64;
+
+// How long the pump sleeps before it notices newly opened tunnels
+static const gint WSH_JUMP_POLL_MS = 50;
+static const gsize WSH_JUMP_BUF_SIZE = 32 * 1024;
+
+/* One direct-tcpip channel, bridged to our end of a socketpair. Each
+ * direction has its own buffer, so a target that stops reading only stops its
+ * own channel */
+typedef struct {
+	ssh_channel channel;
+	gint sock;
+	gchar* to_sock;		// read from the channel, not yet written to sock
+	gsize to_sock_len;
+	gchar* to_chan;		// read from sock, not yet written to the channel
+	gsize to_chan_len;
+	gboolean sock_eof;	// the target session hung up
+} tunnel_t;
+
+/* One authenticated session to the bastion */
+typedef struct {
+	wsh_ssh_session_t session;
+	GMutex* mut;		// libssh sessions aren't thread safe, guards everything
+	GThread* pump;
+	GPtrArray* tunnels;
+	gint stop;
+} jump_conn_t;
+
+__attribute__((nonnull))
+gint wsh_jump_parse_spec(const gchar* spec, gchar** username, gchar** hostname,
+                         gint* port, GError** err) {
+	WSH_JUMP_ERROR = g_quark_from_static_string("wsh_jump_error");
+
+	*username = NULL;
+	*hostname = NULL;
+	*port = 22;
+
+	const gchar* host = strrchr(spec, '@');
+	if (host) {
+		*username = g_strndup(spec, host - spec);
+		host++;
+	} else {
+		host = spec;
+	}
+
+	const gchar* host_end = NULL;
+	const gchar* port_str = NULL;
+	if (*host == '[') {
+		host++;
+		if (! (host_end = strchr(host, ']')))
+			goto wsh_jump_parse_spec_err;
+
+		if (host_end[1] == ':')
+			port_str = host_end + 2;
+		else if (host_end[1])
+			goto wsh_jump_parse_spec_err;
+	} else if ((host_end = strchr(host, ':'))) {
+		port_str = host_end + 1;
+	} else {
+		host_end = host + strlen(host);
+	}
+
+	if (host_end == host)
+		goto wsh_jump_parse_spec_err;
+
+	if (port_str) {
+		gchar* end = NULL;
+		gint64 val = g_ascii_strtoll(port_str, &end, 10);
+		if (! *port_str || *end || val < 1 || val > 65535)
+			goto wsh_jump_parse_spec_err;
+		*port = (gint)val;
+	}
+
+	*hostname = g_strndup(host, host_end - host);
+	return 0;
+
+wsh_jump_parse_spec_err:
+	*err = g_error_new(WSH_JUMP_ERROR, WSH_JUMP_SPEC_ERR,
+	                   "Invalid jump host, expected [user@]host[:port]: %s", spec);
+	g_free(*username);
+	*username = NULL;
+	return -1;
+}
+
+__attribute__((nonnull (1, 2, 3, 7)))
+gint wsh_jump_new(wsh_jump_t** jump, const gchar* spec, const gchar* username,
+                  const gchar* password, const gchar** ssh_opts,
+                  guint max_channels, GError** err) {
+	gchar* spec_user = NULL;
+	gchar* spec_host = NULL;
+	gint spec_port = 22;
+
+	if (wsh_jump_parse_spec(spec, &spec_user, &spec_host, &spec_port, err))
+		return -1;
+
+	*jump = g_slice_new0(wsh_jump_t);
+	(*jump)->hostname = spec_host;
+	(*jump)->username = spec_user ? spec_user : g_strdup(username);
+	(*jump)->password = password;
+	(*jump)->ssh_opts = ssh_opts;
+	(*jump)->port = spec_port;
+	(*jump)->max_channels = max_channels ? max_channels : WSH_JUMP_DEFAULT_MAX_CHANNELS;
+	(*jump)->conns = g_ptr_array_new();
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	(*jump)->mut = g_slice_new(GMutex);
+	g_mutex_init((*jump)->mut);
+#else
+	(*jump)->mut = g_mutex_new();
+#endif
+
+	return 0;
+}
+
+__attribute__((nonnull))
+static void free_tunnel(tunnel_t* tunnel) {
+	close(tunnel->sock);
+	ssh_channel_close(tunnel->channel);
+	ssh_channel_free(tunnel->channel);
+	g_free(tunnel->to_sock);
+	g_free(tunnel->to_chan);
+	g_slice_free(tunnel_t, tunnel);
+}
+
+// Drops the first len bytes of a buffer
+__attribute__((nonnull))
+static void consume(gchar* buf, gsize* buf_len, gsize len) {
+	*buf_len -= len;
+	memmove(buf, buf + len, *buf_len);
+}
+
+// Writes as much as the socket takes right now. Returns -1 if the target
+// session is gone, without the SIGPIPE
+__attribute__((nonnull))
+static gint flush_to_sock(tunnel_t* tunnel) {
+	while (tunnel->to_sock_len) {
+		gssize w = send(tunnel->sock, tunnel->to_sock, tunnel->to_sock_len,
+		                MSG_NOSIGNAL);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+
+		consume(tunnel->to_sock, &tunnel->to_sock_len, w);
+	}
+
+	return 0;
+}
+
+// Writes as much as the channel's window takes, so the write doesn't wait on
+// the target. Returns -1 if the channel is gone
+__attribute__((nonnull))
+static gint flush_to_chan(tunnel_t* tunnel) {
+	gsize len = MIN(tunnel->to_chan_len, ssh_channel_window_size(tunnel->channel));
+	if (! len)
+		return 0;
+
+	gint w = ssh_channel_write(tunnel->channel, tunnel->to_chan, len);
+	if (w < 0)
+		return -1;
+
+	consume(tunnel->to_chan, &tunnel->to_chan_len, w);
+	return 0;
+}
+
+// Moves whatever is ready in either direction, never waiting on either end.
+// A full buffer stops reading from that side until the other end catches up.
+// Returns TRUE once the tunnel is finished with
+__attribute__((nonnull))
+static gboolean pump_tunnel(tunnel_t* tunnel) {
+	gboolean chan_eof = FALSE;
+
+	if (flush_to_sock(tunnel))
+		return TRUE;
+
+	while (tunnel->to_sock_len < WSH_JUMP_BUF_SIZE) {
+		gint n = ssh_channel_read_nonblocking(tunnel->channel,
+		                                      tunnel->to_sock + tunnel->to_sock_len,
+		                                      WSH_JUMP_BUF_SIZE - tunnel->to_sock_len, 0);
+		if (n == SSH_ERROR)
+			return TRUE;
+
+		if (n <= 0) {
+			chan_eof = n < 0 || ssh_channel_is_eof(tunnel->channel) ||
+			           ssh_channel_is_closed(tunnel->channel);
+			break;
+		}
+
+		tunnel->to_sock_len += n;
+		if (flush_to_sock(tunnel))
+			return TRUE;
+	}
+
+	// Whatever the bastion sent before hanging up still goes to the target
+	if (chan_eof && ! tunnel->to_sock_len)
+		return TRUE;
+
+	if (flush_to_chan(tunnel))
+		return TRUE;
+
+	while (! tunnel->sock_eof && tunnel->to_chan_len < WSH_JUMP_BUF_SIZE) {
+		gssize r = read(tunnel->sock, tunnel->to_chan + tunnel->to_chan_len,
+		                WSH_JUMP_BUF_SIZE - tunnel->to_chan_len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return TRUE;
+		}
+
+		if (r == 0)
+			tunnel->sock_eof = TRUE;
+
+		tunnel->to_chan_len += r;
+		if (flush_to_chan(tunnel))
+			return TRUE;
+	}
+
+	// The target session hung up, and everything it sent is on its way
+	return tunnel->sock_eof && ! tunnel->to_chan_len;
+}
+
+static gpointer pump(gpointer data) {
+	jump_conn_t* conn = data;
+
+	while (! g_atomic_int_get(&conn->stop)) {
+		g_mutex_lock(conn->mut);
+		guint nfds = conn->tunnels->len + 1;
+		struct pollfd fds[nfds];
+
+		fds[0].fd = ssh_get_fd(conn->session.session);
+		fds[0].events = POLLIN;
+		for (guint i = 1; i < nfds; i++) {
+			tunnel_t* tunnel = g_ptr_array_index(conn->tunnels, i - 1);
+			fds[i].fd = tunnel->sock;
+			fds[i].events = 0;
+
+			// Don't wake up for a side we aren't going to read
+			if (! tunnel->sock_eof && tunnel->to_chan_len < WSH_JUMP_BUF_SIZE)
+				fds[i].events |= POLLIN;
+			if (tunnel->to_sock_len)
+				fds[i].events |= POLLOUT;
+		}
+		g_mutex_unlock(conn->mut);
+
+		// Only used as a wakeup, every tunnel gets pumped afterwards anyway
+		(void) poll(fds, nfds, WSH_JUMP_POLL_MS);
+
+		g_mutex_lock(conn->mut);
+		for (guint i = 0; i < conn->tunnels->len;) {
+			tunnel_t* tunnel = g_ptr_array_index(conn->tunnels, i);
+			if (pump_tunnel(tunnel)) {
+				g_ptr_array_remove_index_fast(conn->tunnels, i);
+				free_tunnel(tunnel);
+			} else {
+				i++;
+			}
+		}
+		g_mutex_unlock(conn->mut);
+	}
+
+	return NULL;
+}
+
+__attribute__((nonnull))
+static void free_conn(jump_conn_t* conn) {
+	if (conn->pump) {
+		g_atomic_int_set(&conn->stop, TRUE);
+		(void) g_thread_join(conn->pump);
+	}
+
+	for (guint i = 0; i < conn->tunnels->len; i++)
+		free_tunnel(g_ptr_array_index(conn->tunnels, i));
+	g_ptr_array_free(conn->tunnels, TRUE);
+
+	if (conn->session.session)
+		wsh_ssh_disconnect(&conn->session);
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	g_mutex_clear(conn->mut);
+	g_slice_free(GMutex, conn->mut);
+#else
+	g_mutex_free(conn->mut);
+#endif
+
+	g_slice_free(jump_conn_t, conn);
+}
+
+__attribute__((nonnull))
+static jump_conn_t* new_conn(wsh_jump_t* jump, GError** err) {
+	jump_conn_t* conn = g_slice_new0(jump_conn_t);
+	conn->tunnels = g_ptr_array_new();
+	conn->session.hostname = jump->hostname;
+	conn->session.username = jump->username;
+	conn->session.password = jump->password;
+	conn->session.port = jump->port;
+	conn->session.ssh_opts = jump->ssh_opts;
+	conn->session.auth_type = jump->password ? WSH_SSH_AUTH_PASSWORD : WSH_SSH_AUTH_PUBKEY;
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	conn->mut = g_slice_new(GMutex);
+	g_mutex_init(conn->mut);
+#else
+	conn->mut = g_mutex_new();
+#endif
+
+	// These mostly disconnect on failure, free_conn cleans up after the rest
+	if (wsh_ssh_host(&conn->session, err))
+		goto new_conn_err;
+
+	if (wsh_verify_host_key(&conn->session, FALSE, FALSE, err))
+		goto new_conn_err;
+
+	if (wsh_ssh_authenticate(&conn->session, err))
+		goto new_conn_err;
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	conn->pump = g_thread_try_new("wsh-jump", pump, conn, err);
+#else
+	conn->pump = g_thread_create(pump, conn, TRUE, err);
+#endif
+	if (! conn->pump)
+		goto new_conn_err;
+
+	return conn;
+
+new_conn_err:
+	free_conn(conn);
+	return NULL;
+}
+
+__attribute__((nonnull))
+gint wsh_jump_connect(wsh_jump_t* jump, const gchar* hostname, gint port,
+                      gint* sock, GError** err) {
+	WSH_JUMP_ERROR = g_quark_from_static_string("wsh_jump_error");
+
+	jump_conn_t* conn = NULL;
+	gint ret = 0;
+
+	g_mutex_lock(jump->mut);
+	for (guint i = 0; i < jump->conns->len && ! conn; i++) {
+		jump_conn_t* cur = g_ptr_array_index(jump->conns, i);
+
+		g_mutex_lock(cur->mut);
+		if (cur->tunnels->len < jump->max_channels)
+			conn = cur;
+		g_mutex_unlock(cur->mut);
+	}
+
+	if (! conn) {
+		if (! (conn = new_conn(jump, err))) {
+			g_mutex_unlock(jump->mut);
+			return -1;
+		}
+		g_ptr_array_add(jump->conns, conn);
+	}
+
+	// Hold the conn before letting go of the jump, so it can't fill up under us
+	g_mutex_lock(conn->mut);
+	g_mutex_unlock(jump->mut);
+
+	gint sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		*err = g_error_new(WSH_JUMP_ERROR, WSH_JUMP_SOCKET_ERR,
+		                   "socketpair: %s", strerror(errno));
+		ret = -1;
+		goto wsh_jump_connect_out;
+	}
+
+	(void) fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	(void) fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+	(void) fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+
+	ssh_channel channel = ssh_channel_new(conn->session.session);
+	if (channel == NULL ||
+	        ssh_channel_open_forward(channel, hostname, port, "127.0.0.1", 0) != SSH_OK) {
+		*err = g_error_new(WSH_JUMP_ERROR, WSH_JUMP_CHANNEL_ERR,
+		                   "%s: can't open channel to %s:%d: %s", jump->hostname,
+		                   hostname, port, ssh_get_error(conn->session.session));
+		if (channel)
+			ssh_channel_free(channel);
+		close(sv[0]);
+		close(sv[1]);
+		ret = -1;
+		goto wsh_jump_connect_out;
+	}
+
+	tunnel_t* tunnel = g_slice_new0(tunnel_t);
+	tunnel->channel = channel;
+	tunnel->sock = sv[0];
+	tunnel->to_sock = g_malloc(WSH_JUMP_BUF_SIZE);
+	tunnel->to_chan = g_malloc(WSH_JUMP_BUF_SIZE);
+	g_ptr_array_add(conn->tunnels, tunnel);
+
+	*sock = sv[1];
+
+wsh_jump_connect_out:
+	g_mutex_unlock(conn->mut);
+	return ret;
+}
+
+void wsh_jump_free(wsh_jump_t** jump) {
+	if (! jump || ! *jump) return;
+
+	for (guint i = 0; i < (*jump)->conns->len; i++)
+		free_conn(g_ptr_array_index((*jump)->conns, i));
+	g_ptr_array_free((*jump)->conns, TRUE);
+
+	g_free((*jump)->hostname);
+	g_free((*jump)->username);
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	g_mutex_clear((*jump)->mut);
+	g_slice_free(GMutex, (*jump)->mut);
+#else
+	g_mutex_free((*jump)->mut);
+#endif
+
+	g_slice_free(wsh_jump_t, *jump);
+	*jump = NULL;
+}
+
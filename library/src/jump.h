@@ -0,0 +1,126 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/** @file
+ * @brief Tunnelling ssh connections through a bastion host
+ *
+ * One authenticated session per bastion carries many direct-tcpip channels,
+ * one per target. Each channel is bridged to a socketpair, and the other end
+ * of the socketpair is handed to libssh as the target session's socket.
+ */
+#ifndef __WSH_JUMP_H
+#define __WSH_JUMP_H
+
+#include <glib.h>
+
+#include "ssh.h"
+
+/** GQuark for jump host errors */
+GQuark WSH_JUMP_ERROR;
+
+/** Jump host errors */
+typedef enum {
+	WSH_JUMP_SPEC_ERR,		/**< Can't parse the jump host spec */
+	WSH_JUMP_SOCKET_ERR,	/**< Can't create the local end of a tunnel */
+	WSH_JUMP_CHANNEL_ERR,	/**< Bastion refused to open a channel */
+	WSH_JUMP_THREAD_ERR,	/**< Can't start the thread that moves data */
+} wsh_jump_err_enum;
+
+/** Default cap on channels carried by one bastion connection */
+extern const guint WSH_JUMP_DEFAULT_MAX_CHANNELS;
+
+/** A bastion, and the connections to it we've opened so far */
+struct wsh_jump {
+	gchar* hostname;		/**< bastion hostname */
+	gchar* username;		/**< username to log in to the bastion with */
+	const gchar* password;	/**< password for the bastion, if any */
+	const gchar** ssh_opts;	/**< ssh options applied to bastion sessions */
+	GMutex* mut;			/**< protects conns */
+	GPtrArray* conns;		/**< open bastion connections */
+	guint max_channels;		/**< channels per connection before opening another */
+	gint port;				/**< bastion port */
+};
+
+/** Tunnels target sessions through a bastion */
+typedef struct wsh_jump wsh_jump_t;
+
+/**
+ * @brief Splits a [user@]host[:port] jump host spec
+ *
+ * IPv6 addresses can be given in brackets, like [::1]:22.
+ *
+ * @param[in] spec The spec to parse
+ * @param[out] username User from the spec, or NULL. Must be g_free'd
+ * @param[out] hostname Host from the spec. Must be g_free'd
+ * @param[out] port Port from the spec, or 22
+ * @param[out] err GError describing error condition
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_jump_parse_spec(const gchar* spec, gchar** username, gchar** hostname,
+                         gint* port, GError** err);
+
+/**
+ * @brief Sets up a bastion. Nothing is connected until the first tunnel
+ *
+ * @param[out] jump The new bastion. Free with wsh_jump_free
+ * @param[in] spec [user@]host[:port] of the bastion
+ * @param[in] username User to log in as if spec doesn't name one
+ * @param[in] password Password to log in with, or NULL for pubkey auth
+ * @param[in] ssh_opts ssh options applied to bastion sessions, or NULL
+ * @param[in] max_channels Channels per bastion connection, 0 for the default
+ * @param[out] err GError describing error condition
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull (1, 2, 3, 7)))
+gint wsh_jump_new(wsh_jump_t** jump, const gchar* spec, const gchar* username,
+                  const gchar* password, const gchar** ssh_opts,
+                  guint max_channels, GError** err);
+
+/**
+ * @brief Opens a tunnel to a target through the bastion
+ *
+ * Reuses a bastion connection with room for another channel, or connects,
+ * verifies and authenticates a new one. The returned socket belongs to the
+ * caller, and the tunnel is torn down once it's closed.
+ *
+ * @param[in] jump The bastion
+ * @param[in] hostname Target host, as resolved by the bastion
+ * @param[in] port Target port
+ * @param[out] sock Socket to hand to libssh with SSH_OPTIONS_FD
+ * @param[out] err GError describing error condition
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_jump_connect(wsh_jump_t* jump, const gchar* hostname, gint port,
+                      gint* sock, GError** err);
+
+/**
+ * @brief Disconnects from the bastion and frees everything
+ *
+ * @param[in,out] jump The bastion to free, is set to NULL
+ */
+void wsh_jump_free(wsh_jump_t** jump);
+
+#endif
+
@@ -24,12 +24,22 @@
 #ifndef __LIBWSH_H
 #define __LIBWSH_H
 
+#include <libwsh/aggregate.h>
+#include <libwsh/auth_cache.h>
 #include <libwsh/client.h>
 #include <libwsh/cmd.h>
 #include <libwsh/expansion.h>
+#include <libwsh/jump.h>
 #include <libwsh/log.h>
+#include <libwsh/manifest.h>
 #include <libwsh/pack.h>
+#include <libwsh/payload.h>
+#include <libwsh/relay.h>
+#include <libwsh/sftp.h>
+#include <libwsh/spool.h>
 #include <libwsh/ssh.h>
+#include <libwsh/tar.h>
+#include <libwsh/throttle.h>
 #include <libwsh/types.h>
 
 #ifdef WITH_RANGE
@@ -0,0 +1,443 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include "manifest.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "types.h"
+
+// Hash a mapped file in pieces, since GChecksum only takes a gssize
+static const gsize WSH_MANIFEST_HASH_CHUNK = 1024 * 1024;
+
+// Hashes the whole of buf, and each chunk of it too if chunks isn't NULL
+__attribute__((nonnull (1, 3)))
+static void hash_buf(const guchar* buf, gsize len, gchar** hash, GPtrArray* chunks) {
+	GChecksum* sum = g_checksum_new(G_CHECKSUM_SHA256);
+	GChecksum* chunk_sum = chunks ? g_checksum_new(G_CHECKSUM_SHA256) : NULL;
+
+	for (gsize off = 0, piece = 0; off < len; off += piece) {
+		piece = MIN(WSH_MANIFEST_HASH_CHUNK, len - off);
+		if (chunk_sum)
+			piece = MIN(piece, WSH_MANIFEST_CHUNK_SIZE - off % WSH_MANIFEST_CHUNK_SIZE);
+
+		g_checksum_update(sum, buf + off, piece);
+		if (! chunk_sum)
+			continue;
+
+		g_checksum_update(chunk_sum, buf + off, piece);
+		if ((off + piece) % WSH_MANIFEST_CHUNK_SIZE == 0 || off + piece == len) {
+			g_ptr_array_add(chunks, g_strdup(g_checksum_get_string(chunk_sum)));
+			g_checksum_reset(chunk_sum);
+		}
+	}
+
+	*hash = g_strdup(g_checksum_get_string(sum));
+
+	g_checksum_free(sum);
+	if (chunk_sum)
+		g_checksum_free(chunk_sum);
+}
+
+__attribute__((nonnull (1, 2, 4)))
+static gint hash_file(const gchar* path, gchar** hash, GPtrArray* chunks,
+                      GError** err) {
+	GMappedFile* map = NULL;
+	if ((map = g_mapped_file_new(path, FALSE, err)) == NULL)
+		return WSH_MANIFEST_READ_ERR;
+
+	hash_buf((const guchar*)g_mapped_file_get_contents(map),
+	         g_mapped_file_get_length(map), hash, chunks);
+
+	g_mapped_file_unref(map);
+	return 0;
+}
+
+__attribute__((nonnull))
+gint wsh_manifest_hash_file(const gchar* path, gchar** hash, GError** err) {
+	WSH_MANIFEST_ERROR = g_quark_from_static_string("wsh_manifest_error");
+
+	return hash_file(path, hash, NULL, err);
+}
+
+__attribute__((nonnull))
+static gint add_entry(GArray* entries, const gchar* local, const gchar* path,
+                      gboolean hash, GError** err) {
+	struct stat st;
+	if (g_stat(local, &st)) {
+		*err = g_error_new(WSH_MANIFEST_ERROR, WSH_MANIFEST_READ_ERR,
+		                   "%s: %s", local, strerror(errno));
+		return WSH_MANIFEST_READ_ERR;
+	}
+
+	wsh_manifest_entry_t entry = {
+		.path = g_strdup(path),
+		.local = g_strdup(local),
+		.size = st.st_size,
+	};
+
+	// Chunk hashes only pay for themselves once there's more than one
+	GPtrArray* chunks = NULL;
+	if (hash && entry.size > WSH_MANIFEST_CHUNK_SIZE)
+		chunks = g_ptr_array_new();
+
+	if (hash && hash_file(local, &entry.hash, chunks, err)) {
+		g_free(entry.path);
+		g_free(entry.local);
+		if (chunks)
+			g_ptr_array_free(chunks, TRUE);
+		return WSH_MANIFEST_READ_ERR;
+	}
+
+	if (chunks) {
+		entry.chunks_len = chunks->len;
+		g_ptr_array_add(chunks, NULL);
+		entry.chunks = (gchar**)g_ptr_array_free(chunks, FALSE);
+	}
+
+	g_array_append_val(entries, entry);
+	return 0;
+}
+
+__attribute__((nonnull))
+static gint add_dir(GArray* entries, const gchar* local, const gchar* path,
+                    gboolean hash, GError** err) {
+	GDir* dir = NULL;
+	if ((dir = g_dir_open(local, 0, err)) == NULL)
+		return WSH_MANIFEST_READ_ERR;
+
+	gint ret = 0;
+	for (const gchar* name = g_dir_read_name(dir); name && ! ret;
+	        name = g_dir_read_name(dir)) {
+		gchar* child_local = g_build_filename(local, name, NULL);
+		gchar* child_path = g_strconcat(path, "/", name, NULL);
+
+		if (g_file_test(child_local, G_FILE_TEST_IS_DIR))
+			ret = add_dir(entries, child_local, child_path, hash, err);
+		else
+			ret = add_entry(entries, child_local, child_path, hash, err);
+
+		g_free(child_path);
+		g_free(child_local);
+	}
+
+	g_dir_close(dir);
+	return ret;
+}
+
+static gint entry_cmp(gconstpointer a, gconstpointer b) {
+	return strcmp(((const wsh_manifest_entry_t*)a)->path,
+	              ((const wsh_manifest_entry_t*)b)->path);
+}
+
+__attribute__((nonnull))
+gint wsh_manifest_build(gchar** files, gsize num_files, gboolean hash,
+                        wsh_manifest_entry_t** manifest, gsize* manifest_len,
+                        GError** err) {
+	WSH_MANIFEST_ERROR = g_quark_from_static_string("wsh_manifest_error");
+
+	GArray* entries = g_array_new(FALSE, FALSE, sizeof(wsh_manifest_entry_t));
+	gint ret = 0;
+
+	for (gsize i = 0; i < num_files && ! ret; i++) {
+		gchar* base = g_path_get_basename(files[i]);
+
+		if (g_file_test(files[i], G_FILE_TEST_IS_DIR))
+			ret = add_dir(entries, files[i], base, hash, err);
+		else
+			ret = add_entry(entries, files[i], base, hash, err);
+
+		g_free(base);
+	}
+
+	g_array_sort(entries, entry_cmp);
+
+	*manifest_len = entries->len;
+	*manifest = (wsh_manifest_entry_t*)g_array_free(entries, FALSE);
+
+	if (ret)
+		wsh_manifest_free(manifest, *manifest_len);
+
+	return ret;
+}
+
+void wsh_manifest_free(wsh_manifest_entry_t** manifest, gsize manifest_len) {
+	if (! manifest || ! *manifest) return;
+
+	for (gsize i = 0; i < manifest_len; i++) {
+		g_free((*manifest)[i].path);
+		g_free((*manifest)[i].local);
+		g_free((*manifest)[i].hash);
+		g_strfreev((*manifest)[i].chunks);
+	}
+
+	g_free(*manifest);
+	*manifest = NULL;
+}
+
+// Only ever look under root
+__attribute__((nonnull))
+static gboolean unsafe_path(const gchar* path) {
+	return g_path_is_absolute(path) || strstr(path, "..") != NULL;
+}
+
+__attribute__((nonnull))
+static gboolean is_stale(const gchar* root, const wsh_manifest_entry_t* entry) {
+	if (unsafe_path(entry->path))
+		return TRUE;
+
+	gchar* path = g_build_filename(root, entry->path, NULL);
+	gboolean stale = TRUE;
+	struct stat st;
+
+	if (! g_stat(path, &st) && S_ISREG(st.st_mode) &&
+	        (guint64)st.st_size == entry->size) {
+		gchar* hash = NULL;
+		GError* err = NULL;
+
+		if (! wsh_manifest_hash_file(path, &hash, &err))
+			stale = g_ascii_strcasecmp(hash, entry->hash) != 0;
+		else
+			g_error_free(err);
+
+		g_free(hash);
+	}
+
+	g_free(path);
+	return stale;
+}
+
+__attribute__((nonnull))
+gchar** wsh_manifest_stale(const gchar* root,
+                           const wsh_manifest_entry_t* manifest,
+                           gsize manifest_len, gsize* stale_len) {
+	gchar** stale = g_new0(gchar*, manifest_len + 1);
+	*stale_len = 0;
+
+	for (gsize i = 0; i < manifest_len; i++) {
+		if (is_stale(root, &manifest[i]))
+			stale[(*stale_len)++] = g_strdup(manifest[i].path);
+	}
+
+	return stale;
+}
+
+__attribute__((nonnull))
+gchar* wsh_manifest_part_name(const gchar* path, guint64 offset) {
+	return g_strdup_printf("%s" WSH_MANIFEST_PART_SUFFIX "-%" G_GUINT64_FORMAT,
+	                       path, offset);
+}
+
+/* A piece of a resumable file, and the byte it starts at */
+typedef struct {
+	gchar* path;
+	guint64 offset;
+} part_piece_t;
+
+static gint piece_cmp(gconstpointer a, gconstpointer b) {
+	guint64 x = ((const part_piece_t*)a)->offset;
+	guint64 y = ((const part_piece_t*)b)->offset;
+	return (x > y) - (x < y);
+}
+
+__attribute__((nonnull))
+static gboolean append_file(const gchar* part, const gchar* piece) {
+	GMappedFile* map = NULL;
+	if ((map = g_mapped_file_new(piece, FALSE, NULL)) == NULL)
+		return FALSE;
+
+	const gchar* buf = g_mapped_file_get_contents(map);
+	gsize len = g_mapped_file_get_length(map);
+	gboolean ok = FALSE;
+
+	gint fd = g_open(part, O_WRONLY|O_APPEND|O_CREAT, 0644);
+	if (fd >= 0) {
+		gsize off = 0;
+		while (off < len) {
+			gssize wrote = write(fd, buf + off, len - off);
+			if (wrote < 0 && errno == EINTR)
+				continue;
+			if (wrote <= 0)
+				break;
+			off += wrote;
+		}
+
+		ok = (off == len);
+		ok = ! close(fd) && ok;
+	}
+
+	g_mapped_file_unref(map);
+	return ok;
+}
+
+// Joins pieces onto part in order. Each piece starts where the part was
+// cut back to when it was asked for, so anything after that is replaced
+__attribute__((nonnull))
+static void join_pieces(const gchar* part) {
+	gchar* dir_name = g_path_get_dirname(part);
+	gchar* prefix = g_strconcat(strrchr(part, '/') ? strrchr(part, '/') + 1 : part,
+	                            "-", NULL);
+	GArray* pieces = g_array_new(FALSE, FALSE, sizeof(part_piece_t));
+
+	GDir* dir = NULL;
+	if ((dir = g_dir_open(dir_name, 0, NULL)) != NULL) {
+		for (const gchar* name = g_dir_read_name(dir); name;
+		        name = g_dir_read_name(dir)) {
+			if (! g_str_has_prefix(name, prefix))
+				continue;
+
+			const gchar* num = name + strlen(prefix);
+			gchar* end = NULL;
+			part_piece_t piece = {
+				.offset = g_ascii_strtoull(num, &end, 10),
+			};
+			if (! *num || *end)
+				continue;
+
+			piece.path = g_build_filename(dir_name, name, NULL);
+			g_array_append_val(pieces, piece);
+		}
+		g_dir_close(dir);
+	}
+
+	g_array_sort(pieces, piece_cmp);
+
+	gboolean ok = TRUE;
+	for (guint i = 0; i < pieces->len; i++) {
+		part_piece_t* piece = &g_array_index(pieces, part_piece_t, i);
+		struct stat st = { .st_size = 0 };
+		(void) g_stat(part, &st);
+
+		// A gap can't be filled in, so the piece is no use
+		if (ok && piece->offset == 0)
+			ok = ! g_rename(piece->path, part);
+		else if (ok && piece->offset <= (guint64)st.st_size)
+			ok = ! truncate(part, piece->offset) && append_file(part, piece->path);
+
+		(void) g_unlink(piece->path);
+		g_free(piece->path);
+	}
+
+	g_array_free(pieces, TRUE);
+	g_free(prefix);
+	g_free(dir_name);
+}
+
+// Bytes at the start of part that match the entry's chunk hashes
+__attribute__((nonnull))
+static guint64 verified_len(const gchar* part, const wsh_manifest_entry_t* entry) {
+	GMappedFile* map = NULL;
+	if ((map = g_mapped_file_new(part, FALSE, NULL)) == NULL)
+		return 0;
+
+	const guchar* buf = (const guchar*)g_mapped_file_get_contents(map);
+	gsize len = g_mapped_file_get_length(map);
+	guint64 good = 0;
+
+	for (gsize i = 0; i < entry->chunks_len; i++) {
+		guint64 want = MIN(WSH_MANIFEST_CHUNK_SIZE, entry->size - good);
+		if (len - good < want)
+			break;
+
+		gchar* hash = NULL;
+		hash_buf(buf + good, want, &hash, NULL);
+		gboolean match = ! g_ascii_strcasecmp(hash, entry->chunks[i]);
+		g_free(hash);
+
+		if (! match)
+			break;
+		good += want;
+	}
+
+	g_mapped_file_unref(map);
+	return good;
+}
+
+// Chunk hashes that can't describe the file are as good as none
+__attribute__((nonnull))
+static gboolean resumable(const wsh_manifest_entry_t* entry) {
+	return entry->chunks_len && ! unsafe_path(entry->path) &&
+	       entry->chunks_len == (entry->size + WSH_MANIFEST_CHUNK_SIZE - 1) /
+	       WSH_MANIFEST_CHUNK_SIZE;
+}
+
+__attribute__((nonnull))
+guint64 wsh_manifest_resume(const gchar* root, const wsh_manifest_entry_t* entry) {
+	if (! resumable(entry))
+		return 0;
+
+	gchar* dest = g_build_filename(root, entry->path, NULL);
+	gchar* part = g_strconcat(dest, WSH_MANIFEST_PART_SUFFIX, NULL);
+
+	join_pieces(part);
+
+	guint64 good = verified_len(part, entry);
+	if (g_file_test(part, G_FILE_TEST_EXISTS) && truncate(part, good))
+		good = 0;
+
+	g_free(part);
+	g_free(dest);
+	return good;
+}
+
+__attribute__((nonnull))
+gint wsh_manifest_complete(const gchar* root, const wsh_manifest_entry_t* entry,
+                           GError** err) {
+	WSH_MANIFEST_ERROR = g_quark_from_static_string("wsh_manifest_error");
+
+	if (! resumable(entry)) {
+		*err = g_error_new(WSH_MANIFEST_ERROR, WSH_MANIFEST_INCOMPLETE_ERR,
+		                   "%s can't be resumed", entry->path);
+		return WSH_MANIFEST_INCOMPLETE_ERR;
+	}
+
+	// Every chunk matching means the whole file does
+	guint64 good = wsh_manifest_resume(root, entry);
+	if (good != entry->size) {
+		*err = g_error_new(WSH_MANIFEST_ERROR, WSH_MANIFEST_INCOMPLETE_ERR,
+		                   "%s is incomplete at %" G_GUINT64_FORMAT " of %"
+		                   G_GUINT64_FORMAT " bytes, run again to resume",
+		                   entry->path, good, entry->size);
+		return WSH_MANIFEST_INCOMPLETE_ERR;
+	}
+
+	gchar* dest = g_build_filename(root, entry->path, NULL);
+	gchar* part = g_strconcat(dest, WSH_MANIFEST_PART_SUFFIX, NULL);
+	gint ret = 0;
+
+	if (g_rename(part, dest)) {
+		*err = g_error_new(WSH_MANIFEST_ERROR, WSH_MANIFEST_WRITE_ERR,
+		                   "Can't move %s into place: %s", entry->path,
+		                   strerror(errno));
+		ret = WSH_MANIFEST_WRITE_ERR;
+	}
+
+	g_free(part);
+	g_free(dest);
+	return ret;
+}
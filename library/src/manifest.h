@@ -0,0 +1,154 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/** @file
+ * @brief Working out which files a host already has
+ *
+ * The client hashes what it's about to send and passes the list to wshd,
+ * which answers with the files that are missing or different. Hashing on
+ * the remote side only happens when the sizes already match.
+ *
+ * Files bigger than a chunk are also hashed chunk by chunk, and sent as
+ * .wshpart pieces next to where they belong. A transfer that dies part way
+ * leaves its verified chunks behind, the next one picks up after them, and
+ * the finished file is renamed into place.
+ */
+#ifndef __WSH_MANIFEST_H
+#define __WSH_MANIFEST_H
+
+#include <glib.h>
+
+#include "types.h"
+
+/** GQuark for manifest errors */
+GQuark WSH_MANIFEST_ERROR;
+
+/** Manifest errors */
+typedef enum {
+	WSH_MANIFEST_READ_ERR,		/**< Can't read a file or directory */
+	WSH_MANIFEST_INCOMPLETE_ERR,	/**< A resumable file hasn't fully arrived */
+	WSH_MANIFEST_WRITE_ERR,		/**< Can't move a finished file into place */
+} wsh_manifest_err_enum;
+
+/** Files are hashed, and resumed, in chunks this big */
+#define WSH_MANIFEST_CHUNK_SIZE (4 * 1024 * 1024)
+
+/** Appended to a resumable file while it's arriving */
+#define WSH_MANIFEST_PART_SUFFIX ".wshpart"
+
+/**
+ * @brief Hashes a file
+ *
+ * @param[in] path File to hash
+ * @param[out] hash Hex SHA-256 of the file. g_free() it
+ * @param[out] err GError describing the failure
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_manifest_hash_file(const gchar* path, gchar** hash, GError** err);
+
+/**
+ * @brief Lists, and optionally hashes, every file under some paths
+ *
+ * Each file is named by its path under the destination: the basename of a
+ * file, or a directory's basename followed by the path inside it. Entries
+ * are sorted by path. Hashed files bigger than WSH_MANIFEST_CHUNK_SIZE get
+ * chunk hashes too, which makes them resumable.
+ *
+ * @param[in] files Files and directories that will be sent
+ * @param[in] num_files Length of files
+ * @param[in] hash Hash each file. Otherwise every hash is NULL
+ * @param[out] manifest The entries. Free with wsh_manifest_free
+ * @param[out] manifest_len Length of manifest
+ * @param[out] err GError describing the failure
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_manifest_build(gchar** files, gsize num_files, gboolean hash,
+                        wsh_manifest_entry_t** manifest, gsize* manifest_len,
+                        GError** err);
+
+/**
+ * @brief Frees entries from wsh_manifest_build
+ *
+ * @param[in,out] manifest Entries to free, is set to NULL
+ * @param[in] manifest_len Length of manifest
+ */
+void wsh_manifest_free(wsh_manifest_entry_t** manifest, gsize manifest_len);
+
+/**
+ * @brief Finds the entries that this host doesn't have
+ *
+ * A file is stale if it's missing, a different size, or hashes
+ * differently. Files are only hashed when their size matches.
+ *
+ * @param[in] root Directory the entries' paths are under
+ * @param[in] manifest Entries to check
+ * @param[in] manifest_len Length of manifest
+ * @param[out] stale_len Number of stale entries
+ *
+ * @returns NULL terminated paths of the stale entries. g_strfreev() it
+ */
+__attribute__((nonnull))
+gchar** wsh_manifest_stale(const gchar* root,
+                           const wsh_manifest_entry_t* manifest,
+                           gsize manifest_len, gsize* stale_len);
+
+/**
+ * @brief Names the piece of a resumable file that starts at offset
+ *
+ * @param[in] path Path of the file under the destination
+ * @param[in] offset Byte of the file the piece starts at
+ *
+ * @returns Path to send the piece to. g_free() it
+ */
+__attribute__((nonnull))
+gchar* wsh_manifest_part_name(const gchar* path, guint64 offset);
+
+/**
+ * @brief Works out where a resumable file should pick up from
+ *
+ * Any pieces that have arrived are joined onto the file's .wshpart, which
+ * is then cut back to its last chunk that matches its hash.
+ *
+ * @param[in] root Directory the entry's path is under
+ * @param[in] entry Entry to check
+ *
+ * @returns Bytes of the file this host holds, 0 if it isn't resumable
+ */
+__attribute__((nonnull))
+guint64 wsh_manifest_resume(const gchar* root, const wsh_manifest_entry_t* entry);
+
+/**
+ * @brief Moves a resumable file into place, once all of it is here
+ *
+ * @param[in] root Directory the entry's path is under
+ * @param[in] entry Entry that has been sent
+ * @param[out] err GError describing the failure
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_manifest_complete(const gchar* root, const wsh_manifest_entry_t* entry,
+                           GError** err);
+
+#endif
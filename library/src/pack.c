@@ -23,11 +23,72 @@
 
 #include <glib.h>
 #include <string.h>
+#include <zlib.h>
 
+#include "aggregate.h"
 #include "auth.pb-c.h"
 #include "cmd-messages.pb-c.h"
 #include "types.h"
 
+// Replies smaller than this aren't worth compressing
+static const guint32 WSH_PACK_COMPRESS_MIN = 1024;
+
+// deflate never does better than this, so anything claiming to is corrupt
+static const guint32 WSH_PACK_MAX_RATIO = 1032;
+
+// Manifests can run to many thousands of files, so keep them off the stack.
+// g_free() the returned array and *storage when done
+__attribute__((nonnull (3)))
+static ManifestEntry** pack_entries(const wsh_manifest_entry_t* manifest,
+                                    gsize len, ManifestEntry** storage) {
+	*storage = g_new0(ManifestEntry, len);
+	ManifestEntry** ptrs = g_new0(ManifestEntry*, len);
+
+	for (gsize i = 0; i < len; i++) {
+		ManifestEntry entry = MANIFEST_ENTRY__INIT;
+		entry.path = manifest[i].path;
+		entry.size = manifest[i].size;
+		entry.sha256 = manifest[i].hash;
+		entry.chunk_sha256 = manifest[i].chunks;
+		entry.n_chunk_sha256 = manifest[i].chunks_len;
+
+		(*storage)[i] = entry;
+		ptrs[i] = &(*storage)[i];
+	}
+
+	return ptrs;
+}
+
+static wsh_manifest_entry_t* unpack_entries(ManifestEntry** entries, gsize len) {
+	if (! len) return NULL;
+
+	wsh_manifest_entry_t* manifest = g_new0(wsh_manifest_entry_t, len);
+	for (gsize i = 0; i < len; i++) {
+		manifest[i].path = g_strdup(entries[i]->path);
+		manifest[i].size = entries[i]->size;
+		manifest[i].hash = g_strdup(entries[i]->sha256);
+
+		if (entries[i]->n_chunk_sha256) {
+			manifest[i].chunks_len = entries[i]->n_chunk_sha256;
+			manifest[i].chunks = g_new0(gchar*, manifest[i].chunks_len + 1);
+			for (gsize j = 0; j < manifest[i].chunks_len; j++)
+				manifest[i].chunks[j] = g_strdup(entries[i]->chunk_sha256[j]);
+		}
+	}
+
+	return manifest;
+}
+
+static void free_entries(wsh_manifest_entry_t* manifest, gsize len) {
+	for (gsize i = 0; i < len; i++) {
+		g_free(manifest[i].path);
+		g_free(manifest[i].local);
+		g_free(manifest[i].hash);
+		g_strfreev(manifest[i].chunks);
+	}
+	g_free(manifest);
+}
+
 // buf MUST be g_free()d
 __attribute__((nonnull))
 void wsh_pack_request(guint8** buf, guint32* buf_len,
@@ -57,10 +118,76 @@ void wsh_pack_request(guint8** buf, guint32* buf_len,
 		cmd_req.has_use_shell = TRUE;
 	cmd_req.use_shell = req->use_shell;
 
+	cmd_req.relay_hosts = req->relay_hosts;
+	cmd_req.n_relay_hosts = req->relay_hosts_len;
+	if (req->relay_hosts_len) {
+		cmd_req.has_relay_depth = TRUE;
+		cmd_req.relay_depth = req->relay_depth;
+		cmd_req.has_relay_port = (req->relay_port != 0);
+		cmd_req.relay_port = req->relay_port;
+		cmd_req.has_relay_threads = (req->relay_threads != 0);
+		cmd_req.relay_threads = req->relay_threads;
+	}
+
+	cmd_req.inflate = req->inflate;
+	cmd_req.n_inflate = req->inflate_len;
+	cmd_req.untar = req->untar;
+	cmd_req.n_untar = req->untar_len;
+	cmd_req.argv = req->argv;
+	cmd_req.n_argv = req->argv_len;
+
+	if (req->passthrough)
+		cmd_req.has_passthrough = TRUE;
+	cmd_req.passthrough = req->passthrough;
+
+	if (req->raw_output)
+		cmd_req.has_raw_output = TRUE;
+	cmd_req.raw_output = req->raw_output;
+
+	if (req->compress_level)
+		cmd_req.has_compress_level = TRUE;
+	cmd_req.compress_level = req->compress_level;
+	cmd_req.expect_sha256 = req->expect_hash;
+	if (req->summary_only)
+		cmd_req.has_summary_only = TRUE;
+	cmd_req.summary_only = req->summary_only;
+	cmd_req.fetch_spool = req->fetch_spool;
+	if (req->aggregate_op)
+		cmd_req.has_aggregate = TRUE;
+	cmd_req.aggregate = req->aggregate_op;
+
+	if (req->script_name) {
+		cmd_req.has_script = TRUE;
+		cmd_req.script.data = req->script;
+		cmd_req.script.len = req->script_len;
+		cmd_req.script_name = req->script_name;
+	}
+
+	ManifestEntry* entries = NULL;
+	cmd_req.manifest = pack_entries(req->manifest, req->manifest_len, &entries);
+	cmd_req.n_manifest = req->manifest_len;
+
+	ManifestEntry* dist_entries = NULL;
+	cmd_req.distribute = pack_entries(req->distribute, req->distribute_len,
+	                                  &dist_entries);
+	cmd_req.n_distribute = req->distribute_len;
+
+	ManifestEntry* complete_entries = NULL;
+	cmd_req.complete = pack_entries(req->complete, req->complete_len,
+	                                &complete_entries);
+	cmd_req.n_complete = req->complete_len;
+
 	*buf_len = command_request__get_packed_size(&cmd_req);
 	*buf = g_slice_alloc0(*buf_len);
 
 	command_request__pack(&cmd_req, *buf);
+
+	g_free(cmd_req.manifest);
+	g_free(entries);
+	g_free(cmd_req.distribute);
+	g_free(dist_entries);
+	g_free(cmd_req.complete);
+	g_free(complete_entries);
 }
 
 // req ought to be allocated
@@ -104,6 +231,58 @@ void wsh_unpack_request(wsh_cmd_req_t** req, const guint8* buf,
 	(*req)->host = g_strndup(cmd_req->host, strlen(cmd_req->host));
 
 	(*req)->use_shell = cmd_req->use_shell;
+	(*req)->passthrough = cmd_req->passthrough;
+	(*req)->raw_output = cmd_req->raw_output;
+	(*req)->compress_level = MIN(cmd_req->compress_level, Z_BEST_COMPRESSION);
+	(*req)->expect_hash = g_strdup(cmd_req->expect_sha256);
+	(*req)->summary_only = cmd_req->summary_only;
+	(*req)->fetch_spool = g_strdup(cmd_req->fetch_spool);
+	if (cmd_req->aggregate < WSH_AGGREGATE_MAX)
+		(*req)->aggregate_op = cmd_req->aggregate;
+
+	if (cmd_req->n_relay_hosts) {
+		(*req)->relay_hosts = g_new0(gchar*, cmd_req->n_relay_hosts + 1);
+		for (gsize i = 0; i < cmd_req->n_relay_hosts; i++)
+			(*req)->relay_hosts[i] = g_strdup(cmd_req->relay_hosts[i]);
+		(*req)->relay_hosts_len = cmd_req->n_relay_hosts;
+		(*req)->relay_depth = cmd_req->relay_depth;
+		(*req)->relay_port = cmd_req->relay_port;
+		(*req)->relay_threads = cmd_req->relay_threads;
+	}
+
+	if (cmd_req->n_inflate) {
+		(*req)->inflate = g_new0(gchar*, cmd_req->n_inflate + 1);
+		for (gsize i = 0; i < cmd_req->n_inflate; i++)
+			(*req)->inflate[i] = g_strdup(cmd_req->inflate[i]);
+		(*req)->inflate_len = cmd_req->n_inflate;
+	}
+
+	if (cmd_req->n_untar) {
+		(*req)->untar = g_new0(gchar*, cmd_req->n_untar + 1);
+		for (gsize i = 0; i < cmd_req->n_untar; i++)
+			(*req)->untar[i] = g_strdup(cmd_req->untar[i]);
+		(*req)->untar_len = cmd_req->n_untar;
+	}
+
+	if (cmd_req->n_argv) {
+		(*req)->argv = g_new0(gchar*, cmd_req->n_argv + 1);
+		for (gsize i = 0; i < cmd_req->n_argv; i++)
+			(*req)->argv[i] = g_strdup(cmd_req->argv[i]);
+		(*req)->argv_len = cmd_req->n_argv;
+	}
+
+	if (cmd_req->script_name) {
+		(*req)->script_name = g_strdup(cmd_req->script_name);
+		(*req)->script = g_memdup2(cmd_req->script.data, cmd_req->script.len);
+		(*req)->script_len = cmd_req->script.len;
+	}
+
+	(*req)->manifest = unpack_entries(cmd_req->manifest, cmd_req->n_manifest);
+	(*req)->manifest_len = cmd_req->n_manifest;
+	(*req)->distribute = unpack_entries(cmd_req->distribute, cmd_req->n_distribute);
+	(*req)->distribute_len = cmd_req->n_distribute;
+	(*req)->complete = unpack_entries(cmd_req->complete, cmd_req->n_complete);
+	(*req)->complete_len = cmd_req->n_complete;
 
 	command_request__free_unpacked(cmd_req, NULL);
 }
@@ -117,14 +296,162 @@ void wsh_free_unpacked_request(wsh_cmd_req_t** req) {
 	g_strfreev((*req)->env);
 	g_free((*req)->cwd);
 	g_free((*req)->host);
+	g_strfreev((*req)->relay_hosts);
+	g_strfreev((*req)->inflate);
+	g_strfreev((*req)->untar);
+	g_strfreev((*req)->argv);
+	g_free((*req)->script_name);
+	g_free((*req)->expect_hash);
+	g_free((*req)->fetch_spool);
+	g_free((*req)->script);
+	free_entries((*req)->manifest, (*req)->manifest_len);
+	free_entries((*req)->distribute, (*req)->distribute_len);
+	free_entries((*req)->complete, (*req)->complete_len);
 	g_free(*req);
 	*req = NULL;
 }
 
+// Offsets just past each newline in raw. wshd stops collecting raw output
+// well short of 4GiB, at MAX_RAW_OUTPUT, so they fit
+static guint32* index_lines(const guint8* raw, gsize len, gsize* index_len) {
+	GArray* index = g_array_new(FALSE, FALSE, sizeof(guint32));
+
+	for (const guint8* nl = raw; len && (nl = memchr(nl, '\n', raw + len - nl)); nl++) {
+		guint32 off = nl - raw + 1;
+		g_array_append_val(index, off);
+	}
+
+	*index_len = index->len;
+	return (guint32*)g_array_free(index, FALSE);
+}
+
+// Offsets have to climb, land within raw, and each follow a newline
+static gboolean index_fits(const guint8* raw, gsize len, const guint32* index,
+                           gsize index_len) {
+	for (gsize i = 0; i < index_len; i++) {
+		if (index[i] == 0 || index[i] > len || (i && index[i] <= index[i - 1]) ||
+		        raw[index[i] - 1] != '\n')
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+// Whatever follows the last newline is a line of its own
+static gchar** split_lines(const guint8* raw, gsize len, const guint32* index,
+                           gsize index_len, gsize* lines_len) {
+	guint32* own = NULL;
+	if (! index || ! index_fits(raw, len, index, index_len))
+		index = own = index_lines(raw, len, &index_len);
+
+	gchar** lines = g_new(gchar*, index_len + 2);
+	gsize start = 0;
+	*lines_len = 0;
+
+	for (gsize i = 0; i < index_len; i++) {
+		lines[(*lines_len)++] = g_strndup((const gchar*)raw + start, index[i] - 1 - start);
+		start = index[i];
+	}
+	if (start < len)
+		lines[(*lines_len)++] = g_strndup((const gchar*)raw + start, len - start);
+	lines[*lines_len] = NULL;
+
+	g_free(own);
+	return lines;
+}
+
+// A copy with a NUL after it, so text output can be used as a string
+static guint8* copy_raw(const ProtobufCBinaryData* data, gsize* len) {
+	guint8* ret = g_malloc(data->len + 1);
+
+	memcpy(ret, data->data, data->len);
+	ret[data->len] = '\0';
+	*len = data->len;
+
+	return ret;
+}
+
+// Arrays point into agg, and are freed with free_packed_aggregate()
+static void pack_aggregate(Aggregate* msg, const wsh_aggregate_t* agg) {
+	GHashTableIter iter;
+	gpointer key, value;
+	gsize i = 0;
+
+	msg->op = agg->op;
+
+	if (agg->counts) {
+		msg->n_lines = msg->n_line_counts = g_hash_table_size(agg->counts);
+		msg->lines = g_new(gchar*, msg->n_lines);
+		msg->line_counts = g_new(uint64_t, msg->n_line_counts);
+
+		g_hash_table_iter_init(&iter, agg->counts);
+		for (i = 0; g_hash_table_iter_next(&iter, &key, &value); i++) {
+			msg->lines[i] = key;
+			msg->line_counts[i] = *(guint64*)value;
+		}
+	}
+
+	if (agg->buckets) {
+		msg->n_buckets = msg->n_bucket_counts = g_hash_table_size(agg->buckets);
+		msg->buckets = g_new(int32_t, msg->n_buckets);
+		msg->bucket_counts = g_new(uint64_t, msg->n_bucket_counts);
+
+		g_hash_table_iter_init(&iter, agg->buckets);
+		for (i = 0; g_hash_table_iter_next(&iter, &key, &value); i++) {
+			msg->buckets[i] = GPOINTER_TO_INT(key);
+			msg->bucket_counts[i] = *(guint64*)value;
+		}
+	}
+
+	if (agg->op != WSH_AGGREGATE_UNIQ_COUNT) {
+		msg->has_sum = msg->has_values = msg->has_skipped = TRUE;
+		msg->sum = agg->sum;
+		msg->values = agg->values;
+		msg->skipped = agg->skipped;
+	}
+
+	if (agg->values) {
+		msg->has_min = msg->has_max = TRUE;
+		msg->min = agg->min;
+		msg->max = agg->max;
+	}
+}
+
+static void free_packed_aggregate(Aggregate* msg) {
+	g_free(msg->lines);
+	g_free(msg->line_counts);
+	g_free(msg->buckets);
+	g_free(msg->bucket_counts);
+}
+
+// Anything that doesn't add up is dropped rather than trusted
+static wsh_aggregate_t* unpack_aggregate(const Aggregate* msg) {
+	if (msg->op == WSH_AGGREGATE_NONE || msg->op >= WSH_AGGREGATE_MAX ||
+	        msg->n_lines != msg->n_line_counts || msg->n_buckets != msg->n_bucket_counts)
+		return NULL;
+
+	wsh_aggregate_t* agg = NULL;
+	wsh_aggregate_new(&agg, msg->op);
+
+	for (gsize i = 0; agg->counts && i < msg->n_lines; i++)
+		wsh_aggregate_count(agg, msg->lines[i], msg->line_counts[i]);
+	for (gsize i = 0; agg->buckets && i < msg->n_buckets; i++)
+		wsh_aggregate_count_bucket(agg, msg->buckets[i], msg->bucket_counts[i]);
+
+	agg->sum = msg->sum;
+	agg->min = msg->min;
+	agg->max = msg->max;
+	agg->values = msg->values;
+	agg->skipped = msg->skipped;
+
+	return agg;
+}
+
 __attribute__((nonnull))
 void wsh_pack_response(guint8** buf, guint32* buf_len,
                        const wsh_cmd_res_t* res) {
 	CommandReply cmd_res = COMMAND_REPLY__INIT;
+	Aggregate agg = AGGREGATE__INIT;
 
 	cmd_res.stdout = res->std_output;
 	cmd_res.stderr = res->std_error;
@@ -132,11 +459,162 @@ void wsh_pack_response(guint8** buf, guint32* buf_len,
 	cmd_res.n_stderr = res->std_error_len;
 	cmd_res.ret_code = res->exit_status;
 	cmd_res.error_message = res->error_message;
+	if (res->matches)
+		cmd_res.has_matches = TRUE;
+	cmd_res.matches = res->matches;
+	cmd_res.spool_id = res->spool_id;
+	cmd_res.output_sha256 = res->output_hash;
+	if (res->spool_id)
+		cmd_res.has_output_size = TRUE;
+	cmd_res.output_size = res->output_size;
+	if (res->aggregate) {
+		pack_aggregate(&agg, res->aggregate);
+		cmd_res.aggregate = &agg;
+	}
+	cmd_res.hosts = res->hosts;
+	cmd_res.n_hosts = res->hosts_len;
+	cmd_res.stale = res->stale;
+	cmd_res.n_stale = res->stale_len;
+	if (res->resume) {
+		cmd_res.resume = (uint64_t*)res->resume;
+		cmd_res.n_resume = res->stale_len;
+	}
+
+	if (res->std_output_raw) {
+		cmd_res.has_stdout_raw = TRUE;
+		cmd_res.stdout_raw.data = res->std_output_raw;
+		cmd_res.stdout_raw.len = res->std_output_raw_len;
+		cmd_res.stdout_index = index_lines(res->std_output_raw,
+		                                   res->std_output_raw_len,
+		                                   &cmd_res.n_stdout_index);
+	}
+
+	if (res->std_error_raw) {
+		cmd_res.has_stderr_raw = TRUE;
+		cmd_res.stderr_raw.data = res->std_error_raw;
+		cmd_res.stderr_raw.len = res->std_error_raw_len;
+		cmd_res.stderr_index = index_lines(res->std_error_raw,
+		                                   res->std_error_raw_len,
+		                                   &cmd_res.n_stderr_index);
+	}
 
 	*buf_len = command_reply__get_packed_size(&cmd_res);
 	*buf = g_slice_alloc0(*buf_len);
 
 	command_reply__pack(&cmd_res, *buf);
+
+	g_free(cmd_res.stdout_index);
+	g_free(cmd_res.stderr_index);
+	free_packed_aggregate(&agg);
+}
+
+__attribute__((nonnull))
+void wsh_pack_response_compressed(guint8** buf, guint32* buf_len,
+                                  const wsh_cmd_res_t* res, guint level) {
+	wsh_pack_response(buf, buf_len, res);
+	if (! level || *buf_len < WSH_PACK_COMPRESS_MIN)
+		return;
+
+	uLongf z_len = compressBound(*buf_len);
+	guint8* z = g_malloc(z_len);
+
+	// Output that's already compressed can come out bigger
+	if (compress2(z, &z_len, *buf, *buf_len, MIN(level, Z_BEST_COMPRESSION)) == Z_OK &&
+	        z_len < *buf_len) {
+		CommandReply outer = COMMAND_REPLY__INIT;
+		outer.ret_code = res->exit_status;
+		outer.has_compressed = TRUE;
+		outer.compressed.data = z;
+		outer.compressed.len = z_len;
+		outer.has_uncompressed_size = TRUE;
+		outer.uncompressed_size = *buf_len;
+
+		g_slice_free1(*buf_len, *buf);
+		*buf_len = command_reply__get_packed_size(&outer);
+		*buf = g_slice_alloc0(*buf_len);
+		command_reply__pack(&outer, *buf);
+	}
+
+	g_free(z);
+}
+
+__attribute__((nonnull))
+static void unpack_reply(wsh_cmd_res_t* res, const CommandReply* cmd_res) {
+	// Raw output is left whole until wsh_split_response()
+	if (cmd_res->has_stdout_raw) {
+		res->std_output_raw = copy_raw(&cmd_res->stdout_raw, &res->std_output_raw_len);
+		res->std_output_index = g_memdup2(cmd_res->stdout_index,
+		                                  cmd_res->n_stdout_index * sizeof(guint32));
+		res->std_output_index_len = cmd_res->n_stdout_index;
+	} else {
+		res->std_output_len = cmd_res->n_stdout;
+		res->std_output = g_new0(gchar*, res->std_output_len + 1);
+		for (gsize i = 0; i < cmd_res->n_stdout; i++)
+			res->std_output[i] = g_strdup(cmd_res->stdout[i]);
+		res->std_output[res->std_output_len] = NULL;
+	}
+
+	if (cmd_res->has_stderr_raw) {
+		res->std_error_raw = copy_raw(&cmd_res->stderr_raw, &res->std_error_raw_len);
+		res->std_error_index = g_memdup2(cmd_res->stderr_index,
+		                                 cmd_res->n_stderr_index * sizeof(guint32));
+		res->std_error_index_len = cmd_res->n_stderr_index;
+	} else {
+		res->std_error_len = cmd_res->n_stderr;
+		res->std_error = g_new0(gchar*, res->std_error_len + 1);
+		for (gsize i = 0; i < cmd_res->n_stderr; i++)
+			res->std_error[i] = g_strdup(cmd_res->stderr[i]);
+		res->std_error[res->std_error_len] = NULL;
+	}
+
+	res->exit_status = cmd_res->ret_code;
+	res->error_message = g_strdup(cmd_res->error_message);
+	res->matches = cmd_res->matches;
+	res->spool_id = g_strdup(cmd_res->spool_id);
+	res->output_hash = g_strdup(cmd_res->output_sha256);
+	res->output_size = cmd_res->output_size;
+	if (cmd_res->aggregate)
+		res->aggregate = unpack_aggregate(cmd_res->aggregate);
+
+	if (cmd_res->n_hosts) {
+		res->hosts_len = cmd_res->n_hosts;
+		res->hosts = g_new0(gchar*, cmd_res->n_hosts + 1);
+		for (gsize i = 0; i < cmd_res->n_hosts; i++)
+			res->hosts[i] = g_strdup(cmd_res->hosts[i]);
+	}
+
+	if (cmd_res->n_stale) {
+		res->stale_len = cmd_res->n_stale;
+		res->stale = g_new0(gchar*, cmd_res->n_stale + 1);
+		for (gsize i = 0; i < cmd_res->n_stale; i++)
+			res->stale[i] = g_strdup(cmd_res->stale[i]);
+	}
+
+	// Offsets only mean anything lined up against stale
+	if (cmd_res->n_resume && cmd_res->n_resume == cmd_res->n_stale)
+		res->resume = g_memdup2(cmd_res->resume, cmd_res->n_resume * sizeof(guint64));
+}
+
+// The reply inside can't be compressed again
+__attribute__((nonnull))
+static CommandReply* inflate_reply(const CommandReply* outer) {
+	uLongf len = outer->uncompressed_size;
+	if (! len || len / WSH_PACK_MAX_RATIO > outer->compressed.len)
+		return NULL;
+
+	guint8* buf = g_malloc(len);
+	CommandReply* ret = NULL;
+	if (uncompress(buf, &len, outer->compressed.data,
+	               outer->compressed.len) == Z_OK && len == outer->uncompressed_size)
+		ret = command_reply__unpack(NULL, len, buf);
+	g_free(buf);
+
+	if (ret && ret->has_compressed) {
+		command_reply__free_unpacked(ret, NULL);
+		ret = NULL;
+	}
+
+	return ret;
 }
 
 __attribute__((nonnull))
@@ -148,29 +626,116 @@ void wsh_unpack_response(wsh_cmd_res_t** res, const guint8* buf,
 	if (!cmd_res)
 		return;
 
-	(*res)->std_output_len = cmd_res->n_stdout;
-	(*res)->std_output = g_new0(gchar*, (*res)->std_output_len + 1);
-	for (gsize i = 0; i < cmd_res->n_stdout; i++)
-		(*res)->std_output[i] = g_strdup(cmd_res->stdout[i]);
-	(*res)->std_output[(*res)->std_output_len] = NULL;
+	if (cmd_res->has_compressed) {
+		CommandReply* inner = inflate_reply(cmd_res);
+		if (inner) {
+			unpack_reply(*res, inner);
+			command_reply__free_unpacked(inner, NULL);
+		} else {
+			(*res)->error_message = g_strdup("Compressed reply arrived corrupt");
+			(*res)->exit_status = -1;
+		}
+	} else {
+		unpack_reply(*res, cmd_res);
+	}
 
-	(*res)->std_error_len = cmd_res->n_stderr;
-	(*res)->std_error = g_new0(gchar*, (*res)->std_error_len + 1);
-	for (gsize i = 0; i < cmd_res->n_stderr; i++)
-		(*res)->std_error[i] = g_strdup(cmd_res->stderr[i]);
-	(*res)->std_error[(*res)->std_error_len] = NULL;
+	command_reply__free_unpacked(cmd_res, NULL);
+}
 
-	(*res)->exit_status = cmd_res->ret_code;
-	(*res)->error_message = g_strdup(cmd_res->error_message);
+__attribute__((nonnull))
+void wsh_split_response(wsh_cmd_res_t* res) {
+	if (! res->std_output)
+		res->std_output = split_lines(res->std_output_raw, res->std_output_raw_len,
+		                              res->std_output_index, res->std_output_index_len,
+		                              &res->std_output_len);
+
+	if (! res->std_error)
+		res->std_error = split_lines(res->std_error_raw, res->std_error_raw_len,
+		                             res->std_error_index, res->std_error_index_len,
+		                             &res->std_error_len);
+}
 
-	command_reply__free_unpacked(cmd_res, NULL);
+// Raw output is hashed byte for byte. Lines, from a wshd that split them
+// itself, are joined back up with the newlines they were split at. Lengths
+// keep stdout and stderr from running into each other
+static void hash_output(GChecksum* sum, const guint8* raw, gsize raw_len,
+                        gchar** lines, gsize lines_len) {
+	guint64 len = raw_len;
+	if (! raw) {
+		len = 0;
+		for (gsize i = 0; i < lines_len; i++)
+			len += strlen(lines[i]) + 1;
+	}
+
+	guint64 be_len = GUINT64_TO_BE(len);
+	g_checksum_update(sum, (const guchar*)&be_len, sizeof(be_len));
+
+	if (raw) {
+		g_checksum_update(sum, raw, raw_len);
+		return;
+	}
+
+	for (gsize i = 0; i < lines_len; i++) {
+		g_checksum_update(sum, (const guchar*)lines[i], -1);
+		g_checksum_update(sum, (const guchar*)"\n", 1);
+	}
+}
+
+__attribute__((nonnull))
+gchar* wsh_response_hash(const wsh_cmd_res_t* res) {
+	GChecksum* sum = g_checksum_new(G_CHECKSUM_SHA256);
+
+	hash_output(sum, res->std_output_raw, res->std_output_raw_len, res->std_output,
+	            res->std_output_len);
+	hash_output(sum, res->std_error_raw, res->std_error_raw_len, res->std_error,
+	            res->std_error_len);
+
+	gint32 status = GINT32_TO_BE(res->exit_status);
+	g_checksum_update(sum, (const guchar*)&status, sizeof(status));
+
+	gchar* ret = g_strdup(g_checksum_get_string(sum));
+	g_checksum_free(sum);
+
+	return ret;
+}
+
+__attribute__((nonnull))
+gboolean wsh_response_match(wsh_cmd_res_t* res, const gchar* hash) {
+	gchar* ours = wsh_response_hash(res);
+	gboolean match = ! g_ascii_strcasecmp(ours, hash);
+	g_free(ours);
+
+	if (! match)
+		return FALSE;
+
+	g_strfreev(res->std_output);
+	g_strfreev(res->std_error);
+	g_free(res->std_output_raw);
+	g_free(res->std_error_raw);
+	res->std_output = res->std_error = NULL;
+	res->std_output_raw = res->std_error_raw = NULL;
+	res->std_output_len = res->std_error_len = 0;
+	res->std_output_raw_len = res->std_error_raw_len = 0;
+	res->matches = TRUE;
+
+	return TRUE;
 }
 
 void wsh_free_unpacked_response(wsh_cmd_res_t** res) {
 	if (!res || ! *res) return;
 	g_strfreev((*res)->std_output);
 	g_strfreev((*res)->std_error);
+	g_free((*res)->std_output_raw);
+	g_free((*res)->std_error_raw);
+	g_free((*res)->std_output_index);
+	g_free((*res)->std_error_index);
 	g_free((*res)->error_message);
+	g_free((*res)->spool_id);
+	g_free((*res)->output_hash);
+	wsh_aggregate_free(&(*res)->aggregate);
+	g_strfreev((*res)->hosts);
+	g_strfreev((*res)->stale);
+	g_free((*res)->resume);
 	g_free(*res);
 	*res = NULL;
 }
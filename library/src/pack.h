@@ -71,6 +71,24 @@ __attribute__((nonnull))
 void wsh_pack_response(guint8** buf, guint32* buf_len,
                        const wsh_cmd_res_t* res);
 
+/**
+ * @brief Packs a wsh_cmd_res_t, zlib compressing it if that's worthwhile
+ *
+ * Replies of at least a kilobyte that get smaller are compressed whole,
+ * and wsh_unpack_response() decompresses them. Only send these to clients
+ * that asked for them with compress_level.
+ *
+ * @param[out] buf The generated byte string
+ * @param[out] buf_len The length of the generated byte string
+ * @param[in] res The wsh_cmd_res_t to pack into the byte string
+ * @param[in] level zlib compression level, 0 to not compress
+ *
+ * @note buf should be freed with g_slice_free1
+ */
+__attribute__((nonnull))
+void wsh_pack_response_compressed(guint8** buf, guint32* buf_len,
+                                  const wsh_cmd_res_t* res, guint level);
+
 /**
  * @brief Unpacks a byte string into a wsh_cmd_res_t
  *
@@ -82,6 +100,47 @@ __attribute__((nonnull))
 void wsh_unpack_response(wsh_cmd_res_t** res, const guint8* buf,
                          guint32 buf_len);
 
+/**
+ * @brief Splits a result's raw output into lines
+ *
+ * Results for raw_output requests arrive with their output as it was
+ * written, and std_output and std_error left NULL until this fills them
+ * in. Lines are split on newlines alone, and keep any other whitespace.
+ * Results that already have lines are left as they are.
+ *
+ * @param[in,out] res The result to split
+ */
+__attribute__((nonnull))
+void wsh_split_response(wsh_cmd_res_t* res);
+
+/**
+ * @brief Hashes a result's output and exit status
+ *
+ * Raw output is hashed exactly as it was written, so a change to so much as
+ * its whitespace changes the hash. Lines, from a wshd that split output
+ * itself, are hashed as if each ended in a newline. Splitting a result with
+ * wsh_split_response() leaves its raw output, and its hash, as they were.
+ *
+ * @param[in] res The result to hash
+ *
+ * @returns Hex SHA-256. Free with g_free
+ */
+__attribute__((nonnull))
+gchar* wsh_response_hash(const wsh_cmd_res_t* res);
+
+/**
+ * @brief Leaves a result's output out if it's what was expected
+ *
+ * If res hashes to hash, its output is freed and matches is set.
+ *
+ * @param[in,out] res The result to check
+ * @param[in] hash Hex SHA-256 from wsh_response_hash()
+ *
+ * @returns TRUE if res matched
+ */
+__attribute__((nonnull))
+gboolean wsh_response_match(wsh_cmd_res_t* res, const gchar* hash);
+
 /**
  * @brief Free an unpacked wsh_cmd_res_t
  *
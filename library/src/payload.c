@@ -0,0 +1,302 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include "payload.h"
+
+#include <errno.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+static const gsize WSH_PAYLOAD_BUF_SIZE = 64 * 1024;
+
+// gzip rather than a raw zlib stream, so a payload can be inflated by hand
+static const gint WSH_PAYLOAD_WINDOW_BITS = 15 + 16;
+
+__attribute__((nonnull))
+static gint deflate_contents(const guint8* contents, gsize len,
+                             GByteArray* out, GError** err) {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+	                 WSH_PAYLOAD_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		*err = g_error_new(WSH_PAYLOAD_ERROR, WSH_PAYLOAD_DEFLATE_ERR,
+		                   "Can't start compressing: %s", zs.msg ? zs.msg : "unknown error");
+		return -1;
+	}
+
+	guint8 buf[WSH_PAYLOAD_BUF_SIZE];
+	gsize off = 0;
+	gint zret = Z_OK;
+	do {
+		// avail_in is only a uInt, so feed large files in pieces
+		if (zs.avail_in == 0 && off < len) {
+			gsize chunk = MIN(len - off, G_MAXUINT32);
+			zs.next_in = (Bytef*)contents + off;
+			zs.avail_in = chunk;
+			off += chunk;
+		}
+
+		zs.next_out = buf;
+		zs.avail_out = sizeof(buf);
+		zret = deflate(&zs, off == len ? Z_FINISH : Z_NO_FLUSH);
+		if (zret == Z_STREAM_ERROR) {
+			*err = g_error_new(WSH_PAYLOAD_ERROR, WSH_PAYLOAD_DEFLATE_ERR,
+			                   "Compression failed: %s", zs.msg ? zs.msg : "unknown error");
+			deflateEnd(&zs);
+			return -1;
+		}
+
+		g_byte_array_append(out, buf, sizeof(buf) - zs.avail_out);
+	} while (zret != Z_STREAM_END);
+
+	deflateEnd(&zs);
+	return 0;
+}
+
+__attribute__((nonnull))
+gint wsh_payload_new(wsh_payload_t** payload, const gchar* file,
+                     gboolean executable, GError** err) {
+	WSH_PAYLOAD_ERROR = g_quark_from_static_string("wsh_payload_error");
+
+	GMappedFile* map = NULL;
+	if ((map = g_mapped_file_new(file, FALSE, err)) == NULL)
+		return WSH_PAYLOAD_READ_ERR;
+
+	const guint8* contents = (const guint8*)g_mapped_file_get_contents(map);
+	gsize len = g_mapped_file_get_length(map);
+	gchar* base = g_path_get_basename(file);
+
+	GByteArray* out = g_byte_array_sized_new(len / 2 + 64);
+	if (deflate_contents(contents, len, out, err)) {
+		g_byte_array_free(out, TRUE);
+		g_mapped_file_unref(map);
+		g_free(base);
+		return WSH_PAYLOAD_DEFLATE_ERR;
+	}
+
+	*payload = g_slice_new0(wsh_payload_t);
+	(*payload)->size = len;
+	(*payload)->mode = (executable ? 0755 : 0644);
+
+	// Already compressed files don't get any smaller, so don't make wshd
+	// inflate them for nothing
+	if (out->len < len) {
+		(*payload)->compressed = TRUE;
+		(*payload)->name = g_strconcat(base, WSH_PAYLOAD_SUFFIX, NULL);
+		(*payload)->data = g_byte_array_free_to_bytes(out);
+		g_free(base);
+	} else {
+		(*payload)->name = base;
+		(*payload)->data = g_bytes_new(contents, len);
+		g_byte_array_free(out, TRUE);
+	}
+
+	g_mapped_file_unref(map);
+	return 0;
+}
+
+void wsh_payload_free(wsh_payload_t** payload) {
+	if (! payload || ! *payload) return;
+
+	g_free((*payload)->name);
+	g_bytes_unref((*payload)->data);
+	g_slice_free(wsh_payload_t, *payload);
+	*payload = NULL;
+}
+
+__attribute__((nonnull))
+gint wsh_payload_inflate(const gchar* path, GError** err) {
+	WSH_PAYLOAD_ERROR = g_quark_from_static_string("wsh_payload_error");
+
+	if (! g_str_has_suffix(path, WSH_PAYLOAD_SUFFIX)) {
+		*err = g_error_new(WSH_PAYLOAD_ERROR, WSH_PAYLOAD_NAME_ERR,
+		                   "%s isn't a payload", path);
+		return WSH_PAYLOAD_NAME_ERR;
+	}
+
+	struct stat st;
+	if (g_stat(path, &st)) {
+		*err = g_error_new(WSH_PAYLOAD_ERROR, WSH_PAYLOAD_READ_ERR,
+		                   "%s: %s", path, strerror(errno));
+		return WSH_PAYLOAD_READ_ERR;
+	}
+
+	gzFile in = NULL;
+	if ((in = gzopen(path, "rb")) == NULL) {
+		*err = g_error_new(WSH_PAYLOAD_ERROR, WSH_PAYLOAD_READ_ERR,
+		                   "%s: %s", path, strerror(errno));
+		return WSH_PAYLOAD_READ_ERR;
+	}
+
+	gchar* dest = g_strndup(path, strlen(path) - strlen(WSH_PAYLOAD_SUFFIX));
+	gchar* tmp = g_strconcat(dest, ".XXXXXX", NULL);
+	guint8* buf = g_malloc(WSH_PAYLOAD_BUF_SIZE);
+	gint ret = 0;
+	gint fd = -1;
+
+	// Inflate next to the destination so the rename can't cross filesystems,
+	// and nobody sees a half written file
+	if ((fd = g_mkstemp(tmp)) == -1) {
+		*err = g_error_new(WSH_PAYLOAD_ERROR, WSH_PAYLOAD_WRITE_ERR,
+		                   "%s: %s", tmp, strerror(errno));
+		ret = WSH_PAYLOAD_WRITE_ERR;
+		goto wsh_payload_inflate_err;
+	}
+
+	gint len;
+	while ((len = gzread(in, buf, WSH_PAYLOAD_BUF_SIZE)) > 0) {
+		for (gint off = 0; off < len; ) {
+			gssize w = write(fd, buf + off, len - off);
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w < 0) {
+				*err = g_error_new(WSH_PAYLOAD_ERROR, WSH_PAYLOAD_WRITE_ERR,
+				                   "%s: %s", tmp, strerror(errno));
+				ret = WSH_PAYLOAD_WRITE_ERR;
+				goto wsh_payload_inflate_err;
+			}
+			off += w;
+		}
+	}
+
+	// A truncated stream reads as a short file, with the error left in gzerror()
+	gint errnum = Z_OK;
+	const gchar* msg = gzerror(in, &errnum);
+	if (len < 0 || errnum != Z_OK) {
+		*err = g_error_new(WSH_PAYLOAD_ERROR, WSH_PAYLOAD_INFLATE_ERR,
+		                   "%s: %s", path, errnum == Z_ERRNO ? strerror(errno) : msg);
+		ret = WSH_PAYLOAD_INFLATE_ERR;
+		goto wsh_payload_inflate_err;
+	}
+
+	if (fchmod(fd, st.st_mode & 07777)) {
+		*err = g_error_new(WSH_PAYLOAD_ERROR, WSH_PAYLOAD_WRITE_ERR,
+		                   "%s: %s", tmp, strerror(errno));
+		ret = WSH_PAYLOAD_WRITE_ERR;
+		goto wsh_payload_inflate_err;
+	}
+
+	gint close_ret = close(fd);
+	fd = -1;
+	if (close_ret) {
+		*err = g_error_new(WSH_PAYLOAD_ERROR, WSH_PAYLOAD_WRITE_ERR,
+		                   "%s: %s", tmp, strerror(errno));
+		ret = WSH_PAYLOAD_WRITE_ERR;
+		goto wsh_payload_inflate_err;
+	}
+
+	if (g_rename(tmp, dest)) {
+		*err = g_error_new(WSH_PAYLOAD_ERROR, WSH_PAYLOAD_WRITE_ERR,
+		                   "%s: %s", dest, strerror(errno));
+		ret = WSH_PAYLOAD_WRITE_ERR;
+		goto wsh_payload_inflate_err;
+	}
+
+	gzclose(in);
+	(void) g_unlink(path);
+	g_free(buf);
+	g_free(tmp);
+	g_free(dest);
+	return 0;
+
+wsh_payload_inflate_err:
+	if (fd != -1)
+		close(fd);
+	(void) g_unlink(tmp);
+	gzclose(in);
+	g_free(buf);
+	g_free(tmp);
+	g_free(dest);
+	return ret;
+}
+
+__attribute__((nonnull(1, 4, 5)))
+gint wsh_payload_write_script(const gchar* name, const guint8* data, gsize len,
+                              gchar** path, GError** err) {
+	WSH_PAYLOAD_ERROR = g_quark_from_static_string("wsh_payload_error");
+
+	if (! *name || strchr(name, '/') || ! strcmp(name, ".") || ! strcmp(name, "..")) {
+		*err = g_error_new(WSH_PAYLOAD_ERROR, WSH_PAYLOAD_SCRIPT_ERR,
+		                   "%s isn't a valid script name", name);
+		return WSH_PAYLOAD_SCRIPT_ERR;
+	}
+
+	// mkdtemp() makes the directory 0700, so nobody can swap the script out
+	// from under us before it runs
+	gchar* dir = g_build_filename(g_get_tmp_dir(), "wsh-XXXXXX", NULL);
+	if (mkdtemp(dir) == NULL) {
+		*err = g_error_new(WSH_PAYLOAD_ERROR, WSH_PAYLOAD_WRITE_ERR,
+		                   "%s: %s", dir, strerror(errno));
+		g_free(dir);
+		return WSH_PAYLOAD_WRITE_ERR;
+	}
+
+	gint ret = 0;
+	gchar* file = g_build_filename(dir, name, NULL);
+	if (! g_file_set_contents(file, (const gchar*)data, len, err)) {
+		ret = WSH_PAYLOAD_WRITE_ERR;
+		goto wsh_payload_write_script_err;
+	}
+
+	if (g_str_has_suffix(file, WSH_PAYLOAD_SUFFIX)) {
+		if ((ret = wsh_payload_inflate(file, err)))
+			goto wsh_payload_write_script_err;
+		file[strlen(file) - strlen(WSH_PAYLOAD_SUFFIX)] = '\0';
+	}
+
+	if (g_chmod(file, 0700)) {
+		*err = g_error_new(WSH_PAYLOAD_ERROR, WSH_PAYLOAD_WRITE_ERR,
+		                   "%s: %s", file, strerror(errno));
+		ret = WSH_PAYLOAD_WRITE_ERR;
+		goto wsh_payload_write_script_err;
+	}
+
+	g_free(dir);
+	*path = file;
+	return 0;
+
+wsh_payload_write_script_err:
+	wsh_payload_remove_script(&file);
+	g_free(dir);
+	return ret;
+}
+
+void wsh_payload_remove_script(gchar** path) {
+	if (! path || ! *path) return;
+
+	gchar* dir = g_path_get_dirname(*path);
+	(void) g_unlink(*path);
+	// Whatever a failed inflate left behind
+	gchar* payload = g_strconcat(*path, WSH_PAYLOAD_SUFFIX, NULL);
+	(void) g_unlink(payload);
+	(void) g_rmdir(dir);
+
+	g_free(payload);
+	g_free(dir);
+	g_free(*path);
+	*path = NULL;
+}
@@ -0,0 +1,125 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/** @file
+ * @brief Files compressed once and sent to many hosts
+ *
+ * The client gzips a file once and pushes the same compressed bytes to
+ * every host, named with WSH_PAYLOAD_SUFFIX. wshd inflates it back into
+ * place before it runs anything.
+ */
+#ifndef __WSH_PAYLOAD_H
+#define __WSH_PAYLOAD_H
+
+#include <glib.h>
+
+/** GQuark for payload errors */
+GQuark WSH_PAYLOAD_ERROR;
+
+/** Payload errors */
+typedef enum {
+	WSH_PAYLOAD_READ_ERR,		/**< Can't read the file */
+	WSH_PAYLOAD_DEFLATE_ERR,	/**< zlib failed compressing */
+	WSH_PAYLOAD_INFLATE_ERR,	/**< Payload is corrupt or truncated */
+	WSH_PAYLOAD_WRITE_ERR,		/**< Can't write the inflated file */
+	WSH_PAYLOAD_NAME_ERR,		/**< Path doesn't end in WSH_PAYLOAD_SUFFIX */
+	WSH_PAYLOAD_SCRIPT_ERR,		/**< Script name isn't a plain file name */
+} wsh_payload_err_enum;
+
+/** Appended to the name of a compressed payload on the remote host */
+#define WSH_PAYLOAD_SUFFIX ".wshz"
+
+/** A file ready to send to any number of hosts */
+typedef struct {
+	gchar* name;		/**< name to send the file as, suffix included if compressed */
+	GBytes* data;		/**< bytes to send */
+	gsize size;			/**< size of the original file */
+	gint mode;			/**< mode of the file on the remote host */
+	gboolean compressed;	/**< data is gzipped, and needs inflating remotely */
+} wsh_payload_t;
+
+/**
+ * @brief Reads and compresses a file
+ *
+ * If compressing doesn't make the file any smaller, the payload holds the
+ * file as it is and compressed is FALSE.
+ *
+ * @param[out] payload The new payload. Free with wsh_payload_free
+ * @param[in] file Regular file to read
+ * @param[in] executable Should the file be executable on the remote host?
+ * @param[out] err GError describing the failure
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_payload_new(wsh_payload_t** payload, const gchar* file,
+                     gboolean executable, GError** err);
+
+/**
+ * @brief Frees a payload
+ *
+ * @param[in,out] payload Payload to free, is set to NULL
+ */
+void wsh_payload_free(wsh_payload_t** payload);
+
+/**
+ * @brief Inflates a payload that's landed on this host
+ *
+ * The inflated file replaces path with WSH_PAYLOAD_SUFFIX removed, with the
+ * same mode as path, and path is removed.
+ *
+ * @param[in] path Path of the compressed payload
+ * @param[out] err GError describing the failure
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_payload_inflate(const gchar* path, GError** err);
+
+/**
+ * @brief Writes a script sent inside a request where only we can run it
+ *
+ * The script lands in a new directory under g_get_tmp_dir() that only this
+ * user can enter, with WSH_PAYLOAD_SUFFIX removed from its name after it's
+ * inflated.
+ *
+ * @param[in] name File name to give the script, without any directories
+ * @param[in] data Contents of the script, gzipped if name ends in
+ * WSH_PAYLOAD_SUFFIX
+ * @param[in] len Length of data
+ * @param[out] path Where the script was written. Remove with
+ * wsh_payload_remove_script
+ * @param[out] err GError describing the failure
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull(1, 4, 5)))
+gint wsh_payload_write_script(const gchar* name, const guint8* data, gsize len,
+                              gchar** path, GError** err);
+
+/**
+ * @brief Removes a script and the directory wsh_payload_write_script made
+ * for it
+ *
+ * @param[in,out] path Path of the script, is freed and set to NULL
+ */
+void wsh_payload_remove_script(gchar** path);
+
+#endif
@@ -0,0 +1,357 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include "relay.h"
+
+#include <glib.h>
+#include <string.h>
+
+#include "aggregate.h"
+#include "cmd.h"
+#include "pack.h"
+#include "sftp.h"
+#include "ssh.h"
+#include "types.h"
+
+/* Everything identical to res, and who said it */
+typedef struct {
+	wsh_cmd_res_t* res;
+	GPtrArray* hosts;
+} group_t;
+
+guint wsh_relay_distribute_depth(gsize num_hosts) {
+	guint depth = 1;
+	for (gsize shard = num_hosts; shard > WSH_RELAY_DISTRIBUTE_FANOUT; depth++)
+		shard = (shard + WSH_RELAY_DISTRIBUTE_FANOUT - 1) / WSH_RELAY_DISTRIBUTE_FANOUT;
+
+	return depth;
+}
+
+__attribute__((nonnull))
+gchar*** wsh_relay_split(gchar** hosts, gsize num_hosts, gsize parts) {
+	parts = MIN(parts, num_hosts);
+
+	gchar*** shards = g_new0(gchar**, parts + 1);
+	gsize off = 0;
+
+	for (gsize i = 0; i < parts; i++) {
+		gsize len = num_hosts / parts + (i < num_hosts % parts ? 1 : 0);
+
+		shards[i] = g_new0(gchar*, len + 1);
+		for (gsize j = 0; j < len; j++)
+			shards[i][j] = g_strdup(hosts[off + j]);
+		off += len;
+	}
+
+	return shards;
+}
+
+void wsh_relay_free_shards(gchar*** shards) {
+	if (! shards) return;
+
+	for (gchar*** shard = shards; *shard; shard++)
+		g_strfreev(*shard);
+	g_free(shards);
+}
+
+static void free_group(group_t* group) {
+	wsh_free_unpacked_response(&group->res);
+	if (group->hosts)
+		g_ptr_array_free(group->hosts, TRUE);
+	g_slice_free(group_t, group);
+}
+
+__attribute__((nonnull))
+void wsh_relay_merge_init(wsh_relay_merge_t** merge) {
+	*merge = g_slice_new0(wsh_relay_merge_t);
+	(*merge)->groups = g_hash_table_new_full(g_bytes_hash, g_bytes_equal,
+	                   (GDestroyNotify)g_bytes_unref,
+	                   (GDestroyNotify)free_group);
+}
+
+__attribute__((nonnull))
+void wsh_relay_merge_add(wsh_relay_merge_t* merge, const wsh_cmd_res_t* res) {
+	// Results are identical if they pack identically, ignoring who sent them
+	// and their aggregates, which merge. A host that matched the expected
+	// output never merges with one that sent the same output in full, and
+	// summaries stay apart, as each is fetched from its own host's spool
+	wsh_cmd_res_t anon = *res;
+	anon.hosts = NULL;
+	anon.hosts_len = 0;
+	anon.aggregate = NULL;
+
+	guint8* buf = NULL;
+	guint32 buf_len = 0;
+	wsh_pack_response(&buf, &buf_len, &anon);
+	GBytes* key = g_bytes_new(buf, buf_len);
+	g_slice_free1(buf_len, buf);
+
+	group_t* group = g_hash_table_lookup(merge->groups, key);
+	if (group) {
+		g_bytes_unref(key);
+	} else {
+		group = g_slice_new0(group_t);
+		group->hosts = g_ptr_array_new_with_free_func(g_free);
+		group->res = g_new0(wsh_cmd_res_t, 1);
+		group->res->std_output = g_strdupv(res->std_output);
+		group->res->std_output_len = res->std_output_len;
+		group->res->std_error = g_strdupv(res->std_error);
+		group->res->std_error_len = res->std_error_len;
+		group->res->std_output_raw = g_memdup2(res->std_output_raw,
+		                                       res->std_output_raw_len);
+		group->res->std_output_raw_len = res->std_output_raw_len;
+		group->res->std_error_raw = g_memdup2(res->std_error_raw,
+		                                      res->std_error_raw_len);
+		group->res->std_error_raw_len = res->std_error_raw_len;
+		group->res->exit_status = res->exit_status;
+		group->res->error_message = g_strdup(res->error_message);
+		group->res->matches = res->matches;
+		group->res->spool_id = g_strdup(res->spool_id);
+		group->res->output_hash = g_strdup(res->output_hash);
+		group->res->output_size = res->output_size;
+
+		g_hash_table_insert(merge->groups, key, group);
+	}
+
+	if (res->aggregate) {
+		if (! group->res->aggregate)
+			wsh_aggregate_new(&group->res->aggregate, res->aggregate->op);
+		wsh_aggregate_merge(group->res->aggregate, res->aggregate);
+	}
+
+	for (gsize i = 0; i < res->hosts_len; i++)
+		g_ptr_array_add(group->hosts, g_strdup(res->hosts[i]));
+	merge->num_hosts += res->hosts_len;
+}
+
+__attribute__((nonnull))
+GPtrArray* wsh_relay_merge_take(wsh_relay_merge_t* merge) {
+	GPtrArray* ret = g_ptr_array_sized_new(g_hash_table_size(merge->groups));
+	GHashTableIter iter;
+	group_t* group;
+
+	g_hash_table_iter_init(&iter, merge->groups);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&group)) {
+		group->res->hosts_len = group->hosts->len;
+		g_ptr_array_add(group->hosts, NULL);
+		group->res->hosts = (gchar**)g_ptr_array_free(group->hosts, FALSE);
+		group->hosts = NULL;
+
+		g_ptr_array_add(ret, group->res);
+		group->res = NULL;
+	}
+
+	g_hash_table_remove_all(merge->groups);
+	merge->num_hosts = 0;
+
+	return ret;
+}
+
+void wsh_relay_merge_free(wsh_relay_merge_t** merge) {
+	if (! merge || ! *merge) return;
+
+	g_hash_table_destroy((*merge)->groups);
+	g_slice_free(wsh_relay_merge_t, *merge);
+	*merge = NULL;
+}
+
+// Hands res to cb, minus any hosts that already had a result
+__attribute__((nonnull))
+static void report(GHashTable* pending, wsh_cmd_res_t* res,
+                   wsh_relay_result_fn cb, gpointer user_data) {
+	gchar** all = res->hosts;
+	gsize all_len = res->hosts_len;
+	gchar** fresh = g_new0(gchar*, all_len + 1);
+	gsize fresh_len = 0;
+
+	for (gsize i = 0; i < all_len; i++) {
+		if (g_hash_table_remove(pending, all[i]))
+			fresh[fresh_len++] = all[i];
+	}
+
+	if (fresh_len) {
+		res->hosts = fresh;
+		res->hosts_len = fresh_len;
+		cb(res, user_data);
+		res->hosts = all;
+		res->hosts_len = all_len;
+	}
+
+	g_free(fresh);
+}
+
+__attribute__((nonnull))
+static void report_failure(GHashTable* pending, const gchar* msg,
+                           wsh_relay_result_fn cb, gpointer user_data) {
+	if (! g_hash_table_size(pending))
+		return;
+
+	wsh_cmd_res_t res = {
+		.error_message = (gchar*)msg,
+		.exit_status = -1,
+		.hosts = g_new0(gchar*, g_hash_table_size(pending) + 1),
+	};
+
+	GHashTableIter iter;
+	gpointer host;
+	g_hash_table_iter_init(&iter, pending);
+	while (g_hash_table_iter_next(&iter, &host, NULL))
+		res.hosts[res.hosts_len++] = host;
+
+	// report() empties pending, so it can't free the keys under us
+	report(pending, &res, cb, user_data);
+	g_free(res.hosts);
+}
+
+// Pushes the files the host doesn't have identical copies of yet
+__attribute__((nonnull))
+static gint distribute(wsh_ssh_session_t* session, const wsh_cmd_req_t* req,
+                       GError** err) {
+	wsh_cmd_req_t check = {
+		.cmd_string = "",
+		.username = req->username,
+		.host = req->host,
+		.cwd = req->cwd,
+		.manifest = req->distribute,
+		.manifest_len = req->distribute_len,
+	};
+	wsh_cmd_res_t* res = NULL;
+	gint ret = 0;
+
+	if ((ret = wsh_ssh_exec_wshd(session, err)) ||
+	        (ret = wsh_ssh_send_cmd(session, &check, err)) ||
+	        (ret = wsh_ssh_recv_cmd_res(session, &res, err)))
+		return ret;
+
+	if (res->error_message) {
+		*err = g_error_new(WSH_RELAY_ERROR, WSH_RELAY_DISTRIBUTE_ERR, "%s",
+		                   res->error_message);
+		wsh_free_unpacked_response(&res);
+		return WSH_RELAY_DISTRIBUTE_ERR;
+	}
+
+	GHashTable* stale = g_hash_table_new(g_str_hash, g_str_equal);
+	for (gsize i = 0; i < res->stale_len; i++)
+		g_hash_table_add(stale, res->stale[i]);
+
+	GPtrArray* entries = g_ptr_array_new();
+	for (gsize i = 0; i < req->distribute_len; i++) {
+		if (g_hash_table_contains(stale, req->distribute[i].path))
+			g_ptr_array_add(entries, &req->distribute[i]);
+	}
+
+	if (entries->len) {
+		wsh_sftp_t* sftp = NULL;
+		if (! (ret = wsh_sftp_new(&sftp, session, err))) {
+			ret = wsh_sftp_push(sftp, req->cwd ? req->cwd : "",
+			                    (const wsh_manifest_entry_t**)entries->pdata,
+			                    entries->len, NULL, 0, err);
+			wsh_sftp_free(&sftp);
+		}
+	}
+
+	g_ptr_array_free(entries, TRUE);
+	g_hash_table_destroy(stale);
+	wsh_free_unpacked_response(&res);
+	return ret;
+}
+
+__attribute__((nonnull (1, 2, 3, 5)))
+gint wsh_relay_host(wsh_ssh_session_t* session, const wsh_cmd_req_t* req,
+                    wsh_relay_result_fn cb, gpointer user_data, GError** err) {
+	WSH_RELAY_ERROR = g_quark_from_static_string("wsh_relay_error");
+
+	gboolean relay = (req->relay_hosts_len != 0);
+	wsh_cmd_res_t* res = NULL;
+	gint ret = 0;
+
+	// Keys are borrowed from req and session
+	GHashTable* pending = g_hash_table_new(g_str_hash, g_str_equal);
+	if (relay) {
+		for (gsize i = 0; i < req->relay_hosts_len; i++)
+			g_hash_table_add(pending, req->relay_hosts[i]);
+	} else {
+		g_hash_table_add(pending, (gpointer)session->hostname);
+	}
+
+	if ((ret = wsh_ssh_host(session, err)))
+		goto wsh_relay_host_err;
+	if ((ret = wsh_verify_host_key(session, FALSE, FALSE, err)))
+		goto wsh_relay_host_err;
+	if ((ret = wsh_ssh_authenticate(session, err)))
+		goto wsh_relay_host_err;
+	if (req->distribute_len && (ret = distribute(session, req, err)))
+		goto wsh_relay_host_err;
+	if ((ret = wsh_ssh_exec_wshd(session, err)))
+		goto wsh_relay_host_err;
+	if ((ret = wsh_ssh_send_cmd(session, req, err)))
+		goto wsh_relay_host_err;
+
+	if (relay) {
+		do {
+			res = NULL;
+			if ((ret = wsh_ssh_recv_relay_res(session, &res, err)))
+				goto wsh_relay_host_err;
+
+			if (res) {
+				report(pending, res, cb, user_data);
+				wsh_free_unpacked_response(&res);
+			}
+		} while (res);
+	} else {
+		if ((ret = wsh_ssh_recv_cmd_res(session, &res, err)))
+			goto wsh_relay_host_err;
+
+		gchar* hosts[] = { (gchar*)session->hostname, NULL };
+		res->hosts = hosts;
+		res->hosts_len = 1;
+		report(pending, res, cb, user_data);
+		res->hosts = NULL;
+		wsh_free_unpacked_response(&res);
+	}
+
+	wsh_ssh_disconnect(session);
+
+	// A relay that forgets hosts is as good as one that failed on them
+	gchar* msg = g_strdup_printf("relay %s sent no result", session->hostname);
+	report_failure(pending, msg, cb, user_data);
+	g_free(msg);
+
+	g_hash_table_destroy(pending);
+	return 0;
+
+wsh_relay_host_err:
+	if (session->session)
+		wsh_ssh_disconnect(session);
+
+	if (relay) {
+		gchar* msg = g_strdup_printf("relay %s: %s", session->hostname,
+		                             (*err)->message);
+		report_failure(pending, msg, cb, user_data);
+		g_free(msg);
+	} else {
+		report_failure(pending, (*err)->message, cb, user_data);
+	}
+
+	g_hash_table_destroy(pending);
+	return ret;
+}
+
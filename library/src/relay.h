@@ -0,0 +1,153 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/** @file
+ * @brief Fanning out through relaying wshd instances
+ *
+ * A relay is a wshd whose request carries a list of hosts. It runs the
+ * command on those hosts instead of itself, possibly through relays of its
+ * own, and streams back replies merged by content, each naming the hosts
+ * that produced it.
+ *
+ * A request can also carry files to distribute. Each host is sent whatever
+ * it's missing of them before it gets the request, so relays pass files on
+ * tier by tier rather than the client sending every copy.
+ */
+#ifndef __WSH_RELAY_H
+#define __WSH_RELAY_H
+
+#include <glib.h>
+
+#include "cmd.h"
+#include "ssh.h"
+
+/** GQuark for relay errors */
+GQuark WSH_RELAY_ERROR;
+
+/** Relay errors */
+typedef enum {
+	WSH_RELAY_DISTRIBUTE_ERR,	/**< Host wouldn't say which files it's missing */
+} wsh_relay_err_enum;
+
+/** Hosts each relay passes distributed files on to, per level of relays */
+#define WSH_RELAY_DISTRIBUTE_FANOUT 4
+
+/**
+ * @brief Relay depth a distribution to this many hosts needs
+ *
+ * Enough levels that no relay sends to more than
+ * WSH_RELAY_DISTRIBUTE_FANOUT hosts itself.
+ *
+ * @param[in] num_hosts Hosts a seed is responsible for
+ *
+ * @returns The depth, at least 1
+ */
+guint wsh_relay_distribute_depth(gsize num_hosts);
+
+/** Called once per result, with res->hosts saying where it came from */
+typedef void (*wsh_relay_result_fn)(const wsh_cmd_res_t* res, gpointer user_data);
+
+/** Identical results, collected until someone takes them */
+typedef struct {
+	GHashTable* groups;		/**< packed result -> merged wsh_cmd_res_t */
+	gsize num_hosts;		/**< hosts across all groups */
+} wsh_relay_merge_t;
+
+/**
+ * @brief Splits a host list into contiguous, nearly equal shards
+ *
+ * @param[in] hosts Hosts to split
+ * @param[in] num_hosts Length of hosts
+ * @param[in] parts How many shards to make. Fewer come back if there aren't
+ * enough hosts
+ *
+ * @returns NULL terminated array of NULL terminated shards. Free with
+ * wsh_relay_free_shards
+ */
+__attribute__((nonnull))
+gchar*** wsh_relay_split(gchar** hosts, gsize num_hosts, gsize parts);
+
+/**
+ * @brief Frees shards from wsh_relay_split
+ *
+ * @param[in] shards Shards to free
+ */
+void wsh_relay_free_shards(gchar*** shards);
+
+/**
+ * @brief Makes an empty merge
+ *
+ * @param[out] merge The new merge. Free with wsh_relay_merge_free
+ */
+__attribute__((nonnull))
+void wsh_relay_merge_init(wsh_relay_merge_t** merge);
+
+/**
+ * @brief Adds a result, folding it into an identical one if we have it
+ *
+ * @param[in] merge The merge
+ * @param[in] res Result to add. res->hosts must be set
+ */
+__attribute__((nonnull))
+void wsh_relay_merge_add(wsh_relay_merge_t* merge, const wsh_cmd_res_t* res);
+
+/**
+ * @brief Takes everything merged so far, leaving the merge empty
+ *
+ * @param[in] merge The merge
+ *
+ * @returns Merged results, free each with wsh_free_unpacked_response
+ */
+__attribute__((nonnull))
+GPtrArray* wsh_relay_merge_take(wsh_relay_merge_t* merge);
+
+/**
+ * @brief Frees a merge and anything left in it
+ *
+ * @param[in,out] merge The merge to free, is set to NULL
+ */
+void wsh_relay_merge_free(wsh_relay_merge_t** merge);
+
+/**
+ * @brief Runs a request on one host, which may itself be a relay
+ *
+ * Every host the request covers gets exactly one result passed to cb. If
+ * the host fails, hosts that haven't got one yet get a result whose
+ * error_message says why.
+ *
+ * If the request has files to distribute, the host is asked which of them
+ * it's missing first, and those are pushed to it over sftp from each
+ * entry's local path.
+ *
+ * @param[in] session Session with hostname, username, port and auth filled in
+ * @param[in] req Request to send. If it has relay_hosts, results come from
+ * them, otherwise from the host itself
+ * @param[in] cb Called with each result
+ * @param[in] user_data Passed to cb
+ * @param[out] err GError describing why the host itself failed
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull (1, 2, 3, 5)))
+gint wsh_relay_host(wsh_ssh_session_t* session, const wsh_cmd_req_t* req,
+                    wsh_relay_result_fn cb, gpointer user_data, GError** err);
+
+#endif
+
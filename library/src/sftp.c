@@ -0,0 +1,307 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include "sftp.h"
+
+#include <fcntl.h>
+#include <glib.h>
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "payload.h"
+#include "ssh.h"
+#include "throttle.h"
+#include "types.h"
+
+/* A remote file with writes still in flight */
+typedef struct {
+	sftp_file file;
+	GMappedFile* map;	// NULL for payloads
+	gchar* path;
+	guint pending;		// writes sent, but not yet acked
+	gboolean issued;	// every write for the file has been sent
+} push_file_t;
+
+/* One outstanding write */
+typedef struct {
+#ifdef HAVE_SFTP_AIO_BEGIN_WRITE
+	sftp_aio aio;
+#endif
+	push_file_t* file;
+} push_req_t;
+
+// Only the first failure is reported, the rest are just cleaned up after
+__attribute__((format (printf, 3, 4)))
+static void set_error(GError** err, gint code, const gchar* format, ...) {
+	if (*err) return;
+
+	va_list args;
+	va_start(args, format);
+	*err = g_error_new_valist(WSH_SFTP_ERROR, code, format, args);
+	va_end(args);
+}
+
+__attribute__((nonnull))
+gint wsh_sftp_new(wsh_sftp_t** sftp, wsh_ssh_session_t* session, GError** err) {
+	WSH_SFTP_ERROR = g_quark_from_static_string("wsh_sftp_error");
+
+	sftp_session sess = NULL;
+	if ((sess = sftp_new(session->session)) == NULL) {
+		*err = g_error_new(WSH_SFTP_ERROR, WSH_SFTP_INIT_ERR,
+		                   "%s: Can't start sftp: %s", session->hostname,
+		                   ssh_get_error(session->session));
+		return WSH_SFTP_INIT_ERR;
+	}
+
+	if (sftp_init(sess)) {
+		*err = g_error_new(WSH_SFTP_ERROR, WSH_SFTP_INIT_ERR,
+		                   "%s: Can't start sftp: %s", session->hostname,
+		                   ssh_get_error(session->session));
+		sftp_free(sess);
+		return WSH_SFTP_INIT_ERR;
+	}
+
+	*sftp = g_slice_new0(wsh_sftp_t);
+	(*sftp)->sftp = sess;
+	(*sftp)->session = session->session;
+	(*sftp)->dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	(*sftp)->throttle = session->throttle;
+	(*sftp)->host_throttle = session->host_throttle;
+
+	return 0;
+}
+
+void wsh_sftp_free(wsh_sftp_t** sftp) {
+	if (! sftp || ! *sftp) return;
+
+	sftp_free((*sftp)->sftp);
+	g_hash_table_destroy((*sftp)->dirs);
+	g_slice_free(wsh_sftp_t, *sftp);
+	*sftp = NULL;
+}
+
+// Makes every missing directory between root and path's basename
+__attribute__((nonnull))
+static gint make_parents(wsh_sftp_t* sftp, const gchar* root, const gchar* path,
+                         GError** err) {
+	gchar** parts = g_strsplit(path, "/", 0);
+	guint depth = g_strv_length(parts) - 1;
+	gchar* dir = g_strdup(root);
+	gint ret = 0;
+
+	for (guint i = 0; i < depth && ! ret; i++) {
+		gchar* next = g_build_filename(dir, parts[i], NULL);
+		g_free(dir);
+		dir = next;
+
+		if (g_hash_table_contains(sftp->dirs, dir))
+			continue;
+
+		// OpenSSH answers a plain failure for a directory that's there
+		if (sftp_mkdir(sftp->sftp, dir, 0755)) {
+			gint code = sftp_get_error(sftp->sftp);
+			if (code != SSH_FX_FILE_ALREADY_EXISTS && code != SSH_FX_FAILURE) {
+				set_error(err, WSH_SFTP_DIR_ERR, "Can't make directory %s: %s", dir,
+				          ssh_get_error(sftp->session));
+				ret = WSH_SFTP_DIR_ERR;
+				continue;
+			}
+		}
+
+		g_hash_table_add(sftp->dirs, g_strdup(dir));
+	}
+
+	g_free(dir);
+	g_strfreev(parts);
+	return ret;
+}
+
+__attribute__((nonnull))
+static void finish_file(push_file_t* file, GError** err) {
+	if (sftp_close(file->file))
+		set_error(err, WSH_SFTP_WRITE_ERR, "Can't close %s", file->path);
+
+	if (file->map)
+		g_mapped_file_unref(file->map);
+	g_free(file->path);
+	g_slice_free(push_file_t, file);
+}
+
+#ifdef HAVE_SFTP_AIO_BEGIN_WRITE
+// Waits for the oldest write, closing its file if that was its last one
+__attribute__((nonnull))
+static gint wait_oldest(wsh_sftp_t* sftp, GQueue* inflight, GError** err) {
+	push_req_t* req = g_queue_pop_head(inflight);
+	push_file_t* file = req->file;
+	gint ret = 0;
+
+	if (sftp_aio_wait_write(&req->aio) < 0) {
+		set_error(err, WSH_SFTP_WRITE_ERR, "Can't write %s: %s", file->path,
+		          ssh_get_error(sftp->session));
+		ret = WSH_SFTP_WRITE_ERR;
+	}
+	sftp_aio_free(req->aio);
+	g_slice_free(push_req_t, req);
+
+	if (--file->pending == 0 && file->issued)
+		finish_file(file, err);
+
+	return ret;
+}
+#endif
+
+// Queues up every write for a file, waiting on old ones to make room
+__attribute__((nonnull (1, 2, 3, 6)))
+static gint write_file(wsh_sftp_t* sftp, GQueue* inflight, push_file_t* file,
+                       const guint8* buf, gsize len, GError** err) {
+	gint ret = 0;
+
+	for (gsize off = 0; off < len && ! ret; off += WSH_SFTP_CHUNK_SIZE) {
+		gsize chunk = MIN(WSH_SFTP_CHUNK_SIZE, len - off);
+
+		wsh_throttle_take(sftp->throttle, chunk);
+		wsh_throttle_take(sftp->host_throttle, chunk);
+
+#ifdef HAVE_SFTP_AIO_BEGIN_WRITE
+		if (g_queue_get_length(inflight) >= WSH_SFTP_MAX_REQUESTS &&
+		        (ret = wait_oldest(sftp, inflight, err)))
+			break;
+
+		push_req_t* req = g_slice_new0(push_req_t);
+		req->file = file;
+		if (sftp_aio_begin_write(file->file, buf + off, chunk, &req->aio) < 0) {
+			set_error(err, WSH_SFTP_WRITE_ERR, "Can't write %s: %s", file->path,
+			          ssh_get_error(sftp->session));
+			g_slice_free(push_req_t, req);
+			ret = WSH_SFTP_WRITE_ERR;
+			break;
+		}
+
+		file->pending++;
+		g_queue_push_tail(inflight, req);
+#else
+		// Without aio, libssh waits on each write before the next
+		if (sftp_write(file->file, buf + off, chunk) != (gssize)chunk) {
+			set_error(err, WSH_SFTP_WRITE_ERR, "Can't write %s: %s", file->path,
+			          ssh_get_error(sftp->session));
+			ret = WSH_SFTP_WRITE_ERR;
+		}
+#endif
+	}
+
+	file->issued = TRUE;
+	if (file->pending == 0)
+		finish_file(file, err);
+
+	return ret;
+}
+
+__attribute__((nonnull (1, 2, 3, 4, 8)))
+static gint push_one(wsh_sftp_t* sftp, GQueue* inflight, const gchar* root,
+                     const gchar* path, GMappedFile* map, guint64 offset,
+                     const wsh_payload_t* payload, GError** err) {
+	gint ret = 0;
+	if ((ret = make_parents(sftp, root, path, err))) {
+		if (map) g_mapped_file_unref(map);
+		return ret;
+	}
+
+	gchar* remote = g_build_filename(root, path, NULL);
+	gint mode = payload ? payload->mode : 0644;
+
+	sftp_file handle = NULL;
+	if ((handle = sftp_open(sftp->sftp, remote, O_WRONLY|O_CREAT|O_TRUNC, mode)) == NULL) {
+		set_error(err, WSH_SFTP_OPEN_ERR, "Can't open %s: %s", remote,
+		          ssh_get_error(sftp->session));
+		if (map) g_mapped_file_unref(map);
+		g_free(remote);
+		return WSH_SFTP_OPEN_ERR;
+	}
+
+	push_file_t* file = g_slice_new0(push_file_t);
+	file->file = handle;
+	file->map = map;
+	file->path = remote;
+
+	const guint8* buf = NULL;
+	gsize len = 0;
+	if (map) {
+		// Resumed files only send what the host doesn't have yet
+		buf = (const guint8*)g_mapped_file_get_contents(map) + offset;
+		len = g_mapped_file_get_length(map) - offset;
+	} else {
+		buf = g_bytes_get_data(payload->data, &len);
+	}
+
+	return write_file(sftp, inflight, file, buf, len, err);
+}
+
+__attribute__((nonnull (1, 2, 7)))
+gint wsh_sftp_push(wsh_sftp_t* sftp, const gchar* root,
+                   const wsh_manifest_entry_t** entries, gsize num_entries,
+                   const wsh_payload_t** payloads, gsize num_payloads,
+                   GError** err) {
+	WSH_SFTP_ERROR = g_quark_from_static_string("wsh_sftp_error");
+	g_assert(*err == NULL);
+
+	GQueue* inflight = g_queue_new();
+	gint ret = 0;
+
+	// Opening a file is a round trip of its own, but writes for the files
+	// before it stay in flight while we wait on it
+	for (gsize i = 0; i < num_payloads && ! ret; i++)
+		ret = push_one(sftp, inflight, root, payloads[i]->name, NULL, 0, payloads[i], err);
+
+	for (gsize i = 0; i < num_entries && ! ret; i++) {
+		GMappedFile* map = NULL;
+		GError* map_err = NULL;
+		if ((map = g_mapped_file_new(entries[i]->local, FALSE, &map_err)) == NULL) {
+			set_error(err, WSH_SFTP_READ_ERR, "%s", map_err->message);
+			g_error_free(map_err);
+			ret = WSH_SFTP_READ_ERR;
+			break;
+		}
+
+		if (entries[i]->offset > g_mapped_file_get_length(map)) {
+			set_error(err, WSH_SFTP_READ_ERR, "%s changed while it was being sent",
+			          entries[i]->local);
+			g_mapped_file_unref(map);
+			ret = WSH_SFTP_READ_ERR;
+			break;
+		}
+
+		ret = push_one(sftp, inflight, root, entries[i]->path, map,
+		               entries[i]->offset, NULL, err);
+	}
+
+#ifdef HAVE_SFTP_AIO_BEGIN_WRITE
+	// Every write gets waited on, even after a failure, so every file closes
+	while (! g_queue_is_empty(inflight)) {
+		gint wait_ret = wait_oldest(sftp, inflight, err);
+		if (! ret) ret = wait_ret;
+	}
+#endif
+
+	g_queue_free(inflight);
+	return ret;
+}
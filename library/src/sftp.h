@@ -0,0 +1,112 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/** @file
+ * @brief Pushing files over SFTP, many requests at a time
+ *
+ * SCP waits on every file and every chunk before it sends the next one.
+ * SFTP lets us keep WSH_SFTP_MAX_REQUESTS writes outstanding on a session,
+ * spread across however many files they belong to, so one round trip is
+ * paid per window rather than per chunk.
+ */
+#ifndef __WSH_SFTP_H
+#define __WSH_SFTP_H
+
+#include <glib.h>
+#include <libssh/sftp.h>
+
+#include "payload.h"
+#include "ssh.h"
+#include "types.h"
+
+/** GQuark for sftp errors */
+GQuark WSH_SFTP_ERROR;
+
+/** SFTP errors */
+typedef enum {
+	WSH_SFTP_INIT_ERR,		/**< Host has no sftp subsystem */
+	WSH_SFTP_READ_ERR,		/**< Can't read a local file */
+	WSH_SFTP_DIR_ERR,		/**< Can't make a remote directory */
+	WSH_SFTP_OPEN_ERR,		/**< Can't open a remote file */
+	WSH_SFTP_WRITE_ERR,		/**< Remote write failed */
+} wsh_sftp_err_enum;
+
+/** Bytes sent per write request. Every server takes at least this much */
+#define WSH_SFTP_CHUNK_SIZE (32 * 1024)
+
+/** Writes left outstanding on a session before we wait on the oldest */
+#define WSH_SFTP_MAX_REQUESTS 64
+
+/** An sftp session on top of an authenticated ssh session */
+struct wsh_sftp {
+	sftp_session sftp;		/**< libssh sftp session */
+	ssh_session session;	/**< ssh session sftp runs over */
+	GHashTable* dirs;		/**< remote directories we've made or found */
+	struct wsh_throttle* throttle;	/**< the ssh session's shared limit, or NULL */
+	struct wsh_throttle* host_throttle;	/**< the ssh session's own limit, or NULL */
+};
+
+/** Pushes files over sftp */
+typedef struct wsh_sftp wsh_sftp_t;
+
+/**
+ * @brief Starts sftp on an authenticated session
+ *
+ * @param[out] sftp The new sftp session. Free with wsh_sftp_free
+ * @param[in] session Authenticated ssh session
+ * @param[out] err GError describing the failure
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_sftp_new(wsh_sftp_t** sftp, wsh_ssh_session_t* session, GError** err);
+
+/**
+ * @brief Pushes files and payloads under a remote directory
+ *
+ * Entries land at their path under root, with any missing parent
+ * directories made, and are sent from their offset on. Payloads land at their name under root. Writes from
+ * consecutive files are kept in flight together, up to
+ * WSH_SFTP_MAX_REQUESTS at once.
+ *
+ * @param[in] sftp sftp session to push over
+ * @param[in] root Remote directory, or "" for the home directory
+ * @param[in] entries Files to push, or NULL
+ * @param[in] num_entries Length of entries
+ * @param[in] payloads Payloads to push, or NULL
+ * @param[in] num_payloads Length of payloads
+ * @param[out] err GError describing the first failure
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull (1, 2, 7)))
+gint wsh_sftp_push(wsh_sftp_t* sftp, const gchar* root,
+                   const wsh_manifest_entry_t** entries, gsize num_entries,
+                   const wsh_payload_t** payloads, gsize num_payloads,
+                   GError** err);
+
+/**
+ * @brief Closes the sftp session. The ssh session is left open
+ *
+ * @param[in,out] sftp sftp session to free, is set to NULL
+ */
+void wsh_sftp_free(wsh_sftp_t** sftp);
+
+#endif
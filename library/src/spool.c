@@ -0,0 +1,234 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include "spool.h"
+
+#include <errno.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pack.h"
+
+static const gchar* WSH_SPOOL_PREFIX = "wsh-";
+
+// Anything else could walk out of the spool directory
+static gboolean valid_id(const gchar* id) {
+	if (! g_str_has_prefix(id, WSH_SPOOL_PREFIX))
+		return FALSE;
+
+	const gchar* p = id + strlen(WSH_SPOOL_PREFIX);
+	if (! *p)
+		return FALSE;
+
+	for (; *p; p++)
+		if (! g_ascii_isalnum(*p))
+			return FALSE;
+
+	return TRUE;
+}
+
+static void expire(const gchar* dir) {
+	GDir* d = g_dir_open(dir, 0, NULL);
+	if (! d)
+		return;
+
+	time_t cutoff = time(NULL) - WSH_SPOOL_TTL;
+	const gchar* name;
+	while ((name = g_dir_read_name(d))) {
+		if (! valid_id(name))
+			continue;
+
+		gchar* path = g_build_filename(dir, name, NULL);
+		struct stat st;
+		if (! lstat(path, &st) && S_ISREG(st.st_mode) && st.st_mtime < cutoff)
+			g_unlink(path);
+		g_free(path);
+	}
+
+	g_dir_close(d);
+}
+
+static gsize output_size(const guint8* raw, gsize raw_len, gchar** lines,
+                         gsize lines_len) {
+	if (raw)
+		return raw_len;
+
+	gsize len = 0;
+	for (gsize i = 0; i < lines_len; i++)
+		len += strlen(lines[i]) + 1;
+
+	return len;
+}
+
+// Leaves the first WSH_SPOOL_HEAD_LINES lines, however the output is held
+static void keep_head(guint8* raw, gsize* raw_len, gchar** lines,
+                      gsize* lines_len) {
+	if (raw) {
+		gsize seen = 0;
+		for (gsize i = 0; i < *raw_len; i++) {
+			if (raw[i] == '\n' && ++seen == WSH_SPOOL_HEAD_LINES) {
+				if (i + 1 < *raw_len) {
+					*raw_len = i + 1;
+					raw[*raw_len] = '\0';
+				}
+				break;
+			}
+		}
+	}
+
+	for (gsize i = WSH_SPOOL_HEAD_LINES; lines && i < *lines_len; i++) {
+		g_free(lines[i]);
+		lines[i] = NULL;
+	}
+	*lines_len = MIN(*lines_len, WSH_SPOOL_HEAD_LINES);
+}
+
+__attribute__((nonnull))
+gchar* wsh_spool_dir(GError** err) {
+	WSH_SPOOL_ERROR = g_quark_from_static_string("wsh_spool_error");
+
+	gchar* name = g_strdup_printf("wsh-spool-%lu", (gulong)getuid());
+	gchar* dir = g_build_filename(g_get_tmp_dir(), name, NULL);
+	g_free(name);
+
+	if (g_mkdir(dir, 0700) && errno != EEXIST) {
+		*err = g_error_new(WSH_SPOOL_ERROR, WSH_SPOOL_DIR_ERR,
+		                   "%s: %s", dir, strerror(errno));
+		g_free(dir);
+		return NULL;
+	}
+
+	// Somebody else could have made it first, to read or plant results
+	struct stat st;
+	if (lstat(dir, &st) || ! S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+	        (st.st_mode & 077)) {
+		*err = g_error_new(WSH_SPOOL_ERROR, WSH_SPOOL_DIR_ERR,
+		                   "%s isn't a directory only we can use", dir);
+		g_free(dir);
+		return NULL;
+	}
+
+	return dir;
+}
+
+__attribute__((nonnull))
+gint wsh_spool_store(wsh_cmd_res_t* res, const gchar* dir, GError** err) {
+	WSH_SPOOL_ERROR = g_quark_from_static_string("wsh_spool_error");
+	gint ret = 0;
+
+	expire(dir);
+
+	guint8* buf = NULL;
+	guint32 buf_len = 0;
+	wsh_pack_response(&buf, &buf_len, res);
+
+	gchar* tmpl = g_strdup_printf("%sXXXXXX", WSH_SPOOL_PREFIX);
+	gchar* path = g_build_filename(dir, tmpl, NULL);
+	g_free(tmpl);
+
+	gint fd = g_mkstemp(path);
+	if (fd == -1) {
+		*err = g_error_new(WSH_SPOOL_ERROR, WSH_SPOOL_WRITE_ERR,
+		                   "%s: %s", path, strerror(errno));
+		ret = WSH_SPOOL_WRITE_ERR;
+		goto wsh_spool_store_err;
+	}
+
+	for (guint32 off = 0; off < buf_len; ) {
+		gssize w = write(fd, buf + off, buf_len - off);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w < 0) {
+			*err = g_error_new(WSH_SPOOL_ERROR, WSH_SPOOL_WRITE_ERR,
+			                   "%s: %s", path, strerror(errno));
+			ret = WSH_SPOOL_WRITE_ERR;
+			break;
+		}
+		off += w;
+	}
+
+	if (close(fd) && ! ret) {
+		*err = g_error_new(WSH_SPOOL_ERROR, WSH_SPOOL_WRITE_ERR,
+		                   "%s: %s", path, strerror(errno));
+		ret = WSH_SPOOL_WRITE_ERR;
+	}
+
+	if (ret) {
+		g_unlink(path);
+		goto wsh_spool_store_err;
+	}
+
+	res->spool_id = g_path_get_basename(path);
+	res->output_hash = wsh_response_hash(res);
+	res->output_size =
+	    output_size(res->std_output_raw, res->std_output_raw_len,
+	                res->std_output, res->std_output_len) +
+	    output_size(res->std_error_raw, res->std_error_raw_len,
+	                res->std_error, res->std_error_len);
+
+	keep_head(res->std_output_raw, &res->std_output_raw_len, res->std_output,
+	          &res->std_output_len);
+	keep_head(res->std_error_raw, &res->std_error_raw_len, res->std_error,
+	          &res->std_error_len);
+
+wsh_spool_store_err:
+	g_free(path);
+	g_slice_free1(buf_len, buf);
+
+	return ret;
+}
+
+__attribute__((nonnull))
+gint wsh_spool_fetch(wsh_cmd_res_t* res, const gchar* dir, const gchar* id,
+                     GError** err) {
+	WSH_SPOOL_ERROR = g_quark_from_static_string("wsh_spool_error");
+
+	if (! valid_id(id)) {
+		*err = g_error_new(WSH_SPOOL_ERROR, WSH_SPOOL_ID_ERR,
+		                   "%s isn't a spooled result", id);
+		return WSH_SPOOL_ID_ERR;
+	}
+
+	gchar* path = g_build_filename(dir, id, NULL);
+	gchar* buf = NULL;
+	gsize buf_len = 0;
+
+	if (! g_file_get_contents(path, &buf, &buf_len, NULL) || buf_len > G_MAXUINT32) {
+		*err = g_error_new(WSH_SPOOL_ERROR, WSH_SPOOL_READ_ERR,
+		                   "Output %s is gone, it may have expired", id);
+		g_free(path);
+		g_free(buf);
+		return WSH_SPOOL_READ_ERR;
+	}
+
+	// Each result is only fetched the once
+	g_unlink(path);
+	g_free(path);
+
+	wsh_unpack_response(&res, (const guint8*)buf, buf_len);
+	g_free(buf);
+
+	return 0;
+}
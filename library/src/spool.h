@@ -0,0 +1,93 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/** @file
+ * @brief Holding on to output until the client asks for it
+ *
+ * wshd writes a command's full result to a private spool directory and
+ * sends back only a summary of it. The client then fetches the full result
+ * from one host per group of matching summaries. Spooled results are
+ * removed when fetched, or once they're older than WSH_SPOOL_TTL.
+ */
+#ifndef __WSH_SPOOL_H
+#define __WSH_SPOOL_H
+
+#include <glib.h>
+
+#include "types.h"
+
+/** GQuark for spool errors */
+GQuark WSH_SPOOL_ERROR;
+
+/** Spool errors */
+typedef enum {
+	WSH_SPOOL_DIR_ERR,		/**< Can't make or trust the spool directory */
+	WSH_SPOOL_WRITE_ERR,	/**< Can't write a result out */
+	WSH_SPOOL_ID_ERR,		/**< Not something wsh_spool_store() handed out */
+	WSH_SPOOL_READ_ERR,		/**< Result has been fetched, expired or damaged */
+} wsh_spool_err_enum;
+
+/** Seconds a spooled result is kept if nobody fetches it */
+#define WSH_SPOOL_TTL 600
+
+/** Lines of each stream left in a summary */
+#define WSH_SPOOL_HEAD_LINES 10
+
+/**
+ * @brief Finds the spool directory for the current user, creating it if need be
+ *
+ * @param[out] err GError describing the failure
+ *
+ * @returns The directory, to free with g_free, or NULL on failure
+ */
+__attribute__((nonnull))
+gchar* wsh_spool_dir(GError** err);
+
+/**
+ * @brief Spools a result, and cuts it down to a summary
+ *
+ * Sets spool_id, output_hash and output_size, and leaves only the first
+ * WSH_SPOOL_HEAD_LINES lines of stdout and stderr. Results older than
+ * WSH_SPOOL_TTL are cleared out of dir on the way.
+ *
+ * @param[in,out] res The result to spool
+ * @param[in] dir Spool directory, from wsh_spool_dir()
+ * @param[out] err GError describing the failure
+ *
+ * @returns 0 on success, anything else on failure. res is untouched on failure
+ */
+__attribute__((nonnull))
+gint wsh_spool_store(wsh_cmd_res_t* res, const gchar* dir, GError** err);
+
+/**
+ * @brief Takes a spooled result back out of the spool
+ *
+ * @param[out] res Empty result to unpack into
+ * @param[in] dir Spool directory, from wsh_spool_dir()
+ * @param[in] id spool_id of the summary
+ * @param[out] err GError describing the failure
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_spool_fetch(wsh_cmd_res_t* res, const gchar* dir, const gchar* id,
+                     GError** err);
+
+#endif
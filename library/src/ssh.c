@@ -22,20 +22,29 @@
 #include "ssh.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <libssh/callbacks.h>
 #include <libssh/libssh.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <poll.h>
 
 #include "cmd.h"
+#include "jump.h"
 #include "pack.h"
+#include "payload.h"
+#include "throttle.h"
 #include "types.h"
 
 const gint WSH_SSH_NEED_ADD_HOST_KEY = 1;
 const gint WSH_SSH_HOST_KEY_ERROR = 2;
+
+// Passthrough output is read off the channel this much at a time
+#define FRAME_BUF_SIZE (64 * 1024)
 #ifdef DEBUG
 static ssh_pcap_file pfile;
 #endif
@@ -180,6 +189,19 @@ gint wsh_ssh_host(wsh_ssh_session_t* session, GError** err) {
 
 	set_options(session);
 
+	if (session->jump) {
+		gint sock = -1;
+		if (wsh_jump_connect(session->jump, session->hostname, session->port, &sock,
+		                     err)) {
+			ssh_free(session->session);
+			session->session = NULL;
+			return -1;
+		}
+
+		// libssh owns the socket from here, and closes it on ssh_free()
+		ssh_options_set(session->session, SSH_OPTIONS_FD, &sock);
+	}
+
 	// Try and connect
 	gint conn_ret;
 	do {
@@ -280,11 +302,72 @@ gint wsh_add_host_key(wsh_ssh_session_t* session, GError** err) {
 	return 0;
 }
 
+// Try whatever worked last time without probing the server first.
+// Failures here aren't reported, we just fall back to full negotiation.
+// tried is set if the method was attempted, so negotiation can skip it
+// rather than spend another of the server's MaxAuthTries on it
+__attribute__((nonnull))
+static gboolean try_auth_hint(wsh_ssh_session_t* session, gboolean* tried) {
+	gint ret = SSH_AUTH_DENIED;
+	*tried = FALSE;
+
+	switch (session->auth_hint) {
+		case WSH_SSH_AUTH_METHOD_PUBKEY:
+			if (session->auth_type != WSH_SSH_AUTH_PUBKEY)
+				return FALSE;
+
+			*tried = TRUE;
+			do {
+				ret = ssh_userauth_autopubkey(session->session, NULL);
+			} while (ret == SSH_AUTH_AGAIN);
+			break;
+		case WSH_SSH_AUTH_METHOD_KBDINT:
+			if (session->auth_type != WSH_SSH_AUTH_PASSWORD)
+				return FALSE;
+
+			*tried = TRUE;
+			do {
+				ret = ssh_userauth_kbdint(session->session, NULL, NULL);
+				if (ret == SSH_AUTH_INFO &&
+				        ssh_userauth_kbdint_setanswer(session->session, 0, session->password))
+					return FALSE;
+			} while (ret == SSH_AUTH_INFO || ret == SSH_AUTH_AGAIN);
+			break;
+		case WSH_SSH_AUTH_METHOD_PASSWORD:
+			if (session->auth_type != WSH_SSH_AUTH_PASSWORD)
+				return FALSE;
+
+			*tried = TRUE;
+			do {
+				ret = ssh_userauth_password(session->session, NULL, session->password);
+			} while (ret == SSH_AUTH_AGAIN);
+			break;
+		default:
+			return FALSE;
+	}
+
+	if (ret != SSH_AUTH_SUCCESS)
+		return FALSE;
+
+	session->auth_method = session->auth_hint;
+	return TRUE;
+}
+
 __attribute__((nonnull))
 gint wsh_ssh_authenticate(wsh_ssh_session_t* session, GError** err) {
 	g_assert(session->session != NULL);
 	g_assert(session->hostname != NULL);
 
+	session->auth_method = WSH_SSH_AUTH_METHOD_UNKNOWN;
+	wsh_ssh_auth_method_t hint_tried = WSH_SSH_AUTH_METHOD_UNKNOWN;
+	if (session->auth_hint != WSH_SSH_AUTH_METHOD_UNKNOWN) {
+		gboolean tried = FALSE;
+		if (try_auth_hint(session, &tried))
+			return 0;
+		if (tried)
+			hint_tried = session->auth_hint;
+	}
+
 	(void)ssh_userauth_none(session->session, NULL);
 
 	gint method = ssh_userauth_list(session->session, NULL);
@@ -292,6 +375,14 @@ gint wsh_ssh_authenticate(wsh_ssh_session_t* session, GError** err) {
 	gboolean pubkey_denied, password_denied, kbdint_denied;
 	pubkey_denied = password_denied = kbdint_denied = FALSE;
 
+	// The hint was already turned down, don't ask again
+	if (hint_tried == WSH_SSH_AUTH_METHOD_PUBKEY)
+		method &= ~SSH_AUTH_METHOD_PUBLICKEY;
+	else if (hint_tried == WSH_SSH_AUTH_METHOD_KBDINT)
+		method &= ~SSH_AUTH_METHOD_INTERACTIVE;
+	else if (hint_tried == WSH_SSH_AUTH_METHOD_PASSWORD)
+		method &= ~SSH_AUTH_METHOD_PASSWORD;
+
 	if ((session->auth_type == WSH_SSH_AUTH_PUBKEY) &&
 	        (method & SSH_AUTH_METHOD_PUBLICKEY)) {
 		do {
@@ -307,6 +398,9 @@ gint wsh_ssh_authenticate(wsh_ssh_session_t* session, GError** err) {
 					break;
 			}
 		} while (ret == SSH_AUTH_AGAIN);
+
+		if (ret == SSH_AUTH_SUCCESS)
+			session->auth_method = WSH_SSH_AUTH_METHOD_PUBKEY;
 	} else {
 		pubkey_denied = TRUE;
 	}
@@ -341,11 +435,16 @@ gint wsh_ssh_authenticate(wsh_ssh_session_t* session, GError** err) {
 			}
 
 		} while (ret == SSH_AUTH_INFO || ret == SSH_AUTH_AGAIN);
+
+		if (ret == SSH_AUTH_SUCCESS)
+			session->auth_method = WSH_SSH_AUTH_METHOD_KBDINT;
 	} else {
 		kbdint_denied = TRUE;
 	}
 
+	// No need to send the password twice if kbdint already took it
 	if ((session->auth_type == WSH_SSH_AUTH_PASSWORD) &&
+	        (session->auth_method == WSH_SSH_AUTH_METHOD_UNKNOWN) &&
 	        (method & SSH_AUTH_METHOD_PASSWORD)) {
 		g_assert(session->password != NULL);
 		do {
@@ -362,7 +461,10 @@ gint wsh_ssh_authenticate(wsh_ssh_session_t* session, GError** err) {
 					break;
 			}
 		} while (ret == SSH_AUTH_AGAIN);
-	} else {
+
+		if (ret == SSH_AUTH_SUCCESS)
+			session->auth_method = WSH_SSH_AUTH_METHOD_PASSWORD;
+	} else if (session->auth_method == WSH_SSH_AUTH_METHOD_UNKNOWN) {
 		password_denied = TRUE;
 	}
 
@@ -389,6 +491,13 @@ gint wsh_ssh_exec_wshd(wsh_ssh_session_t* session, GError** err) {
 
 	gint ret = 0;
 
+	// One wshd at a time per session, the last one has already answered
+	if (session->channel != NULL) {
+		ssh_channel_close(session->channel);
+		ssh_channel_free(session->channel);
+		session->channel = NULL;
+	}
+
 	if ((session->channel = ssh_channel_new(session->session)) == NULL) {
 		*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_CHANNEL_CREATION_ERR,
 		                   "Error opening ssh channel: %s",
@@ -459,12 +568,21 @@ gint wsh_ssh_send_cmd(wsh_ssh_session_t* session, const wsh_cmd_req_t* req,
 		goto wsh_ssh_send_cmd_error;
 	}
 
-	if (ssh_channel_write(session->channel, buf, buf_len) != buf_len) {
-		ret = WSH_SSH_WRITE_ERR;
-		*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_WRITE_ERR,
-		                   "Error writing out command over ssh: %s",
-		                   ssh_get_error(session->session));
-		goto wsh_ssh_send_cmd_error;
+	// An inline script is held to the same limits as one pushed over scp
+	for (guint32 off = 0; off < buf_len; off += WSH_SSH_SCP_CHUNK_SIZE) {
+		guint32 chunk = MIN(WSH_SSH_SCP_CHUNK_SIZE, buf_len - off);
+
+		if (req->script_len) {
+			wsh_throttle_take(session->throttle, chunk);
+			wsh_throttle_take(session->host_throttle, chunk);
+		}
+		if (ssh_channel_write(session->channel, buf + off, chunk) != chunk) {
+			ret = WSH_SSH_WRITE_ERR;
+			*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_WRITE_ERR,
+			                   "Error writing out command over ssh: %s",
+			                   ssh_get_error(session->session));
+			goto wsh_ssh_send_cmd_error;
+		}
 	}
 
 	if (ssh_channel_send_eof(session->channel)) {
@@ -485,6 +603,22 @@ wsh_ssh_send_cmd_error:
 	return ret;
 }
 
+__attribute__((nonnull))
+static gint write_all(gint fd, const guint8* buf, gsize len) {
+	while (len) {
+		gssize wrote = write(fd, buf, len);
+		if (wrote < 0 && errno == EINTR)
+			continue;
+		if (wrote <= 0)
+			return -1;
+
+		buf += wrote;
+		len -= wrote;
+	}
+
+	return 0;
+}
+
 __attribute__((nonnull))
 gint wsh_ssh_recv_cmd_res(wsh_ssh_session_t* session, wsh_cmd_res_t** res,
                           GError** err) {
@@ -547,6 +681,135 @@ wsh_ssh_recv_cmd_res_error:
 	return ret;
 }
 
+__attribute__((nonnull))
+gint wsh_ssh_recv_relay_res(wsh_ssh_session_t* session, wsh_cmd_res_t** res,
+                            GError** err) {
+	g_assert(session != NULL);
+	g_assert(session->session != NULL);
+	g_assert(session->channel != NULL);
+	g_assert(*res == NULL);
+
+	gint ret = 0;
+	wsh_message_size_t buf_u;
+	guchar* buf = NULL;
+
+	if (ssh_channel_read(session->channel, buf_u.buf, 4, FALSE) != 4) {
+		ret = WSH_SSH_READ_ERR;
+		*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_READ_ERR,
+		                   "Couldn't read size bytes: %s",
+		                   ssh_get_error(session->session));
+		goto wsh_ssh_recv_relay_res_error;
+	}
+
+	buf_u.size = g_ntohl(buf_u.size);
+
+	// An empty message ends the stream
+	if (buf_u.size == 0)
+		return 0;
+
+	buf = g_slice_alloc0(buf_u.size);
+	for (gsize buf_len = 0; buf_len < buf_u.size;) {
+		gint r = ssh_channel_read(session->channel, buf + buf_len,
+		                          buf_u.size - buf_len, FALSE);
+		if (r <= 0) {
+			ret = WSH_SSH_READ_ERR;
+			*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_READ_ERR,
+			                   "Relay stream ended early: %s",
+			                   ssh_get_error(session->session));
+			goto wsh_ssh_recv_relay_res_error;
+		}
+		buf_len += r;
+	}
+
+	*res = g_new0(wsh_cmd_res_t, 1);
+	wsh_unpack_response(res, buf, buf_u.size);
+	g_slice_free1(buf_u.size, buf);
+
+	return ret;
+
+wsh_ssh_recv_relay_res_error:
+	if (buf) g_slice_free1(buf_u.size, buf);
+	wsh_ssh_disconnect(session);
+
+	return ret;
+}
+
+// Reads exactly len bytes, unless the channel ends first
+__attribute__((nonnull))
+static gboolean channel_read_all(ssh_channel channel, guint8* buf, gsize len) {
+	while (len) {
+		gint r = ssh_channel_read(channel, buf, len, FALSE);
+		if (r <= 0)
+			return FALSE;
+
+		buf += r;
+		len -= r;
+	}
+
+	return TRUE;
+}
+
+__attribute__((nonnull))
+gint wsh_ssh_recv_frames(wsh_ssh_session_t* session, gint out_fd, gint err_fd,
+                         GError** err) {
+	g_assert(session != NULL);
+	g_assert(session->session != NULL);
+	g_assert(session->channel != NULL);
+
+	gint ret = 0;
+	guint8 header[WSH_FRAME_HEADER_LEN];
+	guint8* buf = g_malloc(FRAME_BUF_SIZE);
+
+	for (;;) {
+		if (! channel_read_all(session->channel, header, sizeof(header))) {
+			ret = WSH_SSH_READ_ERR;
+			*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_READ_ERR,
+			                   "Output stream ended early: %s",
+			                   ssh_get_error(session->session));
+			goto wsh_ssh_recv_frames_error;
+		}
+
+		guint32 len;
+		memcpy(&len, header + 1, sizeof(len));
+		len = g_ntohl(len);
+
+		if (header[0] == WSH_FRAME_END)
+			break;
+
+		if (header[0] != WSH_FRAME_STDOUT && header[0] != WSH_FRAME_STDERR) {
+			ret = WSH_SSH_PACK_ERR;
+			*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_PACK_ERR,
+			                   "Unknown output stream %u", header[0]);
+			goto wsh_ssh_recv_frames_error;
+		}
+
+		gint fd = header[0] == WSH_FRAME_STDERR ? err_fd : out_fd;
+		while (len) {
+			gsize want = MIN(len, FRAME_BUF_SIZE);
+			if (! channel_read_all(session->channel, buf, want)) {
+				ret = WSH_SSH_READ_ERR;
+				*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_READ_ERR,
+				                   "Output stream ended early: %s",
+				                   ssh_get_error(session->session));
+				goto wsh_ssh_recv_frames_error;
+			}
+
+			// Output nobody will see shouldn't cost us the exit status
+			(void) write_all(fd, buf, want);
+			len -= want;
+		}
+	}
+
+	g_free(buf);
+	return ret;
+
+wsh_ssh_recv_frames_error:
+	g_free(buf);
+	wsh_ssh_disconnect(session);
+
+	return ret;
+}
+
 __attribute__((nonnull))
 void wsh_ssh_disconnect(wsh_ssh_session_t* session) {
 	g_assert(session != NULL);
@@ -587,32 +850,122 @@ void wsh_ssh_scp_cleanup(wsh_ssh_session_t* session) {
 	ssh_scp_free(session->scp);
 }
 
+/* Files being pushed right now, shared by every host pushing them, so a file
+ * is mapped once no matter how many hosts it's going to */
+typedef struct {
+	GMappedFile* map;
+	guint users;
+} scp_source_t;
+
+G_LOCK_DEFINE_STATIC(scp_sources);
+static GHashTable* scp_sources = NULL;
+
+__attribute__((nonnull))
+static GMappedFile* scp_source_get(const gchar* file, GError** err) {
+	scp_source_t* src;
+
+	G_LOCK(scp_sources);
+	if (! scp_sources)
+		scp_sources = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	if ((src = g_hash_table_lookup(scp_sources, file)) == NULL) {
+		GMappedFile* map = g_mapped_file_new(file, FALSE, err);
+		if (map == NULL) {
+			G_UNLOCK(scp_sources);
+			return NULL;
+		}
+
+		src = g_slice_new0(scp_source_t);
+		src->map = map;
+		g_hash_table_insert(scp_sources, g_strdup(file), src);
+	}
+	src->users++;
+	G_UNLOCK(scp_sources);
+
+	return src->map;
+}
+
+__attribute__((nonnull))
+static void scp_source_put(const gchar* file) {
+	G_LOCK(scp_sources);
+	scp_source_t* src = g_hash_table_lookup(scp_sources, file);
+	g_assert(src != NULL);
+
+	if (--src->users == 0) {
+		g_hash_table_remove(scp_sources, file);
+		g_mapped_file_unref(src->map);
+		g_slice_free(scp_source_t, src);
+	}
+	G_UNLOCK(scp_sources);
+}
+
+// ssh_scp_write() blocks until the channel window takes each chunk, so a
+// slow host holds onto one chunk of buf at a time rather than all of it
+__attribute__((nonnull (1, 2, 6)))
+static gint scp_write_buf(wsh_ssh_session_t* session, const gchar* name,
+                          const guint8* buf, gsize len, gint mode, GError** err) {
+	gint ret = EXIT_SUCCESS;
+	if ((ret = ssh_scp_push_file(session->scp, name, len, mode))) {
+		*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_FILE_ERR, "%s",
+		                   ssh_get_error(session->session));
+		return ret;
+	}
+
+	for (gsize off = 0; off < len; off += WSH_SSH_SCP_CHUNK_SIZE) {
+		gsize chunk = MIN(WSH_SSH_SCP_CHUNK_SIZE, len - off);
+
+		wsh_throttle_take(session->throttle, chunk);
+		wsh_throttle_take(session->host_throttle, chunk);
+		if ((ret = ssh_scp_write(session->scp, buf + off, chunk))) {
+			*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_FILE_ERR, "%s",
+			                   ssh_get_error(session->session));
+			return ret;
+		}
+	}
+
+	return ret;
+}
+
 // There are too many steps to scping a file
 __attribute__((nonnull))
 static gint scp_write_file(wsh_ssh_session_t* session, const gchar* file,
                            gboolean executable, GError** err) {
-	gchar* contents = NULL;
-	gsize len = 0;
 	gint mode = (executable ? 0755 : 0644);
-	if (!g_file_get_contents(file, &contents, &len, err))
+	GMappedFile* map = NULL;
+	if ((map = scp_source_get(file, err)) == NULL)
 		return EXIT_FAILURE;
 
+	gint ret = scp_write_buf(session, file,
+	                         (const guint8*)g_mapped_file_get_contents(map),
+	                         g_mapped_file_get_length(map), mode, err);
+
+	scp_source_put(file);
+	return ret;
+}
+
+// Sends an entry under the given name, from its offset on
+__attribute__((nonnull))
+static gint scp_write_entry(wsh_ssh_session_t* session,
+                            const wsh_manifest_entry_t* entry, const gchar* name,
+                            GError** err) {
+	GMappedFile* map = NULL;
+	if ((map = scp_source_get(entry->local, err)) == NULL)
+		return EXIT_FAILURE;
+
+	const guint8* buf = (const guint8*)g_mapped_file_get_contents(map);
+	gsize len = g_mapped_file_get_length(map);
 	gint ret = EXIT_SUCCESS;
-	if ((ret = ssh_scp_push_file(session->scp, file, len, mode))) {
-		*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_FILE_ERR, "%s",
-		                   ssh_get_error(session->session));
-		g_free(contents);
-		return ret;
-	}
 
-	if ((ret = ssh_scp_write(session->scp, contents, len))) {
-		*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_FILE_ERR, "%s",
-		                   ssh_get_error(session->session));
-		g_free(contents);
-		return ret;
+	if (entry->offset > len) {
+		*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_FILE_ERR,
+		                   "%s changed while it was being sent", entry->local);
+		ret = WSH_SSH_FILE_ERR;
+	} else {
+		ret = scp_write_buf(session, name, buf + entry->offset,
+		                    len - entry->offset, 0644, err);
 	}
 
-	g_free(contents);
+	scp_source_put(entry->local);
 	return ret;
 }
 
@@ -686,7 +1039,7 @@ gint wsh_ssh_scp_file(wsh_ssh_session_t* session, const gchar* file,
 	is_dir = g_file_test(file, G_FILE_TEST_IS_DIR);
 
 	if (!is_dir) {
-		scp_write_file(session, file, executable, err);
+		ret = scp_write_file(session, file, executable, err);
 	} else {
 		if ((ret = ssh_scp_push_directory(session->scp, g_path_get_basename(file),
 		                                  0755))) {
@@ -701,3 +1054,259 @@ gint wsh_ssh_scp_file(wsh_ssh_session_t* session, const gchar* file,
 	return ret;
 }
 
+__attribute__((nonnull))
+gint wsh_ssh_scp_payload(wsh_ssh_session_t* session,
+                         const wsh_payload_t* payload, GError** err) {
+	g_assert(session != NULL);
+	g_assert(session->scp != NULL);
+	g_assert(*err == NULL);
+
+	gsize len = 0;
+	const guint8* data = g_bytes_get_data(payload->data, &len);
+
+	return scp_write_buf(session, payload->name, data, len, payload->mode, err);
+}
+
+__attribute__((nonnull))
+gint wsh_ssh_scp_entries(wsh_ssh_session_t* session,
+                         const wsh_manifest_entry_t** entries, gsize len,
+                         GError** err) {
+	g_assert(session != NULL);
+	g_assert(session->scp != NULL);
+	g_assert(*err == NULL);
+
+	// Directories we're in on the remote side, outermost first
+	GPtrArray* dirs = g_ptr_array_new_with_free_func(g_free);
+	gint ret = EXIT_SUCCESS;
+
+	for (gsize i = 0; i < len && ! ret; i++) {
+		gchar** parts = g_strsplit(entries[i]->path, "/", 0);
+		guint depth = g_strv_length(parts) - 1;
+		guint common = 0;
+
+		while (common < dirs->len && common < depth &&
+		        ! strcmp(g_ptr_array_index(dirs, common), parts[common]))
+			common++;
+
+		while (dirs->len > common && ! ret) {
+			if ((ret = ssh_scp_leave_directory(session->scp)))
+				*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_DIR_ERR, "Can't leave directory: %s",
+				                   ssh_get_error(session->session));
+			g_ptr_array_remove_index(dirs, dirs->len - 1);
+		}
+
+		// Pushing a directory that's already there just enters it
+		for (guint j = common; j < depth && ! ret; j++) {
+			if ((ret = ssh_scp_push_directory(session->scp, parts[j], 0755)))
+				*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_DIR_ERR, "Can't push directory: %s",
+				                   ssh_get_error(session->session));
+			else
+				g_ptr_array_add(dirs, g_strdup(parts[j]));
+		}
+
+		if (! ret)
+			ret = scp_write_entry(session, entries[i], parts[depth], err);
+
+		g_strfreev(parts);
+	}
+
+	for (guint i = dirs->len; i > 0 && ! ret; i--) {
+		if ((ret = ssh_scp_leave_directory(session->scp)))
+			*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_DIR_ERR, "Can't leave directory: %s",
+			                   ssh_get_error(session->session));
+	}
+
+	g_ptr_array_free(dirs, TRUE);
+	return ret;
+}
+
+// Hands the tar stream to scp a chunk at a time
+static gint scp_tar_write(const guint8* buf, gsize len, gpointer user_data) {
+	wsh_ssh_session_t* session = user_data;
+
+	for (gsize off = 0; off < len; off += WSH_SSH_SCP_CHUNK_SIZE) {
+		gsize chunk = MIN(WSH_SSH_SCP_CHUNK_SIZE, len - off);
+
+		wsh_throttle_take(session->throttle, chunk);
+		wsh_throttle_take(session->host_throttle, chunk);
+		if (ssh_scp_write(session->scp, buf + off, chunk))
+			return -1;
+	}
+
+	return 0;
+}
+
+__attribute__((nonnull))
+gint wsh_ssh_scp_tar(wsh_ssh_session_t* session, const gchar* name,
+                     const wsh_manifest_entry_t** entries, gsize len,
+                     GError** err) {
+	g_assert(session != NULL);
+	g_assert(session->scp != NULL);
+	g_assert(*err == NULL);
+
+	// scp wants the size before any of the contents
+	guint64 size = 0;
+	gint ret = EXIT_SUCCESS;
+	if ((ret = wsh_tar_size(entries, len, &size, err)))
+		return ret;
+
+	if ((ret = ssh_scp_push_file(session->scp, name, size, 0600))) {
+		*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_FILE_ERR, "%s",
+		                   ssh_get_error(session->session));
+		return ret;
+	}
+
+	// The channel knows better than the tar code why a write failed
+	if ((ret = wsh_tar_stream(entries, len, scp_tar_write, session, err)) &&
+	        g_error_matches(*err, WSH_TAR_ERROR, WSH_TAR_WRITE_ERR)) {
+		g_clear_error(err);
+		*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_FILE_ERR, "Can't send %s: %s",
+		                   name, ssh_get_error(session->session));
+	}
+
+	return ret;
+}
+
+// A name from the remote end has to stay inside the directory it lands in
+static gboolean safe_pull_name(const gchar* name) {
+	return name && *name && ! strchr(name, '/') && strcmp(name, ".") &&
+	       strcmp(name, "..");
+}
+
+// Streams the file scp just offered us to path
+__attribute__((nonnull))
+static gint pull_file(wsh_ssh_session_t* session, ssh_scp scp, const gchar* path,
+                      guint8* buf, GError** err) {
+	guint64 size = ssh_scp_request_get_size64(scp);
+	gint mode = ssh_scp_request_get_permissions(scp) & 0777;
+
+	gint fd = g_open(path, O_WRONLY|O_CREAT|O_TRUNC, mode | 0600);
+	if (fd < 0) {
+		*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_PULL_ERR, "%s: %s", path,
+		                   strerror(errno));
+		ssh_scp_deny_request(scp, "Can't create file");
+		return WSH_SSH_PULL_ERR;
+	}
+
+	gint ret = 0;
+	if (ssh_scp_accept_request(scp)) {
+		*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_PULL_ERR, "Can't fetch %s: %s",
+		                   path, ssh_get_error(session->session));
+		ret = WSH_SSH_PULL_ERR;
+	}
+
+	for (guint64 got = 0; got < size && ! ret;) {
+		gint n = ssh_scp_read(scp, buf, MIN(WSH_SSH_SCP_CHUNK_SIZE, size - got));
+		if (n <= 0) {
+			*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_PULL_ERR, "Can't fetch %s: %s",
+			                   path, ssh_get_error(session->session));
+			ret = WSH_SSH_PULL_ERR;
+		} else if (write_all(fd, buf, n)) {
+			*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_PULL_ERR, "%s: %s", path,
+			                   strerror(errno));
+			ret = WSH_SSH_PULL_ERR;
+		}
+
+		got += MAX(n, 0);
+	}
+
+	if (close(fd) && ! ret) {
+		*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_PULL_ERR, "%s: %s", path,
+		                   strerror(errno));
+		ret = WSH_SSH_PULL_ERR;
+	}
+
+	return ret;
+}
+
+__attribute__((nonnull))
+gint wsh_ssh_scp_pull(wsh_ssh_session_t* session, const gchar* remote,
+                      const gchar* dest, GError** err) {
+	g_assert(session != NULL);
+	g_assert(session->session != NULL);
+	g_assert(*err == NULL);
+
+	ssh_scp scp = NULL;
+	if ((scp = ssh_scp_new(session->session, SSH_SCP_READ|SSH_SCP_RECURSIVE,
+	                       remote)) == NULL || ssh_scp_init(scp)) {
+		*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_PULL_ERR, "Can't fetch %s: %s",
+		                   remote, ssh_get_error(session->session));
+		if (scp)
+			ssh_scp_free(scp);
+		return WSH_SSH_PULL_ERR;
+	}
+
+	// Local directories we're in, innermost last
+	GPtrArray* dirs = g_ptr_array_new_with_free_func(g_free);
+	g_ptr_array_add(dirs, g_strdup(dest));
+	guint8* buf = g_malloc(WSH_SSH_SCP_CHUNK_SIZE);
+	gboolean done = FALSE;
+	gint ret = 0;
+
+	while (! ret && ! done) {
+		const gchar* cwd = g_ptr_array_index(dirs, dirs->len - 1);
+		gint req = ssh_scp_pull_request(scp);
+		const gchar* name = NULL;
+		gchar* path = NULL;
+
+		switch (req) {
+			case SSH_SCP_REQUEST_NEWDIR:
+			case SSH_SCP_REQUEST_NEWFILE:
+				name = ssh_scp_request_get_filename(scp);
+				if (! safe_pull_name(name)) {
+					*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_PULL_ERR,
+					                   "%s: refusing to fetch %s", remote,
+					                   name ? name : "(null)");
+					ssh_scp_deny_request(scp, "Bad name");
+					ret = WSH_SSH_PULL_ERR;
+					break;
+				}
+
+				path = g_build_filename(cwd, name, NULL);
+				if (req == SSH_SCP_REQUEST_NEWFILE) {
+					ret = pull_file(session, scp, path, buf, err);
+					g_free(path);
+					break;
+				}
+
+				// We have to be able to write into it, whatever its mode
+				if (g_mkdir(path, (ssh_scp_request_get_permissions(scp) & 0777) | 0700) &&
+				        errno != EEXIST) {
+					*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_PULL_ERR, "%s: %s", path,
+					                   strerror(errno));
+					ssh_scp_deny_request(scp, "Can't create directory");
+					ret = WSH_SSH_PULL_ERR;
+					g_free(path);
+				} else {
+					ssh_scp_accept_request(scp);
+					g_ptr_array_add(dirs, path);
+				}
+				break;
+			case SSH_SCP_REQUEST_ENDDIR:
+				if (dirs->len > 1)
+					g_ptr_array_remove_index(dirs, dirs->len - 1);
+				break;
+			case SSH_SCP_REQUEST_WARNING:
+				// Usually the remote path isn't there
+				*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_PULL_ERR, "%s: %s", remote,
+				                   ssh_scp_request_get_warning(scp));
+				ret = WSH_SSH_PULL_ERR;
+				break;
+			case SSH_SCP_REQUEST_EOF:
+				done = TRUE;
+				break;
+			default:
+				*err = g_error_new(WSH_SSH_ERROR, WSH_SSH_PULL_ERR, "Can't fetch %s: %s",
+				                   remote, ssh_get_error(session->session));
+				ret = WSH_SSH_PULL_ERR;
+				break;
+		}
+	}
+
+	g_free(buf);
+	g_ptr_array_free(dirs, TRUE);
+	ssh_scp_close(scp);
+	ssh_scp_free(scp);
+
+	return ret;
+}
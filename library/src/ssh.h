@@ -35,6 +35,9 @@
 #endif
 
 #include "cmd.h"
+#include "payload.h"
+#include "tar.h"
+#include "types.h"
 
 GQuark WSH_SSH_ERROR;		/**< GQuark for SSH Error reporting */
 
@@ -42,12 +45,23 @@ extern const gint
 WSH_SSH_NEED_ADD_HOST_KEY;	/**< Return for not having a hostkey for a machine */
 extern const gint WSH_SSH_HOST_KEY_ERROR;		/**< Return for hostkey change */
 
+/** Bytes handed to scp at a time when sending a file */
+#define WSH_SSH_SCP_CHUNK_SIZE (64 * 1024)
+
 /** Different types of auth available */
 typedef enum {
 	WSH_SSH_AUTH_PASSWORD,	/**< password auth type */
 	WSH_SSH_AUTH_PUBKEY		/**< pubkey auth type */
 } wsh_ssh_auth_type_t;
 
+/** Auth methods a session actually authenticated with */
+typedef enum {
+	WSH_SSH_AUTH_METHOD_UNKNOWN,	/**< not authenticated yet/no preference */
+	WSH_SSH_AUTH_METHOD_PUBKEY,		/**< publickey (agent or identity files) */
+	WSH_SSH_AUTH_METHOD_KBDINT,		/**< keyboard-interactive */
+	WSH_SSH_AUTH_METHOD_PASSWORD,	/**< password */
+} wsh_ssh_auth_method_t;
+
 /** Possible error conditions for WSH_SSH_ERROR */
 typedef enum {
 	WSH_SSH_KNOWN_HOSTS_WRITE_ERR,      /**< Error writing out host keys */
@@ -74,8 +88,12 @@ typedef enum {
 	WSH_SSH_HOST_KEY_UNKNOWN,			/**< Unknown host key */
 	WSH_SSH_OPT_NOT_SUPPORTED,			/**< libssh does not support a provided option */
 	WSH_SSH_OPT_INVALID,				/**< Invalid option specifier */
+	WSH_SSH_PULL_ERR,					/**< Can't fetch a remote file */
 } wsh_ssh_err_enum;
 
+struct wsh_jump;
+struct wsh_throttle;
+
 /** Represents an ssh session */
 typedef struct {
 	ssh_session session;			/**< libssh session struct */
@@ -85,8 +103,13 @@ typedef struct {
 	const gchar* username;			/**< Username used for auth */
 	const gchar* password;			/**< Password (if any) used in auth */
 	ssh_scp scp;					/**< libssh scp session struct */
+	struct wsh_jump* jump;			/**< Bastion to tunnel through, or NULL */
+	struct wsh_throttle* throttle;	/**< Limit shared with other sessions, or NULL */
+	struct wsh_throttle* host_throttle;	/**< Limit on just this session, or NULL */
 	gint port;						/**< Port to connect to */
 	wsh_ssh_auth_type_t auth_type;	/**< Type of auth being used */
+	wsh_ssh_auth_method_t auth_hint;	/**< Method to try before negotiating */
+	wsh_ssh_auth_method_t auth_method;	/**< Method that authenticated us */
 } wsh_ssh_session_t;
 
 /**
@@ -142,6 +165,10 @@ gint wsh_add_host_key(wsh_ssh_session_t* session, GError** err);
 /**
  * @brief Authenticates an ssh session
  *
+ * If session->auth_hint is set, that method is attempted first without
+ * probing the server with none/list. On success, session->auth_method is
+ * set to the method that worked.
+ *
  * @param[in] session Struct representing current state of ssh session
  * @param[out] err GError describing error condition
  *
@@ -164,6 +191,9 @@ gint wsh_ssh_exec_wshd(wsh_ssh_session_t* session, GError** err);
 /**
  * @brief Sends a wsh_cmd_req_t to the wshd on the remote host
  *
+ * A request carrying an inline script is held to session->throttle and
+ * session->host_throttle as it's written.
+ *
  * @param[in] session Struct representing current state of ssh session
  * @param[in] req wsh_cmd_req_t that you want wshd to execute
  * @param[out] err GError describing error condition
@@ -187,6 +217,39 @@ __attribute__((nonnull))
 gint wsh_ssh_recv_cmd_res(wsh_ssh_session_t* session, wsh_cmd_res_t** res,
                           GError** err);
 
+/**
+ * @brief Copies output a wshd passes straight through to local fds
+ *
+ * For requests with passthrough set. Returns once wshd has sent its last
+ * frame, and the result is ready for wsh_ssh_recv_cmd_res().
+ *
+ * @param[in] session Struct representing current state of ssh session
+ * @param[in] out_fd Where the command's stdout goes
+ * @param[in] err_fd Where the command's stderr goes
+ * @param[out] err GError describing error condition
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_ssh_recv_frames(wsh_ssh_session_t* session, gint out_fd, gint err_fd,
+                         GError** err);
+
+/**
+ * @brief Gets the next result from a relaying wshd
+ *
+ * Relays send any number of results, each naming the hosts it came from,
+ * followed by an empty message.
+ *
+ * @param[in] session Struct representing current state of ssh session
+ * @param[out] res Next result, or NULL once the relay is done
+ * @param[out] err GError describing error condition
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_ssh_recv_relay_res(wsh_ssh_session_t* session, wsh_cmd_res_t** res,
+                            GError** err);
+
 /**
  * @brief Disconnects from a remote host
  *
@@ -219,6 +282,9 @@ void wsh_ssh_scp_cleanup(wsh_ssh_session_t* session);
 /**
  * @brief Send a file
  *
+ * Files are mapped rather than read, once for all hosts sending them at the
+ * same time, and written out WSH_SSH_SCP_CHUNK_SIZE bytes at a time.
+ *
  * @param[in] session wsh_ssh_session_t that we're transferring file over
  * @param[in] file The file or directory to transfer
  * @param[in] executable Should the file be executable?
@@ -230,6 +296,77 @@ __attribute__((nonnull))
 gint wsh_ssh_scp_file(wsh_ssh_session_t* session, const gchar* file,
                       gboolean executable, GError** err);
 
+/**
+ * @brief Send a payload
+ *
+ * The same payload can be sent over any number of sessions at once.
+ *
+ * @param[in] session wsh_ssh_session_t that we're transferring the payload over
+ * @param[in] payload Payload to send, from wsh_payload_new()
+ * @param[out] err GError describing the error condition
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_ssh_scp_payload(wsh_ssh_session_t* session,
+                         const wsh_payload_t* payload, GError** err);
+
+/**
+ * @brief Send files at their paths under the scp location
+ *
+ * Directories along each path are created as needed. Each file is sent
+ * from its entry's offset on.
+ *
+ * @param[in] session wsh_ssh_session_t that we're transferring files over
+ * @param[in] entries Files to send, sorted by path
+ * @param[in] len Length of entries
+ * @param[out] err GError describing the error condition
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_ssh_scp_entries(wsh_ssh_session_t* session,
+                         const wsh_manifest_entry_t** entries, gsize len,
+                         GError** err);
+
+/**
+ * @brief Send files as one tar stream, for wshd to unpack
+ *
+ * The archive is written straight from the files onto the channel, so the
+ * whole tree costs one scp push however many files are in it.
+ *
+ * @param[in] session wsh_ssh_session_t that we're transferring files over
+ * @param[in] name Name to give the archive under the scp location
+ * @param[in] entries Files to send, sorted by path
+ * @param[in] len Length of entries
+ * @param[out] err GError describing the error condition
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_ssh_scp_tar(wsh_ssh_session_t* session, const gchar* name,
+                     const wsh_manifest_entry_t** entries, gsize len,
+                     GError** err);
+
+/**
+ * @brief Fetch a remote file or directory into a local directory
+ *
+ * Runs its own scp session in read mode, so it doesn't need
+ * wsh_ssh_scp_init(). Files are streamed to disk WSH_SSH_SCP_CHUNK_SIZE
+ * bytes at a time rather than held in memory, and directories are
+ * recreated under dest. Names that would land outside dest are refused.
+ *
+ * @param[in] session Authenticated session to fetch over
+ * @param[in] remote Path on the remote host, relative to its home directory
+ * @param[in] dest Existing local directory to drop it in
+ * @param[out] err GError describing the error condition
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_ssh_scp_pull(wsh_ssh_session_t* session, const gchar* remote,
+                      const gchar* dest, GError** err);
+
 #ifdef BUILD_TESTS
 /**
  * @internal
@@ -0,0 +1,531 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include "tar.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#include <zlib.h>
+
+#include "types.h"
+
+static const gsize WSH_TAR_BUF_SIZE = 64 * 1024;
+
+/* ustar header, as laid out on disk */
+typedef struct {
+	gchar name[100];
+	gchar mode[8];
+	gchar uid[8];
+	gchar gid[8];
+	gchar size[12];
+	gchar mtime[12];
+	gchar chksum[8];
+	gchar typeflag;
+	gchar linkname[100];
+	gchar magic[6];
+	gchar version[2];
+	gchar uname[32];
+	gchar gname[32];
+	gchar devmajor[8];
+	gchar devminor[8];
+	gchar prefix[155];
+	gchar pad[12];
+} tar_header_t;
+
+G_STATIC_ASSERT(sizeof(tar_header_t) == WSH_TAR_BLOCK_SIZE);
+
+static const guint8 zeros[WSH_TAR_BLOCK_SIZE];
+
+/* Where the stream is going. A dry run only counts */
+typedef struct {
+	wsh_tar_write_fn write;
+	gpointer user_data;
+	guint64 written;
+	gboolean dry;
+} tar_out_t;
+
+__attribute__((nonnull))
+static gint out_write(tar_out_t* out, const guint8* buf, gsize len,
+                      GError** err) {
+	out->written += len;
+	if (out->dry || ! len)
+		return 0;
+
+	if (out->write(buf, len, out->user_data)) {
+		*err = g_error_new(WSH_TAR_ERROR, WSH_TAR_WRITE_ERR,
+		                   "Can't write tar stream");
+		return WSH_TAR_WRITE_ERR;
+	}
+
+	return 0;
+}
+
+static gsize padding(guint64 size) {
+	return (WSH_TAR_BLOCK_SIZE - size % WSH_TAR_BLOCK_SIZE) % WSH_TAR_BLOCK_SIZE;
+}
+
+// Numbers too big for octal are stored base-256, GNU style
+__attribute__((nonnull))
+static void put_number(gchar* field, gsize len, guint64 value) {
+	if (value < (G_GUINT64_CONSTANT(1) << (3 * (len - 1)))) {
+		g_snprintf(field, len, "%0*" G_GINT64_MODIFIER "o", (gint)len - 1, value);
+		return;
+	}
+
+	memset(field, 0, len);
+	for (gsize i = len - 1; i > 0; i--, value >>= 8)
+		field[i] = value & 0xff;
+	field[0] = (gchar)0x80;
+}
+
+__attribute__((nonnull))
+static guint64 get_number(const gchar* field, gsize len) {
+	guint64 value = 0;
+
+	if (field[0] & 0x80) {
+		for (gsize i = 1; i < len; i++)
+			value = (value << 8) | (guint8)field[i];
+		return value;
+	}
+
+	for (gsize i = 0; i < len && field[i]; i++) {
+		if (field[i] >= '0' && field[i] <= '7')
+			value = (value << 3) | (field[i] - '0');
+		else if (field[i] != ' ')
+			break;
+	}
+
+	return value;
+}
+
+// Splits a path into ustar's name and prefix fields
+__attribute__((nonnull))
+static gboolean split_name(const gchar* path, tar_header_t* hdr) {
+	gsize len = strlen(path);
+	if (len <= sizeof(hdr->name)) {
+		memcpy(hdr->name, path, len);
+		return TRUE;
+	}
+
+	for (const gchar* slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) {
+		gsize prefix_len = slash - path;
+		gsize name_len = len - prefix_len - 1;
+		if (prefix_len > sizeof(hdr->prefix))
+			break;
+
+		if (name_len && name_len <= sizeof(hdr->name)) {
+			memcpy(hdr->prefix, path, prefix_len);
+			memcpy(hdr->name, slash + 1, name_len);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+__attribute__((nonnull))
+static gint write_header(tar_out_t* out, const gchar* path, gchar typeflag,
+                         guint mode, guint64 size, gint64 mtime, GError** err) {
+	tar_header_t hdr;
+	memset(&hdr, 0, sizeof(hdr));
+
+	if (! split_name(path, &hdr)) {
+		*err = g_error_new(WSH_TAR_ERROR, WSH_TAR_NAME_ERR,
+		                   "%s: path is too long to archive", path);
+		return WSH_TAR_NAME_ERR;
+	}
+
+	put_number(hdr.mode, sizeof(hdr.mode), mode & 07777);
+	put_number(hdr.uid, sizeof(hdr.uid), 0);
+	put_number(hdr.gid, sizeof(hdr.gid), 0);
+	put_number(hdr.size, sizeof(hdr.size), size);
+	put_number(hdr.mtime, sizeof(hdr.mtime), MAX(mtime, 0));
+	hdr.typeflag = typeflag;
+	memcpy(hdr.magic, "ustar", 6);
+	memcpy(hdr.version, "00", 2);
+
+	// The checksum is taken with its own field full of spaces
+	memset(hdr.chksum, ' ', sizeof(hdr.chksum));
+	guint sum = 0;
+	for (gsize i = 0; i < sizeof(hdr); i++)
+		sum += ((const guint8*)&hdr)[i];
+	g_snprintf(hdr.chksum, sizeof(hdr.chksum), "%06o", sum);
+	hdr.chksum[7] = ' ';
+
+	return out_write(out, (const guint8*)&hdr, sizeof(hdr), err);
+}
+
+// Stores the directories above an entry that we haven't stored yet
+__attribute__((nonnull))
+static gint write_dirs(tar_out_t* out, const wsh_manifest_entry_t* entry,
+                       GHashTable* dirs, GError** err) {
+	gchar** parts = g_strsplit(entry->path, "/", 0);
+	guint depth = g_strv_length(parts) - 1;
+	gint ret = 0;
+
+	for (guint i = 0; i < depth && ! ret; i++) {
+		gchar* saved = parts[i + 1];
+		parts[i + 1] = NULL;
+		gchar* dir = g_strjoinv("/", parts);
+		parts[i + 1] = saved;
+
+		if (g_hash_table_contains(dirs, dir)) {
+			g_free(dir);
+			continue;
+		}
+
+		// Walk back up from the file to the same directory locally
+		gchar* local = g_strdup(entry->local);
+		for (guint j = i; j < depth; j++) {
+			gchar* parent = g_path_get_dirname(local);
+			g_free(local);
+			local = parent;
+		}
+
+		struct stat st = { .st_mode = 0755 };
+		if (! out->dry && g_stat(local, &st)) {
+			*err = g_error_new(WSH_TAR_ERROR, WSH_TAR_READ_ERR,
+			                   "%s: %s", local, strerror(errno));
+			ret = WSH_TAR_READ_ERR;
+		}
+
+		if (! ret) {
+			gchar* name = g_strconcat(dir, "/", NULL);
+			ret = write_header(out, name, '5', st.st_mode, 0, st.st_mtime, err);
+			g_free(name);
+		}
+
+		g_hash_table_add(dirs, dir);
+		g_free(local);
+	}
+
+	g_strfreev(parts);
+	return ret;
+}
+
+__attribute__((nonnull))
+static gint write_file(tar_out_t* out, const wsh_manifest_entry_t* entry,
+                      GError** err) {
+	gint ret = 0;
+
+	if (out->dry) {
+		if ((ret = write_header(out, entry->path, '0', 0644, entry->size, 0, err)))
+			return ret;
+		out->written += entry->size + padding(entry->size);
+		return 0;
+	}
+
+	struct stat st;
+	if (g_stat(entry->local, &st)) {
+		*err = g_error_new(WSH_TAR_ERROR, WSH_TAR_READ_ERR,
+		                   "%s: %s", entry->local, strerror(errno));
+		return WSH_TAR_READ_ERR;
+	}
+
+	GMappedFile* map = NULL;
+	GError* map_err = NULL;
+	if ((map = g_mapped_file_new(entry->local, FALSE, &map_err)) == NULL) {
+		*err = g_error_new(WSH_TAR_ERROR, WSH_TAR_READ_ERR, "%s", map_err->message);
+		g_error_free(map_err);
+		return WSH_TAR_READ_ERR;
+	}
+
+	gsize len = g_mapped_file_get_length(map);
+	if (len != entry->size) {
+		*err = g_error_new(WSH_TAR_ERROR, WSH_TAR_READ_ERR,
+		                   "%s changed while it was being sent", entry->local);
+		g_mapped_file_unref(map);
+		return WSH_TAR_READ_ERR;
+	}
+
+	if (! (ret = write_header(out, entry->path, '0', st.st_mode, len, st.st_mtime, err)) &&
+	        ! (ret = out_write(out, (const guint8*)g_mapped_file_get_contents(map), len, err)))
+		ret = out_write(out, zeros, padding(len), err);
+
+	g_mapped_file_unref(map);
+	return ret;
+}
+
+__attribute__((nonnull))
+static gint write_entries(tar_out_t* out, const wsh_manifest_entry_t** entries,
+                          gsize len, GError** err) {
+	WSH_TAR_ERROR = g_quark_from_static_string("wsh_tar_error");
+
+	GHashTable* dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	gint ret = 0;
+
+	for (gsize i = 0; i < len && ! ret; i++) {
+		if (! (ret = write_dirs(out, entries[i], dirs, err)))
+			ret = write_file(out, entries[i], err);
+	}
+
+	// Two empty blocks end the archive
+	if (! ret && ! (ret = out_write(out, zeros, sizeof(zeros), err)))
+		ret = out_write(out, zeros, sizeof(zeros), err);
+
+	g_hash_table_destroy(dirs);
+	return ret;
+}
+
+__attribute__((nonnull))
+gint wsh_tar_size(const wsh_manifest_entry_t** entries, gsize len,
+                  guint64* size, GError** err) {
+	tar_out_t out = { .dry = TRUE };
+	gint ret = write_entries(&out, entries, len, err);
+
+	*size = out.written;
+	return ret;
+}
+
+__attribute__((nonnull (1, 3, 5)))
+gint wsh_tar_stream(const wsh_manifest_entry_t** entries, gsize len,
+                    wsh_tar_write_fn write, gpointer user_data, GError** err) {
+	tar_out_t out = { .write = write, .user_data = user_data };
+	return write_entries(&out, entries, len, err);
+}
+
+__attribute__((nonnull))
+static gint read_full(gzFile in, const gchar* path, guint8* buf, gsize len,
+                      GError** err) {
+	gsize off = 0;
+	while (off < len) {
+		gint r = gzread(in, buf + off, len - off);
+		if (r <= 0) {
+			gint errnum = Z_OK;
+			const gchar* msg = gzerror(in, &errnum);
+			*err = g_error_new(WSH_TAR_ERROR, WSH_TAR_FORMAT_ERR, "%s: %s", path,
+			                   errnum == Z_OK ? "archive is truncated" :
+			                   errnum == Z_ERRNO ? strerror(errno) : msg);
+			return WSH_TAR_FORMAT_ERR;
+		}
+		off += r;
+	}
+
+	return 0;
+}
+
+// Nothing outside the archive's directory gets written
+static gboolean safe_name(const gchar* name) {
+	if (! *name || g_path_is_absolute(name))
+		return FALSE;
+
+	gchar** parts = g_strsplit(name, "/", 0);
+	gboolean safe = TRUE;
+	for (gchar** part = parts; *part && safe; part++)
+		safe = strcmp(*part, "..") != 0;
+
+	g_strfreev(parts);
+	return safe;
+}
+
+/* A directory whose mode and mtime get set once everything's inside it */
+typedef struct {
+	gchar* path;
+	guint mode;
+	gint64 mtime;
+} tar_dir_t;
+
+__attribute__((nonnull))
+static gint extract_file(gzFile in, const gchar* archive, const gchar* path,
+                         guint mode, guint64 size, guint8* buf, GError** err) {
+	gchar* dir = g_path_get_dirname(path);
+	gint ret = 0;
+	if (g_mkdir_with_parents(dir, 0755)) {
+		*err = g_error_new(WSH_TAR_ERROR, WSH_TAR_WRITE_ERR,
+		                   "%s: %s", dir, strerror(errno));
+		g_free(dir);
+		return WSH_TAR_WRITE_ERR;
+	}
+	g_free(dir);
+
+	gint fd = -1;
+	if ((fd = g_open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600)) == -1) {
+		*err = g_error_new(WSH_TAR_ERROR, WSH_TAR_WRITE_ERR,
+		                   "%s: %s", path, strerror(errno));
+		return WSH_TAR_WRITE_ERR;
+	}
+
+	for (guint64 left = size; left && ! ret; ) {
+		gsize chunk = MIN(left, WSH_TAR_BUF_SIZE);
+		if ((ret = read_full(in, archive, buf, chunk, err)))
+			break;
+
+		for (gsize off = 0; off < chunk; ) {
+			gssize w = write(fd, buf + off, chunk - off);
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w < 0) {
+				*err = g_error_new(WSH_TAR_ERROR, WSH_TAR_WRITE_ERR,
+				                   "%s: %s", path, strerror(errno));
+				ret = WSH_TAR_WRITE_ERR;
+				break;
+			}
+			off += w;
+		}
+		left -= chunk;
+	}
+
+	if (! ret && fchmod(fd, mode)) {
+		*err = g_error_new(WSH_TAR_ERROR, WSH_TAR_WRITE_ERR,
+		                   "%s: %s", path, strerror(errno));
+		ret = WSH_TAR_WRITE_ERR;
+	}
+
+	if (close(fd) && ! ret) {
+		*err = g_error_new(WSH_TAR_ERROR, WSH_TAR_WRITE_ERR,
+		                   "%s: %s", path, strerror(errno));
+		ret = WSH_TAR_WRITE_ERR;
+	}
+
+	return ret;
+}
+
+__attribute__((nonnull))
+static gint skip(gzFile in, const gchar* archive, guint64 len, guint8* buf,
+                 GError** err) {
+	gint ret = 0;
+	for (guint64 left = len; left && ! ret; left -= MIN(left, WSH_TAR_BUF_SIZE))
+		ret = read_full(in, archive, buf, MIN(left, WSH_TAR_BUF_SIZE), err);
+
+	return ret;
+}
+
+__attribute__((nonnull))
+gint wsh_tar_extract(const gchar* path, GError** err) {
+	WSH_TAR_ERROR = g_quark_from_static_string("wsh_tar_error");
+
+	gzFile in = NULL;
+	if ((in = gzopen(path, "rb")) == NULL) {
+		*err = g_error_new(WSH_TAR_ERROR, WSH_TAR_READ_ERR,
+		                   "%s: %s", path, strerror(errno));
+		return WSH_TAR_READ_ERR;
+	}
+
+	gchar* root = g_path_get_dirname(path);
+	guint8* buf = g_malloc(WSH_TAR_BUF_SIZE);
+	GArray* dirs = g_array_new(FALSE, FALSE, sizeof(tar_dir_t));
+	tar_header_t hdr;
+	gint ret = 0;
+
+	while (! (ret = read_full(in, path, (guint8*)&hdr, sizeof(hdr), err))) {
+		if (! memcmp(&hdr, zeros, sizeof(hdr)))
+			break;
+
+		guint sum = 0;
+		for (gsize i = 0; i < sizeof(hdr); i++)
+			sum += (i >= G_STRUCT_OFFSET(tar_header_t, chksum) &&
+			        i < G_STRUCT_OFFSET(tar_header_t, typeflag)) ?
+			       ' ' : ((const guint8*)&hdr)[i];
+		if (sum != get_number(hdr.chksum, sizeof(hdr.chksum))) {
+			*err = g_error_new(WSH_TAR_ERROR, WSH_TAR_FORMAT_ERR,
+			                   "%s: bad header checksum", path);
+			ret = WSH_TAR_FORMAT_ERR;
+			break;
+		}
+
+		gchar* name_part = g_strndup(hdr.name, sizeof(hdr.name));
+		gchar* name = NULL;
+		if (hdr.prefix[0]) {
+			gchar* prefix = g_strndup(hdr.prefix, sizeof(hdr.prefix));
+			name = g_strconcat(prefix, "/", name_part, NULL);
+			g_free(prefix);
+			g_free(name_part);
+		} else {
+			name = name_part;
+		}
+
+		while (g_str_has_suffix(name, "/"))
+			name[strlen(name) - 1] = '\0';
+
+		guint64 size = get_number(hdr.size, sizeof(hdr.size));
+		guint mode = get_number(hdr.mode, sizeof(hdr.mode)) & 07777;
+		gint64 mtime = get_number(hdr.mtime, sizeof(hdr.mtime));
+
+		if (! safe_name(name)) {
+			*err = g_error_new(WSH_TAR_ERROR, WSH_TAR_NAME_ERR,
+			                   "%s: refusing to extract %s", path, name);
+			g_free(name);
+			ret = WSH_TAR_NAME_ERR;
+			break;
+		}
+
+		gchar* dest = g_build_filename(root, name, NULL);
+		g_free(name);
+
+		switch (hdr.typeflag) {
+			case '5':
+				if (g_mkdir_with_parents(dest, 0700)) {
+					*err = g_error_new(WSH_TAR_ERROR, WSH_TAR_WRITE_ERR,
+					                   "%s: %s", dest, strerror(errno));
+					ret = WSH_TAR_WRITE_ERR;
+				} else {
+					tar_dir_t dir = { .path = dest, .mode = mode, .mtime = mtime };
+					g_array_append_val(dirs, dir);
+					dest = NULL;
+				}
+				break;
+			case '0':
+			case '\0':
+				if (! (ret = extract_file(in, path, dest, mode, size, buf, err))) {
+					struct utimbuf times = { .actime = mtime, .modtime = mtime };
+					(void) g_utime(dest, &times);
+					ret = skip(in, path, padding(size), buf, err);
+				}
+				break;
+			default:
+				// We never write anything else, so just step over it
+				ret = skip(in, path, size + padding(size), buf, err);
+				break;
+		}
+
+		g_free(dest);
+		if (ret)
+			break;
+	}
+
+	// Innermost first, so a read-only directory doesn't stop us finishing
+	// the ones inside it
+	for (guint i = dirs->len; i > 0; i--) {
+		tar_dir_t* dir = &g_array_index(dirs, tar_dir_t, i - 1);
+		if (! ret) {
+			struct utimbuf times = { .actime = dir->mtime, .modtime = dir->mtime };
+			(void) g_chmod(dir->path, dir->mode);
+			(void) g_utime(dir->path, &times);
+		}
+		g_free(dir->path);
+	}
+
+	g_array_free(dirs, TRUE);
+	g_free(buf);
+	g_free(root);
+	gzclose(in);
+
+	if (! ret)
+		(void) g_unlink(path);
+
+	return ret;
+}
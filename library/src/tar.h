@@ -0,0 +1,105 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/** @file
+ * @brief Streaming directory trees as one tar
+ *
+ * Pushing a tree file by file costs a round trip per file and per
+ * directory. Instead the client streams every file as one ustar archive,
+ * sized up front so it can go out as a single scp push, and wshd unpacks
+ * it in place.
+ */
+#ifndef __WSH_TAR_H
+#define __WSH_TAR_H
+
+#include <glib.h>
+
+#include "types.h"
+
+/** GQuark for tar errors */
+GQuark WSH_TAR_ERROR;
+
+/** Tar errors */
+typedef enum {
+	WSH_TAR_NAME_ERR,		/**< Path can't be stored, or isn't safe to extract */
+	WSH_TAR_READ_ERR,		/**< Can't read a file, or it changed size */
+	WSH_TAR_WRITE_ERR,		/**< Can't write the stream or an extracted file */
+	WSH_TAR_FORMAT_ERR,		/**< Archive is corrupt or truncated */
+} wsh_tar_err_enum;
+
+/** Appended to the name of an archive sent to the remote host */
+#define WSH_TAR_SUFFIX ".wshtar"
+
+/** Tar archives are made of blocks this big */
+#define WSH_TAR_BLOCK_SIZE 512
+
+/** Takes the next piece of a stream. Returns 0 on success */
+typedef gint (*wsh_tar_write_fn)(const guint8* buf, gsize len, gpointer user_data);
+
+/**
+ * @brief Works out how long the stream for some entries will be
+ *
+ * @param[in] entries Files to archive, named by their paths
+ * @param[in] len Length of entries
+ * @param[out] size Length of the stream wsh_tar_stream will write
+ * @param[out] err GError describing the failure
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_tar_size(const wsh_manifest_entry_t** entries, gsize len,
+                  guint64* size, GError** err);
+
+/**
+ * @brief Writes entries out as a ustar archive
+ *
+ * Each file is stored under its path, with its mode and mtime, preceded
+ * by any directories above it that haven't been stored yet. A file whose
+ * size no longer matches its entry fails the stream, since its size has
+ * already been promised.
+ *
+ * @param[in] entries Files to archive, named by their paths
+ * @param[in] len Length of entries
+ * @param[in] write Called with each piece of the stream, in order
+ * @param[in] user_data Passed to write
+ * @param[out] err GError describing the failure
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull (1, 3, 5)))
+gint wsh_tar_stream(const wsh_manifest_entry_t** entries, gsize len,
+                    wsh_tar_write_fn write, gpointer user_data, GError** err);
+
+/**
+ * @brief Unpacks an archive that's landed on this host
+ *
+ * Everything is extracted under the archive's directory, keeping modes
+ * and mtimes, and the archive is removed. gzipped archives are inflated
+ * on the way. Absolute paths and paths with .. in them are refused.
+ *
+ * @param[in] path Path of the archive
+ * @param[out] err GError describing the failure
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_tar_extract(const gchar* path, GError** err);
+
+#endif
@@ -0,0 +1,100 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include "throttle.h"
+
+#include <glib.h>
+
+__attribute__((nonnull))
+gint wsh_throttle_parse_rate(const gchar* spec, guint64* rate, GError** err) {
+	WSH_THROTTLE_ERROR = g_quark_from_static_string("wsh_throttle_error");
+
+	gchar* end = NULL;
+	guint64 value = g_ascii_strtoull(spec, &end, 10);
+	guint shift = 0;
+
+	switch (g_ascii_toupper(*end)) {
+		case 'K': shift = 10; end++; break;
+		case 'M': shift = 20; end++; break;
+		case 'G': shift = 30; end++; break;
+	}
+
+	if (! g_ascii_isdigit(*spec) || *end || ! value || value > (G_MAXUINT64 >> shift)) {
+		*err = g_error_new(WSH_THROTTLE_ERROR, WSH_THROTTLE_PARSE_ERR,
+		                   "%s isn't a rate, try something like 500K or 10M", spec);
+		return WSH_THROTTLE_PARSE_ERR;
+	}
+
+	*rate = value << shift;
+	return 0;
+}
+
+__attribute__((nonnull))
+void wsh_throttle_new(wsh_throttle_t** throttle, guint64 rate) {
+	g_assert(rate > 0);
+
+	*throttle = g_slice_new0(wsh_throttle_t);
+	(*throttle)->rate = rate;
+	(*throttle)->last = g_get_monotonic_time();
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	(*throttle)->mut = g_slice_new(GMutex);
+	g_mutex_init((*throttle)->mut);
+#else
+	(*throttle)->mut = g_mutex_new();
+#endif
+}
+
+void wsh_throttle_take(wsh_throttle_t* throttle, gsize len) {
+	if (! throttle) return;
+
+	g_mutex_lock(throttle->mut);
+
+	gint64 now = g_get_monotonic_time();
+	gdouble cap = (gdouble)throttle->rate * WSH_THROTTLE_BURST_USEC / G_USEC_PER_SEC;
+	throttle->tokens += (gdouble)throttle->rate * (now - throttle->last) / G_USEC_PER_SEC;
+	throttle->tokens = MIN(throttle->tokens, cap);
+	throttle->last = now;
+
+	// Taking more than there is puts the bucket in debt, so whoever comes
+	// next waits for us to be paid off first
+	throttle->tokens -= len;
+	gdouble owed = -throttle->tokens;
+
+	g_mutex_unlock(throttle->mut);
+
+	if (owed > 0)
+		g_usleep((gulong)(owed * G_USEC_PER_SEC / throttle->rate));
+}
+
+void wsh_throttle_free(wsh_throttle_t** throttle) {
+	if (! throttle || ! *throttle) return;
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	g_mutex_clear((*throttle)->mut);
+	g_slice_free(GMutex, (*throttle)->mut);
+#else
+	g_mutex_free((*throttle)->mut);
+#endif
+
+	g_slice_free(wsh_throttle_t, *throttle);
+	*throttle = NULL;
+}
@@ -0,0 +1,94 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/** @file
+ * @brief Capping how fast we push files
+ *
+ * Token buckets refilled at a fixed rate. Writers take the bytes they're
+ * about to send before sending them, and sleep off any shortfall, so one
+ * bucket shared between threads caps all of them together.
+ */
+#ifndef __WSH_THROTTLE_H
+#define __WSH_THROTTLE_H
+
+#include <glib.h>
+
+/** GQuark for throttle errors */
+GQuark WSH_THROTTLE_ERROR;
+
+/** Throttle errors */
+typedef enum {
+	WSH_THROTTLE_PARSE_ERR,		/**< Can't make sense of a rate */
+} wsh_throttle_err_enum;
+
+/** A bucket never saves up more than this long's worth of bytes */
+#define WSH_THROTTLE_BURST_USEC (G_USEC_PER_SEC / 10)
+
+/** A bandwidth limit */
+struct wsh_throttle {
+	GMutex* mut;		/**< protects tokens and last */
+	gdouble tokens;		/**< bytes that can go now, negative when in debt */
+	gint64 last;		/**< monotonic time tokens was last topped up */
+	guint64 rate;		/**< bytes per second */
+};
+
+/** A bandwidth limit, which may be shared between threads */
+typedef struct wsh_throttle wsh_throttle_t;
+
+/**
+ * @brief Parses a rate like 500K or 10M
+ *
+ * Rates are in bytes per second, with an optional K, M or G suffix for
+ * powers of 1024.
+ *
+ * @param[in] spec The rate to parse
+ * @param[out] rate Bytes per second
+ * @param[out] err GError describing the failure
+ *
+ * @returns 0 on success, anything else on failure
+ */
+__attribute__((nonnull))
+gint wsh_throttle_parse_rate(const gchar* spec, guint64* rate, GError** err);
+
+/**
+ * @brief Makes a bandwidth limit
+ *
+ * @param[out] throttle The new limit. Free with wsh_throttle_free
+ * @param[in] rate Bytes per second, more than 0
+ */
+__attribute__((nonnull))
+void wsh_throttle_new(wsh_throttle_t** throttle, guint64 rate);
+
+/**
+ * @brief Waits until len bytes can be sent
+ *
+ * @param[in] throttle The limit, or NULL for none
+ * @param[in] len Bytes about to be sent
+ */
+void wsh_throttle_take(wsh_throttle_t* throttle, gsize len);
+
+/**
+ * @brief Frees a bandwidth limit
+ *
+ * @param[in,out] throttle The limit to free, is set to NULL
+ */
+void wsh_throttle_free(wsh_throttle_t** throttle);
+
+#endif
@@ -24,27 +24,80 @@
 #ifndef __WSH_TYPES_H
 #define __WSH_TYPES_H
 
+#include <string.h>
+
+#if ! GLIB_CHECK_VERSION( 2, 68, 0 )
+// g_memdup() takes a guint and truncates anything 4GiB or larger
+static inline gpointer g_memdup2(gconstpointer mem, gsize byte_size) {
+	if (! mem || ! byte_size)
+		return NULL;
+
+	gpointer ret = g_malloc(byte_size);
+	memcpy(ret, mem, byte_size);
+	return ret;
+}
+#endif
+
 /** Union to easily get message sizes from byte strings */
 typedef union {
 	volatile guint32 size;	/**< guint32 representation of message size */
 	gchar buf[4];			/**< Byte string representation of message size */
 } wsh_message_size_t;
 
+/** A file we might send, and what it hashes to
+ */
+typedef struct {
+	gchar* path;		/**< Path under the destination, '/' separated */
+	gchar* local;		/**< Where the file is locally. Not sent */
+	gchar* hash;		/**< Hex SHA-256 of the contents */
+	gchar** chunks;		/**< Hex SHA-256 of each chunk, NULL unless resumable */
+	gsize chunks_len;	/**< The length of chunks */
+	guint64 size;		/**< Size in bytes */
+	guint64 offset;		/**< Where sending starts, when resuming. Not sent */
+} wsh_manifest_entry_t;
+
 /** A command request that we send to a remote host
  */
 typedef struct {
 	gchar** env;		/**< The environment to execute in */
 	gchar** std_input;	/**< A NULL terminated array of std input */
+	gchar** relay_hosts;	/**< Hosts to relay the command to, NULL for none */
+	gchar** inflate;	/**< Payloads to inflate before running, NULL for none */
+	gchar** untar;		/**< Archives to unpack before running, NULL for none */
+	gchar** argv;		/**< Arguments to exec as they are, NULL to parse cmd_string */
+	wsh_manifest_entry_t* manifest;	/**< Files to check for, NULL for none */
+	wsh_manifest_entry_t* distribute;	/**< Files to verify and pass on to relay_hosts, NULL for none */
+	wsh_manifest_entry_t* complete;	/**< Resumable files that have been sent, NULL for none */
 	gchar* cmd_string;	/**< The command to run */
 	gchar* username;	/**< The username to execute as */
 	gchar* password;	/**< The password to use with sudo */
 	gchar* cwd;			/**< Directory to execute in */
 	gchar* host;		/**< The host we're sending the request from */
+	gchar* script_name;	/**< Name to run script as, NULL for no script */
+	gchar* expect_hash;	/**< Hex SHA-256 of the output we expect, NULL for none */
+	gchar* fetch_spool;	/**< Send back this spooled result instead of running anything, NULL for none */
+	guint8* script;		/**< Script to run the command with */
+	gsize script_len;	/**< The length of script */
 	gsize std_input_len; /**< The length of std_input */
+	gsize relay_hosts_len;	/**< The length of relay_hosts */
+	gsize inflate_len;	/**< The length of inflate */
+	gsize untar_len;	/**< The length of untar */
+	gsize argv_len;		/**< The length of argv */
+	gsize manifest_len;	/**< The length of manifest */
+	gsize distribute_len;	/**< The length of distribute */
+	gsize complete_len;	/**< The length of complete */
 	guint64 timeout;	/**< Maximum time to let a command run. 0 for none */
 	gint in_fd;			/**< Internal use only */
+	gint relay_port;	/**< Port relays ssh to, 0 for the default */
+	guint relay_depth;	/**< Levels of relays left below this one, including it */
+	guint relay_threads;	/**< Threads a relay fans out with, 0 for the default */
+	guint compress_level;	/**< zlib level to compress big replies at, 0 for none */
+	guint aggregate_op;	/**< wsh_aggregate_op_t to send stdout back as, 0 for none */
 	gboolean sudo;		/**< Whether or not to use sudo */
 	gboolean use_shell;	/**< Whether or not to use sudo with a shell or direct execution */
+	gboolean passthrough;	/**< Stream output back raw as it comes, instead of in the result */
+	gboolean raw_output;	/**< Send output back as it was written, instead of in lines */
+	gboolean summary_only;	/**< Spool the output, and send back only a summary of it */
 } wsh_cmd_req_t;
 
 /** Result from running a command
@@ -53,10 +106,28 @@ typedef struct {
 	GError* err;			/**< GError for use in Glib functions */
 	gchar** std_output;		/**< Standard output from command */
 	gchar** std_error;		/**< Standard error from command */
+	guint8* std_output_raw;	/**< stdout as it was written, for raw_output requests. NULL otherwise */
+	guint8* std_error_raw;	/**< stderr as it was written, for raw_output requests. NULL otherwise */
+	guint32* std_output_index;	/**< Offset just past each newline in std_output_raw, NULL if not sent */
+	guint32* std_error_index;	/**< Offset just past each newline in std_error_raw, NULL if not sent */
+	gchar** hosts;			/**< Hosts that produced this result, when relayed */
+	gchar** stale;			/**< Manifest paths that need sending */
+	guint64* resume;		/**< Verified bytes held of each stale path, NULL for none */
 	gchar* error_message;	/**< Error for use in client */
+	gchar* spool_id;		/**< Where the full output is spooled, for summaries. NULL otherwise */
+	gchar* output_hash;		/**< wsh_response_hash() of the full output, for summaries */
+	struct wsh_aggregate* aggregate;	/**< stdout boiled down, for aggregate_op requests. NULL otherwise */
+	guint64 output_size;	/**< Bytes of the full output, for summaries */
 	gsize std_output_len;	/**< Length of stdout */
 	gsize std_error_len;	/**< Length of stderr */
+	gsize std_output_raw_len;	/**< Length of std_output_raw */
+	gsize std_error_raw_len;	/**< Length of std_error_raw */
+	gsize std_output_index_len;	/**< Length of std_output_index */
+	gsize std_error_index_len;	/**< Length of std_error_index */
+	gsize hosts_len;		/**< Length of hosts */
+	gsize stale_len;		/**< Length of stale */
 	gint exit_status;		/**< Return code of command */
+	gboolean matches;		/**< Output matched the request's expect_hash, and was left out */
 	gint out_fd;			/**< Internal use only */
 	gint err_fd;			/**< Internal use only */
 } wsh_cmd_res_t;
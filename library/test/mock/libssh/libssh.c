@@ -33,6 +33,7 @@ gint ssh_connect_ret;
 gint ssh_write_knownhost_ret;
 gint ssh_userauth_list_ret;
 gint ssh_userauth_autopubkey_ret;
+guint ssh_userauth_autopubkey_calls;
 gint ssh_userauth_kbdint_ret;
 gint ssh_userauth_kbdint_setanswer_ret;
 gint ssh_userauth_password_ret;
@@ -45,11 +46,18 @@ gboolean ssh_channel_read_ret_first = TRUE;
 gint ssh_channel_request_pty_ret;
 gint ssh_channel_request_shell_ret;
 gint ssh_channel_change_pty_size_ret;
+gint ssh_channel_open_forward_ret;
+gint ssh_channel_read_nonblocking_ret;
 gpointer ssh_scp_new_ret;
 gint ssh_scp_init_ret;
 gint ssh_scp_push_file_ret;
 gint ssh_scp_push_directory_ret;
+guint ssh_scp_push_directory_calls;
+guint ssh_scp_leave_directory_calls;
 gint ssh_scp_write_ret;
+guint ssh_scp_write_calls;
+gsize ssh_scp_write_max;
+gsize ssh_scp_write_total;
 gint ssh_channel_poll_timeout_ret;
 gint ssh_new_ret = 1;
 
@@ -57,6 +65,8 @@ gint ssh_strict_hostkey_checking = 1;
 gchar ssh_connect_timeout[4] = { 0 };
 
 void* ssh_channel_read_set;
+const guint8* ssh_channel_read_stream;
+gsize ssh_channel_read_stream_len;
 guint8 ssh_channel_read_size[4] = { 0x00, 0x00, 0x00, 0x11, };
 
 gint ssh_get_publickey() {
@@ -177,9 +187,15 @@ gint ssh_userauth_list() {
 
 void set_ssh_userauth_autopubkey(gint ret) {
 	ssh_userauth_autopubkey_ret = ret;
+	ssh_userauth_autopubkey_calls = 0;
+}
+
+guint get_ssh_userauth_autopubkey_calls(void) {
+	return ssh_userauth_autopubkey_calls;
 }
 
 gint ssh_userauth_autopubkey() {
+	ssh_userauth_autopubkey_calls++;
 	return ssh_userauth_autopubkey_ret;
 }
 
@@ -260,8 +276,22 @@ void set_ssh_channel_read_set(void* buf) {
 	ssh_channel_read_set = buf;
 }
 
+// Reads come from buf in order, as much as fits each time, then EOF
+void set_ssh_channel_read_stream(const void* buf, gsize len) {
+	ssh_channel_read_stream = buf;
+	ssh_channel_read_stream_len = len;
+}
+
 gint ssh_channel_read(ssh_channel channel, void* buf, guint32 buf_len,
                       gboolean is_stderr) {
+	if (ssh_channel_read_stream) {
+		gsize len = MIN(buf_len, ssh_channel_read_stream_len);
+		memmove(buf, ssh_channel_read_stream, len);
+		ssh_channel_read_stream += len;
+		ssh_channel_read_stream_len -= len;
+		return len;
+	}
+
 	if (buf_len == 4) {
 		memmove(buf, ssh_channel_read_size, buf_len);
 	} else {
@@ -310,6 +340,34 @@ gint ssh_channel_send_eof() {
 	return 0;
 }
 
+void set_ssh_channel_open_forward_ret(gint ret) {
+	ssh_channel_open_forward_ret = ret;
+}
+
+gint ssh_channel_open_forward() {
+	return ssh_channel_open_forward_ret;
+}
+
+void set_ssh_channel_read_nonblocking_ret(gint ret) {
+	ssh_channel_read_nonblocking_ret = ret;
+}
+
+gint ssh_channel_read_nonblocking() {
+	return ssh_channel_read_nonblocking_ret;
+}
+
+gint ssh_channel_is_eof() {
+	return 0;
+}
+
+gint ssh_channel_is_closed() {
+	return 0;
+}
+
+guint32 ssh_channel_window_size() {
+	return 0;
+}
+
 gint ssh_userauth_none() {
 	return 0;
 }
@@ -355,24 +413,110 @@ gint ssh_scp_push_file() {
 
 void set_ssh_scp_push_directory_ret(gint ret) {
 	ssh_scp_push_directory_ret = ret;
+	ssh_scp_push_directory_calls = 0;
+	ssh_scp_leave_directory_calls = 0;
+}
+
+void get_ssh_scp_directory_stats(guint* pushed, guint* left) {
+	*pushed = ssh_scp_push_directory_calls;
+	*left = ssh_scp_leave_directory_calls;
 }
 
 gint ssh_scp_push_directory() {
+	ssh_scp_push_directory_calls++;
 	return ssh_scp_push_directory_ret;
 }
 
 void set_ssh_scp_write_ret(gint ret) {
 	ssh_scp_write_ret = ret;
+	ssh_scp_write_calls = 0;
+	ssh_scp_write_max = 0;
+	ssh_scp_write_total = 0;
+}
+
+void get_ssh_scp_write_stats(guint* calls, gsize* max, gsize* total) {
+	*calls = ssh_scp_write_calls;
+	*max = ssh_scp_write_max;
+	*total = ssh_scp_write_total;
 }
 
-gint ssh_scp_write() {
+gint ssh_scp_write(ssh_scp scp, const void* buf, gsize len) {
+	ssh_scp_write_calls++;
+	ssh_scp_write_max = MAX(ssh_scp_write_max, len);
+	ssh_scp_write_total += len;
 	return ssh_scp_write_ret;
 }
 
 void ssh_scp_close() {
 }
 
+const mock_scp_request_t* ssh_scp_pull_reqs;
+gsize ssh_scp_pull_reqs_len;
+gsize ssh_scp_pull_next;
+guint64 ssh_scp_read_left;
+gint ssh_scp_read_ret;
+
+void set_ssh_scp_pull_requests(const mock_scp_request_t* reqs, gsize len) {
+	ssh_scp_pull_reqs = reqs;
+	ssh_scp_pull_reqs_len = len;
+	ssh_scp_pull_next = 0;
+	ssh_scp_read_left = 0;
+}
+
+static const mock_scp_request_t* current_pull_request(void) {
+	return &ssh_scp_pull_reqs[ssh_scp_pull_next - 1];
+}
+
+gint ssh_scp_pull_request(ssh_scp scp) {
+	if (ssh_scp_pull_next == ssh_scp_pull_reqs_len)
+		return SSH_SCP_REQUEST_EOF;
+
+	const mock_scp_request_t* req = &ssh_scp_pull_reqs[ssh_scp_pull_next++];
+	ssh_scp_read_left = req->size;
+	return req->type;
+}
+
+const gchar* ssh_scp_request_get_filename(ssh_scp scp) {
+	return current_pull_request()->name;
+}
+
+const gchar* ssh_scp_request_get_warning(ssh_scp scp) {
+	return current_pull_request()->name;
+}
+
+gint ssh_scp_request_get_permissions(ssh_scp scp) {
+	return current_pull_request()->mode;
+}
+
+guint64 ssh_scp_request_get_size64(ssh_scp scp) {
+	return current_pull_request()->size;
+}
+
+gint ssh_scp_accept_request(ssh_scp scp) {
+	return SSH_OK;
+}
+
+gint ssh_scp_deny_request(ssh_scp scp, const gchar* reason) {
+	return SSH_OK;
+}
+
+void set_ssh_scp_read_ret(gint ret) {
+	ssh_scp_read_ret = ret;
+}
+
+// Hands back files full of 'x', in pieces no bigger than 1000 bytes
+gint ssh_scp_read(ssh_scp scp, void* buf, gsize len) {
+	if (ssh_scp_read_ret)
+		return ssh_scp_read_ret;
+
+	gsize n = MIN(MIN(len, 1000), ssh_scp_read_left);
+	memset(buf, 'x', n);
+	ssh_scp_read_left -= n;
+	return n;
+}
+
 gint ssh_scp_leave_directory() {
+	ssh_scp_leave_directory_calls++;
 	return 0;
 }
 
@@ -51,6 +51,23 @@
 
 #define SSH_SCP_WRITE 0
 #define SSH_SCP_RECURSIVE 1
+#define SSH_SCP_READ 2
+
+enum ssh_scp_request_types {
+	SSH_SCP_REQUEST_NEWDIR = 1,
+	SSH_SCP_REQUEST_NEWFILE,
+	SSH_SCP_REQUEST_EOF,
+	SSH_SCP_REQUEST_ENDDIR,
+	SSH_SCP_REQUEST_WARNING,
+};
+
+/* One step of what the remote scp sends when we pull */
+typedef struct {
+	gint type;			/* SSH_SCP_REQUEST_*, or SSH_ERROR */
+	const gchar* name;	/* file or directory name, or the warning */
+	guint64 size;
+	gint mode;
+} mock_scp_request_t;
 
 typedef void* ssh_session;
 typedef void* ssh_channel;
@@ -112,6 +129,7 @@ void ssh_options_parse_config();
 void set_ssh_userauth_list_ret(gint ret);
 gint ssh_userauth_list();
 void set_ssh_userauth_autopubkey(gint ret);
+guint get_ssh_userauth_autopubkey_calls(void);
 gint ssh_userauth_autopubkey();
 void set_ssh_userauth_kbdint_ret(gint ret);
 gint ssh_userauth_kbdint();
@@ -130,6 +148,7 @@ void set_ssh_channel_write_ret(gint ret);
 gint ssh_channel_write();
 void set_ssh_channel_read_ret(gint ret);
 void set_ssh_channel_read_set(void* buf);
+void set_ssh_channel_read_stream(const void* buf, gsize len);
 gint ssh_channel_read(ssh_channel channel, void* buf, guint32 buf_len,
                       gboolean is_stderr);
 void set_ssh_channel_request_pty_ret(gint ret);
@@ -140,6 +159,13 @@ void reset_ssh_channel_write_first(gboolean first);
 void set_ssh_channel_change_pty_size_ret(gint ret);
 gint ssh_channel_change_pty_size();
 gint ssh_channel_send_eof();
+void set_ssh_channel_open_forward_ret(gint ret);
+gint ssh_channel_open_forward();
+void set_ssh_channel_read_nonblocking_ret(gint ret);
+gint ssh_channel_read_nonblocking();
+gint ssh_channel_is_eof();
+gint ssh_channel_is_closed();
+guint32 ssh_channel_window_size();
 gint ssh_userauth_none();
 ssh_pcap_file ssh_pcap_file_new();
 gint ssh_pcap_file_open();
@@ -152,10 +178,22 @@ void ssh_scp_free();
 void set_ssh_scp_push_file_ret(gint ret);
 gint ssh_scp_push_file();
 void set_ssh_scp_push_directory_ret(gint ret);
+void get_ssh_scp_directory_stats(guint* pushed, guint* left);
 gint ssh_scp_push_directory();
 void set_ssh_scp_write_ret(gint ret);
-gint ssh_scp_write();
+void get_ssh_scp_write_stats(guint* calls, gsize* max, gsize* total);
+gint ssh_scp_write(ssh_scp scp, const void* buf, gsize len);
 void ssh_scp_close();
+void set_ssh_scp_pull_requests(const mock_scp_request_t* reqs, gsize len);
+gint ssh_scp_pull_request(ssh_scp scp);
+const gchar* ssh_scp_request_get_filename(ssh_scp scp);
+const gchar* ssh_scp_request_get_warning(ssh_scp scp);
+gint ssh_scp_request_get_permissions(ssh_scp scp);
+guint64 ssh_scp_request_get_size64(ssh_scp scp);
+gint ssh_scp_accept_request(ssh_scp scp);
+gint ssh_scp_deny_request(ssh_scp scp, const gchar* reason);
+void set_ssh_scp_read_ret(gint ret);
+gint ssh_scp_read(ssh_scp scp, void* buf, gsize len);
 gint ssh_scp_leave_directory();
 void set_ssh_channel_poll_timeout_ret(gint ret);
 gint ssh_channel_poll_timeout();
@@ -0,0 +1,143 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include <glib.h>
+
+#include "sftp.h"
+
+sftp_session sftp_new_ret = (sftp_session)1;
+gint sftp_init_ret;
+gint sftp_mkdir_ret;
+gint sftp_mkdir_error;
+guint sftp_mkdir_calls;
+sftp_file sftp_open_ret = (sftp_file)1;
+gint sftp_write_ret;
+guint sftp_write_calls;
+gsize sftp_write_total;
+guint sftp_inflight;
+guint sftp_max_inflight;
+guint sftp_opened;
+guint sftp_closed;
+
+void set_sftp_new_ret(sftp_session ret) {
+	sftp_new_ret = ret;
+}
+
+sftp_session sftp_new(ssh_session session) {
+	return sftp_new_ret;
+}
+
+void set_sftp_init_ret(gint ret) {
+	sftp_init_ret = ret;
+}
+
+gint sftp_init(sftp_session sftp) {
+	return sftp_init_ret;
+}
+
+void sftp_free(sftp_session sftp) {
+}
+
+void set_sftp_mkdir_ret(gint ret, gint error) {
+	sftp_mkdir_ret = ret;
+	sftp_mkdir_error = error;
+	sftp_mkdir_calls = 0;
+}
+
+void get_sftp_mkdir_stats(guint* calls) {
+	*calls = sftp_mkdir_calls;
+}
+
+gint sftp_mkdir(sftp_session sftp, const gchar* dir, mode_t mode) {
+	sftp_mkdir_calls++;
+	return sftp_mkdir_ret;
+}
+
+gint sftp_get_error(sftp_session sftp) {
+	return sftp_mkdir_error;
+}
+
+void set_sftp_open_ret(sftp_file ret) {
+	sftp_open_ret = ret;
+}
+
+sftp_file sftp_open(sftp_session sftp, const gchar* file, gint flags, mode_t mode) {
+	if (sftp_open_ret)
+		sftp_opened++;
+	return sftp_open_ret;
+}
+
+gint sftp_close(sftp_file file) {
+	sftp_closed++;
+	return 0;
+}
+
+void set_sftp_write_ret(gint ret) {
+	sftp_write_ret = ret;
+	sftp_write_calls = 0;
+	sftp_write_total = 0;
+	sftp_inflight = 0;
+	sftp_max_inflight = 0;
+	sftp_opened = 0;
+	sftp_closed = 0;
+}
+
+void get_sftp_write_stats(guint* writes, gsize* total, guint* max_inflight,
+                          guint* opened, guint* closed) {
+	*writes = sftp_write_calls;
+	*total = sftp_write_total;
+	*max_inflight = sftp_max_inflight;
+	*opened = sftp_opened;
+	*closed = sftp_closed;
+}
+
+gssize sftp_write(sftp_file file, const void* buf, gsize len) {
+	sftp_write_calls++;
+	sftp_write_total += len;
+	sftp_max_inflight = MAX(sftp_max_inflight, 1);
+	return sftp_write_ret ? -1 : (gssize)len;
+}
+
+gssize sftp_aio_begin_write(sftp_file file, const void* buf, gsize len,
+                            sftp_aio* aio) {
+	sftp_write_calls++;
+	sftp_write_total += len;
+	sftp_inflight++;
+	sftp_max_inflight = MAX(sftp_max_inflight, sftp_inflight);
+
+	gsize* handle = g_new(gsize, 1);
+	*handle = len;
+	*aio = handle;
+	return len;
+}
+
+gssize sftp_aio_wait_write(sftp_aio* aio) {
+	gssize len = *(gsize*)*aio;
+	sftp_inflight--;
+
+	g_free(*aio);
+	*aio = NULL;
+	return sftp_write_ret ? -1 : len;
+}
+
+void sftp_aio_free(sftp_aio aio) {
+	g_free(aio);
+}
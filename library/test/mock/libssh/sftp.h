@@ -0,0 +1,63 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __WSH_MOCK_SFTP_H
+#define __WSH_MOCK_SFTP_H
+
+#include "config.h"
+#include <glib.h>
+#include <sys/types.h>
+
+#include "libssh.h"
+
+#define SSH_FX_OK 0
+#define SSH_FX_FAILURE 4
+#define SSH_FX_PERMISSION_DENIED 3
+#define SSH_FX_FILE_ALREADY_EXISTS 11
+
+typedef void* sftp_session;
+typedef void* sftp_file;
+typedef void* sftp_aio;
+
+void set_sftp_new_ret(sftp_session ret);
+sftp_session sftp_new(ssh_session session);
+void set_sftp_init_ret(gint ret);
+gint sftp_init(sftp_session sftp);
+void sftp_free(sftp_session sftp);
+
+void set_sftp_mkdir_ret(gint ret, gint error);
+void get_sftp_mkdir_stats(guint* calls);
+gint sftp_mkdir(sftp_session sftp, const gchar* dir, mode_t mode);
+gint sftp_get_error(sftp_session sftp);
+
+void set_sftp_open_ret(sftp_file ret);
+sftp_file sftp_open(sftp_session sftp, const gchar* file, gint flags, mode_t mode);
+gint sftp_close(sftp_file file);
+
+void set_sftp_write_ret(gint ret);
+void get_sftp_write_stats(guint* writes, gsize* total, guint* max_inflight,
+                          guint* opened, guint* closed);
+gssize sftp_write(sftp_file file, const void* buf, gsize len);
+gssize sftp_aio_begin_write(sftp_file file, const void* buf, gsize len,
+                            sftp_aio* aio);
+gssize sftp_aio_wait_write(sftp_aio* aio);
+void sftp_aio_free(sftp_aio aio);
+
+#endif
@@ -0,0 +1,294 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include <glib.h>
+#include <math.h>
+#include <string.h>
+
+#include "aggregate.h"
+#include "pack.h"
+
+static guint64 count_of(const wsh_aggregate_t* agg, const gchar* line) {
+	guint64* count = g_hash_table_lookup(agg->counts, line);
+	return count ? *count : 0;
+}
+
+static guint64 bucket_of(const wsh_aggregate_t* agg, gint bucket) {
+	guint64* count = g_hash_table_lookup(agg->buckets, GINT_TO_POINTER(bucket));
+	return count ? *count : 0;
+}
+
+static void parse_op(void) {
+	GError* err = NULL;
+	wsh_aggregate_op_t op = WSH_AGGREGATE_NONE;
+
+	g_assert(! wsh_aggregate_parse_op("uniq-count", &op, &err));
+	g_assert_cmpint(op, ==, WSH_AGGREGATE_UNIQ_COUNT);
+	g_assert(! wsh_aggregate_parse_op("histogram", &op, &err));
+	g_assert_cmpint(op, ==, WSH_AGGREGATE_HISTOGRAM);
+	g_assert_no_error(err);
+
+	for (gint i = WSH_AGGREGATE_NONE + 1; i < WSH_AGGREGATE_MAX; i++) {
+		g_assert(! wsh_aggregate_parse_op(wsh_aggregate_op_name(i), &op, &err));
+		g_assert_cmpint(op, ==, i);
+	}
+	g_assert(wsh_aggregate_op_name(WSH_AGGREGATE_NONE) == NULL);
+	g_assert(wsh_aggregate_op_name(WSH_AGGREGATE_MAX) == NULL);
+
+	const gchar* bad[] = { "", "count", "SUM", "uniq-count " };
+	for (gsize i = 0; i < G_N_ELEMENTS(bad); i++) {
+		g_assert(wsh_aggregate_parse_op(bad[i], &op, &err));
+		g_assert_error(err, WSH_AGGREGATE_ERROR, WSH_AGGREGATE_PARSE_ERR);
+		g_error_free(err);
+		err = NULL;
+	}
+}
+
+static void uniq_count(void) {
+	guint8 raw[] = "5.15\n6.1\n5.15\n\n6.1";
+	wsh_cmd_res_t res = {
+		.std_output_raw = raw,
+		.std_output_raw_len = sizeof(raw) - 1,
+	};
+
+	wsh_aggregate_t* agg = NULL;
+	wsh_aggregate_new(&agg, WSH_AGGREGATE_UNIQ_COUNT);
+	wsh_aggregate_output(agg, &res);
+
+	// Including the empty line, and the last without a newline
+	g_assert_cmpuint(g_hash_table_size(agg->counts), ==, 3);
+	g_assert_cmpuint(count_of(agg, "5.15"), ==, 2);
+	g_assert_cmpuint(count_of(agg, "6.1"), ==, 2);
+	g_assert_cmpuint(count_of(agg, ""), ==, 1);
+
+	// Lines count the same as the raw output they came from
+	gchar* lines[] = { "5.15", NULL };
+	wsh_cmd_res_t split = {
+		.std_output = lines,
+		.std_output_len = 1,
+	};
+	wsh_aggregate_output(agg, &split);
+	g_assert_cmpuint(count_of(agg, "5.15"), ==, 3);
+
+	wsh_aggregate_free(&agg);
+	g_assert(agg == NULL);
+}
+
+static void numbers(void) {
+	gchar* lines[] = { "3", " -1.5 ", "1e3", "nan", "inf", "12abc", "", "0x10", NULL };
+	wsh_cmd_res_t res = {
+		.std_output = lines,
+		.std_output_len = g_strv_length(lines),
+	};
+
+	wsh_aggregate_t* agg = NULL;
+	wsh_aggregate_new(&agg, WSH_AGGREGATE_SUM);
+	wsh_aggregate_output(agg, &res);
+
+	// Hex is a number to strtod, but NaN and infinity aren't worth adding
+	g_assert_cmpuint(agg->values, ==, 4);
+	g_assert_cmpuint(agg->skipped, ==, 4);
+	g_assert_cmpfloat(agg->sum, ==, 3 - 1.5 + 1000 + 16);
+	g_assert_cmpfloat(agg->min, ==, -1.5);
+	g_assert_cmpfloat(agg->max, ==, 1000);
+	g_assert(agg->counts == NULL);
+	g_assert(agg->buckets == NULL);
+
+	wsh_aggregate_free(&agg);
+}
+
+static void buckets(void) {
+	g_assert_cmpint(wsh_aggregate_bucket(0), ==, 0);
+	g_assert_cmpint(wsh_aggregate_bucket(1), ==, wsh_aggregate_bucket(1.99));
+	g_assert_cmpint(wsh_aggregate_bucket(1), <, wsh_aggregate_bucket(2));
+	g_assert_cmpint(wsh_aggregate_bucket(-1), ==, -wsh_aggregate_bucket(1));
+	g_assert_cmpint(wsh_aggregate_bucket(-4), <, wsh_aggregate_bucket(-3));
+	g_assert_cmpint(wsh_aggregate_bucket(4.9e-324), >, 0);
+	g_assert_cmpint(wsh_aggregate_bucket(-4.9e-324), <, 0);
+
+	gdouble low, high;
+	wsh_aggregate_bucket_range(wsh_aggregate_bucket(5), &low, &high);
+	g_assert_cmpfloat(low, ==, 4);
+	g_assert_cmpfloat(high, ==, 8);
+	wsh_aggregate_bucket_range(wsh_aggregate_bucket(-5), &low, &high);
+	g_assert_cmpfloat(low, ==, -8);
+	g_assert_cmpfloat(high, ==, -4);
+	wsh_aggregate_bucket_range(0, &low, &high);
+	g_assert_cmpfloat(low, ==, 0);
+	g_assert_cmpfloat(high, ==, 0);
+
+	gchar* lines[] = { "5", "6", "7.9", "8", "0", "-5", NULL };
+	wsh_cmd_res_t res = {
+		.std_output = lines,
+		.std_output_len = g_strv_length(lines),
+	};
+
+	wsh_aggregate_t* agg = NULL;
+	wsh_aggregate_new(&agg, WSH_AGGREGATE_HISTOGRAM);
+	wsh_aggregate_output(agg, &res);
+
+	g_assert_cmpuint(g_hash_table_size(agg->buckets), ==, 4);
+	g_assert_cmpuint(bucket_of(agg, wsh_aggregate_bucket(4)), ==, 3);
+	g_assert_cmpuint(bucket_of(agg, wsh_aggregate_bucket(8)), ==, 1);
+	g_assert_cmpuint(bucket_of(agg, 0), ==, 1);
+	g_assert_cmpuint(bucket_of(agg, wsh_aggregate_bucket(-4.5)), ==, 1);
+	g_assert_cmpfloat(agg->min, ==, -5);
+	g_assert_cmpfloat(agg->max, ==, 8);
+
+	wsh_aggregate_free(&agg);
+}
+
+static void merge(void) {
+	gchar* first[] = { "1", "2", "x", NULL };
+	gchar* second[] = { "-7", "100", NULL };
+	gchar* both[] = { "1", "2", "x", "-7", "100", NULL };
+
+	for (gint op = WSH_AGGREGATE_NONE + 1; op < WSH_AGGREGATE_MAX; op++) {
+		wsh_aggregate_t* a = NULL, * b = NULL, * whole = NULL;
+		wsh_aggregate_new(&a, op);
+		wsh_aggregate_new(&b, op);
+		wsh_aggregate_new(&whole, op);
+
+		wsh_cmd_res_t res = { .std_output = first, .std_output_len = 3 };
+		wsh_aggregate_output(a, &res);
+		res.std_output = second;
+		res.std_output_len = 2;
+		wsh_aggregate_output(b, &res);
+		res.std_output = both;
+		res.std_output_len = 5;
+		wsh_aggregate_output(whole, &res);
+
+		// Merging partials comes out the same as aggregating everything
+		wsh_aggregate_merge(a, b);
+		g_assert_cmpfloat(a->sum, ==, whole->sum);
+		g_assert_cmpfloat(a->min, ==, whole->min);
+		g_assert_cmpfloat(a->max, ==, whole->max);
+		g_assert_cmpuint(a->values, ==, whole->values);
+		g_assert_cmpuint(a->skipped, ==, whole->skipped);
+		if (op == WSH_AGGREGATE_UNIQ_COUNT) {
+			g_assert_cmpuint(g_hash_table_size(a->counts), ==, 5);
+			g_assert_cmpuint(count_of(a, "x"), ==, 1);
+		}
+		if (op == WSH_AGGREGATE_HISTOGRAM) {
+			g_assert_cmpuint(g_hash_table_size(a->buckets), ==,
+			                 g_hash_table_size(whole->buckets));
+			g_assert_cmpuint(bucket_of(a, wsh_aggregate_bucket(100)), ==, 1);
+		}
+
+		wsh_aggregate_free(&a);
+		wsh_aggregate_free(&b);
+		wsh_aggregate_free(&whole);
+	}
+
+	// Partials of different operators don't mix
+	wsh_aggregate_t* sum = NULL, * count = NULL;
+	wsh_aggregate_new(&sum, WSH_AGGREGATE_SUM);
+	wsh_aggregate_new(&count, WSH_AGGREGATE_UNIQ_COUNT);
+	wsh_aggregate_line(count, "5", 1);
+	wsh_aggregate_merge(sum, count);
+	g_assert_cmpuint(sum->values, ==, 0);
+	wsh_aggregate_free(&sum);
+	wsh_aggregate_free(&count);
+}
+
+static void pack(void) {
+	gchar* lines[] = { "a", "b", "a", NULL };
+	wsh_cmd_res_t src = { .std_output = lines, .std_output_len = 3 };
+
+	wsh_aggregate_t* agg = NULL;
+	wsh_aggregate_new(&agg, WSH_AGGREGATE_UNIQ_COUNT);
+	wsh_aggregate_output(agg, &src);
+
+	wsh_cmd_res_t res = {
+		.aggregate = agg,
+		.exit_status = 0,
+	};
+	guint8* buf = NULL;
+	guint32 buf_len;
+	wsh_pack_response(&buf, &buf_len, &res);
+
+	wsh_cmd_res_t* out = g_new0(wsh_cmd_res_t, 1);
+	wsh_unpack_response(&out, buf, buf_len);
+	g_slice_free1(buf_len, buf);
+
+	g_assert(out->aggregate != NULL);
+	g_assert_cmpint(out->aggregate->op, ==, WSH_AGGREGATE_UNIQ_COUNT);
+	g_assert_cmpuint(count_of(out->aggregate, "a"), ==, 2);
+	g_assert_cmpuint(count_of(out->aggregate, "b"), ==, 1);
+	wsh_free_unpacked_response(&out);
+	wsh_aggregate_free(&agg);
+
+	gchar* nums[] = { "3", "-20", "x", NULL };
+	src.std_output = nums;
+	wsh_aggregate_new(&agg, WSH_AGGREGATE_HISTOGRAM);
+	wsh_aggregate_output(agg, &src);
+	res.aggregate = agg;
+	wsh_pack_response(&buf, &buf_len, &res);
+
+	out = g_new0(wsh_cmd_res_t, 1);
+	wsh_unpack_response(&out, buf, buf_len);
+	g_slice_free1(buf_len, buf);
+
+	g_assert_cmpuint(g_hash_table_size(out->aggregate->buckets), ==, 2);
+	g_assert_cmpuint(bucket_of(out->aggregate, wsh_aggregate_bucket(-20)), ==, 1);
+	g_assert_cmpfloat(out->aggregate->sum, ==, -17);
+	g_assert_cmpfloat(out->aggregate->min, ==, -20);
+	g_assert_cmpuint(out->aggregate->skipped, ==, 1);
+	wsh_free_unpacked_response(&out);
+	wsh_aggregate_free(&agg);
+
+	// The operator travels with the request
+	wsh_cmd_req_t req = {
+		.cmd_string = "uname -r",
+		.cwd = "/",
+		.username = "worr",
+		.password = "",
+		.host = "localhost",
+		.aggregate_op = WSH_AGGREGATE_MIN_MAX,
+	};
+	wsh_pack_request(&buf, &buf_len, &req);
+	wsh_cmd_req_t* req_out = g_new0(wsh_cmd_req_t, 1);
+	wsh_unpack_request(&req_out, buf, buf_len);
+	g_slice_free1(buf_len, buf);
+	g_assert_cmpuint(req_out->aggregate_op, ==, WSH_AGGREGATE_MIN_MAX);
+	wsh_free_unpacked_request(&req_out);
+}
+
+static void free_null(void) {
+	wsh_aggregate_t* agg = NULL;
+	wsh_aggregate_free(&agg);
+	wsh_aggregate_free(NULL);
+}
+
+int main(int argc, char** argv) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/Library/Aggregate/ParseOp", parse_op);
+	g_test_add_func("/Library/Aggregate/UniqCount", uniq_count);
+	g_test_add_func("/Library/Aggregate/Numbers", numbers);
+	g_test_add_func("/Library/Aggregate/Buckets", buckets);
+	g_test_add_func("/Library/Aggregate/Merge", merge);
+	g_test_add_func("/Library/Aggregate/Pack", pack);
+
+	g_test_add_func("/Regress/Library/Aggregate/FreeNull", free_null);
+
+	return g_test_run();
+}
@@ -0,0 +1,147 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "auth_cache.h"
+#include "ssh.h"
+
+static gchar* make_cache_path(void) {
+	gchar* dir = g_dir_make_tmp("wsh-auth-cache-XXXXXX", NULL);
+	g_assert(dir != NULL);
+
+	gchar* path = g_build_filename(dir, "nested", "auth_cache", NULL);
+	g_free(dir);
+	return path;
+}
+
+static void remove_cache_path(gchar* path) {
+	gchar* nested = g_path_get_dirname(path);
+	gchar* dir = g_path_get_dirname(nested);
+
+	(void) g_unlink(path);
+	(void) g_rmdir(nested);
+	(void) g_rmdir(dir);
+
+	g_free(dir);
+	g_free(nested);
+	g_free(path);
+}
+
+static void lookup_empty(void) {
+	gchar* path = make_cache_path();
+	wsh_auth_cache_t* cache = NULL;
+
+	wsh_auth_cache_open(&cache, path);
+	g_assert(cache != NULL);
+	g_assert(wsh_auth_cache_lookup(cache, "worr", "127.0.0.1", 22) ==
+	         WSH_SSH_AUTH_METHOD_UNKNOWN);
+
+	wsh_auth_cache_free(&cache);
+	g_assert(cache == NULL);
+	remove_cache_path(path);
+}
+
+static void store_and_lookup(void) {
+	gchar* path = make_cache_path();
+	wsh_auth_cache_t* cache = NULL;
+
+	wsh_auth_cache_open(&cache, path);
+	wsh_auth_cache_store(cache, "worr", "127.0.0.1", 22,
+	                     WSH_SSH_AUTH_METHOD_KBDINT);
+
+	g_assert(wsh_auth_cache_lookup(cache, "worr", "127.0.0.1", 22) ==
+	         WSH_SSH_AUTH_METHOD_KBDINT);
+	g_assert(wsh_auth_cache_lookup(cache, "worr", "127.0.0.1", 2222) ==
+	         WSH_SSH_AUTH_METHOD_UNKNOWN);
+	g_assert(wsh_auth_cache_lookup(cache, "root", "127.0.0.1", 22) ==
+	         WSH_SSH_AUTH_METHOD_UNKNOWN);
+
+	wsh_auth_cache_store(cache, "worr", "127.0.0.1", 22,
+	                     WSH_SSH_AUTH_METHOD_UNKNOWN);
+	g_assert(wsh_auth_cache_lookup(cache, "worr", "127.0.0.1", 22) ==
+	         WSH_SSH_AUTH_METHOD_UNKNOWN);
+
+	wsh_auth_cache_free(&cache);
+	remove_cache_path(path);
+}
+
+static void save_and_reload(void) {
+	gchar* path = make_cache_path();
+	wsh_auth_cache_t* cache = NULL;
+	GError* err = NULL;
+
+	wsh_auth_cache_open(&cache, path);
+	wsh_auth_cache_store(cache, "worr", "rancor.csh.rit.edu", 22,
+	                     WSH_SSH_AUTH_METHOD_PUBKEY);
+	g_assert(wsh_auth_cache_save(cache, &err) == 0);
+	g_assert_no_error(err);
+	g_assert(cache->dirty == FALSE);
+	wsh_auth_cache_free(&cache);
+
+	g_assert(g_file_test(path, G_FILE_TEST_EXISTS));
+
+	wsh_auth_cache_open(&cache, path);
+	g_assert(wsh_auth_cache_lookup(cache, "worr", "rancor.csh.rit.edu", 22) ==
+	         WSH_SSH_AUTH_METHOD_PUBKEY);
+	wsh_auth_cache_free(&cache);
+
+	remove_cache_path(path);
+}
+
+static void save_clean_cache(void) {
+	gchar* path = make_cache_path();
+	wsh_auth_cache_t* cache = NULL;
+	GError* err = NULL;
+
+	wsh_auth_cache_open(&cache, path);
+	g_assert(wsh_auth_cache_save(cache, &err) == 0);
+	g_assert_no_error(err);
+
+	// Nothing changed, so nothing should have been written
+	g_assert(! g_file_test(path, G_FILE_TEST_EXISTS));
+
+	wsh_auth_cache_free(&cache);
+	remove_cache_path(path);
+}
+
+static void free_null(void) {
+	wsh_auth_cache_t* cache = NULL;
+	wsh_auth_cache_free(&cache);
+	wsh_auth_cache_free(NULL);
+}
+
+int main(int argc, char** argv) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/Library/AuthCache/LookupEmpty", lookup_empty);
+	g_test_add_func("/Library/AuthCache/StoreAndLookup", store_and_lookup);
+	g_test_add_func("/Library/AuthCache/SaveAndReload", save_and_reload);
+	g_test_add_func("/Library/AuthCache/SaveCleanCache", save_clean_cache);
+
+	g_test_add_func("/Regress/Library/AuthCache/FreeNull", free_null);
+
+	return g_test_run();
+}
+
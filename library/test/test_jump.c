@@ -0,0 +1,244 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include <glib.h>
+#include <libssh/libssh.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "jump.h"
+#include "ssh.h"
+
+extern GQuark WSH_JUMP_ERROR;
+
+static const gchar* username = "worr";
+
+static void parse_spec_full(void) {
+	gchar* user = NULL;
+	gchar* host = NULL;
+	gint port = 0;
+	GError* err = NULL;
+
+	g_assert(wsh_jump_parse_spec("will@bastion.example.com:2222", &user, &host,
+	                             &port, &err) == 0);
+	g_assert_no_error(err);
+	g_assert_cmpstr(user, ==, "will");
+	g_assert_cmpstr(host, ==, "bastion.example.com");
+	g_assert(port == 2222);
+
+	g_free(user);
+	g_free(host);
+}
+
+static void parse_spec_host_only(void) {
+	gchar* user = NULL;
+	gchar* host = NULL;
+	gint port = 0;
+	GError* err = NULL;
+
+	g_assert(wsh_jump_parse_spec("bastion", &user, &host, &port, &err) == 0);
+	g_assert_no_error(err);
+	g_assert(user == NULL);
+	g_assert_cmpstr(host, ==, "bastion");
+	g_assert(port == 22);
+
+	g_free(host);
+}
+
+static void parse_spec_ipv6(void) {
+	gchar* user = NULL;
+	gchar* host = NULL;
+	gint port = 0;
+	GError* err = NULL;
+
+	g_assert(wsh_jump_parse_spec("[::1]:2200", &user, &host, &port, &err) == 0);
+	g_assert_no_error(err);
+	g_assert(user == NULL);
+	g_assert_cmpstr(host, ==, "::1");
+	g_assert(port == 2200);
+
+	g_free(host);
+}
+
+static void parse_spec_bad_port(void) {
+	gchar* user = NULL;
+	gchar* host = NULL;
+	gint port = 0;
+	GError* err = NULL;
+
+	g_assert(wsh_jump_parse_spec("will@bastion:ssh", &user, &host, &port,
+	                             &err) != 0);
+	g_assert_error(err, WSH_JUMP_ERROR, WSH_JUMP_SPEC_ERR);
+	g_assert(user == NULL);
+	g_assert(host == NULL);
+
+	g_error_free(err);
+}
+
+static void parse_spec_no_host(void) {
+	gchar* user = NULL;
+	gchar* host = NULL;
+	gint port = 0;
+	GError* err = NULL;
+
+	g_assert(wsh_jump_parse_spec("will@:22", &user, &host, &port, &err) != 0);
+	g_assert_error(err, WSH_JUMP_ERROR, WSH_JUMP_SPEC_ERR);
+
+	g_error_free(err);
+}
+
+static void new_defaults(void) {
+	wsh_jump_t* jump = NULL;
+	GError* err = NULL;
+
+	g_assert(wsh_jump_new(&jump, "bastion", username, NULL, NULL, 0, &err) == 0);
+	g_assert_no_error(err);
+	g_assert_cmpstr(jump->username, ==, username);
+	g_assert_cmpstr(jump->hostname, ==, "bastion");
+	g_assert(jump->port == 22);
+	g_assert(jump->max_channels == WSH_JUMP_DEFAULT_MAX_CHANNELS);
+	g_assert(jump->conns->len == 0);
+
+	wsh_jump_free(&jump);
+	g_assert(jump == NULL);
+}
+
+static void connect_success(void) {
+	wsh_ssh_init();
+	set_ssh_connect_res(SSH_OK);
+	set_ssh_is_server_known_res(SSH_SERVER_KNOWN_OK);
+	set_ssh_userauth_list_ret(SSH_AUTH_METHOD_PUBLICKEY);
+	set_ssh_userauth_autopubkey(SSH_AUTH_SUCCESS);
+	set_ssh_channel_open_forward_ret(SSH_OK);
+
+	wsh_jump_t* jump = NULL;
+	GError* err = NULL;
+	gint sock1 = -1, sock2 = -1, sock3 = -1;
+
+	g_assert(wsh_jump_new(&jump, "bastion", username, NULL, NULL, 2, &err) == 0);
+
+	g_assert(wsh_jump_connect(jump, "127.0.0.1", 22, &sock1, &err) == 0);
+	g_assert_no_error(err);
+	g_assert(sock1 >= 0);
+	g_assert(jump->conns->len == 1);
+
+	g_assert(wsh_jump_connect(jump, "127.0.0.2", 22, &sock2, &err) == 0);
+	g_assert(jump->conns->len == 1);
+
+	// Over the channel cap, so we need a second bastion connection
+	g_assert(wsh_jump_connect(jump, "127.0.0.3", 22, &sock3, &err) == 0);
+	g_assert_no_error(err);
+	g_assert(jump->conns->len == 2);
+
+	close(sock1);
+	close(sock2);
+	close(sock3);
+	wsh_jump_free(&jump);
+}
+
+static void connect_channel_failure(void) {
+	wsh_ssh_init();
+	set_ssh_connect_res(SSH_OK);
+	set_ssh_is_server_known_res(SSH_SERVER_KNOWN_OK);
+	set_ssh_userauth_list_ret(SSH_AUTH_METHOD_PUBLICKEY);
+	set_ssh_userauth_autopubkey(SSH_AUTH_SUCCESS);
+	set_ssh_channel_open_forward_ret(SSH_ERROR);
+
+	wsh_jump_t* jump = NULL;
+	GError* err = NULL;
+	gint sock = -1;
+
+	g_assert(wsh_jump_new(&jump, "bastion", username, NULL, NULL, 0, &err) == 0);
+	g_assert(wsh_jump_connect(jump, "127.0.0.1", 22, &sock, &err) != 0);
+	g_assert_error(err, WSH_JUMP_ERROR, WSH_JUMP_CHANNEL_ERR);
+	g_assert(sock == -1);
+
+	g_error_free(err);
+	wsh_jump_free(&jump);
+}
+
+static void connect_bastion_failure(void) {
+	wsh_ssh_init();
+	set_ssh_connect_res(SSH_ERROR);
+
+	wsh_jump_t* jump = NULL;
+	GError* err = NULL;
+	gint sock = -1;
+
+	g_assert(wsh_jump_new(&jump, "bastion", username, NULL, NULL, 0, &err) == 0);
+	g_assert(wsh_jump_connect(jump, "127.0.0.1", 22, &sock, &err) != 0);
+	g_assert(err != NULL);
+	g_assert(jump->conns->len == 0);
+
+	g_error_free(err);
+	wsh_jump_free(&jump);
+}
+
+static void connect_stalled_reader(void) {
+	wsh_ssh_init();
+	set_ssh_connect_res(SSH_OK);
+	set_ssh_is_server_known_res(SSH_SERVER_KNOWN_OK);
+	set_ssh_userauth_list_ret(SSH_AUTH_METHOD_PUBLICKEY);
+	set_ssh_userauth_autopubkey(SSH_AUTH_SUCCESS);
+	set_ssh_channel_open_forward_ret(SSH_OK);
+
+	// The bastion never stops sending
+	set_ssh_channel_read_nonblocking_ret(4096);
+
+	wsh_jump_t* jump = NULL;
+	GError* err = NULL;
+	gint stalled = -1, sock = -1;
+
+	g_assert(wsh_jump_new(&jump, "bastion", username, NULL, NULL, 0, &err) == 0);
+	g_assert(wsh_jump_connect(jump, "127.0.0.1", 22, &stalled, &err) == 0);
+
+	// Nothing reads stalled, so give the pump time to fill it up
+	g_usleep(G_USEC_PER_SEC / 5);
+
+	// The pump mustn't be sitting on the connection waiting for room
+	g_assert(wsh_jump_connect(jump, "127.0.0.2", 22, &sock, &err) == 0);
+	g_assert_no_error(err);
+	g_assert(jump->conns->len == 1);
+
+	set_ssh_channel_read_nonblocking_ret(0);
+	wsh_jump_free(&jump);
+	close(stalled);
+	close(sock);
+}
+
+int main(int argc, char** argv) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/Library/Jump/ParseSpecFull", parse_spec_full);
+	g_test_add_func("/Library/Jump/ParseSpecHostOnly", parse_spec_host_only);
+	g_test_add_func("/Library/Jump/ParseSpecIPv6", parse_spec_ipv6);
+	g_test_add_func("/Library/Jump/ParseSpecBadPort", parse_spec_bad_port);
+	g_test_add_func("/Library/Jump/ParseSpecNoHost", parse_spec_no_host);
+	g_test_add_func("/Library/Jump/NewDefaults", new_defaults);
+
+	g_test_add_func("/Library/Jump/ConnectSuccess", connect_success);
+	g_test_add_func("/Library/Jump/ConnectChannelFailure", connect_channel_failure);
+	g_test_add_func("/Library/Jump/ConnectBastionFailure", connect_bastion_failure);
+	g_test_add_func("/Library/Jump/ConnectStalledReader", connect_stalled_reader);
+
+	return g_test_run();
+}
+
@@ -0,0 +1,355 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "manifest.h"
+
+// sha256("hello\n")
+static const gchar* hello_hash =
+    "5891b5b522d5df086d0ff0b110fbd9d21bb4fc7163af34d08286a2e846f6be03";
+
+static gchar* make_file(const gchar* dir, const gchar* name,
+                        const gchar* contents) {
+	gchar* path = g_build_filename(dir, name, NULL);
+	g_assert(g_file_set_contents(path, contents, -1, NULL));
+	return path;
+}
+
+static void hash_file(void) {
+	GError* err = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-manifest-XXXXXX", NULL);
+	gchar* path = make_file(dir, "hello", "hello\n");
+	gchar* hash = NULL;
+
+	g_assert(! wsh_manifest_hash_file(path, &hash, &err));
+	g_assert_no_error(err);
+	g_assert_cmpstr(hash, ==, hello_hash);
+
+	g_free(hash);
+	(void) g_unlink(path);
+	(void) g_rmdir(dir);
+	g_free(path);
+	g_free(dir);
+}
+
+static void build_tree(void) {
+	GError* err = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-manifest-XXXXXX", NULL);
+	gchar* tree = g_build_filename(dir, "tree", NULL);
+	gchar* sub = g_build_filename(tree, "sub", NULL);
+	g_assert(! g_mkdir_with_parents(sub, 0755));
+
+	gchar* a = make_file(tree, "a", "hello\n");
+	gchar* b = make_file(sub, "b", "");
+	gchar* top = make_file(dir, "top", "hello\n");
+
+	gchar* files[] = { top, tree, NULL };
+	wsh_manifest_entry_t* manifest = NULL;
+	gsize len = 0;
+
+	g_assert(! wsh_manifest_build(files, 2, TRUE, &manifest, &len, &err));
+	g_assert_no_error(err);
+	g_assert_cmpuint(len, ==, 3);
+
+	// Sorted by path, under the destination
+	g_assert_cmpstr(manifest[0].path, ==, "top");
+	g_assert_cmpstr(manifest[0].local, ==, top);
+	g_assert_cmpstr(manifest[0].hash, ==, hello_hash);
+	g_assert_cmpuint(manifest[0].size, ==, 6);
+	g_assert_cmpstr(manifest[1].path, ==, "tree/a");
+	g_assert_cmpstr(manifest[1].local, ==, a);
+	g_assert_cmpstr(manifest[2].path, ==, "tree/sub/b");
+	g_assert_cmpuint(manifest[2].size, ==, 0);
+
+	wsh_manifest_free(&manifest, len);
+	g_assert(manifest == NULL);
+
+	(void) g_unlink(a);
+	(void) g_unlink(b);
+	(void) g_unlink(top);
+	(void) g_rmdir(sub);
+	(void) g_rmdir(tree);
+	(void) g_rmdir(dir);
+	g_free(a);
+	g_free(b);
+	g_free(top);
+	g_free(sub);
+	g_free(tree);
+	g_free(dir);
+}
+
+static void build_missing(void) {
+	GError* err = NULL;
+	gchar* files[] = { "/nonexistent/wsh-manifest", NULL };
+	wsh_manifest_entry_t* manifest = NULL;
+	gsize len = 0;
+
+	g_assert(wsh_manifest_build(files, 1, TRUE, &manifest, &len, &err));
+	g_assert(err != NULL);
+	g_assert(manifest == NULL);
+	g_error_free(err);
+}
+
+static void build_unhashed(void) {
+	GError* err = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-manifest-XXXXXX", NULL);
+	gchar* top = make_file(dir, "top", "hello\n");
+
+	gchar* files[] = { top, NULL };
+	wsh_manifest_entry_t* manifest = NULL;
+	gsize len = 0;
+
+	g_assert(! wsh_manifest_build(files, 1, FALSE, &manifest, &len, &err));
+	g_assert_no_error(err);
+	g_assert_cmpuint(len, ==, 1);
+	g_assert_cmpstr(manifest[0].path, ==, "top");
+	g_assert_cmpuint(manifest[0].size, ==, 6);
+	g_assert(manifest[0].hash == NULL);
+
+	wsh_manifest_free(&manifest, len);
+
+	(void) g_unlink(top);
+	(void) g_rmdir(dir);
+	g_free(top);
+	g_free(dir);
+}
+
+static void stale(void) {
+	gchar* dir = g_dir_make_tmp("wsh-manifest-XXXXXX", NULL);
+	gchar* same = make_file(dir, "same", "hello\n");
+	gchar* changed = make_file(dir, "changed", "jello\n");
+	gchar* resized = make_file(dir, "resized", "hello, world\n");
+
+	wsh_manifest_entry_t manifest[] = {
+		{ .path = "same", .hash = (gchar*)hello_hash, .size = 6 },
+		{ .path = "changed", .hash = (gchar*)hello_hash, .size = 6 },
+		{ .path = "resized", .hash = (gchar*)hello_hash, .size = 6 },
+		{ .path = "missing", .hash = (gchar*)hello_hash, .size = 6 },
+		{ .path = "../same", .hash = (gchar*)hello_hash, .size = 6 },
+	};
+	gsize len = 0;
+
+	gchar** paths = wsh_manifest_stale(dir, manifest, G_N_ELEMENTS(manifest), &len);
+	g_assert_cmpuint(len, ==, 4);
+	g_assert_cmpstr(paths[0], ==, "changed");
+	g_assert_cmpstr(paths[1], ==, "resized");
+	g_assert_cmpstr(paths[2], ==, "missing");
+	g_assert_cmpstr(paths[3], ==, "../same");
+	g_assert(paths[4] == NULL);
+	g_strfreev(paths);
+
+	(void) g_unlink(same);
+	(void) g_unlink(changed);
+	(void) g_unlink(resized);
+	(void) g_rmdir(dir);
+	g_free(same);
+	g_free(changed);
+	g_free(resized);
+	g_free(dir);
+}
+
+// A file a chunk and a bit long, with each chunk filled with its own byte
+static gchar* make_big_file(const gchar* dir, const gchar* name) {
+	gsize len = WSH_MANIFEST_CHUNK_SIZE + 100;
+	gchar* contents = g_malloc(len);
+	memset(contents, 'a', WSH_MANIFEST_CHUNK_SIZE);
+	memset(contents + WSH_MANIFEST_CHUNK_SIZE, 'b', 100);
+
+	gchar* path = g_build_filename(dir, name, NULL);
+	g_assert(g_file_set_contents(path, contents, len, NULL));
+	g_free(contents);
+	return path;
+}
+
+static wsh_manifest_entry_t* build_big(gchar* path) {
+	GError* err = NULL;
+	gchar* files[] = { path, NULL };
+	wsh_manifest_entry_t* manifest = NULL;
+	gsize len = 0;
+
+	g_assert(! wsh_manifest_build(files, 1, TRUE, &manifest, &len, &err));
+	g_assert_no_error(err);
+	g_assert_cmpuint(len, ==, 1);
+	return manifest;
+}
+
+// Writes the first len bytes of src to dest
+static void copy_prefix(const gchar* src, const gchar* dest, gsize len) {
+	gchar* contents = NULL;
+	g_assert(g_file_get_contents(src, &contents, NULL, NULL));
+	g_assert(g_file_set_contents(dest, contents, len, NULL));
+	g_free(contents);
+}
+
+static void build_chunks(void) {
+	gchar* dir = g_dir_make_tmp("wsh-manifest-XXXXXX", NULL);
+	gchar* big = make_big_file(dir, "big");
+	gchar* small = make_file(dir, "small", "hello\n");
+	wsh_manifest_entry_t* manifest = build_big(big);
+
+	g_assert_cmpuint(manifest[0].size, ==, WSH_MANIFEST_CHUNK_SIZE + 100);
+	g_assert_cmpuint(manifest[0].chunks_len, ==, 2);
+	g_assert(manifest[0].chunks[2] == NULL);
+
+	// The last chunk is just what's left over
+	gchar* tail = g_compute_checksum_for_string(G_CHECKSUM_SHA256,
+	              "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"
+	              "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb", 100);
+	g_assert_cmpstr(manifest[0].chunks[1], ==, tail);
+	g_free(tail);
+	wsh_manifest_free(&manifest, 1);
+
+	// Small files aren't worth resuming
+	manifest = build_big(small);
+	g_assert(manifest[0].chunks == NULL);
+	g_assert_cmpuint(manifest[0].chunks_len, ==, 0);
+	wsh_manifest_free(&manifest, 1);
+
+	(void) g_unlink(big);
+	(void) g_unlink(small);
+	(void) g_rmdir(dir);
+	g_free(big);
+	g_free(small);
+	g_free(dir);
+}
+
+static void resume(void) {
+	gchar* src = g_dir_make_tmp("wsh-manifest-XXXXXX", NULL);
+	gchar* dest = g_dir_make_tmp("wsh-manifest-XXXXXX", NULL);
+	gchar* big = make_big_file(src, "big");
+	gchar* part = g_build_filename(dest, "big" WSH_MANIFEST_PART_SUFFIX, NULL);
+	wsh_manifest_entry_t* manifest = build_big(big);
+	struct stat st;
+
+	// Nothing there yet
+	g_assert_cmpuint(wsh_manifest_resume(dest, &manifest[0]), ==, 0);
+
+	// Half of the last chunk arrived, which isn't enough to check it
+	copy_prefix(big, part, WSH_MANIFEST_CHUNK_SIZE + 50);
+	g_assert_cmpuint(wsh_manifest_resume(dest, &manifest[0]), ==, WSH_MANIFEST_CHUNK_SIZE);
+	g_assert(! g_stat(part, &st));
+	g_assert_cmpuint(st.st_size, ==, WSH_MANIFEST_CHUNK_SIZE);
+
+	// A chunk that doesn't match is thrown away, along with everything after
+	g_assert(g_file_set_contents(part, "zzz", 3, NULL));
+	g_assert_cmpuint(wsh_manifest_resume(dest, &manifest[0]), ==, 0);
+	g_assert(! g_stat(part, &st));
+	g_assert_cmpuint(st.st_size, ==, 0);
+
+	// Files without chunk hashes aren't touched
+	wsh_manifest_entry_t plain = { .path = "big", .hash = manifest[0].hash,
+	                               .size = manifest[0].size };
+	g_assert_cmpuint(wsh_manifest_resume(dest, &plain), ==, 0);
+
+	wsh_manifest_free(&manifest, 1);
+	(void) g_unlink(part);
+	(void) g_unlink(big);
+	(void) g_rmdir(src);
+	(void) g_rmdir(dest);
+	g_free(part);
+	g_free(big);
+	g_free(src);
+	g_free(dest);
+}
+
+static void complete(void) {
+	GError* err = NULL;
+	gchar* src = g_dir_make_tmp("wsh-manifest-XXXXXX", NULL);
+	gchar* dest = g_dir_make_tmp("wsh-manifest-XXXXXX", NULL);
+	gchar* big = make_big_file(src, "big");
+	gchar* done = g_build_filename(dest, "big", NULL);
+	wsh_manifest_entry_t* manifest = build_big(big);
+
+	// The first try got one chunk over, and some of the next
+	gchar* name = wsh_manifest_part_name("big", 0);
+	gchar* first = g_build_filename(dest, name, NULL);
+	copy_prefix(big, first, WSH_MANIFEST_CHUNK_SIZE + 10);
+	g_free(name);
+
+	g_assert(wsh_manifest_complete(dest, &manifest[0], &err));
+	g_assert_error(err, WSH_MANIFEST_ERROR, WSH_MANIFEST_INCOMPLETE_ERR);
+	g_clear_error(&err);
+	g_assert(! g_file_test(done, G_FILE_TEST_EXISTS));
+
+	// The retry sends the rest, from where it was told to pick up
+	guint64 offset = wsh_manifest_resume(dest, &manifest[0]);
+	g_assert_cmpuint(offset, ==, WSH_MANIFEST_CHUNK_SIZE);
+
+	name = wsh_manifest_part_name("big", offset);
+	gchar* rest = g_build_filename(dest, name, NULL);
+	g_assert(g_file_set_contents(rest,
+	         "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"
+	         "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb", 100, NULL));
+	g_free(name);
+
+	g_assert(! wsh_manifest_complete(dest, &manifest[0], &err));
+	g_assert_no_error(err);
+
+	gsize len = 0;
+	gchar** paths = wsh_manifest_stale(dest, manifest, 1, &len);
+	g_assert_cmpuint(len, ==, 0);
+	g_strfreev(paths);
+
+	// Nothing's left lying around
+	gchar* part = g_build_filename(dest, "big" WSH_MANIFEST_PART_SUFFIX, NULL);
+	g_assert(! g_file_test(part, G_FILE_TEST_EXISTS));
+	g_assert(! g_file_test(rest, G_FILE_TEST_EXISTS));
+
+	wsh_manifest_free(&manifest, 1);
+	(void) g_unlink(done);
+	(void) g_unlink(big);
+	(void) g_rmdir(src);
+	(void) g_rmdir(dest);
+	g_free(part);
+	g_free(rest);
+	g_free(first);
+	g_free(done);
+	g_free(big);
+	g_free(src);
+	g_free(dest);
+}
+
+static void free_null(void) {
+	wsh_manifest_entry_t* manifest = NULL;
+	wsh_manifest_free(&manifest, 0);
+	wsh_manifest_free(NULL, 0);
+}
+
+int main(int argc, char** argv) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/Library/Manifest/HashFile", hash_file);
+	g_test_add_func("/Library/Manifest/BuildTree", build_tree);
+	g_test_add_func("/Library/Manifest/BuildMissing", build_missing);
+	g_test_add_func("/Library/Manifest/BuildUnhashed", build_unhashed);
+	g_test_add_func("/Library/Manifest/Stale", stale);
+	g_test_add_func("/Library/Manifest/BuildChunks", build_chunks);
+	g_test_add_func("/Library/Manifest/Resume", resume);
+	g_test_add_func("/Library/Manifest/Complete", complete);
+
+	g_test_add_func("/Regress/Library/Manifest/FreeNull", free_null);
+
+	return g_test_run();
+}
@@ -21,6 +21,7 @@
 #include "config.h"
 #include <glib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "pack.h"
 #include "types.h"
@@ -65,6 +66,8 @@ static void test_wsh_pack_request(void) {
 	guint8* buf = NULL;
 	guint32 buf_len;
 
+	memset(&req, 0, sizeof(req));
+
 	req.cmd_string = req_cmd;
 	req.std_input = req_stdin;
 	req.std_input_len = req_stdin_len;
@@ -146,6 +149,362 @@ static void test_wsh_unpack_response(void) {
 	wsh_free_unpacked_response(&res);
 }
 
+static void pack_manifests(void) {
+	wsh_cmd_req_t req;
+	guint8* buf = NULL;
+	guint32 buf_len;
+
+	gchar* chunks[] = { "c1", "c2", NULL };
+	wsh_manifest_entry_t manifest[] = {
+		{ .path = "a", .hash = "aa", .size = 1 },
+	};
+	wsh_manifest_entry_t complete[] = {
+		{ .path = "big", .hash = "bb", .chunks = chunks, .chunks_len = 2, .size = 5 },
+	};
+	wsh_manifest_entry_t distribute[] = {
+		{ .path = "b", .local = "/not/sent", .hash = "bb", .size = 2 },
+		{ .path = "c/d", .hash = "dd", .size = 3 },
+	};
+
+	memset(&req, 0, sizeof(req));
+	req.cmd_string = "";
+	req.cwd = req_cwd;
+	req.host = req_host;
+	req.manifest = manifest;
+	req.manifest_len = G_N_ELEMENTS(manifest);
+	req.distribute = distribute;
+	req.distribute_len = G_N_ELEMENTS(distribute);
+	req.complete = complete;
+	req.complete_len = G_N_ELEMENTS(complete);
+
+	wsh_pack_request(&buf, &buf_len, &req);
+
+	wsh_cmd_req_t* out = g_new0(wsh_cmd_req_t, 1);
+	wsh_unpack_request(&out, buf, buf_len);
+	g_slice_free1(buf_len, buf);
+
+	g_assert_cmpuint(out->manifest_len, ==, 1);
+	g_assert_cmpstr(out->manifest[0].path, ==, "a");
+	g_assert_cmpstr(out->manifest[0].hash, ==, "aa");
+	g_assert_cmpuint(out->distribute_len, ==, 2);
+	g_assert_cmpstr(out->distribute[0].path, ==, "b");
+	g_assert(out->distribute[0].local == NULL);
+	g_assert_cmpstr(out->distribute[1].path, ==, "c/d");
+	g_assert_cmpstr(out->distribute[1].hash, ==, "dd");
+	g_assert_cmpuint(out->distribute[1].size, ==, 3);
+	g_assert(out->distribute[1].chunks == NULL);
+	g_assert_cmpuint(out->complete_len, ==, 1);
+	g_assert_cmpstr(out->complete[0].path, ==, "big");
+	g_assert_cmpuint(out->complete[0].chunks_len, ==, 2);
+	g_assert_cmpstr(out->complete[0].chunks[1], ==, "c2");
+	g_assert(out->complete[0].chunks[2] == NULL);
+
+	wsh_free_unpacked_request(&out);
+}
+
+static void pack_resume(void) {
+	gchar* stale[] = { "a", "b", NULL };
+	guint64 resume[] = { 0, 4194304 };
+	wsh_cmd_res_t res = {
+		.stale = stale,
+		.stale_len = 2,
+		.resume = resume,
+	};
+	guint8* buf = NULL;
+	guint32 buf_len;
+
+	wsh_pack_response(&buf, &buf_len, &res);
+
+	wsh_cmd_res_t* out = g_new0(wsh_cmd_res_t, 1);
+	wsh_unpack_response(&out, buf, buf_len);
+	g_slice_free1(buf_len, buf);
+
+	g_assert_cmpuint(out->stale_len, ==, 2);
+	g_assert(out->resume != NULL);
+	g_assert_cmpuint(out->resume[0], ==, 0);
+	g_assert_cmpuint(out->resume[1], ==, 4194304);
+
+	wsh_free_unpacked_response(&out);
+}
+
+static void pack_script(void) {
+	wsh_cmd_req_t req;
+	guint8* buf = NULL;
+	guint32 buf_len;
+	guint8 script[] = { '#', '!', '/', 'b', 'i', 'n', '/', 's', 'h', '\n', 0, 0xff };
+
+	memset(&req, 0, sizeof(req));
+	req.cmd_string = "script.sh";
+	req.cwd = req_cwd;
+	req.host = req_host;
+	req.script_name = "script.sh";
+	req.script = script;
+	req.script_len = sizeof(script);
+
+	wsh_pack_request(&buf, &buf_len, &req);
+
+	wsh_cmd_req_t* out = g_new0(wsh_cmd_req_t, 1);
+	wsh_unpack_request(&out, buf, buf_len);
+	g_slice_free1(buf_len, buf);
+
+	g_assert(out->argv == NULL);
+	g_assert_cmpstr(out->script_name, ==, "script.sh");
+	g_assert_cmpuint(out->script_len, ==, sizeof(script));
+	g_assert(! memcmp(out->script, script, sizeof(script)));
+	wsh_free_unpacked_request(&out);
+
+	// No script, nothing unpacked. Arguments go as they are
+	gchar* argv[] = { "script.sh", "it's", NULL };
+	req.script_name = NULL;
+	req.script = NULL;
+	req.script_len = 0;
+	req.argv = argv;
+	req.argv_len = 2;
+	wsh_pack_request(&buf, &buf_len, &req);
+	out = g_new0(wsh_cmd_req_t, 1);
+	wsh_unpack_request(&out, buf, buf_len);
+	g_slice_free1(buf_len, buf);
+
+	g_assert(out->script_name == NULL);
+	g_assert(out->script == NULL);
+	g_assert_cmpuint(out->argv_len, ==, 2);
+	g_assert_cmpstr(out->argv[1], ==, "it's");
+	g_assert(out->argv[2] == NULL);
+	wsh_free_unpacked_request(&out);
+}
+
+static void pack_raw(void) {
+	guint8 std_output[] = "foo\n \tbar \n\n\xff\xfe";
+	guint8 std_error[] = "err\n";
+	wsh_cmd_res_t res = {
+		.std_output_raw = std_output,
+		.std_output_raw_len = sizeof(std_output) - 1,
+		.std_error_raw = std_error,
+		.std_error_raw_len = sizeof(std_error) - 1,
+		.exit_status = 1,
+	};
+	guint8* buf = NULL;
+	guint32 buf_len;
+
+	wsh_pack_response(&buf, &buf_len, &res);
+
+	wsh_cmd_res_t* out = g_new0(wsh_cmd_res_t, 1);
+	wsh_unpack_response(&out, buf, buf_len);
+	g_slice_free1(buf_len, buf);
+
+	// Nothing's split until it's asked for
+	g_assert(out->std_output == NULL);
+	g_assert(out->std_error == NULL);
+	g_assert_cmpuint(out->std_output_raw_len, ==, sizeof(std_output) - 1);
+	g_assert(! memcmp(out->std_output_raw, std_output, sizeof(std_output) - 1));
+	g_assert_cmpuint(out->std_output_index_len, ==, 3);
+	g_assert_cmpuint(out->std_output_index[0], ==, 4);
+	g_assert_cmpuint(out->std_output_index[1], ==, 11);
+	g_assert_cmpuint(out->std_output_index[2], ==, 12);
+	g_assert_cmpint(out->exit_status, ==, 1);
+
+	wsh_split_response(out);
+	g_assert_cmpuint(out->std_output_len, ==, 4);
+	g_assert_cmpstr(out->std_output[0], ==, "foo");
+	g_assert_cmpstr(out->std_output[1], ==, " \tbar ");
+	g_assert_cmpstr(out->std_output[2], ==, "");
+	g_assert_cmpstr(out->std_output[3], ==, "\xff\xfe");
+	g_assert(out->std_output[4] == NULL);
+	g_assert_cmpuint(out->std_error_len, ==, 1);
+	g_assert_cmpstr(out->std_error[0], ==, "err");
+
+	// An index that doesn't fit the output gets ignored
+	out->std_output_index[1] = 2;
+	g_strfreev(out->std_output);
+	out->std_output = NULL;
+	wsh_split_response(out);
+	g_assert_cmpuint(out->std_output_len, ==, 4);
+	g_assert_cmpstr(out->std_output[1], ==, " \tbar ");
+
+	wsh_free_unpacked_response(&out);
+
+	// Lines that came as lines stay that way
+	gchar* lines[] = { "foo", NULL };
+	wsh_cmd_res_t plain = {
+		.std_output = lines,
+		.std_output_len = 1,
+	};
+	wsh_pack_response(&buf, &buf_len, &plain);
+	out = g_new0(wsh_cmd_res_t, 1);
+	wsh_unpack_response(&out, buf, buf_len);
+	g_slice_free1(buf_len, buf);
+
+	g_assert(out->std_output_raw == NULL);
+	wsh_split_response(out);
+	g_assert_cmpuint(out->std_output_len, ==, 1);
+	g_assert_cmpstr(out->std_output[0], ==, "foo");
+	g_assert_cmpuint(out->std_error_len, ==, 0);
+	wsh_free_unpacked_response(&out);
+}
+
+static void pack_compressed(void) {
+	gchar* lines[1001];
+	for (gsize i = 0; i < 1000; i++)
+		lines[i] = "kernel: the same line of output, over and over";
+	lines[1000] = NULL;
+
+	wsh_cmd_res_t res = {
+		.std_output = lines,
+		.std_output_len = 1000,
+		.exit_status = 3,
+	};
+	guint8* plain = NULL, * buf = NULL;
+	guint32 plain_len, buf_len;
+
+	wsh_pack_response(&plain, &plain_len, &res);
+	wsh_pack_response_compressed(&buf, &buf_len, &res, 6);
+	g_assert_cmpuint(buf_len, <, plain_len / 10);
+
+	wsh_cmd_res_t* out = g_new0(wsh_cmd_res_t, 1);
+	wsh_unpack_response(&out, buf, buf_len);
+	g_assert(out->error_message == NULL);
+	g_assert_cmpint(out->exit_status, ==, 3);
+	g_assert_cmpuint(out->std_output_len, ==, 1000);
+	g_assert_cmpstr(out->std_output[999], ==, lines[999]);
+	wsh_free_unpacked_response(&out);
+
+	// Damage anywhere in the compressed reply is caught
+	buf[buf_len / 2] ^= 0xff;
+	out = g_new0(wsh_cmd_res_t, 1);
+	wsh_unpack_response(&out, buf, buf_len);
+	g_assert_cmpstr(out->error_message, ==, "Compressed reply arrived corrupt");
+	g_assert_cmpint(out->exit_status, ==, -1);
+	wsh_free_unpacked_response(&out);
+	g_slice_free1(buf_len, buf);
+	g_slice_free1(plain_len, plain);
+
+	// Small replies and level 0 go as they are
+	res.std_output_len = 2;
+	lines[2] = NULL;
+	wsh_pack_response(&plain, &plain_len, &res);
+	wsh_pack_response_compressed(&buf, &buf_len, &res, 9);
+	g_assert_cmpuint(buf_len, ==, plain_len);
+	g_assert(! memcmp(buf, plain, buf_len));
+	g_slice_free1(buf_len, buf);
+	g_slice_free1(plain_len, plain);
+
+	res.std_output_len = 1000;
+	lines[2] = lines[1];
+	wsh_pack_response(&plain, &plain_len, &res);
+	wsh_pack_response_compressed(&buf, &buf_len, &res, 0);
+	g_assert_cmpuint(buf_len, ==, plain_len);
+	g_slice_free1(buf_len, buf);
+	g_slice_free1(plain_len, plain);
+}
+
+static void response_hash(void) {
+	guint8 std_output[] = "foo\nbar\n";
+	wsh_cmd_res_t raw = {
+		.std_output_raw = std_output,
+		.std_output_raw_len = sizeof(std_output) - 1,
+	};
+	gchar* lines[] = { "foo", "bar", NULL };
+	gchar* none[] = { NULL };
+	wsh_cmd_res_t split = {
+		.std_output = lines,
+		.std_output_len = 2,
+		.std_error = none,
+	};
+
+	// The same output hashes the same whether it's split or not
+	gchar* hash = wsh_response_hash(&raw);
+	gchar* split_hash = wsh_response_hash(&split);
+	g_assert_cmpuint(strlen(hash), ==, 64);
+	g_assert_cmpstr(hash, ==, split_hash);
+	g_free(split_hash);
+
+	// Moving output to stderr or changing the exit status changes it
+	wsh_cmd_res_t moved = {
+		.std_error_raw = std_output,
+		.std_error_raw_len = sizeof(std_output) - 1,
+	};
+	split_hash = wsh_response_hash(&moved);
+	g_assert_cmpstr(hash, !=, split_hash);
+	g_free(split_hash);
+
+	split.exit_status = 1;
+	split_hash = wsh_response_hash(&split);
+	g_assert_cmpstr(hash, !=, split_hash);
+	g_free(split_hash);
+	split.exit_status = 0;
+
+	// Drift in whitespace or the last newline is drift all the same
+	const gchar* drifted[] = { "  foo\nbar\n", "foo \nbar\n", "foo\r\nbar\n",
+	                           "foo\nbar", "foobar\n" };
+	for (gsize i = 0; i < G_N_ELEMENTS(drifted); i++) {
+		wsh_cmd_res_t other = {
+			.std_output_raw = (guint8*)drifted[i],
+			.std_output_raw_len = strlen(drifted[i]),
+		};
+		split_hash = wsh_response_hash(&other);
+		g_assert_cmpstr(hash, !=, split_hash);
+		g_free(split_hash);
+	}
+
+	// Splitting raw output leaves its hash alone
+	guint8 indented[] = "  foo\nbar";
+	wsh_cmd_res_t both = {
+		.std_output_raw = g_memdup2(indented, sizeof(indented)),
+		.std_output_raw_len = sizeof(indented) - 1,
+	};
+	gchar* indented_hash = wsh_response_hash(&both);
+	wsh_split_response(&both);
+	g_assert_cmpuint(both.std_output_len, ==, 2);
+	split_hash = wsh_response_hash(&both);
+	g_assert_cmpstr(indented_hash, ==, split_hash);
+	g_free(split_hash);
+	g_free(indented_hash);
+	g_strfreev(both.std_output);
+	g_strfreev(both.std_error);
+	g_free(both.std_output_raw);
+
+	// A match drops the output, and makes it through packing
+	guint8* buf = NULL;
+	guint32 buf_len;
+	wsh_pack_response(&buf, &buf_len, &raw);
+	wsh_cmd_res_t* out = g_new0(wsh_cmd_res_t, 1);
+	wsh_unpack_response(&out, buf, buf_len);
+	g_slice_free1(buf_len, buf);
+
+	gchar* upper = g_ascii_strup(hash, -1);
+	g_assert(! wsh_response_match(out, "00"));
+	g_assert(! out->matches);
+	g_assert(wsh_response_match(out, upper));
+	g_assert(out->matches);
+	g_assert(out->std_output_raw == NULL);
+	g_assert_cmpuint(out->std_output_raw_len, ==, 0);
+	g_free(upper);
+
+	wsh_pack_response(&buf, &buf_len, out);
+	wsh_free_unpacked_response(&out);
+	out = g_new0(wsh_cmd_res_t, 1);
+	wsh_unpack_response(&out, buf, buf_len);
+	g_slice_free1(buf_len, buf);
+	g_assert(out->matches);
+	g_assert(out->std_output_raw == NULL);
+	wsh_free_unpacked_response(&out);
+
+	// The hash to match travels with the request
+	wsh_cmd_req_t req = {
+		.cmd_string = "true",
+		.cwd = "",
+		.expect_hash = hash,
+	};
+	wsh_pack_request(&buf, &buf_len, &req);
+	wsh_cmd_req_t* req_out = g_new0(wsh_cmd_req_t, 1);
+	wsh_unpack_request(&req_out, buf, buf_len);
+	g_slice_free1(buf_len, buf);
+	g_assert_cmpstr(req_out->expect_hash, ==, hash);
+	wsh_free_unpacked_request(&req_out);
+
+	g_free(hash);
+}
+
 // Regress
 static void free_response(void) {
 	wsh_cmd_res_t* res = NULL;
@@ -166,6 +525,12 @@ int main(int argc, char** argv) {
 	g_test_add_func("/Library/Packing/UnpackRequest", test_wsh_unpack_request);
 	g_test_add_func("/Library/Packing/PackResponse", test_wsh_pack_response);
 	g_test_add_func("/Library/Packing/UnpackResponse", test_wsh_unpack_response);
+	g_test_add_func("/Library/Packing/PackManifests", pack_manifests);
+	g_test_add_func("/Library/Packing/PackResume", pack_resume);
+	g_test_add_func("/Library/Packing/PackScript", pack_script);
+	g_test_add_func("/Library/Packing/PackRaw", pack_raw);
+	g_test_add_func("/Library/Packing/PackCompressed", pack_compressed);
+	g_test_add_func("/Library/Packing/ResponseHash", response_hash);
 
 	g_test_add_func("/Regress/Library/Packing/FreeResponse", free_response);
 	g_test_add_func("/Regress/Library/Packing/FreeRequest", free_request);
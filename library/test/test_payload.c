@@ -0,0 +1,299 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "payload.h"
+
+static const gchar* text = "echo hello\necho world\n";
+
+static gchar* make_file(const gchar* dir, const gchar* name,
+                        const gchar* contents, gsize len) {
+	gchar* path = g_build_filename(dir, name, NULL);
+	g_assert(g_file_set_contents(path, contents, len, NULL));
+	return path;
+}
+
+// Repetitive enough that gzip always wins
+static gchar* compressible(gsize len) {
+	gchar* buf = g_malloc(len);
+	for (gsize i = 0; i < len; i++)
+		buf[i] = text[i % strlen(text)];
+	return buf;
+}
+
+static void new_compresses(void) {
+	GError* err = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-payload-XXXXXX", NULL);
+	gsize len = 256 * 1024;
+	gchar* contents = compressible(len);
+	gchar* path = make_file(dir, "script.sh", contents, len);
+	wsh_payload_t* payload = NULL;
+
+	g_assert(! wsh_payload_new(&payload, path, TRUE, &err));
+	g_assert_no_error(err);
+	g_assert(payload->compressed);
+	g_assert_cmpstr(payload->name, ==, "script.sh" WSH_PAYLOAD_SUFFIX);
+	g_assert_cmpuint(payload->size, ==, len);
+	g_assert_cmpint(payload->mode, ==, 0755);
+	g_assert_cmpuint(g_bytes_get_size(payload->data), <, len);
+
+	wsh_payload_free(&payload);
+	g_assert(payload == NULL);
+
+	(void) g_unlink(path);
+	(void) g_rmdir(dir);
+	g_free(path);
+	g_free(contents);
+	g_free(dir);
+}
+
+static void new_incompressible(void) {
+	GError* err = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-payload-XXXXXX", NULL);
+	gsize len = 4096;
+	gchar* contents = g_malloc(len);
+	GRand* rand = g_rand_new_with_seed(42);
+	for (gsize i = 0; i < len; i++)
+		contents[i] = g_rand_int(rand);
+	g_rand_free(rand);
+
+	gchar* path = make_file(dir, "blob", contents, len);
+	wsh_payload_t* payload = NULL;
+
+	g_assert(! wsh_payload_new(&payload, path, FALSE, &err));
+	g_assert(! payload->compressed);
+	g_assert_cmpstr(payload->name, ==, "blob");
+	g_assert_cmpint(payload->mode, ==, 0644);
+	g_assert_cmpuint(g_bytes_get_size(payload->data), ==, len);
+	g_assert(! memcmp(g_bytes_get_data(payload->data, NULL), contents, len));
+
+	wsh_payload_free(&payload);
+	(void) g_unlink(path);
+	(void) g_rmdir(dir);
+	g_free(path);
+	g_free(contents);
+	g_free(dir);
+}
+
+static void new_missing(void) {
+	GError* err = NULL;
+	wsh_payload_t* payload = NULL;
+
+	g_assert(wsh_payload_new(&payload, "/nonexistent/wsh-payload", FALSE, &err));
+	g_assert(err != NULL);
+	g_assert(payload == NULL);
+	g_error_free(err);
+}
+
+static void inflate_round_trip(void) {
+	GError* err = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-payload-XXXXXX", NULL);
+	gsize len = 200 * 1024;
+	gchar* contents = compressible(len);
+	gchar* src = make_file(dir, "script.sh", contents, len);
+	wsh_payload_t* payload = NULL;
+
+	g_assert(! wsh_payload_new(&payload, src, TRUE, &err));
+	g_assert(! g_unlink(src));
+
+	// What lands on the remote host
+	gsize data_len = 0;
+	const gchar* data = g_bytes_get_data(payload->data, &data_len);
+	gchar* landed = make_file(dir, payload->name, data, data_len);
+	g_assert(! g_chmod(landed, payload->mode));
+
+	g_assert(! wsh_payload_inflate(landed, &err));
+	g_assert_no_error(err);
+	g_assert(! g_file_test(landed, G_FILE_TEST_EXISTS));
+
+	gchar* got = NULL;
+	gsize got_len = 0;
+	g_assert(g_file_get_contents(src, &got, &got_len, NULL));
+	g_assert_cmpuint(got_len, ==, len);
+	g_assert(! memcmp(got, contents, len));
+
+	struct stat st;
+	g_assert(! g_stat(src, &st));
+	g_assert_cmpint(st.st_mode & 0777, ==, 0755);
+
+	wsh_payload_free(&payload);
+	(void) g_unlink(src);
+	(void) g_rmdir(dir);
+	g_free(got);
+	g_free(landed);
+	g_free(src);
+	g_free(contents);
+	g_free(dir);
+}
+
+static void inflate_corrupt(void) {
+	GError* err = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-payload-XXXXXX", NULL);
+	gsize len = 64 * 1024;
+	gchar* contents = compressible(len);
+	gchar* src = make_file(dir, "script.sh", contents, len);
+	wsh_payload_t* payload = NULL;
+
+	g_assert(! wsh_payload_new(&payload, src, TRUE, &err));
+	g_assert(! g_unlink(src));
+
+	// Cut off halfway through
+	gsize data_len = 0;
+	const gchar* data = g_bytes_get_data(payload->data, &data_len);
+	gchar* landed = make_file(dir, payload->name, data, data_len / 2);
+
+	g_assert(wsh_payload_inflate(landed, &err));
+	g_assert_error(err, WSH_PAYLOAD_ERROR, WSH_PAYLOAD_INFLATE_ERR);
+	g_error_free(err);
+
+	// Nothing half written is left behind
+	g_assert(! g_file_test(src, G_FILE_TEST_EXISTS));
+	GDir* d = g_dir_open(dir, 0, NULL);
+	g_assert_cmpstr(g_dir_read_name(d), ==, payload->name);
+	g_assert(g_dir_read_name(d) == NULL);
+	g_dir_close(d);
+
+	wsh_payload_free(&payload);
+	(void) g_unlink(landed);
+	(void) g_rmdir(dir);
+	g_free(landed);
+	g_free(src);
+	g_free(contents);
+	g_free(dir);
+}
+
+static void inflate_bad_name(void) {
+	GError* err = NULL;
+
+	g_assert(wsh_payload_inflate("/tmp/script.sh", &err));
+	g_assert_error(err, WSH_PAYLOAD_ERROR, WSH_PAYLOAD_NAME_ERR);
+	g_error_free(err);
+}
+
+static void write_script(void) {
+	GError* err = NULL;
+	gchar* path = NULL;
+
+	g_assert(! wsh_payload_write_script("script.sh", (const guint8*)text,
+	                                    strlen(text), &path, &err));
+	g_assert_no_error(err);
+	g_assert(g_str_has_suffix(path, "/script.sh"));
+
+	gchar* got = NULL;
+	g_assert(g_file_get_contents(path, &got, NULL, NULL));
+	g_assert_cmpstr(got, ==, text);
+
+	// Only we can get at it
+	struct stat st;
+	g_assert(! g_stat(path, &st));
+	g_assert_cmpint(st.st_mode & 0777, ==, 0700);
+	gchar* dir = g_path_get_dirname(path);
+	g_assert(! g_stat(dir, &st));
+	g_assert_cmpint(st.st_mode & 0777, ==, 0700);
+
+	wsh_payload_remove_script(&path);
+	g_assert(path == NULL);
+	g_assert(! g_file_test(dir, G_FILE_TEST_EXISTS));
+
+	g_free(dir);
+	g_free(got);
+}
+
+static void write_script_compressed(void) {
+	GError* err = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-payload-XXXXXX", NULL);
+	gsize len = 64 * 1024;
+	gchar* contents = compressible(len);
+	gchar* src = make_file(dir, "script.sh", contents, len);
+	wsh_payload_t* payload = NULL;
+
+	g_assert(! wsh_payload_new(&payload, src, TRUE, &err));
+	g_assert(payload->compressed);
+
+	gsize data_len = 0;
+	const guint8* data = g_bytes_get_data(payload->data, &data_len);
+	gchar* path = NULL;
+	g_assert(! wsh_payload_write_script(payload->name, data, data_len, &path, &err));
+	g_assert_no_error(err);
+	g_assert(g_str_has_suffix(path, "/script.sh"));
+
+	gchar* got = NULL;
+	gsize got_len = 0;
+	g_assert(g_file_get_contents(path, &got, &got_len, NULL));
+	g_assert_cmpuint(got_len, ==, len);
+	g_assert(! memcmp(got, contents, len));
+
+	wsh_payload_remove_script(&path);
+	wsh_payload_free(&payload);
+	(void) g_unlink(src);
+	(void) g_rmdir(dir);
+	g_free(got);
+	g_free(src);
+	g_free(contents);
+	g_free(dir);
+}
+
+static void write_script_bad_name(void) {
+	GError* err = NULL;
+	gchar* path = NULL;
+
+	g_assert(wsh_payload_write_script("../script.sh", (const guint8*)text,
+	                                  strlen(text), &path, &err));
+	g_assert_error(err, WSH_PAYLOAD_ERROR, WSH_PAYLOAD_SCRIPT_ERR);
+	g_assert(path == NULL);
+	g_error_free(err);
+	err = NULL;
+
+	g_assert(wsh_payload_write_script("..", (const guint8*)text,
+	                                  strlen(text), &path, &err));
+	g_assert_error(err, WSH_PAYLOAD_ERROR, WSH_PAYLOAD_SCRIPT_ERR);
+	g_error_free(err);
+}
+
+static void free_null(void) {
+	wsh_payload_t* payload = NULL;
+	wsh_payload_free(&payload);
+	wsh_payload_free(NULL);
+	wsh_payload_remove_script(NULL);
+}
+
+int main(int argc, char** argv) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/Library/Payload/NewCompresses", new_compresses);
+	g_test_add_func("/Library/Payload/NewIncompressible", new_incompressible);
+	g_test_add_func("/Library/Payload/NewMissing", new_missing);
+	g_test_add_func("/Library/Payload/InflateRoundTrip", inflate_round_trip);
+	g_test_add_func("/Library/Payload/InflateCorrupt", inflate_corrupt);
+	g_test_add_func("/Library/Payload/InflateBadName", inflate_bad_name);
+	g_test_add_func("/Library/Payload/WriteScript", write_script);
+	g_test_add_func("/Library/Payload/WriteScriptCompressed", write_script_compressed);
+	g_test_add_func("/Library/Payload/WriteScriptBadName", write_script_bad_name);
+
+	g_test_add_func("/Regress/Library/Payload/FreeNull", free_null);
+
+	return g_test_run();
+}
@@ -0,0 +1,325 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include <glib.h>
+#include <string.h>
+
+#include "aggregate.h"
+#include "pack.h"
+#include "relay.h"
+
+static gchar* hosts[] = {
+	"a", "b", "c", "d", "e", "f", "g", NULL,
+};
+static const gsize num_hosts = 7;
+
+static gchar* out[] = { "hello", NULL };
+static gchar* other_out[] = { "goodbye", NULL };
+
+static void split_even(void) {
+	gchar*** shards = wsh_relay_split(hosts, 6, 3);
+
+	g_assert(shards[3] == NULL);
+	for (gsize i = 0; i < 3; i++) {
+		g_assert_cmpuint(g_strv_length(shards[i]), ==, 2);
+		g_assert_cmpstr(shards[i][0], ==, hosts[i * 2]);
+		g_assert_cmpstr(shards[i][1], ==, hosts[i * 2 + 1]);
+	}
+
+	wsh_relay_free_shards(shards);
+}
+
+static void split_uneven(void) {
+	gchar*** shards = wsh_relay_split(hosts, num_hosts, 3);
+
+	g_assert(shards[3] == NULL);
+	g_assert_cmpuint(g_strv_length(shards[0]), ==, 3);
+	g_assert_cmpuint(g_strv_length(shards[1]), ==, 2);
+	g_assert_cmpuint(g_strv_length(shards[2]), ==, 2);
+
+	// Shards are contiguous and in order
+	g_assert_cmpstr(shards[0][0], ==, "a");
+	g_assert_cmpstr(shards[1][0], ==, "d");
+	g_assert_cmpstr(shards[2][1], ==, "g");
+
+	wsh_relay_free_shards(shards);
+}
+
+static void split_more_parts_than_hosts(void) {
+	gchar*** shards = wsh_relay_split(hosts, 2, 5);
+
+	g_assert(shards[0] != NULL);
+	g_assert(shards[1] != NULL);
+	g_assert(shards[2] == NULL);
+	g_assert_cmpstr(shards[0][0], ==, "a");
+	g_assert_cmpstr(shards[1][0], ==, "b");
+
+	wsh_relay_free_shards(shards);
+}
+
+static void distribute_depth(void) {
+	g_assert_cmpuint(wsh_relay_distribute_depth(1), ==, 1);
+	g_assert_cmpuint(wsh_relay_distribute_depth(WSH_RELAY_DISTRIBUTE_FANOUT), ==, 1);
+	g_assert_cmpuint(wsh_relay_distribute_depth(WSH_RELAY_DISTRIBUTE_FANOUT + 1), ==, 2);
+	g_assert_cmpuint(wsh_relay_distribute_depth(
+	                     WSH_RELAY_DISTRIBUTE_FANOUT * WSH_RELAY_DISTRIBUTE_FANOUT), ==, 2);
+	g_assert_cmpuint(wsh_relay_distribute_depth(
+	                     WSH_RELAY_DISTRIBUTE_FANOUT * WSH_RELAY_DISTRIBUTE_FANOUT + 1), ==, 3);
+}
+
+static void merge_identical(void) {
+	wsh_relay_merge_t* merge = NULL;
+	wsh_relay_merge_init(&merge);
+
+	wsh_cmd_res_t res = {
+		.std_output = out,
+		.std_output_len = 1,
+		.exit_status = 0,
+		.hosts = hosts,
+		.hosts_len = 2,
+	};
+	wsh_relay_merge_add(merge, &res);
+
+	res.hosts = hosts + 2;
+	res.hosts_len = 1;
+	wsh_relay_merge_add(merge, &res);
+	g_assert_cmpuint(merge->num_hosts, ==, 3);
+
+	GPtrArray* merged = wsh_relay_merge_take(merge);
+	g_assert_cmpuint(merged->len, ==, 1);
+
+	wsh_cmd_res_t* m = g_ptr_array_index(merged, 0);
+	g_assert_cmpuint(m->hosts_len, ==, 3);
+	g_assert_cmpstr(m->hosts[0], ==, "a");
+	g_assert_cmpstr(m->hosts[2], ==, "c");
+	g_assert(m->hosts[3] == NULL);
+	g_assert_cmpuint(m->std_output_len, ==, 1);
+	g_assert_cmpstr(m->std_output[0], ==, "hello");
+
+	wsh_free_unpacked_response(&m);
+	g_ptr_array_free(merged, TRUE);
+	wsh_relay_merge_free(&merge);
+	g_assert(merge == NULL);
+}
+
+static void merge_different(void) {
+	wsh_relay_merge_t* merge = NULL;
+	wsh_relay_merge_init(&merge);
+
+	wsh_cmd_res_t res = {
+		.std_output = out,
+		.std_output_len = 1,
+		.exit_status = 0,
+		.hosts = hosts,
+		.hosts_len = 1,
+	};
+	wsh_relay_merge_add(merge, &res);
+
+	// Same output, different exit status
+	res.exit_status = 1;
+	res.hosts = hosts + 1;
+	wsh_relay_merge_add(merge, &res);
+
+	res.exit_status = 0;
+	res.std_output = other_out;
+	res.hosts = hosts + 2;
+	wsh_relay_merge_add(merge, &res);
+
+	GPtrArray* merged = wsh_relay_merge_take(merge);
+	g_assert_cmpuint(merged->len, ==, 3);
+	for (guint i = 0; i < merged->len; i++) {
+		wsh_cmd_res_t* m = g_ptr_array_index(merged, i);
+		g_assert_cmpuint(m->hosts_len, ==, 1);
+		wsh_free_unpacked_response(&m);
+	}
+	g_ptr_array_free(merged, TRUE);
+
+	wsh_relay_merge_free(&merge);
+}
+
+static void merge_matches(void) {
+	wsh_relay_merge_t* merge = NULL;
+	wsh_relay_merge_init(&merge);
+
+	wsh_cmd_res_t res = {
+		.exit_status = 0,
+		.matches = TRUE,
+		.hosts = hosts,
+		.hosts_len = 2,
+	};
+	wsh_relay_merge_add(merge, &res);
+
+	// Left out output isn't the same as no output
+	res.matches = FALSE;
+	res.hosts = hosts + 2;
+	res.hosts_len = 1;
+	wsh_relay_merge_add(merge, &res);
+
+	GPtrArray* merged = wsh_relay_merge_take(merge);
+	g_assert_cmpuint(merged->len, ==, 2);
+	for (guint i = 0; i < merged->len; i++) {
+		wsh_cmd_res_t* m = g_ptr_array_index(merged, i);
+		g_assert_cmpuint(m->hosts_len, ==, m->matches ? 2 : 1);
+		g_assert_cmpstr(m->hosts[0], ==, m->matches ? "a" : "c");
+		wsh_free_unpacked_response(&m);
+	}
+	g_ptr_array_free(merged, TRUE);
+
+	wsh_relay_merge_free(&merge);
+}
+
+static void merge_summaries(void) {
+	wsh_relay_merge_t* merge = NULL;
+	wsh_relay_merge_init(&merge);
+
+	wsh_cmd_res_t res = {
+		.std_output = out,
+		.std_output_len = 1,
+		.spool_id = "wsh-spool-a",
+		.output_hash = "abc123",
+		.output_size = 4096,
+		.hosts = hosts,
+		.hosts_len = 1,
+	};
+	wsh_relay_merge_add(merge, &res);
+
+	res.spool_id = "wsh-spool-b";
+	res.hosts = hosts + 1;
+	wsh_relay_merge_add(merge, &res);
+
+	GPtrArray* merged = wsh_relay_merge_take(merge);
+	g_assert_cmpuint(merged->len, ==, 2);
+	for (guint i = 0; i < merged->len; i++) {
+		wsh_cmd_res_t* m = g_ptr_array_index(merged, i);
+		g_assert_cmpuint(m->hosts_len, ==, 1);
+		g_assert_cmpstr(m->spool_id, ==,
+		                g_strcmp0(m->hosts[0], "a") ? "wsh-spool-b" : "wsh-spool-a");
+		g_assert_cmpstr(m->output_hash, ==, "abc123");
+		g_assert_cmpuint(m->output_size, ==, 4096);
+		wsh_free_unpacked_response(&m);
+	}
+	g_ptr_array_free(merged, TRUE);
+
+	wsh_relay_merge_free(&merge);
+}
+
+static void merge_aggregates(void) {
+	wsh_relay_merge_t* merge = NULL;
+	wsh_relay_merge_init(&merge);
+
+	wsh_aggregate_t* agg = NULL;
+	wsh_aggregate_new(&agg, WSH_AGGREGATE_UNIQ_COUNT);
+	wsh_aggregate_count(agg, "5.15", 1);
+
+	wsh_cmd_res_t res = {
+		.aggregate = agg,
+		.hosts = hosts,
+		.hosts_len = 1,
+	};
+	wsh_relay_merge_add(merge, &res);
+
+	// Different aggregates still merge, into one covering both hosts
+	wsh_aggregate_count(agg, "6.1", 1);
+	res.hosts = hosts + 1;
+	wsh_relay_merge_add(merge, &res);
+
+	GPtrArray* merged = wsh_relay_merge_take(merge);
+	g_assert_cmpuint(merged->len, ==, 1);
+
+	wsh_cmd_res_t* m = g_ptr_array_index(merged, 0);
+	g_assert_cmpuint(m->hosts_len, ==, 2);
+	g_assert(m->aggregate != agg);
+	g_assert_cmpuint(*(guint64*)g_hash_table_lookup(m->aggregate->counts, "5.15"), ==, 2);
+	g_assert_cmpuint(*(guint64*)g_hash_table_lookup(m->aggregate->counts, "6.1"), ==, 1);
+
+	wsh_free_unpacked_response(&m);
+	g_ptr_array_free(merged, TRUE);
+	wsh_relay_merge_free(&merge);
+	wsh_aggregate_free(&agg);
+}
+
+static void merge_take_empties(void) {
+	wsh_relay_merge_t* merge = NULL;
+	wsh_relay_merge_init(&merge);
+
+	wsh_cmd_res_t res = {
+		.error_message = "relay a: connection refused",
+		.exit_status = -1,
+		.hosts = hosts,
+		.hosts_len = num_hosts,
+	};
+	wsh_relay_merge_add(merge, &res);
+
+	GPtrArray* merged = wsh_relay_merge_take(merge);
+	g_assert_cmpuint(merged->len, ==, 1);
+	g_assert_cmpuint(merge->num_hosts, ==, 0);
+
+	wsh_cmd_res_t* m = g_ptr_array_index(merged, 0);
+	g_assert_cmpstr(m->error_message, ==, "relay a: connection refused");
+	g_assert_cmpint(m->exit_status, ==, -1);
+	g_assert_cmpuint(m->hosts_len, ==, num_hosts);
+	wsh_free_unpacked_response(&m);
+	g_ptr_array_free(merged, TRUE);
+
+	merged = wsh_relay_merge_take(merge);
+	g_assert_cmpuint(merged->len, ==, 0);
+	g_ptr_array_free(merged, TRUE);
+
+	wsh_relay_merge_free(&merge);
+}
+
+static void merge_free_unclaimed(void) {
+	wsh_relay_merge_t* merge = NULL;
+	wsh_relay_merge_init(&merge);
+
+	wsh_cmd_res_t res = {
+		.std_output = out,
+		.std_output_len = 1,
+		.hosts = hosts,
+		.hosts_len = 1,
+	};
+	wsh_relay_merge_add(merge, &res);
+
+	wsh_relay_merge_free(&merge);
+	g_assert(merge == NULL);
+	wsh_relay_merge_free(&merge);
+	wsh_relay_merge_free(NULL);
+}
+
+int main(int argc, char** argv) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/Library/Relay/SplitEven", split_even);
+	g_test_add_func("/Library/Relay/SplitUneven", split_uneven);
+	g_test_add_func("/Library/Relay/SplitMorePartsThanHosts",
+	                split_more_parts_than_hosts);
+	g_test_add_func("/Library/Relay/DistributeDepth", distribute_depth);
+	g_test_add_func("/Library/Relay/MergeIdentical", merge_identical);
+	g_test_add_func("/Library/Relay/MergeDifferent", merge_different);
+	g_test_add_func("/Library/Relay/MergeMatches", merge_matches);
+	g_test_add_func("/Library/Relay/MergeSummaries", merge_summaries);
+	g_test_add_func("/Library/Relay/MergeAggregates", merge_aggregates);
+	g_test_add_func("/Library/Relay/MergeTakeEmpties", merge_take_empties);
+
+	g_test_add_func("/Regress/Library/Relay/MergeFreeUnclaimed", merge_free_unclaimed);
+
+	return g_test_run();
+}
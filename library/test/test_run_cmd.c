@@ -20,6 +20,8 @@
  */
 #include "config.h"
 #include <glib.h>
+#include <glib/gstdio.h>
+#include <signal.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -28,6 +30,7 @@
 #include "cmd.h"
 #include "cmd_internal.h"
 #include "log.h"
+#include "pack.h"
 
 #include "getpwent.h"
 
@@ -128,6 +131,143 @@ static void test_run_stdout(struct test_wsh_run_cmd_data* fixture,
 	g_assert_cmpstr(res->std_output[0], ==, "foo");
 }
 
+// More than one read's worth, split across reads mid line
+static void test_run_many_lines(struct test_wsh_run_cmd_data* fixture,
+                                gconstpointer user_data) {
+	wsh_cmd_req_t* req = fixture->req;
+	wsh_cmd_res_t* res = fixture->res;
+
+	req->cmd_string = "seq 1 100000";
+	wsh_run_cmd(res, req);
+	g_assert_no_error(res->err);
+	g_assert(res->exit_status == 0);
+	g_assert_cmpuint(res->std_output_len, ==, 100000);
+	g_assert_cmpstr(res->std_output[0], ==, "1");
+	g_assert_cmpstr(res->std_output[56789], ==, "56790");
+	g_assert_cmpstr(res->std_output[99999], ==, "100000");
+}
+
+// Nothing but the sudo password is sent, so stdin ends right away
+static void test_run_stdin_closed(struct test_wsh_run_cmd_data* fixture,
+                                  gconstpointer user_data) {
+	g_test_timer_start();
+
+	fixture->req->cmd_string = "cat";
+	fixture->req->timeout = 3;
+	wsh_run_cmd(fixture->res, fixture->req);
+
+	g_assert(g_test_timer_elapsed() < 2);
+	g_assert(fixture->res->exit_status == 0);
+	g_assert_cmpuint(fixture->res->std_output_len, ==, 0);
+}
+
+// Output arrives in frames, exactly as it was written, and none in res
+static void test_pass_cmd(struct test_wsh_run_cmd_data* fixture,
+                          gconstpointer user_data) {
+	wsh_cmd_req_t* req = fixture->req;
+	wsh_cmd_res_t* res = fixture->res;
+	GString* out = g_string_new(NULL);
+	GString* err = g_string_new(NULL);
+	gchar* path = NULL;
+	gchar* frames = NULL;
+	gsize frames_len = 0;
+
+	gint fd = g_file_open_tmp(NULL, &path, NULL);
+	g_assert(fd != -1);
+
+	req->cmd_string = "printf \"foo\\n\\tbar\"; printf \"baz\\n\" >&2; exit 3";
+	req->use_shell = TRUE;
+	wsh_pass_cmd(res, req, fd);
+	g_assert_no_error(res->err);
+	g_assert(res->exit_status == 3);
+	g_assert_cmpuint(res->std_output_len, ==, 0);
+	g_assert_cmpuint(res->std_error_len, ==, 0);
+
+	g_assert(g_file_get_contents(path, &frames, &frames_len, NULL));
+	for (gsize i = 0; i < frames_len;) {
+		guint32 len;
+		g_assert_cmpuint(frames_len - i, >=, WSH_FRAME_HEADER_LEN);
+		memcpy(&len, frames + i + 1, sizeof(len));
+		len = g_ntohl(len);
+
+		g_assert(frames[i] == WSH_FRAME_STDOUT || frames[i] == WSH_FRAME_STDERR);
+		g_string_append_len(frames[i] == WSH_FRAME_STDOUT ? out : err,
+		                    frames + i + WSH_FRAME_HEADER_LEN, len);
+		i += WSH_FRAME_HEADER_LEN + len;
+	}
+
+	g_assert_cmpstr(out->str, ==, "foo\n\tbar");
+	g_assert_cmpstr(err->str, ==, "baz\n");
+
+	close(fd);
+	g_unlink(path);
+	g_free(path);
+	g_free(frames);
+	g_string_free(out, TRUE);
+	g_string_free(err, TRUE);
+}
+
+// Output comes back byte for byte, whitespace and all, and isn't split
+static void test_run_raw(struct test_wsh_run_cmd_data* fixture,
+                         gconstpointer user_data) {
+	wsh_cmd_req_t* req = fixture->req;
+	wsh_cmd_res_t* res = fixture->res;
+
+	req->cmd_string = "printf \" foo \\n\\377bar\"; printf \"baz\\n\" >&2";
+	req->use_shell = TRUE;
+	req->raw_output = TRUE;
+	wsh_run_cmd(res, req);
+	g_assert_no_error(res->err);
+	g_assert(res->exit_status == 0);
+	g_assert(res->std_output == NULL);
+	g_assert(res->std_error == NULL);
+	g_assert_cmpuint(res->std_output_raw_len, ==, 10);
+	g_assert(! memcmp(res->std_output_raw, " foo \n\377bar", 10));
+	g_assert_cmpuint(res->std_error_raw_len, ==, 4);
+	g_assert(! memcmp(res->std_error_raw, "baz\n", 4));
+
+	g_free(res->std_output_raw);
+	g_free(res->std_error_raw);
+}
+
+// Raw output hashes exactly as written, whitespace and all
+static void test_run_hash_raw(struct test_wsh_run_cmd_data* fixture,
+                              gconstpointer user_data) {
+	wsh_cmd_req_t* req = fixture->req;
+	wsh_cmd_res_t* lines = fixture->res;
+	wsh_cmd_res_t* raw = g_new0(wsh_cmd_res_t, 1);
+	wsh_cmd_res_t* indented = g_new0(wsh_cmd_res_t, 1);
+
+	// Plain newline ended output hashes the same from either kind of wshd
+	req->cmd_string = "printf 'first\\nsecond\\n'; printf 'err\\n' >&2";
+	req->use_shell = TRUE;
+	wsh_run_cmd(lines, req);
+	g_assert_no_error(lines->err);
+
+	req->raw_output = TRUE;
+	wsh_run_cmd(raw, req);
+	g_assert_no_error(raw->err);
+	g_assert(raw->std_output_raw != NULL);
+
+	gchar* lines_hash = wsh_response_hash(lines);
+	gchar* raw_hash = wsh_response_hash(raw);
+	g_assert_cmpstr(lines_hash, ==, raw_hash);
+
+	// But indenting it is drift
+	req->cmd_string = "printf '  first\\nsecond\\n'; printf 'err\\n' >&2";
+	wsh_run_cmd(indented, req);
+	g_assert_no_error(indented->err);
+
+	gchar* indented_hash = wsh_response_hash(indented);
+	g_assert_cmpstr(indented_hash, !=, raw_hash);
+
+	g_free(lines_hash);
+	g_free(raw_hash);
+	g_free(indented_hash);
+	wsh_free_unpacked_response(&raw);
+	wsh_free_unpacked_response(&indented);
+}
+
 static void test_run_stderr(struct test_wsh_run_cmd_data* fixture,
                             gconstpointer user_data) {
 	wsh_cmd_req_t* req = fixture->req;
@@ -167,6 +307,14 @@ static void test_run_err(struct test_wsh_run_cmd_data* fixture,
 	req->cwd = "/foobarbaz";
 	wsh_run_cmd(res, req);
 	g_assert_error(res->err, G_SPAWN_ERROR, G_SPAWN_ERROR_CHDIR);
+
+	g_error_free(res->err);
+	res->err = NULL;
+	req->cmd_string = "wsh-definitely-not-a-command";
+	req->use_shell = FALSE;
+	req->cwd = "/tmp";
+	wsh_run_cmd(res, req);
+	g_assert_error(res->err, G_SPAWN_ERROR, G_SPAWN_ERROR_NOENT);
 }
 
 static void test_construct_sudo_cmd(struct test_wsh_run_cmd_data* fixture,
@@ -177,7 +325,7 @@ static void test_construct_sudo_cmd(struct test_wsh_run_cmd_data* fixture,
 	req->cmd_string = "/bin/ls";
 	req->use_shell = TRUE;
 	gchar* res = wsh_construct_sudo_cmd(req, &err);
-	g_assert_cmpstr(res, ==, LIBEXEC_PATH"/wsh-killer 0 /bin/sh -c '/bin/ls'");
+	g_assert_cmpstr(res, ==, "/bin/sh -c '/bin/ls'");
 	g_assert_no_error(err);
 	g_free(res);
 
@@ -185,7 +333,7 @@ static void test_construct_sudo_cmd(struct test_wsh_run_cmd_data* fixture,
 	req->use_shell = TRUE;
 	res = wsh_construct_sudo_cmd(req, &err);
 	g_assert_cmpstr(res, ==,
-	                "sudo -sA -u root "LIBEXEC_PATH"/wsh-killer 0 /bin/sh -c '/bin/ls'");
+	                "sudo -sA -u root /bin/sh -c '/bin/ls'");
 	g_assert_no_error(err);
 	g_free(res);
 
@@ -193,7 +341,7 @@ static void test_construct_sudo_cmd(struct test_wsh_run_cmd_data* fixture,
 	req->use_shell = TRUE;
 	res = wsh_construct_sudo_cmd(req, &err);
 	g_assert_cmpstr(res, ==,
-	                "sudo -sA -u worr "LIBEXEC_PATH"/wsh-killer 0 /bin/sh -c '/bin/ls'");
+	                "sudo -sA -u worr /bin/sh -c '/bin/ls'");
 	g_assert_no_error(err);
 	g_free(res);
 
@@ -201,10 +349,39 @@ static void test_construct_sudo_cmd(struct test_wsh_run_cmd_data* fixture,
 	req->use_shell = TRUE;
 	res = wsh_construct_sudo_cmd(req, &err);
 	g_assert_cmpstr(res, ==,
-	                "sudo -sA -u root "LIBEXEC_PATH"/wsh-killer 0 /bin/sh -c '/bin/ls'");
+	                "sudo -sA -u root /bin/sh -c '/bin/ls'");
+	g_assert_no_error(err);
+	g_free(res);
+
+	req->use_shell = FALSE;
+	res = wsh_construct_sudo_cmd(req, &err);
+	g_assert_cmpstr(res, ==, "sudo -A -u root /bin/ls");
+	g_assert_no_error(err);
+	g_free(res);
+
+	// Under sudo, timeout(1) enforces the timeout as the target user
+	req->timeout = 10;
+	res = wsh_construct_sudo_cmd(req, &err);
+	g_assert_cmpstr(res, ==, "sudo -A -u root timeout -k 2 10 /bin/ls");
+	g_assert_no_error(err);
+	g_free(res);
+
+	req->use_shell = TRUE;
+	res = wsh_construct_sudo_cmd(req, &err);
+	g_assert_cmpstr(res, ==, "sudo -sA -u root timeout -k 2 10 /bin/sh -c '/bin/ls'");
+	g_assert_no_error(err);
+	g_free(res);
+	req->use_shell = FALSE;
+	req->timeout = 0;
+
+	req->sudo = FALSE;
+	res = wsh_construct_sudo_cmd(req, &err);
+	g_assert_cmpstr(res, ==, "/bin/ls");
 	g_assert_no_error(err);
 	g_free(res);
 
+	req->sudo = TRUE;
+	req->use_shell = TRUE;
 	req->username = " ";
 	res = wsh_construct_sudo_cmd(req, &err);
 	g_assert_cmpstr(res, ==, NULL);
@@ -225,6 +402,57 @@ static void test_construct_sudo_cmd(struct test_wsh_run_cmd_data* fixture,
 	g_assert(res == NULL);
 }
 
+static void test_construct_argv(struct test_wsh_run_cmd_data* fixture,
+                                gconstpointer user_data) {
+	wsh_cmd_req_t* req = fixture->req;
+	gchar* argv[] = { "/bin/echo", "it's", NULL };
+
+	req->argv = argv;
+	req->argv_len = 2;
+	gchar** res = wsh_construct_argv(req);
+	g_assert_cmpuint(g_strv_length(res), ==, 2);
+	g_assert_cmpstr(res[0], ==, "/bin/echo");
+	g_assert_cmpstr(res[1], ==, "it's");
+	g_strfreev(res);
+
+	req->sudo = TRUE;
+	req->username = "";
+	res = wsh_construct_argv(req);
+	g_assert_cmpuint(g_strv_length(res), ==, 7);
+	g_assert_cmpstr(res[0], ==, "sudo");
+	g_assert_cmpstr(res[3], ==, "root");
+	g_assert_cmpstr(res[4], ==, "--");
+	g_assert_cmpstr(res[6], ==, "it's");
+	g_strfreev(res);
+
+	req->timeout = 10;
+	res = wsh_construct_argv(req);
+	g_assert_cmpuint(g_strv_length(res), ==, 11);
+	g_assert_cmpstr(res[5], ==, "timeout");
+	g_assert_cmpstr(res[6], ==, "-k");
+	g_assert_cmpstr(res[7], ==, "2");
+	g_assert_cmpstr(res[8], ==, "10");
+	g_assert_cmpstr(res[9], ==, "/bin/echo");
+	g_strfreev(res);
+}
+
+static void test_run_argv(struct test_wsh_run_cmd_data* fixture,
+                          gconstpointer user_data) {
+	wsh_cmd_req_t* req = fixture->req;
+	wsh_cmd_res_t* res = fixture->res;
+	gchar* argv[] = { "echo", "it's", "$HOME", NULL };
+
+	// Passed through untouched, with nothing to parse or expand them
+	req->cmd_string = "echo it's $HOME";
+	req->argv = argv;
+	req->argv_len = 3;
+	wsh_run_cmd(res, req);
+	g_assert_no_error(res->err);
+	g_assert(res->exit_status == 0);
+	g_assert_cmpuint(res->std_output_len, ==, 1);
+	g_assert_cmpstr(res->std_output[0], ==, "it's $HOME");
+}
+
 static void test_wsh_run_cmd_path(struct test_wsh_run_cmd_data* fixture,
                                   gconstpointer user_data) {
 	wsh_cmd_req_t* req = fixture->req;
@@ -235,6 +463,26 @@ static void test_wsh_run_cmd_path(struct test_wsh_run_cmd_data* fixture,
 	g_assert(res->exit_status == 0);
 }
 
+// A command killed by a signal mustn't look like one that exited with its number
+static void test_run_signaled(struct test_wsh_run_cmd_data* fixture,
+                              gconstpointer user_data) {
+	wsh_cmd_req_t* req = fixture->req;
+	wsh_cmd_res_t* res = fixture->res;
+
+	req->cmd_string = "kill -9 $$";
+	req->use_shell = TRUE;
+	wsh_run_cmd(res, req);
+	g_assert_no_error(res->err);
+	g_assert_cmpint(res->exit_status, ==, 128 + SIGKILL);
+
+	wsh_cmd_res_t* exited = g_new0(wsh_cmd_res_t, 1);
+	req->cmd_string = "exit 9";
+	wsh_run_cmd(exited, req);
+	g_assert_no_error(exited->err);
+	g_assert_cmpint(exited->exit_status, ==, 9);
+	wsh_free_unpacked_response(&exited);
+}
+
 static void test_wsh_run_cmd_timeout(struct test_wsh_run_cmd_data* fixture,
                                      gconstpointer user_data) {
 	g_test_timer_start();
@@ -248,23 +496,102 @@ static void test_wsh_run_cmd_timeout(struct test_wsh_run_cmd_data* fixture,
 	g_assert(time_len < 4.5);
 }
 
+// Background jobs hold stdout open, and have to go down with the shell
+static void test_wsh_run_cmd_timeout_group(struct test_wsh_run_cmd_data* fixture,
+        gconstpointer user_data) {
+	g_test_timer_start();
+
+	fixture->req->cmd_string = "/bin/sleep 5 & /bin/sleep 5";
+	fixture->req->use_shell = TRUE;
+	fixture->req->timeout = 1;
+
+	wsh_run_cmd(fixture->res, fixture->req);
+
+	gdouble time_len = g_test_timer_elapsed();
+	g_assert(time_len < 4.5);
+	g_assert_cmpstr(fixture->res->std_output[0], ==, "wsh: Timeout exceeded");
+	g_assert_cmpint(fixture->res->exit_status, ==, 128 + SIGTERM);
+}
+
+static void test_wsh_run_cmd_timeout_kill(struct test_wsh_run_cmd_data* fixture,
+        gconstpointer user_data) {
+	g_test_timer_start();
+
+	fixture->req->cmd_string = "trap \"\" TERM; /bin/sleep 8";
+	fixture->req->use_shell = TRUE;
+	fixture->req->timeout = 1;
+
+	wsh_run_cmd(fixture->res, fixture->req);
+
+	gdouble time_len = g_test_timer_elapsed();
+	g_assert(time_len < 7);
+	g_assert_cmpint(fixture->res->exit_status, ==, 128 + SIGKILL);
+}
+
+// Whatever the group kill can't reach, like something that left the group
+// or that sudo runs as another user, mustn't keep us waiting on its pipes
+static void test_wsh_run_cmd_timeout_abandon(struct test_wsh_run_cmd_data* fixture,
+        gconstpointer user_data) {
+	gchar* setsid = g_find_program_in_path("setsid");
+	if (! setsid) {
+		g_test_skip("setsid(1) isn't available");
+		return;
+	}
+	g_free(setsid);
+
+	g_test_timer_start();
+
+	fixture->req->cmd_string = "setsid /bin/sleep 12 & /bin/sleep 12";
+	fixture->req->use_shell = TRUE;
+	fixture->req->timeout = 1;
+
+	wsh_run_cmd(fixture->res, fixture->req);
+
+	gdouble time_len = g_test_timer_elapsed();
+	g_assert(time_len < 9);
+	g_assert_cmpstr(fixture->res->std_output[0], ==, "wsh: Timeout exceeded");
+	g_assert_cmpint(fixture->res->exit_status, ==, 128 + SIGTERM);
+}
+
 int main(int argc, char** argv, char** env) {
 	g_test_init(&argc, &argv, NULL);
 
 	g_test_add("/Library/RunCmd/ConstructSudoCmd", struct test_wsh_run_cmd_data,
 	           NULL, setup, test_construct_sudo_cmd, teardown);
+	g_test_add("/Library/RunCmd/ConstructArgv", struct test_wsh_run_cmd_data,
+	           NULL, setup, test_construct_argv, teardown);
+	g_test_add("/Library/RunCmd/Argv", struct test_wsh_run_cmd_data, NULL, setup,
+	           test_run_argv, teardown);
 	g_test_add("/Library/RunCmd/ExitCode", struct test_wsh_run_cmd_data, NULL,
 	           setup, test_run_exit_code, teardown);
 	g_test_add("/Library/RunCmd/Stdout", struct test_wsh_run_cmd_data, NULL, setup,
 	           test_run_stdout, teardown);
+	g_test_add("/Library/RunCmd/ManyLines", struct test_wsh_run_cmd_data, NULL,
+	           setup, test_run_many_lines, teardown);
+	g_test_add("/Library/RunCmd/StdinClosed", struct test_wsh_run_cmd_data, NULL,
+	           setup, test_run_stdin_closed, teardown);
+	g_test_add("/Library/RunCmd/PassCmd", struct test_wsh_run_cmd_data, NULL,
+	           setup, test_pass_cmd, teardown);
+	g_test_add("/Library/RunCmd/Raw", struct test_wsh_run_cmd_data, NULL,
+	           setup, test_run_raw, teardown);
+	g_test_add("/Library/RunCmd/HashRaw", struct test_wsh_run_cmd_data, NULL,
+	           setup, test_run_hash_raw, teardown);
 	g_test_add("/Library/RunCmd/Stderr", struct test_wsh_run_cmd_data, NULL, setup,
 	           test_run_stderr, teardown);
 	g_test_add("/Library/RunCmd/Errors", struct test_wsh_run_cmd_data, NULL, setup,
 	           test_run_err, teardown);
 	g_test_add("/Library/RunCmd/Path", struct test_wsh_run_cmd_data, NULL, setup,
 	           test_wsh_run_cmd_path, teardown);
+	g_test_add("/Library/RunCmd/Signaled", struct test_wsh_run_cmd_data, NULL, setup,
+	           test_run_signaled, teardown);
 	g_test_add("/Library/RunCmd/Timeout", struct test_wsh_run_cmd_data, NULL, setup,
 	           test_wsh_run_cmd_timeout, teardown);
+	g_test_add("/Library/RunCmd/TimeoutGroup", struct test_wsh_run_cmd_data, NULL,
+	           setup, test_wsh_run_cmd_timeout_group, teardown);
+	g_test_add("/Library/RunCmd/TimeoutKill", struct test_wsh_run_cmd_data, NULL,
+	           setup, test_wsh_run_cmd_timeout_kill, teardown);
+	g_test_add("/Library/RunCmd/TimeoutAbandon", struct test_wsh_run_cmd_data, NULL,
+	           setup, test_wsh_run_cmd_timeout_abandon, teardown);
 
 	return g_test_run();
 }
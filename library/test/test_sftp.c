@@ -0,0 +1,284 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libssh/sftp.h>
+#include <string.h>
+
+#include "sftp.h"
+
+static gchar* make_file(const gchar* dir, const gchar* name, gsize len) {
+	gchar* path = g_build_filename(dir, name, NULL);
+	gchar* contents = g_malloc0(len);
+	g_assert(g_file_set_contents(path, contents, len, NULL));
+	g_free(contents);
+	return path;
+}
+
+static wsh_ssh_session_t session = {
+	.session = (ssh_session)1,
+	.hostname = "localhost",
+};
+
+static void push_tree(void) {
+	GError* err = NULL;
+	wsh_sftp_t* sftp = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-sftp-XXXXXX", NULL);
+	gsize big_len = 3 * WSH_SFTP_CHUNK_SIZE + 1;
+	gchar* big = make_file(dir, "big", big_len);
+	gchar* small = make_file(dir, "small", 10);
+	gchar* empty = make_file(dir, "empty", 0);
+
+	wsh_manifest_entry_t files[] = {
+		{ .path = "big", .local = big },
+		{ .path = "tree/a", .local = small },
+		{ .path = "tree/sub/b", .local = empty },
+	};
+	const wsh_manifest_entry_t* entries[] = { &files[0], &files[1], &files[2] };
+
+	wsh_payload_t payload = {
+		.name = "script" WSH_PAYLOAD_SUFFIX,
+		.data = g_bytes_new_static("compressed", 10),
+		.mode = 0755,
+	};
+	const wsh_payload_t* payloads[] = { &payload };
+
+	set_sftp_init_ret(0);
+	set_sftp_mkdir_ret(0, SSH_FX_OK);
+	set_sftp_write_ret(0);
+	g_assert(! wsh_sftp_new(&sftp, &session, &err));
+	g_assert_no_error(err);
+
+	g_assert(! wsh_sftp_push(sftp, "", entries, 3, payloads, 1, &err));
+	g_assert_no_error(err);
+
+	guint writes, max_inflight, opened, closed, mkdirs;
+	gsize total;
+	get_sftp_write_stats(&writes, &total, &max_inflight, &opened, &closed);
+	get_sftp_mkdir_stats(&mkdirs);
+
+	// tree is only made once. Empty files still get opened
+	g_assert_cmpuint(mkdirs, ==, 2);
+	g_assert_cmpuint(opened, ==, 4);
+	g_assert_cmpuint(closed, ==, 4);
+	g_assert_cmpuint(writes, ==, 6);
+	g_assert_cmpuint(total, ==, big_len + 10 + 10);
+#ifdef HAVE_SFTP_AIO_BEGIN_WRITE
+	g_assert_cmpuint(max_inflight, ==, 6);
+#else
+	g_assert_cmpuint(max_inflight, ==, 1);
+#endif
+
+	wsh_sftp_free(&sftp);
+	g_assert(sftp == NULL);
+	g_bytes_unref(payload.data);
+
+	(void) g_unlink(big);
+	(void) g_unlink(small);
+	(void) g_unlink(empty);
+	(void) g_rmdir(dir);
+	g_free(big);
+	g_free(small);
+	g_free(empty);
+	g_free(dir);
+}
+
+static void push_offset(void) {
+	GError* err = NULL;
+	wsh_sftp_t* sftp = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-sftp-XXXXXX", NULL);
+	gsize len = 3 * WSH_SFTP_CHUNK_SIZE;
+	gchar* big = make_file(dir, "big", len);
+
+	wsh_manifest_entry_t files[] = {
+		{ .path = "big.wshpart-100", .local = big, .offset = 100 },
+		{ .path = "big.wshpart-too-far", .local = big, .offset = len + 1 },
+	};
+	const wsh_manifest_entry_t* entries[] = { &files[0], &files[1] };
+
+	set_sftp_init_ret(0);
+	set_sftp_mkdir_ret(0, SSH_FX_OK);
+	set_sftp_write_ret(0);
+	g_assert(! wsh_sftp_new(&sftp, &session, &err));
+
+	// Only what's past the offset goes
+	g_assert(! wsh_sftp_push(sftp, "", entries, 1, NULL, 0, &err));
+	g_assert_no_error(err);
+
+	guint writes, max_inflight, opened, closed;
+	gsize total;
+	get_sftp_write_stats(&writes, &total, &max_inflight, &opened, &closed);
+	g_assert_cmpuint(total, ==, len - 100);
+	g_assert_cmpuint(closed, ==, 1);
+
+	// An offset past the end means the file shrank underneath us
+	set_sftp_write_ret(0);
+	g_assert(wsh_sftp_push(sftp, "", &entries[1], 1, NULL, 0, &err));
+	g_assert_error(err, WSH_SFTP_ERROR, WSH_SFTP_READ_ERR);
+	g_error_free(err);
+
+	get_sftp_write_stats(&writes, &total, &max_inflight, &opened, &closed);
+	g_assert_cmpuint(opened, ==, 0);
+
+	wsh_sftp_free(&sftp);
+	(void) g_unlink(big);
+	(void) g_rmdir(dir);
+	g_free(big);
+	g_free(dir);
+}
+
+static void push_window(void) {
+	GError* err = NULL;
+	wsh_sftp_t* sftp = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-sftp-XXXXXX", NULL);
+	gsize len = (WSH_SFTP_MAX_REQUESTS + 10) * WSH_SFTP_CHUNK_SIZE;
+	gchar* big = make_file(dir, "big", len);
+
+	wsh_manifest_entry_t file = { .path = "big", .local = big };
+	const wsh_manifest_entry_t* entries[] = { &file };
+
+	set_sftp_init_ret(0);
+	set_sftp_write_ret(0);
+	g_assert(! wsh_sftp_new(&sftp, &session, &err));
+	g_assert(! wsh_sftp_push(sftp, "/tmp", entries, 1, NULL, 0, &err));
+	g_assert_no_error(err);
+
+	guint writes, max_inflight, opened, closed;
+	gsize total;
+	get_sftp_write_stats(&writes, &total, &max_inflight, &opened, &closed);
+
+	g_assert_cmpuint(writes, ==, WSH_SFTP_MAX_REQUESTS + 10);
+	g_assert_cmpuint(total, ==, len);
+	g_assert_cmpuint(max_inflight, <=, WSH_SFTP_MAX_REQUESTS);
+	g_assert_cmpuint(closed, ==, 1);
+
+	wsh_sftp_free(&sftp);
+
+	(void) g_unlink(big);
+	(void) g_rmdir(dir);
+	g_free(big);
+	g_free(dir);
+}
+
+static void push_write_fails(void) {
+	GError* err = NULL;
+	wsh_sftp_t* sftp = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-sftp-XXXXXX", NULL);
+	gchar* a = make_file(dir, "a", 2 * WSH_SFTP_CHUNK_SIZE);
+	gchar* b = make_file(dir, "b", 10);
+
+	wsh_manifest_entry_t files[] = {
+		{ .path = "a", .local = a },
+		{ .path = "b", .local = b },
+	};
+	const wsh_manifest_entry_t* entries[] = { &files[0], &files[1] };
+
+	set_sftp_init_ret(0);
+	set_sftp_write_ret(1);
+	g_assert(! wsh_sftp_new(&sftp, &session, &err));
+	g_assert(wsh_sftp_push(sftp, "", entries, 2, NULL, 0, &err));
+	g_assert_error(err, WSH_SFTP_ERROR, WSH_SFTP_WRITE_ERR);
+	g_error_free(err);
+
+	// Whatever got opened still gets closed
+	guint writes, max_inflight, opened, closed;
+	gsize total;
+	get_sftp_write_stats(&writes, &total, &max_inflight, &opened, &closed);
+	g_assert_cmpuint(opened, ==, closed);
+
+	wsh_sftp_free(&sftp);
+	set_sftp_write_ret(0);
+
+	(void) g_unlink(a);
+	(void) g_unlink(b);
+	(void) g_rmdir(dir);
+	g_free(a);
+	g_free(b);
+	g_free(dir);
+}
+
+static void push_dirs(void) {
+	GError* err = NULL;
+	wsh_sftp_t* sftp = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-sftp-XXXXXX", NULL);
+	gchar* a = make_file(dir, "a", 10);
+
+	wsh_manifest_entry_t file = { .path = "tree/a", .local = a };
+	const wsh_manifest_entry_t* entries[] = { &file };
+
+	set_sftp_init_ret(0);
+	set_sftp_write_ret(0);
+	g_assert(! wsh_sftp_new(&sftp, &session, &err));
+
+	// Directories that are already there are fine
+	set_sftp_mkdir_ret(1, SSH_FX_FILE_ALREADY_EXISTS);
+	g_assert(! wsh_sftp_push(sftp, "", entries, 1, NULL, 0, &err));
+	g_assert_no_error(err);
+	wsh_sftp_free(&sftp);
+
+	g_assert(! wsh_sftp_new(&sftp, &session, &err));
+	set_sftp_mkdir_ret(1, SSH_FX_PERMISSION_DENIED);
+	g_assert(wsh_sftp_push(sftp, "", entries, 1, NULL, 0, &err));
+	g_assert_error(err, WSH_SFTP_ERROR, WSH_SFTP_DIR_ERR);
+	g_error_free(err);
+	wsh_sftp_free(&sftp);
+
+	set_sftp_mkdir_ret(0, SSH_FX_OK);
+
+	(void) g_unlink(a);
+	(void) g_rmdir(dir);
+	g_free(a);
+	g_free(dir);
+}
+
+static void init_fails(void) {
+	GError* err = NULL;
+	wsh_sftp_t* sftp = NULL;
+
+	set_sftp_init_ret(1);
+	g_assert(wsh_sftp_new(&sftp, &session, &err));
+	g_assert_error(err, WSH_SFTP_ERROR, WSH_SFTP_INIT_ERR);
+	g_assert(sftp == NULL);
+	g_error_free(err);
+	set_sftp_init_ret(0);
+}
+
+static void free_null(void) {
+	wsh_sftp_t* sftp = NULL;
+	wsh_sftp_free(&sftp);
+	wsh_sftp_free(NULL);
+}
+
+int main(int argc, char** argv) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/Library/SFTP/PushTree", push_tree);
+	g_test_add_func("/Library/SFTP/PushWindow", push_window);
+	g_test_add_func("/Library/SFTP/PushOffset", push_offset);
+	g_test_add_func("/Library/SFTP/PushWriteFails", push_write_fails);
+	g_test_add_func("/Library/SFTP/PushDirs", push_dirs);
+	g_test_add_func("/Library/SFTP/InitFails", init_fails);
+
+	g_test_add_func("/Regress/Library/SFTP/FreeNull", free_null);
+
+	return g_test_run();
+}
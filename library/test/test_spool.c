@@ -0,0 +1,176 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <utime.h>
+
+#include "pack.h"
+#include "spool.h"
+
+static void store_fetch(void) {
+	GError* err = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-spool-XXXXXX", NULL);
+
+	GString* out = g_string_new(NULL);
+	for (guint i = 0; i < 100; i++)
+		g_string_append_printf(out, "line %u\n", i);
+	gsize full_len = out->len;
+
+	wsh_cmd_res_t* res = g_new0(wsh_cmd_res_t, 1);
+	res->std_output_raw_len = out->len;
+	res->std_output_raw = (guint8*)g_string_free(out, FALSE);
+	res->std_error_raw = (guint8*)g_strdup("oops\n");
+	res->std_error_raw_len = 5;
+	res->exit_status = 2;
+	gchar* hash = wsh_response_hash(res);
+
+	g_assert(! wsh_spool_store(res, dir, &err));
+	g_assert_no_error(err);
+
+	// Only the start of the output is left to send
+	g_assert(g_str_has_prefix(res->spool_id, "wsh-"));
+	g_assert_cmpstr(res->output_hash, ==, hash);
+	g_assert_cmpuint(res->output_size, ==, full_len + 5);
+	g_assert_cmpuint(res->std_output_raw_len, ==, strlen("line 0\n") * WSH_SPOOL_HEAD_LINES);
+	g_assert_cmpstr((gchar*)res->std_output_raw + res->std_output_raw_len - 7, ==, "line 9\n");
+	g_assert_cmpuint(res->std_error_raw_len, ==, 5);
+
+	// And the whole of it comes back out, the once
+	wsh_cmd_res_t* full = g_new0(wsh_cmd_res_t, 1);
+	g_assert(! wsh_spool_fetch(full, dir, res->spool_id, &err));
+	g_assert_no_error(err);
+	g_assert_cmpuint(full->std_output_raw_len, ==, full_len);
+	g_assert_cmpint(full->exit_status, ==, 2);
+	g_assert(full->spool_id == NULL);
+	gchar* full_hash = wsh_response_hash(full);
+	g_assert_cmpstr(full_hash, ==, hash);
+	g_free(full_hash);
+	wsh_free_unpacked_response(&full);
+
+	full = g_new0(wsh_cmd_res_t, 1);
+	g_assert(wsh_spool_fetch(full, dir, res->spool_id, &err));
+	g_assert_error(err, WSH_SPOOL_ERROR, WSH_SPOOL_READ_ERR);
+	g_clear_error(&err);
+	wsh_free_unpacked_response(&full);
+
+	g_free(hash);
+	wsh_free_unpacked_response(&res);
+	(void) g_rmdir(dir);
+	g_free(dir);
+}
+
+static void store_lines(void) {
+	GError* err = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-spool-XXXXXX", NULL);
+
+	wsh_cmd_res_t* res = g_new0(wsh_cmd_res_t, 1);
+	res->std_output_len = WSH_SPOOL_HEAD_LINES + 5;
+	res->std_output = g_new0(gchar*, res->std_output_len + 1);
+	for (gsize i = 0; i < res->std_output_len; i++)
+		res->std_output[i] = g_strdup("abc");
+	res->std_error = g_new0(gchar*, 1);
+
+	g_assert(! wsh_spool_store(res, dir, &err));
+	g_assert_cmpuint(res->output_size, ==, 4 * (WSH_SPOOL_HEAD_LINES + 5));
+	g_assert_cmpuint(res->std_output_len, ==, WSH_SPOOL_HEAD_LINES);
+	g_assert(res->std_output[WSH_SPOOL_HEAD_LINES] == NULL);
+
+	wsh_cmd_res_t* full = g_new0(wsh_cmd_res_t, 1);
+	g_assert(! wsh_spool_fetch(full, dir, res->spool_id, &err));
+	g_assert_cmpuint(full->std_output_len, ==, WSH_SPOOL_HEAD_LINES + 5);
+	wsh_free_unpacked_response(&full);
+
+	wsh_free_unpacked_response(&res);
+	(void) g_rmdir(dir);
+	g_free(dir);
+}
+
+static void expire(void) {
+	GError* err = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-spool-XXXXXX", NULL);
+
+	wsh_cmd_res_t* old = g_new0(wsh_cmd_res_t, 1);
+	g_assert(! wsh_spool_store(old, dir, &err));
+	gchar* path = g_build_filename(dir, old->spool_id, NULL);
+	struct utimbuf times = { .actime = 0, .modtime = time(NULL) - WSH_SPOOL_TTL - 1 };
+	g_assert(! utime(path, &times));
+
+	// Spooling anything else clears out what nobody came back for
+	wsh_cmd_res_t* res = g_new0(wsh_cmd_res_t, 1);
+	g_assert(! wsh_spool_store(res, dir, &err));
+	g_assert(! g_file_test(path, G_FILE_TEST_EXISTS));
+
+	wsh_cmd_res_t* full = g_new0(wsh_cmd_res_t, 1);
+	g_assert(! wsh_spool_fetch(full, dir, res->spool_id, &err));
+	wsh_free_unpacked_response(&full);
+
+	g_free(path);
+	wsh_free_unpacked_response(&old);
+	wsh_free_unpacked_response(&res);
+	(void) g_rmdir(dir);
+	g_free(dir);
+}
+
+static void bad_id(void) {
+	GError* err = NULL;
+	wsh_cmd_res_t res = { 0 };
+
+	const gchar* bad[] = { "", "wsh-", "../etc/passwd", "wsh-../../x", "wsh-a/b", "spool" };
+	for (gsize i = 0; i < G_N_ELEMENTS(bad); i++) {
+		g_assert(wsh_spool_fetch(&res, "/tmp", bad[i], &err));
+		g_assert_error(err, WSH_SPOOL_ERROR, WSH_SPOOL_ID_ERR);
+		g_clear_error(&err);
+	}
+}
+
+static void spool_dir(void) {
+	GError* err = NULL;
+	gchar* dir = wsh_spool_dir(&err);
+	g_assert_no_error(err);
+
+	struct stat st;
+	g_assert(! lstat(dir, &st));
+	g_assert(S_ISDIR(st.st_mode));
+	g_assert_cmpuint(st.st_mode & 077, ==, 0);
+
+	// It's found again rather than made again
+	gchar* again = wsh_spool_dir(&err);
+	g_assert_cmpstr(dir, ==, again);
+
+	g_free(again);
+	g_free(dir);
+}
+
+int main(int argc, char** argv) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/Library/Spool/StoreFetch", store_fetch);
+	g_test_add_func("/Library/Spool/StoreLines", store_lines);
+	g_test_add_func("/Library/Spool/Expire", expire);
+	g_test_add_func("/Library/Spool/BadId", bad_id);
+	g_test_add_func("/Library/Spool/Dir", spool_dir);
+
+	return g_test_run();
+}
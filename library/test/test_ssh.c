@@ -20,8 +20,11 @@
  */
 #include "config.h"
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <libssh/libssh.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "cmd.h"
 #include "pack.h"
@@ -373,6 +376,93 @@ static void authenticate_kbdint_successful(void) {
 	g_slice_free(wsh_ssh_session_t, session);
 }
 
+static void authenticate_hint_skips_negotiation(void) {
+	wsh_ssh_init();
+	set_ssh_connect_res(SSH_OK);
+	set_ssh_is_server_known_res(SSH_SERVER_KNOWN_OK);
+	// If we negotiate, we'll find nothing and fail
+	set_ssh_userauth_list_ret(0);
+	set_ssh_userauth_autopubkey(SSH_AUTH_SUCCESS);
+
+	wsh_ssh_session_t* session = g_slice_new0(wsh_ssh_session_t);
+	session->hostname = remote;
+	session->username = username;
+	session->password = password;
+	session->port = port;
+	session->auth_type = WSH_SSH_AUTH_PUBKEY;
+	session->auth_hint = WSH_SSH_AUTH_METHOD_PUBKEY;
+	GError *err = NULL;
+
+	wsh_ssh_host(session, &err);
+	gint ret = wsh_ssh_authenticate(session, &err);
+
+	g_assert(ret == 0);
+	g_assert(session->session != NULL);
+	g_assert(session->auth_method == WSH_SSH_AUTH_METHOD_PUBKEY);
+	g_assert_no_error(err);
+
+	g_free(session->session);
+	g_slice_free(wsh_ssh_session_t, session);
+}
+
+static void authenticate_hint_falls_back(void) {
+	wsh_ssh_init();
+	set_ssh_connect_res(SSH_OK);
+	set_ssh_is_server_known_res(SSH_SERVER_KNOWN_OK);
+	set_ssh_userauth_list_ret(SSH_AUTH_METHOD_INTERACTIVE);
+	set_ssh_userauth_password_ret(SSH_AUTH_DENIED);
+	set_ssh_userauth_kbdint_ret(SSH_AUTH_SUCCESS);
+
+	wsh_ssh_session_t* session = g_slice_new0(wsh_ssh_session_t);
+	session->hostname = remote;
+	session->username = username;
+	session->password = password;
+	session->port = port;
+	session->auth_type = WSH_SSH_AUTH_PASSWORD;
+	session->auth_hint = WSH_SSH_AUTH_METHOD_PASSWORD;
+	GError *err = NULL;
+
+	wsh_ssh_host(session, &err);
+	gint ret = wsh_ssh_authenticate(session, &err);
+
+	g_assert(ret == 0);
+	g_assert(session->session != NULL);
+	g_assert(session->auth_method == WSH_SSH_AUTH_METHOD_KBDINT);
+	g_assert_no_error(err);
+
+	g_free(session->session);
+	g_slice_free(wsh_ssh_session_t, session);
+}
+
+static void authenticate_hint_not_retried(void) {
+	wsh_ssh_init();
+	set_ssh_connect_res(SSH_OK);
+	set_ssh_is_server_known_res(SSH_SERVER_KNOWN_OK);
+	set_ssh_userauth_list_ret(SSH_AUTH_METHOD_PUBLICKEY);
+	set_ssh_userauth_autopubkey(SSH_AUTH_DENIED);
+
+	wsh_ssh_session_t* session = g_slice_new0(wsh_ssh_session_t);
+	session->hostname = remote;
+	session->username = username;
+	session->password = password;
+	session->port = port;
+	session->auth_type = WSH_SSH_AUTH_PUBKEY;
+	session->auth_hint = WSH_SSH_AUTH_METHOD_PUBKEY;
+	GError *err = NULL;
+
+	wsh_ssh_host(session, &err);
+	gint ret = wsh_ssh_authenticate(session, &err);
+
+	// Negotiation shouldn't spend another auth try on the denied hint
+	g_assert(ret != 0);
+	g_assert_cmpuint(get_ssh_userauth_autopubkey_calls(), ==, 1);
+	g_assert(session->session == NULL);
+	g_assert_error(err, WSH_SSH_ERROR, WSH_SSH_PASSWORD_AUTH_DENIED);
+
+	g_error_free(err);
+	g_slice_free(wsh_ssh_session_t, session);
+}
+
 static void exec_wshd_channel_failure(void) {
 	wsh_ssh_init();
 	set_ssh_connect_res(SSH_OK);
@@ -589,6 +679,91 @@ static void recv_result_success(void) {
 	wsh_free_unpacked_response(&res);
 }
 
+static gchar* read_pipe(gint fd) {
+	gchar buf[64];
+	gssize len = read(fd, buf, sizeof(buf));
+	close(fd);
+	return g_strndup(buf, MAX(len, 0));
+}
+
+static void recv_frames(void) {
+	const guint8 frames[] = {
+		WSH_FRAME_STDOUT, 0, 0, 0, 3, 'o', 'u', 't',
+		WSH_FRAME_STDERR, 0, 0, 0, 2, 'e', 'r',
+		WSH_FRAME_END, 0, 0, 0, 0,
+	};
+
+	wsh_ssh_init();
+	set_ssh_connect_res(SSH_OK);
+	set_ssh_channel_open_session_ret(SSH_OK);
+	set_ssh_channel_request_exec_ret(SSH_OK);
+
+	wsh_ssh_session_t* session = g_slice_new0(wsh_ssh_session_t);
+	session->hostname = remote;
+	session->username = username;
+	GError* err = NULL;
+	gint out[2], errs[2];
+	g_assert(! pipe(out));
+	g_assert(! pipe(errs));
+
+	wsh_ssh_host(session, &err);
+	wsh_ssh_exec_wshd(session, &err);
+	set_ssh_channel_read_stream(frames, sizeof(frames));
+	gint ret = wsh_ssh_recv_frames(session, out[1], errs[1], &err);
+	set_ssh_channel_read_stream(NULL, 0);
+	close(out[1]);
+	close(errs[1]);
+
+	g_assert(ret == 0);
+	g_assert_no_error(err);
+	gchar* got = read_pipe(out[0]);
+	g_assert_cmpstr(got, ==, "out");
+	g_free(got);
+	got = read_pipe(errs[0]);
+	g_assert_cmpstr(got, ==, "er");
+	g_free(got);
+
+	g_free(session->session);
+	g_free(session->channel);
+	g_slice_free(wsh_ssh_session_t, session);
+}
+
+// A frame shorter than its header says is an error, not the start of the next
+static void recv_frames_truncated(void) {
+	const guint8 frames[] = {
+		WSH_FRAME_STDOUT, 0, 0, 0, 10, 'a', 'b', 'c', 'd',
+		WSH_FRAME_END, 0, 0, 0, 0,
+	};
+
+	wsh_ssh_init();
+	set_ssh_connect_res(SSH_OK);
+	set_ssh_channel_open_session_ret(SSH_OK);
+	set_ssh_channel_request_exec_ret(SSH_OK);
+
+	wsh_ssh_session_t* session = g_slice_new0(wsh_ssh_session_t);
+	session->hostname = remote;
+	session->username = username;
+	GError* err = NULL;
+	gint out[2];
+	g_assert(! pipe(out));
+
+	wsh_ssh_host(session, &err);
+	wsh_ssh_exec_wshd(session, &err);
+	set_ssh_channel_read_stream(frames, sizeof(frames));
+	gint ret = wsh_ssh_recv_frames(session, out[1], out[1], &err);
+	set_ssh_channel_read_stream(NULL, 0);
+	close(out[1]);
+
+	g_assert(ret == WSH_SSH_READ_ERR);
+	g_assert_error(err, WSH_SSH_ERROR, WSH_SSH_READ_ERR);
+	g_assert(session->session == NULL);
+	g_assert(session->channel == NULL);
+	close(out[0]);
+
+	g_error_free(err);
+	g_slice_free(wsh_ssh_session_t, session);
+}
+
 static void ssh_init_fails(void) {
 	set_ssh_init_ret(SSH_ERROR);
 
@@ -638,6 +813,329 @@ static void scp_init_success(void) {
 	g_slice_free(wsh_ssh_session_t, session);
 }
 
+static gchar* make_scp_source(gsize len) {
+	gchar* path = NULL;
+	gint fd = g_file_open_tmp("wsh-scp-XXXXXX", &path, NULL);
+	g_assert(fd >= 0);
+	close(fd);
+
+	gchar* contents = g_malloc0(len);
+	g_assert(g_file_set_contents(path, contents, len, NULL));
+	g_free(contents);
+
+	return path;
+}
+
+static void scp_file_chunks(void) {
+	GError* err = NULL;
+	gsize len = WSH_SSH_SCP_CHUNK_SIZE * 2 + 100;
+	gchar* path = make_scp_source(len);
+	wsh_ssh_session_t session = { .scp = (gpointer)1 };
+	guint calls;
+	gsize max, total;
+
+	set_ssh_scp_push_file_ret(SSH_OK);
+	set_ssh_scp_write_ret(SSH_OK);
+
+	g_assert(! wsh_ssh_scp_file(&session, path, FALSE, &err));
+	g_assert_no_error(err);
+
+	get_ssh_scp_write_stats(&calls, &max, &total);
+	g_assert_cmpuint(calls, ==, 3);
+	g_assert_cmpuint(max, ==, WSH_SSH_SCP_CHUNK_SIZE);
+	g_assert_cmpuint(total, ==, len);
+
+	// The mapping is dropped after each send, so a second one maps again
+	g_assert(! wsh_ssh_scp_file(&session, path, FALSE, &err));
+	get_ssh_scp_write_stats(&calls, &max, &total);
+	g_assert_cmpuint(total, ==, len * 2);
+
+	(void) g_unlink(path);
+	g_free(path);
+}
+
+static void scp_file_write_fails(void) {
+	GError* err = NULL;
+	gchar* path = make_scp_source(WSH_SSH_SCP_CHUNK_SIZE * 2);
+	wsh_ssh_session_t session = { .scp = (gpointer)1 };
+	guint calls;
+	gsize max, total;
+
+	set_ssh_scp_push_file_ret(SSH_OK);
+	set_ssh_scp_write_ret(SSH_ERROR);
+
+	g_assert(wsh_ssh_scp_file(&session, path, FALSE, &err));
+	g_assert_error(err, WSH_SSH_ERROR, WSH_SSH_FILE_ERR);
+	g_error_free(err);
+
+	// Stops at the first chunk that fails
+	get_ssh_scp_write_stats(&calls, &max, &total);
+	g_assert_cmpuint(calls, ==, 1);
+
+	(void) g_unlink(path);
+	g_free(path);
+}
+
+static void scp_file_missing(void) {
+	GError* err = NULL;
+	wsh_ssh_session_t session = { .scp = (gpointer)1 };
+
+	set_ssh_scp_write_ret(SSH_OK);
+	g_assert(wsh_ssh_scp_file(&session, "/nonexistent/wsh-scp", FALSE, &err));
+	g_assert(err != NULL);
+	g_error_free(err);
+}
+
+static void scp_entries_dirs(void) {
+	GError* err = NULL;
+	gchar* path = make_scp_source(10);
+	wsh_ssh_session_t session = { .scp = (gpointer)1 };
+	wsh_manifest_entry_t entries[] = {
+		{ .path = "a/b/x", .local = path },
+		{ .path = "a/b/y", .local = path },
+		{ .path = "a/c/z", .local = path },
+		{ .path = "top", .local = path },
+	};
+	const wsh_manifest_entry_t* ptrs[] = {
+		&entries[0], &entries[1], &entries[2], &entries[3],
+	};
+	guint pushed, left, calls;
+	gsize max, total;
+
+	set_ssh_scp_push_file_ret(SSH_OK);
+	set_ssh_scp_push_directory_ret(SSH_OK);
+	set_ssh_scp_write_ret(SSH_OK);
+
+	g_assert(! wsh_ssh_scp_entries(&session, ptrs, 4, &err));
+	g_assert_no_error(err);
+
+	// a and b for x, nothing new for y, out of b and into c for z, then out
+	// of c and a for top
+	get_ssh_scp_directory_stats(&pushed, &left);
+	g_assert_cmpuint(pushed, ==, 3);
+	g_assert_cmpuint(left, ==, 3);
+
+	get_ssh_scp_write_stats(&calls, &max, &total);
+	g_assert_cmpuint(calls, ==, 4);
+
+	(void) g_unlink(path);
+	g_free(path);
+}
+
+static void scp_entries_offset(void) {
+	GError* err = NULL;
+	gchar* path = make_scp_source(10);
+	wsh_ssh_session_t session = { .scp = (gpointer)1 };
+	wsh_manifest_entry_t entry = { .path = "a/x.wshpart-4", .local = path, .offset = 4 };
+	const wsh_manifest_entry_t* ptrs[] = { &entry };
+	guint calls;
+	gsize max, total;
+
+	set_ssh_scp_push_file_ret(SSH_OK);
+	set_ssh_scp_push_directory_ret(SSH_OK);
+	set_ssh_scp_write_ret(SSH_OK);
+
+	g_assert(! wsh_ssh_scp_entries(&session, ptrs, 1, &err));
+	g_assert_no_error(err);
+
+	get_ssh_scp_write_stats(&calls, &max, &total);
+	g_assert_cmpuint(total, ==, 6);
+
+	// Past the end of the file
+	entry.offset = 11;
+	g_assert(wsh_ssh_scp_entries(&session, ptrs, 1, &err));
+	g_assert_error(err, WSH_SSH_ERROR, WSH_SSH_FILE_ERR);
+	g_error_free(err);
+
+	(void) g_unlink(path);
+	g_free(path);
+}
+
+static gsize pulled_size(const gchar* dir, const gchar* name) {
+	gchar* path = g_build_filename(dir, name, NULL);
+	gchar* contents = NULL;
+	gsize len = 0;
+
+	g_assert(g_file_get_contents(path, &contents, &len, NULL));
+	for (gsize i = 0; i < len; i++)
+		g_assert_cmpint(contents[i], ==, 'x');
+
+	g_free(contents);
+	g_free(path);
+	return len;
+}
+
+static void scp_pull(void) {
+	GError* err = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-pull-XXXXXX", NULL);
+	wsh_ssh_session_t session = { .session = (gpointer)1 };
+	const mock_scp_request_t reqs[] = {
+		{ SSH_SCP_REQUEST_NEWDIR, "logs", 0, 0755 },
+		{ SSH_SCP_REQUEST_NEWFILE, "a.log", 2500, 0644 },
+		{ SSH_SCP_REQUEST_NEWDIR, "sub", 0, 0500 },
+		{ SSH_SCP_REQUEST_NEWFILE, "empty", 0, 0600 },
+		{ SSH_SCP_REQUEST_ENDDIR, NULL, 0, 0 },
+		{ SSH_SCP_REQUEST_ENDDIR, NULL, 0, 0 },
+		{ SSH_SCP_REQUEST_NEWFILE, "top", WSH_SSH_SCP_CHUNK_SIZE + 1, 0755 },
+	};
+
+	set_ssh_scp_new_ret((gpointer)1);
+	set_ssh_scp_init_ret(SSH_OK);
+	set_ssh_scp_read_ret(0);
+	set_ssh_scp_pull_requests(reqs, G_N_ELEMENTS(reqs));
+
+	g_assert(! wsh_ssh_scp_pull(&session, "logs", dir, &err));
+	g_assert_no_error(err);
+
+	// Files come out where the tree put them, and top is back at the root
+	g_assert_cmpuint(pulled_size(dir, "logs/a.log"), ==, 2500);
+	g_assert_cmpuint(pulled_size(dir, "logs/sub/empty"), ==, 0);
+	g_assert_cmpuint(pulled_size(dir, "top"), ==, WSH_SSH_SCP_CHUNK_SIZE + 1);
+
+	gchar* top = g_build_filename(dir, "top", NULL);
+	g_assert(g_file_test(top, G_FILE_TEST_IS_EXECUTABLE));
+
+	const gchar* paths[] = { "logs/a.log", "logs/sub/empty", "logs/sub", "logs" };
+	for (gsize i = 0; i < G_N_ELEMENTS(paths); i++) {
+		gchar* path = g_build_filename(dir, paths[i], NULL);
+		(void) g_remove(path);
+		g_free(path);
+	}
+	(void) g_unlink(top);
+	(void) g_rmdir(dir);
+	g_free(top);
+	g_free(dir);
+}
+
+static void scp_pull_fails(void) {
+	GError* err = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-pull-XXXXXX", NULL);
+	wsh_ssh_session_t session = { .session = (gpointer)1 };
+	const mock_scp_request_t evil[] = {
+		{ SSH_SCP_REQUEST_NEWFILE, "../evil", 10, 0644 },
+	};
+	const mock_scp_request_t warning[] = {
+		{ SSH_SCP_REQUEST_WARNING, "scp: logs: No such file or directory", 0, 0 },
+	};
+	const mock_scp_request_t file[] = {
+		{ SSH_SCP_REQUEST_NEWFILE, "a", 10, 0644 },
+	};
+
+	set_ssh_scp_new_ret((gpointer)1);
+	set_ssh_scp_init_ret(SSH_OK);
+	set_ssh_scp_read_ret(0);
+
+	// Nothing gets to climb out of where it's meant to land
+	set_ssh_scp_pull_requests(evil, G_N_ELEMENTS(evil));
+	g_assert(wsh_ssh_scp_pull(&session, "logs", dir, &err));
+	g_assert_error(err, WSH_SSH_ERROR, WSH_SSH_PULL_ERR);
+	g_clear_error(&err);
+
+	gchar* evil_path = g_build_filename(dir, "..", "evil", NULL);
+	g_assert(! g_file_test(evil_path, G_FILE_TEST_EXISTS));
+	g_free(evil_path);
+
+	set_ssh_scp_pull_requests(warning, G_N_ELEMENTS(warning));
+	g_assert(wsh_ssh_scp_pull(&session, "logs", dir, &err));
+	g_assert_error(err, WSH_SSH_ERROR, WSH_SSH_PULL_ERR);
+	g_assert(strstr(err->message, "No such file") != NULL);
+	g_clear_error(&err);
+
+	set_ssh_scp_pull_requests(file, G_N_ELEMENTS(file));
+	set_ssh_scp_read_ret(SSH_ERROR);
+	g_assert(wsh_ssh_scp_pull(&session, "a", dir, &err));
+	g_assert_error(err, WSH_SSH_ERROR, WSH_SSH_PULL_ERR);
+	g_clear_error(&err);
+	set_ssh_scp_read_ret(0);
+
+	set_ssh_scp_init_ret(SSH_ERROR);
+	g_assert(wsh_ssh_scp_pull(&session, "a", dir, &err));
+	g_assert_error(err, WSH_SSH_ERROR, WSH_SSH_PULL_ERR);
+	g_clear_error(&err);
+	set_ssh_scp_init_ret(SSH_OK);
+
+	gchar* a = g_build_filename(dir, "a", NULL);
+	(void) g_unlink(a);
+	(void) g_rmdir(dir);
+	g_free(a);
+	g_free(dir);
+}
+
+static void scp_tar(void) {
+	GError* err = NULL;
+	gchar* path = make_scp_source(10);
+	wsh_ssh_session_t session = { .scp = (gpointer)1 };
+	wsh_manifest_entry_t entries[] = {
+		{ .path = "a/b/x", .local = path, .size = 10 },
+		{ .path = "a/c/y", .local = path, .size = 10 },
+	};
+	const wsh_manifest_entry_t* ptrs[] = { &entries[0], &entries[1] };
+	guint pushed, left, calls;
+	gsize max, total;
+	guint64 size = 0;
+
+	set_ssh_scp_push_file_ret(SSH_OK);
+	set_ssh_scp_push_directory_ret(SSH_OK);
+	set_ssh_scp_write_ret(SSH_OK);
+
+	g_assert(! wsh_tar_size(ptrs, 2, &size, &err));
+	g_assert(! wsh_ssh_scp_tar(&session, "t" WSH_TAR_SUFFIX, ptrs, 2, &err));
+	g_assert_no_error(err);
+
+	// One file, no directory round trips, and exactly the promised bytes
+	get_ssh_scp_directory_stats(&pushed, &left);
+	g_assert_cmpuint(pushed, ==, 0);
+	g_assert_cmpuint(left, ==, 0);
+
+	get_ssh_scp_write_stats(&calls, &max, &total);
+	g_assert_cmpuint(total, ==, size);
+	g_assert_cmpuint(max, <=, WSH_SSH_SCP_CHUNK_SIZE);
+
+	(void) g_unlink(path);
+	g_free(path);
+}
+
+static void scp_tar_write_fails(void) {
+	GError* err = NULL;
+	gchar* path = make_scp_source(10);
+	wsh_ssh_session_t session = { .scp = (gpointer)1 };
+	wsh_manifest_entry_t entry = { .path = "a/x", .local = path, .size = 10 };
+	const wsh_manifest_entry_t* ptrs[] = { &entry };
+
+	set_ssh_scp_push_file_ret(SSH_OK);
+	set_ssh_scp_write_ret(SSH_ERROR);
+
+	g_assert(wsh_ssh_scp_tar(&session, "t" WSH_TAR_SUFFIX, ptrs, 1, &err));
+	g_assert_error(err, WSH_SSH_ERROR, WSH_SSH_FILE_ERR);
+	g_error_free(err);
+
+	set_ssh_scp_write_ret(SSH_OK);
+	(void) g_unlink(path);
+	g_free(path);
+}
+
+static void scp_entries_leaves_dirs(void) {
+	GError* err = NULL;
+	gchar* path = make_scp_source(10);
+	wsh_ssh_session_t session = { .scp = (gpointer)1 };
+	wsh_manifest_entry_t entry = { .path = "a/b/x", .local = path };
+	const wsh_manifest_entry_t* ptrs[] = { &entry };
+	guint pushed, left;
+
+	set_ssh_scp_push_file_ret(SSH_OK);
+	set_ssh_scp_push_directory_ret(SSH_OK);
+	set_ssh_scp_write_ret(SSH_OK);
+
+	g_assert(! wsh_ssh_scp_entries(&session, ptrs, 1, &err));
+
+	get_ssh_scp_directory_stats(&pushed, &left);
+	g_assert_cmpuint(pushed, ==, 2);
+	g_assert_cmpuint(left, ==, 2);
+
+	(void) g_unlink(path);
+	g_free(path);
+}
+
 static void ssh_args(void) {
 	wsh_ssh_init();
 	GError *err = NULL;
@@ -746,6 +1244,13 @@ int main(int argc, char** argv) {
 	g_test_add_func("/Library/SSH/AuthenticateKbdintSuccess",
 	                authenticate_kbdint_successful);
 
+	g_test_add_func("/Library/SSH/AuthenticateHintSkipsNegotiation",
+	                authenticate_hint_skips_negotiation);
+	g_test_add_func("/Library/SSH/AuthenticateHintFallsBack",
+	                authenticate_hint_falls_back);
+	g_test_add_func("/Library/SSH/AuthenticateHintNotRetried",
+	                authenticate_hint_not_retried);
+
 	g_test_add_func("/Library/SSH/ExecWshdChannelFailure",
 	                exec_wshd_channel_failure);
 	g_test_add_func("/Library/SSH/ExecWshdExecError",
@@ -762,6 +1267,8 @@ int main(int argc, char** argv) {
 
 	g_test_add_func("/Library/SSH/RecvResSuccess",
 	                recv_result_success);
+	g_test_add_func("/Library/SSH/RecvFrames", recv_frames);
+	g_test_add_func("/Library/SSH/RecvFramesTruncated", recv_frames_truncated);
 
 	g_test_add_func("/Library/SSH/SSHInitFailure",
 	                ssh_init_fails);
@@ -776,6 +1283,16 @@ int main(int argc, char** argv) {
 	                scp_init_fails);
 	g_test_add_func("/Library/SSH/SFTPInitSuccess",
 	                scp_init_success);
+	g_test_add_func("/Library/SSH/SCPFileChunks", scp_file_chunks);
+	g_test_add_func("/Library/SSH/SCPFileWriteFails", scp_file_write_fails);
+	g_test_add_func("/Library/SSH/SCPFileMissing", scp_file_missing);
+	g_test_add_func("/Library/SSH/SCPEntriesDirs", scp_entries_dirs);
+	g_test_add_func("/Library/SSH/SCPEntriesLeavesDirs", scp_entries_leaves_dirs);
+	g_test_add_func("/Library/SSH/SCPEntriesOffset", scp_entries_offset);
+	g_test_add_func("/Library/SSH/SCPTar", scp_tar);
+	g_test_add_func("/Library/SSH/SCPPull", scp_pull);
+	g_test_add_func("/Library/SSH/SCPPullFails", scp_pull_fails);
+	g_test_add_func("/Library/SSH/SCPTarWriteFails", scp_tar_write_fails);
 
 	g_test_add_func("/Library/SSH/CheckArgs", ssh_args);
 	g_test_add_func("/Library/SSH/ApplyArgs", apply_args);
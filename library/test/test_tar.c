@@ -0,0 +1,255 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "tar.h"
+
+static gint append(const guint8* buf, gsize len, gpointer user_data) {
+	g_byte_array_append(user_data, buf, len);
+	return 0;
+}
+
+static gchar* make_file(const gchar* dir, const gchar* name,
+                        const gchar* contents, guint mode) {
+	gchar* path = g_build_filename(dir, name, NULL);
+	g_assert(g_file_set_contents(path, contents, -1, NULL));
+	g_assert(! g_chmod(path, mode));
+	return path;
+}
+
+static void write_archive(const gchar* path, const GByteArray* stream) {
+	g_assert(g_file_set_contents(path, (const gchar*)stream->data, stream->len, NULL));
+}
+
+static void check_file(const gchar* dir, const gchar* name,
+                       const gchar* contents, guint mode) {
+	gchar* path = g_build_filename(dir, name, NULL);
+	gchar* got = NULL;
+	struct stat st;
+
+	g_assert(g_file_get_contents(path, &got, NULL, NULL));
+	g_assert_cmpstr(got, ==, contents);
+	g_assert(! g_stat(path, &st));
+	g_assert_cmpuint(st.st_mode & 07777, ==, mode);
+
+	g_free(got);
+	g_free(path);
+}
+
+static void remove_tree(const gchar* path) {
+	GDir* dir = g_dir_open(path, 0, NULL);
+	if (dir) {
+		const gchar* name;
+		while ((name = g_dir_read_name(dir))) {
+			gchar* child = g_build_filename(path, name, NULL);
+			remove_tree(child);
+			g_free(child);
+		}
+		g_dir_close(dir);
+		(void) g_rmdir(path);
+	} else {
+		(void) g_unlink(path);
+	}
+}
+
+// A deep name that only fits by using the prefix field
+#define LONG_DIR "dddddddddddddddddddddddddddddddddddddddddddddddddd" \
+                 "dddddddddddddddddddddddddddddddddddddddddddddddddd"
+
+static void round_trip(void) {
+	GError* err = NULL;
+	gchar* src = g_dir_make_tmp("wsh-tar-XXXXXX", NULL);
+	gchar* dst = g_dir_make_tmp("wsh-tar-XXXXXX", NULL);
+	gchar* a = make_file(src, "a", "hello\n", 0640);
+	gchar* b = make_file(src, "b", "", 0755);
+	wsh_manifest_entry_t entries[] = {
+		{ .path = "tree/a", .local = a, .size = 6 },
+		{ .path = "tree/sub/b", .local = b, .size = 0 },
+		{ .path = "tree/" LONG_DIR "/a", .local = a, .size = 6 },
+	};
+	const wsh_manifest_entry_t* ptrs[] = { &entries[0], &entries[1], &entries[2] };
+	GByteArray* stream = g_byte_array_new();
+	guint64 size = 0;
+
+	g_assert(! wsh_tar_size(ptrs, 3, &size, &err));
+	g_assert(! wsh_tar_stream(ptrs, 3, append, stream, &err));
+	g_assert_no_error(err);
+
+	// The size is promised before the stream is sent, so it must be exact
+	g_assert_cmpuint(stream->len, ==, size);
+	g_assert_cmpuint(stream->len % WSH_TAR_BLOCK_SIZE, ==, 0);
+
+	gchar* archive = g_build_filename(dst, "x" WSH_TAR_SUFFIX, NULL);
+	write_archive(archive, stream);
+
+	g_assert(! wsh_tar_extract(archive, &err));
+	g_assert_no_error(err);
+
+	check_file(dst, "tree/a", "hello\n", 0640);
+	check_file(dst, "tree/sub/b", "", 0755);
+	check_file(dst, "tree/" LONG_DIR "/a", "hello\n", 0640);
+	g_assert(! g_file_test(archive, G_FILE_TEST_EXISTS));
+
+	g_byte_array_free(stream, TRUE);
+	remove_tree(src);
+	remove_tree(dst);
+	g_free(archive);
+	g_free(a);
+	g_free(b);
+	g_free(src);
+	g_free(dst);
+}
+
+static void extract_gzip(void) {
+	GError* err = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-tar-XXXXXX", NULL);
+	gchar* a = make_file(dir, "a", "hello\n", 0644);
+	wsh_manifest_entry_t entry = { .path = "out/a", .local = a, .size = 6 };
+	const wsh_manifest_entry_t* ptrs[] = { &entry };
+	GByteArray* stream = g_byte_array_new();
+
+	g_assert(! wsh_tar_stream(ptrs, 1, append, stream, &err));
+
+	gchar* archive = g_build_filename(dir, "x" WSH_TAR_SUFFIX, NULL);
+	gzFile gz = gzopen(archive, "wb");
+	g_assert(gz != NULL);
+	g_assert_cmpint(gzwrite(gz, stream->data, stream->len), ==, stream->len);
+	g_assert_cmpint(gzclose(gz), ==, Z_OK);
+
+	g_assert(! wsh_tar_extract(archive, &err));
+	g_assert_no_error(err);
+	check_file(dir, "out/a", "hello\n", 0644);
+
+	g_byte_array_free(stream, TRUE);
+	remove_tree(dir);
+	g_free(archive);
+	g_free(a);
+	g_free(dir);
+}
+
+static void extract_truncated(void) {
+	GError* err = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-tar-XXXXXX", NULL);
+	gchar* a = make_file(dir, "a", "hello\n", 0644);
+	wsh_manifest_entry_t entry = { .path = "out/a", .local = a, .size = 6 };
+	const wsh_manifest_entry_t* ptrs[] = { &entry };
+	GByteArray* stream = g_byte_array_new();
+
+	g_assert(! wsh_tar_stream(ptrs, 1, append, stream, &err));
+
+	// Cut off in the middle of the file's header
+	g_byte_array_set_size(stream, WSH_TAR_BLOCK_SIZE + 100);
+	gchar* archive = g_build_filename(dir, "x" WSH_TAR_SUFFIX, NULL);
+	write_archive(archive, stream);
+
+	g_assert(wsh_tar_extract(archive, &err));
+	g_assert_error(err, WSH_TAR_ERROR, WSH_TAR_FORMAT_ERR);
+	g_error_free(err);
+
+	// Failed archives are left alone
+	g_assert(g_file_test(archive, G_FILE_TEST_EXISTS));
+
+	g_byte_array_free(stream, TRUE);
+	remove_tree(dir);
+	g_free(archive);
+	g_free(a);
+	g_free(dir);
+}
+
+static void extract_unsafe(void) {
+	GError* err = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-tar-XXXXXX", NULL);
+	gchar* a = make_file(dir, "a", "hello\n", 0644);
+	wsh_manifest_entry_t entry = { .path = "../evil", .local = a, .size = 6 };
+	const wsh_manifest_entry_t* ptrs[] = { &entry };
+	GByteArray* stream = g_byte_array_new();
+
+	g_assert(! wsh_tar_stream(ptrs, 1, append, stream, &err));
+
+	gchar* sub = g_build_filename(dir, "sub", NULL);
+	g_assert(! g_mkdir(sub, 0755));
+	gchar* archive = g_build_filename(sub, "x" WSH_TAR_SUFFIX, NULL);
+	write_archive(archive, stream);
+
+	g_assert(wsh_tar_extract(archive, &err));
+	g_assert_error(err, WSH_TAR_ERROR, WSH_TAR_NAME_ERR);
+	g_error_free(err);
+
+	gchar* evil = g_build_filename(dir, "evil", NULL);
+	g_assert(! g_file_test(evil, G_FILE_TEST_EXISTS));
+
+	g_byte_array_free(stream, TRUE);
+	remove_tree(dir);
+	g_free(evil);
+	g_free(archive);
+	g_free(sub);
+	g_free(a);
+	g_free(dir);
+}
+
+static void name_too_long(void) {
+	GError* err = NULL;
+	gchar* name = g_strnfill(120, 'n');
+	wsh_manifest_entry_t entry = { .path = name, .local = "/nonexistent", .size = 0 };
+	const wsh_manifest_entry_t* ptrs[] = { &entry };
+	guint64 size = 0;
+
+	g_assert(wsh_tar_size(ptrs, 1, &size, &err));
+	g_assert_error(err, WSH_TAR_ERROR, WSH_TAR_NAME_ERR);
+	g_error_free(err);
+	g_free(name);
+}
+
+static void file_changed(void) {
+	GError* err = NULL;
+	gchar* dir = g_dir_make_tmp("wsh-tar-XXXXXX", NULL);
+	gchar* a = make_file(dir, "a", "hello\n", 0644);
+	wsh_manifest_entry_t entry = { .path = "a", .local = a, .size = 3 };
+	const wsh_manifest_entry_t* ptrs[] = { &entry };
+	GByteArray* stream = g_byte_array_new();
+
+	g_assert(wsh_tar_stream(ptrs, 1, append, stream, &err));
+	g_assert_error(err, WSH_TAR_ERROR, WSH_TAR_READ_ERR);
+	g_error_free(err);
+
+	g_byte_array_free(stream, TRUE);
+	remove_tree(dir);
+	g_free(a);
+	g_free(dir);
+}
+
+int main(int argc, char** argv) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/Library/Tar/RoundTrip", round_trip);
+	g_test_add_func("/Library/Tar/ExtractGzip", extract_gzip);
+	g_test_add_func("/Library/Tar/ExtractTruncated", extract_truncated);
+	g_test_add_func("/Library/Tar/ExtractUnsafe", extract_unsafe);
+	g_test_add_func("/Library/Tar/NameTooLong", name_too_long);
+	g_test_add_func("/Library/Tar/FileChanged", file_changed);
+
+	return g_test_run();
+}
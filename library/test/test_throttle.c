@@ -0,0 +1,118 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include <glib.h>
+
+#include "throttle.h"
+
+static void parse_rate(void) {
+	GError* err = NULL;
+	guint64 rate = 0;
+
+	g_assert(! wsh_throttle_parse_rate("123", &rate, &err));
+	g_assert_cmpuint(rate, ==, 123);
+	g_assert(! wsh_throttle_parse_rate("500K", &rate, &err));
+	g_assert_cmpuint(rate, ==, 500 * 1024);
+	g_assert(! wsh_throttle_parse_rate("10M", &rate, &err));
+	g_assert_cmpuint(rate, ==, 10 * 1024 * 1024);
+	g_assert(! wsh_throttle_parse_rate("2g", &rate, &err));
+	g_assert_cmpuint(rate, ==, G_GUINT64_CONSTANT(2) << 30);
+	g_assert_no_error(err);
+
+	const gchar* bad[] = { "", "M", "0", "-5", "10X", "10MB", "1.5M" };
+	for (gsize i = 0; i < G_N_ELEMENTS(bad); i++) {
+		g_assert(wsh_throttle_parse_rate(bad[i], &rate, &err));
+		g_assert_error(err, WSH_THROTTLE_ERROR, WSH_THROTTLE_PARSE_ERR);
+		g_clear_error(&err);
+	}
+}
+
+static void take(void) {
+	wsh_throttle_t* throttle = NULL;
+	wsh_throttle_new(&throttle, 10 * 1024 * 1024);
+
+	// 3MB at 10MB/s is 300ms, however it's split up
+	gint64 start = g_get_monotonic_time();
+	wsh_throttle_take(throttle, 1024 * 1024);
+	for (guint i = 0; i < 64; i++)
+		wsh_throttle_take(throttle, 32 * 1024);
+	wsh_throttle_take(throttle, 0);
+	gint64 elapsed = g_get_monotonic_time() - start;
+
+	g_assert_cmpint(elapsed, >=, 250 * 1000);
+	g_assert_cmpint(elapsed, <, 5 * G_USEC_PER_SEC);
+
+	wsh_throttle_free(&throttle);
+	g_assert(throttle == NULL);
+}
+
+static gpointer take_shared(gpointer throttle) {
+	for (guint i = 0; i < 8; i++)
+		wsh_throttle_take(throttle, 128 * 1024);
+	return NULL;
+}
+
+static void take_shared_threads(void) {
+	wsh_throttle_t* throttle = NULL;
+	wsh_throttle_new(&throttle, 10 * 1024 * 1024);
+	GThread* threads[4];
+
+	// Four threads taking 1MB each still only get 10MB/s between them
+	gint64 start = g_get_monotonic_time();
+	for (guint i = 0; i < G_N_ELEMENTS(threads); i++)
+#if GLIB_CHECK_VERSION(2, 32, 0)
+		threads[i] = g_thread_new("wsh-throttle", take_shared, throttle);
+#else
+		threads[i] = g_thread_create(take_shared, throttle, TRUE, NULL);
+#endif
+	for (guint i = 0; i < G_N_ELEMENTS(threads); i++)
+		g_thread_join(threads[i]);
+	gint64 elapsed = g_get_monotonic_time() - start;
+
+	g_assert_cmpint(elapsed, >=, 350 * 1000);
+
+	wsh_throttle_free(&throttle);
+}
+
+static void take_null(void) {
+	gint64 start = g_get_monotonic_time();
+	wsh_throttle_take(NULL, 1024 * 1024 * 1024);
+	g_assert_cmpint(g_get_monotonic_time() - start, <, G_USEC_PER_SEC);
+}
+
+static void free_null(void) {
+	wsh_throttle_t* throttle = NULL;
+	wsh_throttle_free(&throttle);
+	wsh_throttle_free(NULL);
+}
+
+int main(int argc, char** argv) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/Library/Throttle/ParseRate", parse_rate);
+	g_test_add_func("/Library/Throttle/Take", take);
+	g_test_add_func("/Library/Throttle/TakeSharedThreads", take_shared_threads);
+	g_test_add_func("/Library/Throttle/TakeNull", take_null);
+
+	g_test_add_func("/Regress/Library/Throttle/FreeNull", free_null);
+
+	return g_test_run();
+}
@@ -0,0 +1,220 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "config.h"
+#include "fanout.h"
+
+#include <glib.h>
+
+#include "cmd.h"
+#include "log.h"
+#include "output.h"
+#include "pack.h"
+#include "relay.h"
+#include "ssh.h"
+#include "types.h"
+
+static const guint WSHD_RELAY_THREADS = 32;
+// Send what we've merged once this many hosts are waiting, or this long passes
+static const gsize WSHD_RELAY_FLUSH_HOSTS = 64;
+static const gint64 WSHD_RELAY_FLUSH_USEC = G_USEC_PER_SEC;
+// Shards smaller than this aren't worth another level of relays
+static const gsize WSHD_RELAY_MIN_SHARD = 16;
+
+typedef struct {
+	GIOChannel* out;
+	GMutex* mut;
+	wsh_relay_merge_t* merge;
+	GError* err;		// first write error, nothing more gets written after it
+	gint64 last_flush;
+	guint level;		// zlib level to send results at
+} relay_state_t;
+
+typedef struct {
+	const gchar* hostname;
+	wsh_cmd_req_t req;	// the parent request, with this job's shard
+	relay_state_t* state;
+} relay_job_t;
+
+// Call with state->mut held
+__attribute__((nonnull))
+static void flush(relay_state_t* state) {
+	GPtrArray* results = wsh_relay_merge_take(state->merge);
+
+	for (guint i = 0; i < results->len; i++) {
+		wsh_cmd_res_t* res = g_ptr_array_index(results, i);
+		if (! state->err)
+			wshd_send_message(state->out, res, state->level, &state->err);
+		wsh_free_unpacked_response(&res);
+	}
+
+	g_ptr_array_free(results, TRUE);
+	state->last_flush = g_get_monotonic_time();
+}
+
+static void on_result(const wsh_cmd_res_t* res, gpointer user_data) {
+	relay_state_t* state = user_data;
+
+	g_mutex_lock(state->mut);
+	wsh_relay_merge_add(state->merge, res);
+	if (state->merge->num_hosts >= WSHD_RELAY_FLUSH_HOSTS ||
+	        g_get_monotonic_time() - state->last_flush >= WSHD_RELAY_FLUSH_USEC)
+		flush(state);
+	g_mutex_unlock(state->mut);
+}
+
+static void run_job(relay_job_t* job, gpointer unused) {
+	GError* err = NULL;
+	wsh_ssh_session_t session = {
+		.hostname = job->hostname,
+		.username = g_get_user_name(),
+		.port = job->req.relay_port ? job->req.relay_port : 22,
+		.auth_type = WSH_SSH_AUTH_PUBKEY,
+	};
+
+	if (wsh_relay_host(&session, &job->req, on_result, job->state, &err)) {
+		wsh_log_message(err->message);
+		g_error_free(err);
+	}
+}
+
+__attribute__((nonnull))
+void wshd_relay(GIOChannel* std_output, const wsh_cmd_req_t* req,
+                GError** err) {
+	relay_state_t state = {
+		.out = std_output,
+		.last_flush = g_get_monotonic_time(),
+		.level = req->compress_level,
+	};
+	gsize num_hosts = req->relay_hosts_len;
+	gchar*** shards = NULL;
+	gsize num_jobs = 0;
+	relay_job_t* jobs = NULL;
+	wsh_manifest_entry_t* dist = NULL;
+
+	if (wsh_ssh_init())
+		wsh_log_message("Couldn't initialize libssh");
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	state.mut = g_slice_new(GMutex);
+	g_mutex_init(state.mut);
+#else
+	state.mut = g_mutex_new();
+#endif
+	wsh_relay_merge_init(&state.merge);
+
+	// Unpacking turned "wherever ssh lands" into our own cwd, undo that so
+	// leaves land in their own
+	gchar* here = g_get_current_dir();
+	gchar* cwd = g_strcmp0(req->cwd, here) ? req->cwd : "";
+	g_free(here);
+
+	// Files we were sent get passed on from where they landed. wshd has
+	// already checked them against their hashes
+	if (req->distribute_len) {
+		dist = g_new0(wsh_manifest_entry_t, req->distribute_len);
+		for (gsize i = 0; i < req->distribute_len; i++) {
+			dist[i] = req->distribute[i];
+			dist[i].local = g_build_filename(req->cwd, dist[i].path, NULL);
+		}
+	}
+
+	if (req->distribute_len && req->relay_depth > 1 &&
+	        num_hosts > WSH_RELAY_DISTRIBUTE_FANOUT) {
+		// Every relay sends a copy of each file per shard, so keep the tree
+		// narrow and let it get deep instead
+		shards = wsh_relay_split(req->relay_hosts, num_hosts,
+		                         WSH_RELAY_DISTRIBUTE_FANOUT);
+	} else if (req->relay_depth > 1 && num_hosts > WSHD_RELAY_MIN_SHARD) {
+		// ~sqrt(n) relays with ~sqrt(n) hosts apiece
+		gsize parts = 1;
+		while (parts * parts < num_hosts)
+			parts++;
+
+		shards = wsh_relay_split(req->relay_hosts, num_hosts, parts);
+	}
+
+	if (shards) {
+		while (shards[num_jobs])
+			num_jobs++;
+
+		jobs = g_new0(relay_job_t, num_jobs);
+		for (gsize i = 0; i < num_jobs; i++) {
+			jobs[i].hostname = shards[i][0];
+			jobs[i].req = *req;
+			jobs[i].req.cwd = cwd;
+			jobs[i].req.relay_hosts = shards[i];
+			jobs[i].req.relay_hosts_len = g_strv_length(shards[i]);
+			jobs[i].req.relay_depth = req->relay_depth - 1;
+			jobs[i].req.distribute = dist;
+			jobs[i].state = &state;
+		}
+	} else {
+		num_jobs = num_hosts;
+		jobs = g_new0(relay_job_t, num_jobs);
+		for (gsize i = 0; i < num_jobs; i++) {
+			jobs[i].hostname = req->relay_hosts[i];
+			jobs[i].req = *req;
+			jobs[i].req.cwd = cwd;
+			jobs[i].req.relay_hosts = NULL;
+			jobs[i].req.relay_hosts_len = 0;
+			jobs[i].req.relay_depth = 0;
+			jobs[i].req.distribute = dist;
+			jobs[i].state = &state;
+		}
+	}
+
+	GThreadPool* gtp = g_thread_pool_new((GFunc)run_job, NULL,
+	                                     req->relay_threads ? req->relay_threads : WSHD_RELAY_THREADS,
+	                                     TRUE, err);
+	if (gtp == NULL)
+		goto wshd_relay_out;
+
+	for (gsize i = 0; i < num_jobs; i++)
+		g_thread_pool_push(gtp, &jobs[i], NULL);
+	g_thread_pool_free(gtp, FALSE, TRUE);
+
+	g_mutex_lock(state.mut);
+	flush(&state);
+	g_mutex_unlock(state.mut);
+
+	if (! state.err)
+		wshd_send_end(std_output, &state.err);
+	if (state.err)
+		g_propagate_error(err, state.err);
+
+wshd_relay_out:
+	g_free(jobs);
+	for (gsize i = 0; dist && i < req->distribute_len; i++)
+		g_free(dist[i].local);
+	g_free(dist);
+	wsh_relay_free_shards(shards);
+	wsh_relay_merge_free(&state.merge);
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	g_mutex_clear(state.mut);
+	g_slice_free(GMutex, state.mut);
+#else
+	g_mutex_free(state.mut);
+#endif
+
+	wsh_ssh_cleanup();
+}
+
@@ -0,0 +1,47 @@
+/* Copyright (c) 2014 William Orr <will@worrbase.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/** @internal
+ *  @file
+ *  @brief Relaying commands to other hosts
+ */
+#ifndef __WSHD_FANOUT_H
+#define __WSHD_FANOUT_H
+
+#include <glib.h>
+
+#include "cmd.h"
+
+/**
+ * @brief Runs a request on its relay hosts and streams back merged results
+ *
+ * Leaves are reached over ssh as the user wshd runs as, with public key
+ * auth. With a relay depth over 1, large shards go through relays of
+ * their own.
+ *
+ * @param[in] std_output Output channel to write results to
+ * @param[in] req Request with relay_hosts set
+ * @param[out] err Description of error condition
+ */
+__attribute__((nonnull))
+void wshd_relay(GIOChannel* std_output, const wsh_cmd_req_t* req, GError** err);
+
+#endif
+
@@ -26,11 +26,18 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include "aggregate.h"
 #include "client.h"
 #include "cmd.h"
+#include "fanout.h"
 #include "log.h"
+#include "manifest.h"
 #include "output.h"
+#include "pack.h"
 #include "parse.h"
+#include "payload.h"
+#include "spool.h"
+#include "tar.h"
 #include "types.h"
 
 int main(int argc, char** argv, char** env) {
@@ -40,6 +47,10 @@ int main(int argc, char** argv, char** env) {
 	gint ret = 0;
 	wsh_cmd_req_t* req = NULL;
 	wsh_cmd_res_t* res = g_slice_new0(wsh_cmd_res_t);
+	gboolean relayed = FALSE;
+	gboolean passthrough = FALSE;
+	guint compress_level = 0;
+	gchar* script = NULL;
 
 	wsh_init_logger(WSH_LOGGER_SERVER);
 
@@ -76,7 +87,216 @@ int main(int argc, char** argv, char** env) {
 		goto wshd_error;
 	}
 
-	wsh_run_cmd(res, req);
+	// Relays merge whole results, so output can't skip past them, or be left
+	// spooled on hosts the client never talks to. Once the request is in,
+	// frames come before the result, even if nothing runs
+	if (req->relay_hosts_len) {
+		req->passthrough = FALSE;
+		req->summary_only = FALSE;
+	}
+	passthrough = req->passthrough;
+	compress_level = req->compress_level;
+
+	// Payloads and archives are pushed relative to our starting directory,
+	// and have to be in place before the command that uses them runs
+	for (gsize i = 0; i < req->inflate_len; i++) {
+		if (wsh_payload_inflate(req->inflate[i], &err)) {
+			wsh_log_message(err->message);
+			res->error_message = g_strdup(err->message);
+			res->exit_status = -1;
+			g_error_free(err);
+			err = NULL;
+			goto wshd_error;
+		}
+	}
+
+	for (gsize i = 0; i < req->untar_len; i++) {
+		if (wsh_tar_extract(req->untar[i], &err)) {
+			wsh_log_message(err->message);
+			res->error_message = g_strdup(err->message);
+			res->exit_status = -1;
+			g_error_free(err);
+			err = NULL;
+			goto wshd_error;
+		}
+	}
+
+	// One file that didn't make it shouldn't hold back the rest
+	for (gsize i = 0; i < req->complete_len; i++) {
+		if (wsh_manifest_complete(req->cwd, &req->complete[i], &err)) {
+			wsh_log_message(err->message);
+			if (! res->error_message)
+				res->error_message = g_strdup(err->message);
+			res->exit_status = -1;
+			g_error_free(err);
+			err = NULL;
+		}
+	}
+
+	if (res->error_message)
+		goto wshd_error;
+
+	if (req->manifest_len) {
+		res->stale = wsh_manifest_stale(req->cwd, req->manifest, req->manifest_len,
+		                                 &res->stale_len);
+
+		// Stale paths keep the manifest's order
+		if (res->stale_len)
+			res->resume = g_new0(guint64, res->stale_len);
+		for (gsize i = 0, j = 0; i < req->manifest_len && j < res->stale_len; i++) {
+			if (! strcmp(req->manifest[i].path, res->stale[j]))
+				res->resume[j++] = wsh_manifest_resume(req->cwd, &req->manifest[i]);
+		}
+	}
+
+	// Anything we were sent to pass on has to match its hash before we use
+	// it, let alone send it anywhere else
+	if (req->distribute_len) {
+		gsize bad_len = 0;
+		gchar** bad = wsh_manifest_stale(req->cwd, req->distribute,
+		                                 req->distribute_len, &bad_len);
+		if (bad_len) {
+			res->error_message = g_strdup_printf("%s arrived corrupt or incomplete",
+			                                     bad[0]);
+			res->exit_status = -1;
+			wsh_log_message(res->error_message);
+		}
+		g_strfreev(bad);
+
+		// None of our relay hosts are getting anything from us
+		if (bad_len && req->relay_hosts_len) {
+			res->hosts = req->relay_hosts;
+			res->hosts_len = req->relay_hosts_len;
+			wshd_send_message(out, res, compress_level, &err);
+			if (err == NULL)
+				wshd_send_end(out, &err);
+			if (err != NULL)
+				ret = err->code;
+
+			res->hosts = NULL;
+			res->hosts_len = 0;
+			relayed = TRUE;
+		}
+
+		if (bad_len)
+			goto wshd_error;
+	}
+
+	// An inline script runs out of a directory only we can get into, found
+	// through PATH or WSH_SCRIPT. Without a shell, env(1) sets them
+	if (req->script_name && *req->cmd_string && ! req->relay_hosts_len) {
+		if (wsh_payload_write_script(req->script_name, req->script, req->script_len,
+		                             &script, &err)) {
+			wsh_log_message(err->message);
+			res->error_message = g_strdup(err->message);
+			res->exit_status = -1;
+			g_error_free(err);
+			err = NULL;
+			goto wshd_error;
+		}
+
+		gchar* dir = g_path_get_dirname(script);
+		if (req->use_shell) {
+			gchar* quoted_dir = g_shell_quote(dir);
+			gchar* quoted_script = g_shell_quote(script);
+			gchar* cmd = g_strdup_printf("PATH=%s:\"$PATH\" WSH_SCRIPT=%s; "
+			                             "export PATH WSH_SCRIPT; %s", quoted_dir,
+			                             quoted_script, req->cmd_string);
+			g_free(req->cmd_string);
+			req->cmd_string = cmd;
+			g_free(quoted_script);
+			g_free(quoted_dir);
+		} else {
+			const gchar* path = g_getenv("PATH");
+			gchar* path_var = g_strdup_printf("PATH=%s%s%s", dir, path ? ":" : "",
+			                                  path ? path : "");
+			gchar* script_var = g_strconcat("WSH_SCRIPT=", script, NULL);
+
+			if (req->argv_len) {
+				gchar** argv = g_new0(gchar*, req->argv_len + 4);
+				argv[0] = g_strdup("env");
+				argv[1] = path_var;
+				argv[2] = script_var;
+				memcpy(argv + 3, req->argv, req->argv_len * sizeof(gchar*));
+				g_free(req->argv);
+				req->argv = argv;
+				req->argv_len += 3;
+			} else {
+				gchar* quoted_path = g_shell_quote(path_var);
+				gchar* quoted_script = g_shell_quote(script_var);
+				gchar* cmd = g_strdup_printf("env %s %s %s", quoted_path, quoted_script,
+				                             req->cmd_string);
+				g_free(req->cmd_string);
+				req->cmd_string = cmd;
+				g_free(quoted_script);
+				g_free(quoted_path);
+				g_free(script_var);
+				g_free(path_var);
+			}
+		}
+
+		g_free(dir);
+	}
+
+	if (req->relay_hosts_len) {
+		// Results have already been streamed out as they came in
+		wshd_relay(out, req, &err);
+		relayed = TRUE;
+		if (err != NULL) {
+			wsh_log_message(err->message);
+			ret = err->code;
+		}
+	} else if (req->fetch_spool) {
+		gchar* spool = wsh_spool_dir(&err);
+		if (spool)
+			wsh_spool_fetch(res, spool, req->fetch_spool, &err);
+		g_free(spool);
+
+		if (err != NULL) {
+			wsh_log_message(err->message);
+			res->error_message = g_strdup(err->message);
+			res->exit_status = -1;
+			g_error_free(err);
+			err = NULL;
+		}
+	} else if (*req->cmd_string && req->passthrough) {
+		wsh_pass_cmd(res, req, STDOUT_FILENO);
+	} else if (*req->cmd_string) {
+		wsh_run_cmd(res, req);
+
+		// Only stdout's aggregate goes back, stderr still goes as it is
+		if (req->aggregate_op && ! res->error_message) {
+			wsh_aggregate_new(&res->aggregate, req->aggregate_op);
+			wsh_aggregate_output(res->aggregate, res);
+
+			g_strfreev(res->std_output);
+			g_free(res->std_output_raw);
+			res->std_output = NULL;
+			res->std_output_raw = NULL;
+			res->std_output_len = res->std_output_raw_len = 0;
+		}
+
+		// Output the client already has only needs to be vouched for
+		if (req->expect_hash && ! res->error_message && ! res->aggregate)
+			wsh_response_match(res, req->expect_hash);
+
+		// Failing to spool just means sending everything as usual
+		if (req->summary_only && ! res->error_message && ! res->matches &&
+		        ! res->aggregate) {
+			gchar* spool = wsh_spool_dir(&err);
+			if (spool)
+				wsh_spool_store(res, spool, &err);
+			g_free(spool);
+
+			if (err != NULL) {
+				wsh_log_message(err->message);
+				g_error_free(err);
+				err = NULL;
+			}
+		}
+	}
+
+	wsh_payload_remove_script(&script);
 
 wshd_error:
 	do {
@@ -99,9 +319,14 @@ wshd_error:
 		}
 	} while (errno == EINTR);
 
-	wshd_send_message(out, res, &err);
-	if (err != NULL)
-		ret = err->code;
+	if (! relayed) {
+		if (passthrough && wsh_write_frame_header(STDOUT_FILENO, WSH_FRAME_END, 0))
+			wsh_log_message(strerror(errno));
+
+		wshd_send_message(out, res, compress_level, &err);
+		if (err != NULL)
+			ret = err->code;
+	}
 
 	g_slice_free(wsh_cmd_res_t, res);
 	return ret;
@@ -30,13 +30,13 @@
 #pragma GCC diagnostic ignored "-Wpointer-sign"
 __attribute__((nonnull))
 void wshd_send_message(GIOChannel* std_output, wsh_cmd_res_t* res,
-                       GError** err) {
+                       guint level, GError** err) {
 	guint8* buf;
 	guint32 buf_len;
 	gsize writ;
 	wsh_message_size_t buf_size;
 
-	wsh_pack_response(&buf, &buf_len, res);
+	wsh_pack_response_compressed(&buf, &buf_len, res, level);
 
 	// Set binary encoding
 	g_io_channel_set_encoding(std_output, NULL, err);
@@ -55,5 +55,20 @@ void wshd_send_message(GIOChannel* std_output, wsh_cmd_res_t* res,
 wshd_send_message_err:
 	g_slice_free1(buf_len, buf);
 }
+
+__attribute__((nonnull))
+void wshd_send_end(GIOChannel* std_output, GError** err) {
+	gsize writ;
+	wsh_message_size_t buf_size;
+
+	g_io_channel_set_encoding(std_output, NULL, err);
+	if (*err != NULL) return;
+
+	buf_size.size = 0;
+	g_io_channel_write_chars(std_output, buf_size.buf, 4, &writ, err);
+	if (*err != NULL) return;
+
+	g_io_channel_flush(std_output, err);
+}
 #pragma GCC diagnostic error "-Wpointer-sign"
 
@@ -34,11 +34,22 @@
  *
  * @param[in] std_output Output channel to write to
  * @param[in] res Command result to write
+ * @param[in] level zlib level the client takes compressed replies at, 0 for
+ * none
  * @param[out] err Description of error condition
  */
 __attribute__((nonnull (1, 2)))
 void wshd_send_message(GIOChannel* std_output, wsh_cmd_res_t* res,
-                       GError** err);
+                       guint level, GError** err);
+
+/**
+ * Tells the client a relay has sent its last result
+ *
+ * @param[in] std_output Output channel to write to
+ * @param[out] err Description of error condition
+ */
+__attribute__((nonnull))
+void wshd_send_end(GIOChannel* std_output, GError** err);
 
 #endif
 
@@ -19,14 +19,26 @@
  * SOFTWARE.
  */
 #include "config.h"
+#include <errno.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "client.h"
 #include "expansion.h"
 #include "log.h"
+#include "manifest.h"
+#include "pack.h"
+#include "relay.h"
+#include "payload.h"
+#include "sftp.h"
 #include "ssh.h"
+#include "tar.h"
+#include "throttle.h"
+#include "types.h"
 #ifndef HAVE_MEMSET_S
 extern int memset_s(void* v, size_t smax, int c, size_t n);
 #endif
@@ -36,6 +48,18 @@ static gchar* username = NULL;
 static gboolean ask_password = FALSE;
 static gint threads = 0;
 static gchar* location = NULL;
+static gboolean no_compress = FALSE;
+static gboolean send_all = FALSE;
+static gboolean use_sftp = FALSE;
+static gboolean stream_compress = FALSE;
+static gint seeds = 0;
+static gchar* bwlimit_total = NULL;
+static gchar* bwlimit_host = NULL;
+static gchar* pull_dir = NULL;
+
+// Shared by every host, and the rate each host gets on its own
+static wsh_throttle_t* total_throttle = NULL;
+static guint64 host_rate = 0;
 
 // Host selection variables
 static gchar* hosts_arg = NULL;
@@ -44,12 +68,22 @@ static gchar* range = NULL;
 
 static void* passwd_mem;
 
+static const gchar* compress_opts[] = { "Compression=yes", NULL };
+
 static GOptionEntry entries[] = {
 	{ "port", 0, 0, G_OPTION_ARG_INT, &port, "Port to use, if not 22", NULL },
 	{ "username", 'u', 0, G_OPTION_ARG_STRING, &username, "SSH username", NULL },
 	{ "password", 'p', 0, G_OPTION_ARG_NONE, &ask_password, "Prompt for SSH password", NULL },
 	{ "threads", 't', 0, G_OPTION_ARG_INT, &threads, "Number of threads to spawn", NULL },
 	{ "location", 'l', 0, G_OPTION_ARG_STRING, &location, "Location on remote hosts to drop files", NULL },
+	{ "no-compress", 0, 0, G_OPTION_ARG_NONE, &no_compress, "Send files as they are, for hosts without wshd", NULL },
+	{ "all", 0, 0, G_OPTION_ARG_NONE, &send_all, "Send every file, without asking wshd which ones hosts already have", NULL },
+	{ "sftp", 0, 0, G_OPTION_ARG_NONE, &use_sftp, "Send files over sftp, with many writes in flight at once", NULL },
+	{ "stream-compress", 0, 0, G_OPTION_ARG_NONE, &stream_compress, "Compress everything on the wire with ssh compression", NULL },
+	{ "distribute", 0, 0, G_OPTION_ARG_INT, &seeds, "Send to this many hosts, and have their wshd pass files on to the rest", NULL },
+	{ "bwlimit-total", 0, 0, G_OPTION_ARG_STRING, &bwlimit_total, "Cap on bytes per second sent to all hosts together (e.g. 10M)", NULL },
+	{ "bwlimit-per-host", 0, 0, G_OPTION_ARG_STRING, &bwlimit_host, "Cap on bytes per second sent to each host (e.g. 500K)", NULL },
+	{ "pull", 0, 0, G_OPTION_ARG_STRING, &pull_dir, "Fetch the given remote paths from every host into this directory instead", NULL },
 
 	// Host selection
 	{ "hosts", 'h', 0, G_OPTION_ARG_STRING, &hosts_arg, "Comma separated list of hosts to ssh into", NULL },
@@ -71,20 +105,196 @@ static gboolean valid_arguments(gchar** mesg) {
 		return FALSE;
 	}
 
+	if (seeds < 0) {
+		*mesg = g_strdup("--distribute must be at least 1\n");
+		return FALSE;
+	}
+
+	if (seeds && send_all) {
+		*mesg = g_strdup("--distribute always checks what hosts have, drop --all\n");
+		return FALSE;
+	}
+
+	if (pull_dir && (seeds || use_sftp || send_all)) {
+		*mesg = g_strdup("--pull can't be used with --distribute, --sftp or --all\n");
+		return FALSE;
+	}
+
+	GError* err = NULL;
+	guint64 total_rate = 0;
+	if ((bwlimit_total && wsh_throttle_parse_rate(bwlimit_total, &total_rate, &err)) ||
+	        (bwlimit_host && wsh_throttle_parse_rate(bwlimit_host, &host_rate, &err))) {
+		*mesg = g_strdup_printf("%s\n", err->message);
+		g_error_free(err);
+		return FALSE;
+	}
+
+	if (total_rate)
+		wsh_throttle_new(&total_throttle, total_rate);
+
 	return TRUE;
 }
 
 typedef struct {
-	gchar** files;
+	const wsh_manifest_entry_t* files;
+	GHashTable* payloads;
+	const wsh_cmd_req_t* req;
 	gchar* host;
 	gchar* user;
 	gchar* pass;
 	gchar* location;
-	gint num_files;
+	gchar** paths;
+	gsize num_files;
+	gsize num_paths;
 	gint port;
 } wshc_scp_file_args;
 
-static gint scp_file(const wshc_scp_file_args* args) {
+// Where a file lands, relative to the home directory wshd starts in
+static gchar* remote_path(const gchar* loc, const gchar* name) {
+	if (! strcmp(loc, "~"))
+		return g_strdup(name);
+	if (g_str_has_prefix(loc, "~/"))
+		loc += 2;
+
+	return g_build_filename(loc, name, NULL);
+}
+
+// Runs one request through a fresh wshd. Disconnects on failure
+static gint wshd_exchange(wsh_ssh_session_t* session, const wsh_cmd_req_t* req,
+                          wsh_cmd_res_t** res, GError** err) {
+	gint ret = 0;
+	if ((ret = wsh_ssh_exec_wshd(session, err)) ||
+	        (ret = wsh_ssh_send_cmd(session, req, err)) ||
+	        (ret = wsh_ssh_recv_cmd_res(session, res, err)))
+		return ret;
+
+	return 0;
+}
+
+// Notes a compressed payload that made it over, for wshd to inflate
+static void sent_payload(const wsh_payload_t* payload,
+                         const wshc_scp_file_args* args, GPtrArray* inflate) {
+	if (payload->compressed)
+		g_ptr_array_add(inflate, remote_path(args->location, payload->name));
+}
+
+// Files inside directories go as one tar stream, unless wshd isn't there
+// to unpack it. Pieces of resumable files stay out of it, so whatever of
+// them arrives is kept
+static void send_scp(wsh_ssh_session_t* session, const wshc_scp_file_args* args,
+                     GPtrArray* entries, GPtrArray* payloads, GPtrArray* inflate,
+                     GPtrArray* untar) {
+	GError* err = NULL;
+	GPtrArray* plain = entries;
+	GPtrArray* tree = NULL;
+
+	if (! no_compress) {
+		plain = g_ptr_array_new();
+		tree = g_ptr_array_new();
+		for (guint i = 0; i < entries->len; i++) {
+			const wsh_manifest_entry_t* entry = g_ptr_array_index(entries, i);
+			g_ptr_array_add(strchr(entry->path, '/') && ! entry->chunks_len ? tree : plain,
+			                (gpointer)entry);
+		}
+	}
+
+	if (wsh_ssh_scp_init(session, args->location)) {
+		g_printerr("%s: Error initializing scp\n", args->host);
+		return;
+	}
+
+	for (guint i = 0; i < payloads->len; i++) {
+		const wsh_payload_t* payload = g_ptr_array_index(payloads, i);
+
+		if (wsh_ssh_scp_payload(session, payload, &err)) {
+			g_printerr("%s: %s\n", args->host, err->message);
+			g_error_free(err);
+			err = NULL;
+			continue;
+		}
+
+		sent_payload(payload, args, inflate);
+	}
+
+	if (plain->len && wsh_ssh_scp_entries(session,
+	                                      (const wsh_manifest_entry_t**)plain->pdata,
+	                                      plain->len, &err)) {
+		g_printerr("%s: %s\n", args->host, err->message);
+		g_error_free(err);
+		err = NULL;
+	}
+
+	if (tree && tree->len) {
+		gchar* name = g_strdup_printf(".wscp-%s-%d" WSH_TAR_SUFFIX,
+		                              g_get_host_name(), getpid());
+
+		if (wsh_ssh_scp_tar(session, name, (const wsh_manifest_entry_t**)tree->pdata,
+		                    tree->len, &err)) {
+			g_printerr("%s: %s\n", args->host, err->message);
+			g_error_free(err);
+		} else {
+			g_ptr_array_add(untar, remote_path(args->location, name));
+		}
+
+		g_free(name);
+	}
+
+	if (tree) {
+		g_ptr_array_free(plain, TRUE);
+		g_ptr_array_free(tree, TRUE);
+	}
+
+	wsh_ssh_scp_cleanup(session);
+}
+
+// Everything goes over one sftp session, with writes pipelined across files
+static void send_sftp(wsh_ssh_session_t* session, const wshc_scp_file_args* args,
+                      GPtrArray* entries, GPtrArray* payloads, GPtrArray* inflate) {
+	GError* err = NULL;
+	wsh_sftp_t* sftp = NULL;
+
+	if (wsh_sftp_new(&sftp, session, &err)) {
+		g_printerr("%s\n", err->message);
+		g_error_free(err);
+		return;
+	}
+
+	gchar* root = remote_path(args->location, "");
+	if (wsh_sftp_push(sftp, root,
+	                  (const wsh_manifest_entry_t**)entries->pdata, entries->len,
+	                  (const wsh_payload_t**)payloads->pdata, payloads->len, &err)) {
+		g_printerr("%s: %s\n", args->host, err->message);
+		g_error_free(err);
+	} else {
+		for (guint i = 0; i < payloads->len; i++)
+			sent_payload(g_ptr_array_index(payloads, i), args, inflate);
+	}
+
+	g_free(root);
+	wsh_sftp_free(&sftp);
+}
+
+// Connects, checks the host key and logs in
+static gint open_session(wsh_ssh_session_t* session) {
+	GError* err = NULL;
+
+	if (session->password == NULL)
+		session->auth_type = WSH_SSH_AUTH_PUBKEY;
+	else
+		session->auth_type = WSH_SSH_AUTH_PASSWORD;
+
+	if (wsh_ssh_host(session, &err) ||
+	        wsh_verify_host_key(session, FALSE, FALSE, &err) ||
+	        wsh_ssh_authenticate(session, &err)) {
+		g_printerr("%s\n", err->message);
+		g_error_free(err);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static gint send_host(const wshc_scp_file_args* args, wsh_throttle_t* host_throttle) {
 	GError *err = NULL;
 	wsh_ssh_session_t session = {
 		.session = NULL,
@@ -94,50 +304,358 @@ static gint scp_file(const wshc_scp_file_args* args) {
 		.password = args->pass,
 		.scp = NULL,
 		.port = args->port,
+		.ssh_opts = stream_compress ? compress_opts : NULL,
+		.throttle = total_throttle,
+		.host_throttle = host_throttle,
 	};
 
-	if (session.password == NULL)
-		session.auth_type = WSH_SSH_AUTH_PUBKEY;
+	if (open_session(&session))
+		return EXIT_FAILURE;
+
+	// Ask wshd which files it's missing, and only send those
+	GHashTable* stale = NULL;
+	wsh_cmd_res_t* stale_res = NULL;
+	if (args->req->manifest_len) {
+		if (wshd_exchange(&session, args->req, &stale_res, &err)) {
+			g_printerr("%s: %s\n", args->host, err->message);
+			g_error_free(err);
+			return EXIT_FAILURE;
+		}
+
+		// Remember where each one is, to find how much of it they have
+		stale = g_hash_table_new(g_str_hash, g_str_equal);
+		for (gsize i = 0; i < stale_res->stale_len; i++)
+			g_hash_table_insert(stale, stale_res->stale[i], GSIZE_TO_POINTER(i + 1));
+	}
+
+	// Sort what's left to send into compressed payloads, plain files, and
+	// pieces of resumable ones
+	GPtrArray* entries = g_ptr_array_new();
+	GPtrArray* payloads = g_ptr_array_new();
+	GArray* complete = g_array_new(FALSE, FALSE, sizeof(wsh_manifest_entry_t));
+	wsh_manifest_entry_t* pieces = g_new0(wsh_manifest_entry_t, args->num_files);
+	gsize num_pieces = 0;
+	for (gsize i = 0; i < args->num_files; i++) {
+		const wsh_manifest_entry_t* entry = &args->files[i];
+		gsize idx = 0;
+		if (stale && ! (idx = GPOINTER_TO_SIZE(g_hash_table_lookup(stale, entry->path))))
+			continue;
+
+		// Picks up after whatever the host already has of it
+		if (entry->chunks_len) {
+			wsh_manifest_entry_t* piece = &pieces[num_pieces++];
+			*piece = *entry;
+			if (idx && stale_res->resume)
+				piece->offset = stale_res->resume[idx - 1];
+			piece->path = wsh_manifest_part_name(entry->path, piece->offset);
+
+			g_ptr_array_add(entries, piece);
+			g_array_append_val(complete, *entry);
+			continue;
+		}
+
+		const wsh_payload_t* payload = g_hash_table_lookup(args->payloads, entry->path);
+		if (payload)
+			g_ptr_array_add(payloads, (gpointer)payload);
+		else
+			g_ptr_array_add(entries, (gpointer)entry);
+	}
+
+	if (stale) g_hash_table_destroy(stale);
+	wsh_free_unpacked_response(&stale_res);
+
+	GPtrArray* inflate = g_ptr_array_new_with_free_func(g_free);
+	GPtrArray* untar = g_ptr_array_new_with_free_func(g_free);
+	if (use_sftp)
+		send_sftp(&session, args, entries, payloads, inflate);
 	else
-		session.auth_type = WSH_SSH_AUTH_PASSWORD;
+		send_scp(&session, args, entries, payloads, inflate, untar);
+
+	g_ptr_array_free(entries, TRUE);
+	g_ptr_array_free(payloads, TRUE);
+	for (gsize i = 0; i < num_pieces; i++)
+		g_free(pieces[i].path);
+	g_free(pieces);
+
+	// Have wshd unpack whatever we sent compressed or archived, and put
+	// resumable files together
+	if (inflate->len || untar->len || complete->len) {
+		wsh_cmd_req_t req = *args->req;
+		req.manifest = NULL;
+		req.manifest_len = 0;
+		req.inflate_len = inflate->len;
+		g_ptr_array_add(inflate, NULL);
+		req.inflate = (gchar**)inflate->pdata;
+		req.untar_len = untar->len;
+		g_ptr_array_add(untar, NULL);
+		req.untar = (gchar**)untar->pdata;
+		req.complete = (wsh_manifest_entry_t*)complete->data;
+		req.complete_len = complete->len;
+
+		wsh_cmd_res_t* res = NULL;
+		if (wshd_exchange(&session, &req, &res, &err)) {
+			g_printerr("%s: %s\n", args->host, err->message);
+			g_error_free(err);
+			g_ptr_array_free(inflate, TRUE);
+			g_ptr_array_free(untar, TRUE);
+			g_array_free(complete, TRUE);
+			return EXIT_FAILURE;
+		}
 
-	if (wsh_ssh_host(&session, &err)) {
-		g_printerr("%s\n", err->message);
-		g_error_free(err);
-		return EXIT_FAILURE;
+		if (res->error_message)
+			g_printerr("%s: %s\n", args->host, res->error_message);
+		wsh_free_unpacked_response(&res);
 	}
+	g_ptr_array_free(inflate, TRUE);
+	g_ptr_array_free(untar, TRUE);
+	g_array_free(complete, TRUE);
 
-	if (wsh_verify_host_key(&session, FALSE, FALSE, &err)) {
-		g_printerr("%s\n", err->message);
-		g_error_free(err);
-		return EXIT_FAILURE;
+	wsh_ssh_disconnect(&session);
+
+	return EXIT_SUCCESS;
+}
+
+static gint scp_file(const wshc_scp_file_args* args) {
+	wsh_throttle_t* host_throttle = NULL;
+	if (host_rate)
+		wsh_throttle_new(&host_throttle, host_rate);
+
+	gint ret = send_host(args, host_throttle);
+
+	wsh_throttle_free(&host_throttle);
+	return ret;
+}
+
+// Globs are expanded by the host's own shell, through wshd
+static gint expand_remote(wsh_ssh_session_t* session, const wshc_scp_file_args* args,
+                          const gchar* path, GPtrArray* matches, GError** err) {
+	if (! strpbrk(path, "*?[")) {
+		g_ptr_array_add(matches, g_strdup(path));
+		return 0;
 	}
 
-	if (wsh_ssh_authenticate(&session, &err)) {
-		g_printerr("%s\n", err->message);
-		g_error_free(err);
+	wsh_cmd_req_t req;
+	memset(&req, 0, sizeof(req));
+	req.cmd_string = g_strdup_printf("for f in %s; do [ -e \"$f\" ] && echo \"$f\"; done", path);
+	req.username = args->user;
+	req.host = (gchar*)g_get_host_name();
+	req.cwd = "";
+	req.use_shell = TRUE;
+
+	wsh_cmd_res_t* res = NULL;
+	gint ret = wshd_exchange(session, &req, &res, err);
+	g_free(req.cmd_string);
+	if (ret)
+		return ret;
+
+	for (gsize i = 0; i < res->std_output_len; i++) {
+		gchar* match = g_strchomp(g_strdup(res->std_output[i]));
+		if (*match)
+			g_ptr_array_add(matches, match);
+		else
+			g_free(match);
+	}
+
+	if (res->error_message)
+		g_printerr("%s: %s\n", args->host, res->error_message);
+	wsh_free_unpacked_response(&res);
+
+	return 0;
+}
+
+// Fetches every path from one host into a directory named after it
+static gint pull_host(const wshc_scp_file_args* args) {
+	GError* err = NULL;
+	wsh_ssh_session_t session = {
+		.session = NULL,
+		.channel = NULL,
+		.hostname = args->host,
+		.username = args->user,
+		.password = args->pass,
+		.scp = NULL,
+		.port = args->port,
+		.ssh_opts = stream_compress ? compress_opts : NULL,
+	};
+
+	gchar* dest = g_build_filename(pull_dir, args->host, NULL);
+	if (g_mkdir_with_parents(dest, 0755)) {
+		g_printerr("%s: %s\n", dest, strerror(errno));
+		g_free(dest);
 		return EXIT_FAILURE;
 	}
 
-	if (wsh_ssh_scp_init(&session, args->location)) {
-		g_printerr("Error initializing scp");
+	if (open_session(&session)) {
+		g_free(dest);
 		return EXIT_FAILURE;
 	}
 
-	for (gint i = 0; i < args->num_files; i++) {
-		if (wsh_ssh_scp_file(&session, args->files[i], FALSE, &err)) {
-			g_printerr("%s\n", err->message);
+	gint ret = EXIT_SUCCESS;
+	GPtrArray* matches = g_ptr_array_new_with_free_func(g_free);
+	for (gsize i = 0; i < args->num_paths; i++) {
+		if (expand_remote(&session, args, args->paths[i], matches, &err)) {
+			g_printerr("%s: %s\n", args->host, err->message);
 			g_error_free(err);
 			err = NULL;
+			ret = EXIT_FAILURE;
 		}
 	}
 
-	wsh_ssh_scp_cleanup(&session);
+	for (gsize i = 0; i < matches->len; i++) {
+		if (wsh_ssh_scp_pull(&session, g_ptr_array_index(matches, i), dest, &err)) {
+			g_printerr("%s: %s\n", args->host, err->message);
+			g_error_free(err);
+			err = NULL;
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	g_ptr_array_free(matches, TRUE);
 	wsh_ssh_disconnect(&session);
+	g_free(dest);
+
+	return ret;
+}
+
+// Gathers files from every host, a few at a time if asked
+static gint pull(gchar** hosts, gsize num_hosts, gchar** paths, gsize num_paths,
+                 gchar* password) {
+	GError* err = NULL;
+	wshc_scp_file_args args[num_hosts];
+	memset(args, 0, sizeof(args));
+
+	for (gsize i = 0; i < num_hosts; i++) {
+		args[i].host = hosts[i];
+		args[i].port = port;
+		args[i].user = username;
+		args[i].pass = password;
+		args[i].paths = paths;
+		args[i].num_paths = num_paths;
+	}
+
+	if (threads <= 0) {
+		gint ret = EXIT_SUCCESS;
+		for (gsize i = 0; i < num_hosts; i++)
+			if (pull_host(&args[i]))
+				ret = EXIT_FAILURE;
+		return ret;
+	}
+
+	GThreadPool* gtp;
+	if ((gtp = g_thread_pool_new((GFunc)pull_host, NULL, threads, TRUE, &err)) == NULL) {
+		g_printerr("%s\n", err->message);
+		g_error_free(err);
+		return EXIT_FAILURE;
+	}
+
+	for (gsize i = 0; i < num_hosts; i++)
+		g_thread_pool_push(gtp, &args[i], NULL);
+
+	g_thread_pool_free(gtp, FALSE, TRUE);
 
 	return EXIT_SUCCESS;
 }
 
+/* One host we send files to ourselves, and the hosts it passes them on to */
+typedef struct {
+	wsh_cmd_req_t req;
+	const wshc_scp_file_args* args;
+	GMutex* mut;
+	gsize* failed;
+} wshc_seed_args;
+
+static void seed_result(const wsh_cmd_res_t* res, wshc_seed_args* seed) {
+	if (res->exit_status == 0 && ! res->error_message)
+		return;
+
+	g_mutex_lock(seed->mut);
+	for (gsize i = 0; i < res->hosts_len; i++) {
+		g_printerr("%s: %s\n", res->hosts[i],
+		           res->error_message ? res->error_message : "failed");
+		(*seed->failed)++;
+	}
+	g_mutex_unlock(seed->mut);
+}
+
+static void distribute_seed(wshc_seed_args* seed) {
+	GError* err = NULL;
+	wsh_ssh_session_t session = {
+		.hostname = seed->req.relay_hosts[0],
+		.username = seed->args->user,
+		.password = seed->args->pass,
+		.port = seed->args->port,
+		.ssh_opts = stream_compress ? compress_opts : NULL,
+		.throttle = total_throttle,
+	};
+
+	if (host_rate)
+		wsh_throttle_new(&session.host_throttle, host_rate);
+
+	if (session.password == NULL)
+		session.auth_type = WSH_SSH_AUTH_PUBKEY;
+	else
+		session.auth_type = WSH_SSH_AUTH_PASSWORD;
+
+	// Every host in the shard has had its result reported, even on failure
+	if (wsh_relay_host(&session, &seed->req, (wsh_relay_result_fn)seed_result,
+	                   seed, &err))
+		g_error_free(err);
+
+	wsh_throttle_free(&session.host_throttle);
+}
+
+// Seeds get the files from us, and wshd relays them on in a tree from there
+static gint distribute(gchar** hosts, gsize num_hosts, const wsh_cmd_req_t* req,
+                       const wshc_scp_file_args* args) {
+	if (! num_hosts)
+		return EXIT_SUCCESS;
+
+	gchar*** shards = wsh_relay_split(hosts, num_hosts, seeds);
+	gsize num_seeds = 0;
+	gsize failed = 0;
+	while (shards[num_seeds])
+		num_seeds++;
+
+	GMutex* mut;
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	mut = g_slice_new(GMutex);
+	g_mutex_init(mut);
+#else
+	mut = g_mutex_new();
+#endif
+
+	wshc_seed_args* jobs = g_new0(wshc_seed_args, num_seeds);
+	GThreadPool* gtp = g_thread_pool_new((GFunc)distribute_seed, NULL,
+	                                     num_seeds, TRUE, NULL);
+	for (gsize i = 0; i < num_seeds; i++) {
+		jobs[i].req = *req;
+		jobs[i].req.relay_hosts = shards[i];
+		jobs[i].req.relay_hosts_len = g_strv_length(shards[i]);
+		jobs[i].req.relay_depth = wsh_relay_distribute_depth(jobs[i].req.relay_hosts_len);
+		jobs[i].req.relay_port = args->port;
+		jobs[i].args = args;
+		jobs[i].mut = mut;
+		jobs[i].failed = &failed;
+
+		g_thread_pool_push(gtp, &jobs[i], NULL);
+	}
+	g_thread_pool_free(gtp, FALSE, TRUE);
+
+	g_free(jobs);
+	wsh_relay_free_shards(shards);
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	g_mutex_clear(mut);
+	g_slice_free(GMutex, mut);
+#else
+	g_mutex_free(mut);
+#endif
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void free_payload(wsh_payload_t* payload) {
+	wsh_payload_free(&payload);
+}
+
 gint main(gint argc, gchar** argv) {
 	GError* err = NULL;
 	GOptionContext* context;
@@ -228,6 +746,13 @@ gint main(gint argc, gchar** argv) {
 #endif
 
 	argv++; argc--;
+
+	// The rest are paths on the hosts, not here
+	if (pull_dir) {
+		ret = pull(hosts, num_hosts, argv, argc, password);
+		goto done;
+	}
+
 	for (gint i = 1; i < argc; i++) {
 		// scp will catch this, but I'd like to catch it before
 		// we start even trying to scp files
@@ -238,13 +763,77 @@ gint main(gint argc, gchar** argv) {
 		}
 	}
 
-	if (threads <= 0) {
+	// Compress each file once, and send every host the same bytes
+	GHashTable* payloads = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+	                       (GDestroyNotify)free_payload);
+	for (gint i = 0; i < argc; i++) {
+		wsh_payload_t* payload = NULL;
+		if (no_compress || seeds || g_file_test(argv[i], G_FILE_TEST_IS_DIR))
+			continue;
+
+		// Big files go in resumable pieces instead, which can't be gzipped
+		struct stat st;
+		if (! send_all && ! g_stat(argv[i], &st) && st.st_size > WSH_MANIFEST_CHUNK_SIZE)
+			continue;
+
+		if (wsh_payload_new(&payload, argv[i], FALSE, &err)) {
+			g_printerr("%s\n", err->message);
+			g_error_free(err);
+			err = NULL;
+			continue;
+		}
+
+		g_hash_table_insert(payloads, g_path_get_basename(argv[i]), payload);
+	}
+
+	wsh_cmd_req_t req;
+	memset(&req, 0, sizeof(req));
+	req.cmd_string = "";
+	req.username = username;
+	req.host = (gchar*)g_get_host_name();
+
+	// Manifest paths are relative to the destination
+	gchar* dest = remote_path(location, "");
+	req.cwd = dest;
+
+	// Files are only hashed if we're going to ask hosts what they have
+	wsh_manifest_entry_t* files = NULL;
+	gsize num_files = 0;
+	if (wsh_manifest_build(argv, argc, ! send_all || seeds, &files, &num_files, &err)) {
+		g_printerr("%s\n", err->message);
+		g_error_free(err);
+		ret = EXIT_FAILURE;
+		g_hash_table_destroy(payloads);
+		g_free(dest);
+		goto bad;
+	}
+
+	if (seeds) {
+		req.distribute = files;
+		req.distribute_len = num_files;
+	} else if (! send_all) {
+		req.manifest = files;
+		req.manifest_len = num_files;
+	}
+
+	if (seeds) {
+		wshc_scp_file_args args = {
+			.port = port,
+			.user = username,
+			.pass = password,
+			.location = location,
+		};
+
+		ret = distribute(hosts, num_hosts, &req, &args);
+	} else if (threads <= 0) {
 		wshc_scp_file_args args;
+		args.payloads = payloads;
+		args.req = &req;
 		args.port = port;
 		args.user = username;
 		args.pass = password;
-		args.files = argv;
-		args.num_files = argc;
+		args.files = files;
+		args.num_files = num_files;
 		args.location = location;
 
 		for (gsize i = 0; i < num_hosts; i++) {
@@ -266,8 +855,10 @@ gint main(gint argc, gchar** argv) {
 			args[i].port = port;
 			args[i].user = username;
 			args[i].pass = password;
-			args[i].files = argv;
-			args[i].num_files = argc;
+			args[i].files = files;
+			args[i].payloads = payloads;
+			args[i].req = &req;
+			args[i].num_files = num_files;
 			args[i].location = location;
 
 			g_thread_pool_push(gtp, &args[i], NULL);
@@ -276,12 +867,18 @@ gint main(gint argc, gchar** argv) {
 		g_thread_pool_free(gtp, FALSE, TRUE);
 	}
 
+	g_hash_table_destroy(payloads);
+	wsh_manifest_free(&files, num_files);
+	g_free(dest);
+
+done:
 	if (password) {
 		memset_s(password, WSH_MAX_PASSWORD_LEN, 0, strlen(password));
 		wsh_client_unlock_password_pages(passwd_mem);
 	}
 
 bad:
+	wsh_throttle_free(&total_throttle);
 	wsh_ssh_cleanup();
 	wsh_exit_logger();
 
@@ -290,6 +887,8 @@ bad:
 	if (range) g_free(range);
 	range = NULL;
 	if (hosts_arg) g_free(hosts_arg);
+	g_free(pull_dir);
+	pull_dir = NULL;
 
 	g_free(username);
 	username = NULL;